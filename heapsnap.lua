@@ -0,0 +1,358 @@
+-- $Id: heapsnap.lua $
+-- Analysis of the heap snapshots written by 'debug.heapsnapshot'
+-- See Copyright Notice in file lua.h
+--
+-- usage:
+--   lua heapsnap.lua snapshot [n]      largest objects by retained size
+--   lua heapsnap.lua old new [n]       what grew from 'old' to 'new'
+--
+-- When loaded without arguments (e.g., with 'dofile'), returns a
+-- table with the functions 'read', 'analyze', 'report' and 'diff'.
+
+local M = {}
+
+
+-- {======================================================
+-- JSON decoder (enough for the snapshots)
+-- =======================================================
+
+local find, match, sub = string.find, string.match, string.sub
+
+local escapes = {['"'] = '"', ['\\'] = '\\', ['/'] = '/', b = '\b',
+                 f = '\f', n = '\n', r = '\r', t = '\t'}
+
+local function decode (s)
+  local pos = 1
+
+  local function skip ()
+    pos = find(s, "[^ \t\r\n]", pos) or #s + 1
+  end
+
+  local function fail (what)
+    error(string.format("invalid snapshot: %s at byte %d", what, pos), 0)
+  end
+
+  local value
+
+  local function str ()
+    pos = pos + 1   -- skip opening quote
+    local e = find(s, '["\\]', pos)
+    if e and sub(s, e, e) == '"' then   -- no escapes? (the usual case)
+      local plain = sub(s, pos, e - 1)
+      pos = e + 1
+      return plain
+    end
+    local parts = {}
+    while true do
+      local i, e, plain, c = find(s, '^([^"\\]*)(["\\])', pos)
+      if not i then fail("unfinished string") end
+      parts[#parts + 1] = plain
+      pos = e + 1
+      if c == '"' then break end
+      c = sub(s, pos, pos)
+      if c == 'u' then
+        local hex = match(s, "^%x%x%x%x", pos + 1)
+        if not hex then fail("invalid escape") end
+        local code = tonumber(hex, 16)   -- snapshots escape raw bytes
+        parts[#parts + 1] = code < 256 and string.char(code)
+                                        or utf8.char(code)
+        pos = pos + 5
+      else
+        parts[#parts + 1] = escapes[c] or fail("invalid escape")
+        pos = pos + 1
+      end
+    end
+    return table.concat(parts)
+  end
+
+  local function array ()
+    local t = {}
+    pos = pos + 1
+    skip()
+    if sub(s, pos, pos) == ']' then pos = pos + 1; return t end
+    while true do
+      t[#t + 1] = value()
+      skip()
+      local c = sub(s, pos, pos)
+      pos = pos + 1
+      if c == ']' then return t
+      elseif c ~= ',' then fail("',' or ']' expected")
+      end
+    end
+  end
+
+  local function object ()
+    local t = {}
+    pos = pos + 1
+    skip()
+    if sub(s, pos, pos) == '}' then pos = pos + 1; return t end
+    while true do
+      skip()
+      if sub(s, pos, pos) ~= '"' then fail("key expected") end
+      local k = str()
+      skip()
+      if sub(s, pos, pos) ~= ':' then fail("':' expected") end
+      pos = pos + 1
+      t[k] = value()
+      skip()
+      local c = sub(s, pos, pos)
+      pos = pos + 1
+      if c == '}' then return t
+      elseif c ~= ',' then fail("',' or '}' expected")
+      end
+    end
+  end
+
+  function value ()
+    skip()
+    local c = sub(s, pos, pos)
+    if c == '{' then return object()
+    elseif c == '[' then return array()
+    elseif c == '"' then return str()
+    else
+      local num = match(s, "^-?%d+%.?%d*[eE]?[-+]?%d*", pos)
+      if not num or num == "" then fail("value expected") end
+      pos = pos + #num
+      return math.tointeger(tonumber(num)) or tonumber(num)
+    end
+  end
+
+  local v = value()
+  skip()
+  if pos <= #s then fail("garbage after snapshot") end
+  return v
+end
+
+M.decode = decode
+
+-- }======================================================
+
+
+-- Reads a snapshot file; returns a table with its nodes indexed by id.
+function M.read (fname)
+  local f = assert(io.open(fname, "rb"))
+  local snap = decode(f:read("a"))
+  f:close()
+  assert(snap.version == 1, "unknown snapshot version")
+  local nodes = {}
+  for _, node in ipairs(snap.nodes) do
+    nodes[node.id] = node
+  end
+  assert(nodes[0], "snapshot without a root")
+  return {nodes = nodes}
+end
+
+
+-- Whether an edge labeled 'label' from 'node' keeps its target alive.
+local function isstrong (node, label)
+  local weak = node.weak
+  if not weak or label == "(metatable)" then return true
+  elseif label == "(key)" then return not string.find(weak, "k")
+  else return not string.find(weak, "v")
+  end
+end
+
+
+-- Appends a label to a path.
+local function join (path, label)
+  if path == "" or string.sub(label, 1, 1) == "[" then return path .. label
+  else return path .. "." .. label
+  end
+end
+
+
+--[[
+Computes, for each node reachable through strong edges, its immediate
+dominator ('idom'), its retained size (its size plus the sizes of all
+nodes it dominates) and a path from the root. Dominators use the
+iterative algorithm of Cooper, Harvey and Kennedy over a depth-first
+order. The path of a node follows the depth-first tree, so it is one
+of the chains of references that keep the node alive.
+]]
+function M.analyze (snap)
+  local nodes = snap.nodes
+  local post = {}     -- nodes in postorder
+  local ponum = {}    -- postorder number of each node
+  local parent, plabel = {}, {}
+  local preds = {}
+  -- iterative depth-first search
+  local stack = {{0, 1}}
+  local seen = {[0] = true}
+  preds[0] = {}
+  while #stack > 0 do
+    local top = stack[#stack]
+    local node = nodes[top[1]]
+    local edge = node.edges[top[2]]
+    if edge == nil then   -- all edges visited?
+      stack[#stack] = nil
+      post[#post + 1] = node.id
+      ponum[node.id] = #post
+    else
+      top[2] = top[2] + 1
+      local to, label = edge[1], edge[2]
+      if nodes[to] and isstrong(node, label) then
+        local p = preds[to]
+        if not p then p = {}; preds[to] = p end
+        p[#p + 1] = node.id
+        if not seen[to] then
+          seen[to] = true
+          parent[to], plabel[to] = node.id, label
+          stack[#stack + 1] = {to, 1}
+        end
+      end
+    end
+  end
+  -- dominators
+  local idom = {[0] = 0}
+  local function intersect (a, b)
+    while a ~= b do
+      while ponum[a] < ponum[b] do a = idom[a] end
+      while ponum[b] < ponum[a] do b = idom[b] end
+    end
+    return a
+  end
+  local changed = true
+  while changed do
+    changed = false
+    for i = #post - 1, 1, -1 do   -- reverse postorder, skipping the root
+      local v = post[i]
+      local new
+      for _, p in ipairs(preds[v]) do
+        if idom[p] then new = new and intersect(p, new) or p end
+      end
+      if idom[v] ~= new then idom[v] = new; changed = true end
+    end
+  end
+  -- retained sizes (a node comes after all nodes it dominates)
+  local retained = {}
+  for _, v in ipairs(post) do
+    retained[v] = (retained[v] or 0) + nodes[v].size
+    if v ~= 0 then
+      retained[idom[v]] = (retained[idom[v]] or 0) + retained[v]
+    end
+  end
+  -- paths (a parent comes before its children in reverse postorder)
+  local path = {[0] = ""}
+  for i = #post - 1, 1, -1 do
+    local v = post[i]
+    path[v] = join(path[parent[v]], plabel[v])
+  end
+  snap.order, snap.idom, snap.retained, snap.path = post, idom, retained, path
+  return snap
+end
+
+
+-- Totals by type of the reachable nodes: {type = {count, bytes}}.
+local function bytype (snap)
+  local t = {}
+  for _, v in ipairs(snap.order) do
+    local node = snap.nodes[v]
+    if v ~= 0 then
+      local e = t[node.type] or {0, 0}
+      e[1], e[2] = e[1] + 1, e[2] + node.size
+      t[node.type] = e
+    end
+  end
+  return t
+end
+
+
+local function sortedkeys (t, f)
+  local keys = {}
+  for k in pairs(t) do keys[#keys + 1] = k end
+  table.sort(keys, f)
+  return keys
+end
+
+
+local function describe (node)
+  if node.name then
+    return string.format("%s %q", node.type, node.name)
+  else
+    return node.type
+  end
+end
+
+
+-- Summary of a snapshot and its 'n' largest objects by retained size.
+function M.report (snap, n, out)
+  out = out or io.write
+  local types = bytype(snap)
+  out(string.format("%d objects, %d bytes\n", #snap.order - 1,
+                    snap.retained[0]))
+  for _, k in ipairs(sortedkeys(types, function (a, b)
+                      return types[a][2] > types[b][2] end)) do
+    out(string.format("  %-10s %8d objects %12d bytes\n", k,
+                      types[k][1], types[k][2]))
+  end
+  local objs = {}
+  for i = 1, #snap.order - 1 do objs[i] = snap.order[i] end
+  table.sort(objs, function (a, b)
+    return snap.retained[a] > snap.retained[b]
+  end)
+  out(string.format("\n%12s %10s  object / path\n", "retained", "self"))
+  for i = 1, math.min(n or 20, #objs) do
+    local v = objs[i]
+    local node = snap.nodes[v]
+    out(string.format("%12d %10d  %s\n%24s%s\n", snap.retained[v],
+                      node.size, describe(node), "", snap.path[v]))
+  end
+end
+
+
+-- Differences from snapshot 'old' to snapshot 'new': totals by type,
+-- and the 'n' paths whose retained sizes grew most.
+function M.diff (old, new, n, out)
+  out = out or io.write
+  local t1, t2 = bytype(old), bytype(new)
+  out(string.format("%+d objects, %+d bytes\n",
+                    #new.order - #old.order,
+                    new.retained[0] - old.retained[0]))
+  local types = {}
+  for k in pairs(t1) do types[k] = true end
+  for k in pairs(t2) do types[k] = true end
+  for _, k in ipairs(sortedkeys(types)) do
+    local a, b = t1[k] or {0, 0}, t2[k] or {0, 0}
+    out(string.format("  %-10s %+8d objects %+12d bytes\n", k,
+                      b[1] - a[1], b[2] - a[2]))
+  end
+  local function bypath (snap)
+    local t = {}
+    for i = 1, #snap.order - 1 do
+      local v = snap.order[i]
+      local p = snap.path[v]
+      t[p] = (t[p] or 0) + snap.retained[v]
+    end
+    return t
+  end
+  local p1, p2 = bypath(old), bypath(new)
+  local growth = {}
+  for p, size in pairs(p2) do
+    local d = size - (p1[p] or 0)
+    if d > 0 then growth[#growth + 1] = {p, d, p1[p] == nil} end
+  end
+  table.sort(growth, function (a, b) return a[2] > b[2] end)
+  out(string.format("\n%12s  path\n", "growth"))
+  for i = 1, math.min(n or 20, #growth) do
+    local g = growth[i]
+    out(string.format("%+12d  %s%s\n", g[2], g[1], g[3] and " (new)" or ""))
+  end
+end
+
+
+local args = table.pack(...)
+if args.n == 0 and not (arg and string.find(arg[0], "heapsnap%.lua$")) then
+  return M   -- loaded as a library
+end
+
+local n = math.tointeger(tonumber(args[args.n]))
+if n then args.n = args.n - 1 end
+if args.n == 1 then
+  M.report(M.analyze(M.read(args[1])), n)
+elseif args.n == 2 then
+  M.diff(M.analyze(M.read(args[1])), M.analyze(M.read(args[2])), n)
+else
+  io.stderr:write("usage: lua heapsnap.lua snapshot [n]\n",
+                  "       lua heapsnap.lua old new [n]\n")
+  os.exit(1)
+end
@@ -856,7 +856,7 @@ static void auxsetstr (lua_State *L, const TValue *t, const char *k) {
   api_checkpop(L, 1);
   luaV_fastset(t, str, s2v(L->top.p - 1), hres, luaH_psetstr);
   if (hres == HOK) {
-    luaV_finishfastset(L, t, s2v(L->top.p - 1));
+    luaV_finishfastsets(L, t, str, s2v(L->top.p - 1));
     L->top.p--;  /* pop value */
   }
   else {
@@ -885,7 +885,7 @@ LUA_API void lua_settable (lua_State *L, int idx) {
   t = index2value(L, idx);
   luaV_fastset(t, s2v(L->top.p - 2), s2v(L->top.p - 1), hres, luaH_pset);
   if (hres == HOK)
-    luaV_finishfastset(L, t, s2v(L->top.p - 1));
+    luaV_finishfastset(L, t, s2v(L->top.p - 2), s2v(L->top.p - 1));
   else
     luaV_finishset(L, t, s2v(L->top.p - 2), s2v(L->top.p - 1), hres);
   L->top.p -= 2;  /* pop index and value */
@@ -907,7 +907,7 @@ LUA_API void lua_seti (lua_State *L, int idx, lua_Integer n) {
   t = index2value(L, idx);
   luaV_fastseti(t, n, s2v(L->top.p - 1), hres);
   if (hres == HOK)
-    luaV_finishfastset(L, t, s2v(L->top.p - 1));
+    luaV_finishfastseti(L, t, n, s2v(L->top.p - 1));
   else {
     TValue temp;
     setivalue(&temp, n);
@@ -925,7 +925,7 @@ static void aux_rawset (lua_State *L, int idx, TValue *key, int n) {
   t = gettable(L, idx);
   luaH_set(L, t, key, s2v(L->top.p - 1));
   invalidateTMcache(t);
-  luaC_barrierback(L, obj2gco(t), s2v(L->top.p - 1));
+  luaC_barriertab(L, t, key, s2v(L->top.p - 1));
   L->top.p -= n;
   lua_unlock(L);
 }
@@ -949,7 +949,7 @@ LUA_API void lua_rawseti (lua_State *L, int idx, lua_Integer n) {
   api_checkpop(L, 1);
   t = gettable(L, idx);
   luaH_setint(L, t, n, s2v(L->top.p - 1));
-  luaC_barrierback(L, obj2gco(t), s2v(L->top.p - 1));
+  luaC_barriertabi(L, t, n, s2v(L->top.p - 1));
   L->top.p--;
   lua_unlock(L);
 }
@@ -1161,6 +1161,12 @@ LUA_API int lua_status (lua_State *L) {
 /*
 ** Garbage-collection function
 */
+
+/* current mode of the collector, as a 'lua_gc' option */
+#define gcmode(g)  \
+	((g)->adaptive ? LUA_GCADAPT : (g)->gckind == KGC_INC ? LUA_GCINC \
+	                                                     : LUA_GCGEN)
+
 LUA_API int lua_gc (lua_State *L, int what, ...) {
   va_list argp;
   int res = 0;
@@ -1185,11 +1191,12 @@ LUA_API int lua_gc (lua_State *L, int what, ...) {
     }
     case LUA_GCCOUNT: {
       /* GC values are expressed in Kbytes: #bytes/2^10 */
-      res = cast_int(gettotalbytes(g) >> 10);
+      /* (external memory is not memory in use by Lua) */
+      res = cast_int((gettotalbytes(g) - g->GCextbytes) >> 10);
       break;
     }
     case LUA_GCCOUNTB: {
-      res = cast_int(gettotalbytes(g) & 0x3ff);
+      res = cast_int((gettotalbytes(g) - g->GCextbytes) & 0x3ff);
       break;
     }
     case LUA_GCSTEP: {
@@ -1211,15 +1218,22 @@ LUA_API int lua_gc (lua_State *L, int what, ...) {
       break;
     }
     case LUA_GCGEN: {
-      res = (g->gckind == KGC_INC) ? LUA_GCINC : LUA_GCGEN;
+      res = gcmode(g);
+      luaC_setadaptive(L, 0);
       luaC_changemode(L, KGC_GENMINOR);
       break;
     }
     case LUA_GCINC: {
-      res = (g->gckind == KGC_INC) ? LUA_GCINC : LUA_GCGEN;
+      res = gcmode(g);
+      luaC_setadaptive(L, 0);
       luaC_changemode(L, KGC_INC);
       break;
     }
+    case LUA_GCADAPT: {
+      res = gcmode(g);
+      luaC_setadaptive(L, 1);  /* start from the current mode */
+      break;
+    }
     case LUA_GCPARAM: {
       int param = va_arg(argp, int);
       int value = va_arg(argp, int);
@@ -1229,6 +1243,58 @@ LUA_API int lua_gc (lua_State *L, int what, ...) {
         g->gcparams[param] = luaO_codeparam(cast_uint(value));
       break;
     }
+    case LUA_GCSAFEALLOC: {
+      int safe = va_arg(argp, int);
+      res = g->allocsafe;
+      luaC_setallocsafe(L, safe);
+      break;
+    }
+    case LUA_GCBULKFREE: {
+      int bulk = va_arg(argp, int);
+      res = g->bulkfree;
+      g->bulkfree = cast_byte(bulk != 0);
+      break;
+    }
+    case LUA_GCTIMEDSTEP: {
+      lu_byte oldstp = g->gcstp;
+      int usecs = va_arg(argp, int);
+      g->gcstp = 0;  /* allow GC to run (other bits must be zero here) */
+      res = luaC_timedstep(L, (usecs > 0) ? usecs : 0);
+      g->gcstp = oldstp;  /* restore previous state */
+      break;
+    }
+    case LUA_GCPAUSES: {
+      lua_GCPauses *p = va_arg(argp, lua_GCPauses *);
+      int reset = va_arg(argp, int);
+      if (p != NULL)
+        *p = g->gcpauses;
+      if (reset)
+        memset(&g->gcpauses, 0, sizeof(g->gcpauses));
+      break;
+    }
+    case LUA_GCTELEMETRY: {
+      int on = va_arg(argp, int);
+      res = (g->telemetry != NULL);
+      if (on >= 0)
+        luaC_settelemetry(L, on);
+      break;
+    }
+    case LUA_GCCOMPACT: {
+      l_mem moved = luaC_compact(L);
+      res = (moved < INT_MAX) ? cast_int(moved) : INT_MAX;
+      break;
+    }
+    case LUA_GCSTATS: {
+      lua_GCPhaseStats *s = va_arg(argp, lua_GCPhaseStats *);
+      int reset = va_arg(argp, int);
+      res = luaC_getgcstats(L, s, reset);
+      break;
+    }
+    case LUA_GCBREAKDOWN: {
+      lua_GCBreakdown *b = va_arg(argp, lua_GCBreakdown *);
+      luaC_getbreakdown(L, b);
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   va_end(argp);
@@ -1237,6 +1303,85 @@ LUA_API int lua_gc (lua_State *L, int what, ...) {
 }
 
 
+LUA_API void lua_setgcevents (lua_State *L, lua_GCEventFunction f,
+                              void *ud) {
+  lua_lock(L);
+  luaC_setgcevents(L, f, ud);
+  lua_unlock(L);
+}
+
+
+LUA_API void lua_setgcdecisions (lua_State *L, lua_GCDecisionFunction f,
+                                 void *ud) {
+  global_State *g = G(L);
+  lua_lock(L);
+  g->decisionf = f;
+  g->decisionud = ud;
+  lua_unlock(L);
+}
+
+
+LUA_API lua_GCDecisionFunction lua_getgcdecisions (lua_State *L, void **ud) {
+  lua_GCDecisionFunction f;
+  lua_lock(L);
+  if (ud) *ud = G(L)->decisionud;
+  f = G(L)->decisionf;
+  lua_unlock(L);
+  return f;
+}
+
+
+/*
+** External memory: both functions return the new total. Releasing it
+** does not call the collector, so it can be done in finalizers.
+*/
+LUA_API size_t lua_gcaddpressure (lua_State *L, size_t bytes) {
+  size_t total;
+  lua_lock(L);
+  luaC_addpressure(L, (bytes < cast_sizet(MAX_LMEM)) ? cast(l_mem, bytes)
+                                                     : MAX_LMEM);
+  total = cast_sizet(G(L)->GCextbytes);
+  luaC_checkGC(L);
+  lua_unlock(L);
+  return total;
+}
+
+
+LUA_API size_t lua_gcsubpressure (lua_State *L, size_t bytes) {
+  size_t total;
+  lua_lock(L);
+  luaC_addpressure(L, (bytes < cast_sizet(MAX_LMEM)) ? -cast(l_mem, bytes)
+                                                     : -MAX_LMEM);
+  total = cast_sizet(G(L)->GCextbytes);
+  lua_unlock(L);
+  return total;
+}
+
+
+/*
+** Call up to 'maxcount' pending finalizers; returns how many ran, or -1
+** when called from a finalizer (or while the state is closing).
+*/
+LUA_API int lua_gcfinalize (lua_State *L, int maxcount) {
+  int res;
+  if (G(L)->gcstp & (GCSTPGC | GCSTPCLS))  /* internal stop? */
+    return -1;
+  lua_lock(L);
+  res = luaC_runfinalizers(L, maxcount);
+  lua_unlock(L);
+  return res;
+}
+
+
+LUA_API int lua_heapsnapshot (lua_State *L, lua_Writer writer, void *data) {
+  int status;
+  lua_lock(L);
+  status = luaC_heapsnapshot(L, writer, data);
+  lua_unlock(L);
+  return status;
+}
+
+
 
 /*
 ** miscellaneous functions
@@ -1322,6 +1467,8 @@ LUA_API lua_Alloc lua_getallocf (lua_State *L, void **ud) {
 
 LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud) {
   lua_lock(L);
+  luaC_setallocsafe(L, 0);  /* new allocator is not known to be thread safe */
+  G(L)->bulkfree = 0;  /* nor to free all blocks at once */
   G(L)->ud = ud;
   G(L)->frealloc = f;
   lua_unlock(L);
@@ -16,6 +16,16 @@
 #include <stdlib.h>
 #include <string.h>
 
+/*
+** l_systrim returns to the system the free memory kept by 'malloc'
+*/
+#if defined(__GLIBC__)
+#include <malloc.h>
+#define l_systrim()	((void)malloc_trim(0))
+#else
+#define l_systrim()	((void)0)
+#endif
+
 
 /*
 ** This file uses only the official API of Lua.
@@ -357,6 +367,75 @@ LUALIB_API void *luaL_checkudata (lua_State *L, int ud, const char *tname) {
 /* }====================================================== */
 
 
+
+/*
+** {======================================================
+** External memory of userdata
+** =======================================================
+*/
+
+/*
+** The external memory of a userdata is kept in a "token", a userdata
+** with a 'size_t' and a finalizer that releases that memory. A table
+** with weak keys in the registry maps each userdata to its token, so
+** the token becomes garbage together with the userdata.
+*/
+
+/* key, in the registry, for the table of tokens */
+#define PRESSURETABLE	"_PRESSURE"
+
+/* name of the metatable of tokens */
+#define PRESSURETOKEN	"_PRESSURETOKEN"
+
+
+static int releasepressure (lua_State *L) {
+  size_t *bytes = (size_t *)lua_touserdata(L, 1);
+  lua_gcsubpressure(L, *bytes);
+  *bytes = 0;
+  return 0;
+}
+
+
+/*
+** Set to 'bytes' the external memory kept by the userdata at index
+** 'ud'; it is released when the userdata is collected.
+*/
+LUALIB_API void luaL_setpressure (lua_State *L, int ud, size_t bytes) {
+  size_t *old;
+  ud = lua_absindex(L, ud);
+  if (!luaL_getsubtable(L, LUA_REGISTRYINDEX, PRESSURETABLE)) {
+    lua_createtable(L, 0, 1);  /* new table: make its keys weak */
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+  }
+  lua_pushvalue(L, ud);
+  if (lua_rawget(L, -2) == LUA_TUSERDATA)  /* has a token? */
+    old = (size_t *)lua_touserdata(L, -1);
+  else {
+    lua_pop(L, 1);
+    old = (size_t *)lua_newuserdatauv(L, sizeof(size_t), 0);
+    *old = 0;
+    if (luaL_newmetatable(L, PRESSURETOKEN)) {
+      lua_pushcfunction(L, releasepressure);
+      lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, ud);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);  /* table[ud] = token */
+  }
+  if (bytes >= *old)
+    lua_gcaddpressure(L, bytes - *old);
+  else
+    lua_gcsubpressure(L, *old - bytes);
+  *old = bytes;
+  lua_pop(L, 2);  /* token and table */
+}
+
+/* }====================================================== */
+
+
 /*
 ** {======================================================
 ** Argument check functions
@@ -1046,9 +1125,13 @@ LUALIB_API const char *luaL_gsub (lua_State *L, const char *s,
 }
 
 
+#if !defined(LUA_USE_POOLALLOC)
+
 static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
-  (void)ud; (void)osize;  /* not used */
+  (void)ud;  /* not used */
   if (nsize == 0) {
+    if (ptr == NULL && osize == LUA_ALLOCCOMPACT)
+      l_systrim();
     free(ptr);
     return NULL;
   }
@@ -1056,6 +1139,8 @@ static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
     return realloc(ptr, nsize);
 }
 
+#endif
+
 
 /*
 ** Standard panic function just prints an error message. The test
@@ -1177,13 +1262,545 @@ LUALIB_API unsigned int luaL_makeseed (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Pool allocator
+** =======================================================
+*/
+
+/*
+** Blocks up to POOLMAXSIZE bytes are carved from slabs of POOLSLAB
+** bytes. All blocks in a slab belong to the same size class, in steps
+** of POOLGRAIN bytes. A slab is aligned to its size, so the slab of a
+** block is found by masking the block address. Each slab serves new
+** blocks from its free list or, when that is empty, by bumping 'top'.
+** Larger blocks go directly to 'malloc'. The size class of a block
+** comes from 'osize', which Lua always gives exactly.
+**
+** Slabs that become empty go to a list of spare slabs, which can be
+** reused by any size class. At the end of each collection cycle
+** (LUA_ALLOCIDLE), the pool returns to the system all spare slabs
+** beyond POOLRESERVE.
+**
+** The pool is not thread safe, so states using it do not set
+** LUA_GCSAFEALLOC.
+*/
+
+typedef union { LUAI_MAXALIGN; } PoolAlign;
+
+#define POOLGRAIN	sizeof(PoolAlign)
+#define POOLSLAB	((size_t)16384)
+#define POOLMAXSIZE	((size_t)256)
+#define POOLCLASSES	(POOLMAXSIZE / POOLGRAIN)
+#define POOLRESERVE	4	/* spare slabs kept at the end of a cycle */
+
+
+typedef struct Slab {
+  struct Slab *next, *prev;  /* list of slabs with free blocks */
+  void *freelist;  /* list of freed blocks */
+  char *top;  /* first block never used */
+  void *base;  /* block returned by 'malloc', when not aligned */
+  unsigned int used;  /* number of blocks in use */
+  unsigned int cls;  /* size class */
+} Slab;
+
+
+typedef struct Pool {
+  Slab *avail[POOLCLASSES];  /* slabs with free blocks for each class */
+  Slab *spare;  /* list of empty slabs */
+  size_t nblocks;  /* number of blocks in use (plus creation guard) */
+} Pool;
+
+
+/* size of slab header, rounded up to keep blocks aligned */
+#define SLABHEAD	((sizeof(Slab) + POOLGRAIN - 1) & ~(POOLGRAIN - 1))
+
+#define sizeclass(sz)	cast_uint(((sz) - 1) / POOLGRAIN)
+#define classsize(c)	(((size_t)(c) + 1) * POOLGRAIN)
+
+#define blockslab(b)  \
+	cast(Slab *, cast_charp(b) - (cast_sizet(b) & (POOLSLAB - 1)))
+
+#define slabfull(s)  \
+	((s)->freelist == NULL &&  \
+	 (s)->top + classsize((s)->cls) > cast_charp(s) + POOLSLAB)
+
+
+/*
+** Allocate a slab aligned to its size. Without 'posix_memalign' or
+** 'aligned_alloc', the slab is cut from a block twice its size.
+*/
+static Slab *slabnew (void) {
+#if defined(LUA_USE_POSIX)
+  void *b;
+  if (posix_memalign(&b, POOLSLAB, POOLSLAB) != 0)
+    return NULL;
+  cast(Slab *, b)->base = b;
+  return cast(Slab *, b);
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+  Slab *s = cast(Slab *, aligned_alloc(POOLSLAB, POOLSLAB));
+  if (s != NULL)
+    s->base = s;
+  return s;
+#else
+  char *b = cast_charp(malloc(2 * POOLSLAB));
+  Slab *s;
+  if (b == NULL)
+    return NULL;
+  s = cast(Slab *, b + (POOLSLAB - (cast_sizet(b) & (POOLSLAB - 1))));
+  s->base = b;
+  return s;
+#endif
+}
+
+
+static void slabunlink (Pool *p, Slab *s) {
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    p->avail[s->cls] = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+}
+
+
+static void slablink (Pool *p, Slab *s) {
+  s->prev = NULL;
+  s->next = p->avail[s->cls];
+  if (s->next)
+    s->next->prev = s;
+  p->avail[s->cls] = s;
+}
+
+
+/*
+** Get a new slab for class 'cls', preferably a spare one.
+*/
+static Slab *slabget (Pool *p, unsigned int cls) {
+  Slab *s = p->spare;
+  if (s != NULL)
+    p->spare = s->next;
+  else if ((s = slabnew()) == NULL)
+    return NULL;
+  s->freelist = NULL;
+  s->top = cast_charp(s) + SLABHEAD;
+  s->used = 0;
+  s->cls = cls;
+  slablink(p, s);
+  return s;
+}
+
+
+/*
+** Return spare slabs to the system, keeping the first 'keep' ones.
+*/
+static void pooltrim (Pool *p, int keep) {
+  Slab **ps = &p->spare;
+  while (*ps != NULL && keep-- > 0)
+    ps = &(*ps)->next;
+  while (*ps != NULL) {
+    Slab *s = *ps;
+    *ps = s->next;
+    free(s->base);
+  }
+}
+
+
+static void *blockalloc (Pool *p, size_t size) {
+  if (size <= POOLMAXSIZE) {
+    unsigned int cls = sizeclass(size);
+    Slab *s = p->avail[cls];
+    void *b;
+    if (s == NULL && (s = slabget(p, cls)) == NULL)
+      return NULL;
+    if (s->freelist != NULL) {  /* reuse a freed block? */
+      b = s->freelist;
+      s->freelist = *cast(void **, b);
+    }
+    else {  /* bump allocation */
+      b = s->top;
+      s->top += classsize(cls);
+    }
+    s->used++;
+    if (slabfull(s))
+      slabunlink(p, s);  /* no more blocks here */
+    return b;
+  }
+  else
+    return malloc(size);
+}
+
+
+static void blockfree (Pool *p, void *b, size_t size) {
+  if (size <= POOLMAXSIZE) {
+    Slab *s = blockslab(b);
+    if (slabfull(s))
+      slablink(p, s);  /* it will have a free block */
+    *cast(void **, b) = s->freelist;
+    s->freelist = b;
+    if (--s->used == 0 && (s->prev != NULL || s->next != NULL)) {
+      slabunlink(p, s);  /* empty and not the only slab in its class */
+      s->next = p->spare;
+      p->spare = s;
+    }
+  }
+  else
+    free(b);
+}
+
+
+/*
+** A reallocation inside the same size class is a chance to move the
+** block (see LUA_ALLOCCOMPACT) to the slab that serves new blocks of
+** its class, when that slab has at least as many blocks in use. When
+** the block's own slab is the fuller one, that slab goes to the front
+** of the list, to receive the blocks that come next. So, the blocks
+** gather in the fullest slabs and the sparse ones become empty, ready
+** to return to the system.
+*/
+static void *blockmove (Pool *p, void *b, size_t osize, size_t nsize) {
+  Slab *s = blockslab(b);
+  Slab *to = p->avail[s->cls];
+  if (to == s)
+    return b;  /* already in the front slab */
+  else if (to != NULL && to->used >= s->used) {
+    void *nb = blockalloc(p, nsize);  /* comes from 'to' */
+    memcpy(nb, b, (osize < nsize) ? osize : nsize);
+    blockfree(p, b, osize);
+    return nb;
+  }
+  else {
+    if (!slabfull(s)) {  /* move 's' to the front of its list */
+      slabunlink(p, s);
+      slablink(p, s);
+    }
+    return b;  /* block already has the right size */
+  }
+}
+
+
+/*
+** Release one block (or the creation guard); free the pool when
+** nothing else is in use.
+*/
+static void poolrelease (Pool *p) {
+  if (--p->nblocks == 0) {
+    unsigned int i;
+    for (i = 0; i < POOLCLASSES; i++) {  /* move all slabs to spare */
+      while (p->avail[i] != NULL) {
+        Slab *s = p->avail[i];
+        p->avail[i] = s->next;
+        s->next = p->spare;
+        p->spare = s;
+      }
+    }
+    pooltrim(p, 0);
+    free(p);
+  }
+}
+
+
+static void *pool_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  Pool *p = cast(Pool *, ud);
+  if (ptr == NULL) {
+    if (nsize == 0) {  /* no block to free? */
+      if (osize == LUA_ALLOCIDLE)
+        pooltrim(p, POOLRESERVE);
+      else if (osize == LUA_ALLOCCOMPACT) {
+        pooltrim(p, 0);
+        l_systrim();
+      }
+      return NULL;
+    }
+    if ((ptr = blockalloc(p, nsize)) != NULL)
+      p->nblocks++;
+    return ptr;
+  }
+  else if (nsize == 0) {
+    blockfree(p, ptr, osize);
+    poolrelease(p);
+    return NULL;
+  }
+  else if (osize > POOLMAXSIZE && nsize > POOLMAXSIZE)
+    return realloc(ptr, nsize);
+  else if (osize <= POOLMAXSIZE && nsize <= POOLMAXSIZE &&
+           sizeclass(osize) == sizeclass(nsize))
+    return blockmove(p, ptr, osize, nsize);
+  else {
+    void *nb = blockalloc(p, nsize);
+    if (nb == NULL)
+      return NULL;  /* keep the old block */
+    memcpy(nb, ptr, (osize < nsize) ? osize : nsize);
+    blockfree(p, ptr, osize);
+    return nb;
+  }
+}
+
+
+/*
+** Create a state whose memory comes from a new pool. The pool lives
+** while it has blocks in use, that is, until the state is closed. A
+** guard count keeps it alive while the state is being created.
+*/
+LUALIB_API lua_State *luaL_newpoolstate (void) {
+  Pool *p = cast(Pool *, malloc(sizeof(Pool)));
+  lua_State *L;
+  if (p == NULL)
+    return NULL;
+  memset(p, 0, sizeof(Pool));
+  p->nblocks = 1;  /* creation guard */
+  L = lua_newstate(pool_alloc, p, luai_makeseed());
+  poolrelease(p);  /* remove guard (frees pool if creation failed) */
+  if (l_likely(L)) {
+    lua_atpanic(L, &panic);
+    lua_setwarnf(L, warnfoff, L);  /* default is warnings off */
+  }
+  return L;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Region allocator
+** =======================================================
+*/
+
+/*
+** A region serves all blocks of a state from large chunks, bumping a
+** pointer through the current chunk. Block sizes are rounded to size
+** classes: steps of POOLGRAIN bytes up to POOLMAXSIZE, then powers of
+** two up to REGIONBIG. Freed blocks go to a free list for their class,
+** to be reused by later allocations of that class; chunks are never
+** returned while the state is alive. Blocks larger than REGIONBIG get
+** their own 'malloc' block, linked in a list, and are freed at once.
+**
+** Region states declare their allocator with LUA_GCBULKFREE, so
+** 'lua_close' does not free objects one by one: it runs pending
+** finalizers and then sends LUA_ALLOCRELEASE, which frees all chunks
+** and big blocks. As with pools, a region is also freed when its last
+** block is freed.
+*/
+
+#define REGIONCHUNK	((size_t)1 << 16)	/* size of first chunk */
+#define REGIONMAXCHUNK	((size_t)1 << 20)	/* maximum size of a chunk */
+#define REGIONBIG	(REGIONMAXCHUNK / 4)	/* largest block in chunks */
+
+/* log2 of POOLMAXSIZE and REGIONBIG */
+#define REGIONLOGMIN	8
+#define REGIONLOGBIG	18
+
+#define REGIONCLASSES	(POOLCLASSES + (REGIONLOGBIG - REGIONLOGMIN))
+
+
+/* header for chunks and big blocks */
+typedef union RegionBlock {
+  struct {
+    union RegionBlock *next, *prev;
+    size_t size;  /* size of the block including this header */
+  } h;
+  PoolAlign a;  /* keep what follows aligned */
+} RegionBlock;
+
+
+typedef struct Region {
+  RegionBlock *chunks;  /* list of chunks */
+  RegionBlock *big;  /* list of big blocks */
+  char *top;  /* free part of current chunk... */
+  char *limit;  /* ...and its end */
+  size_t nblocks;  /* number of blocks in use (plus creation guard) */
+  void *freelist[REGIONCLASSES];  /* freed blocks for each class */
+} Region;
+
+
+static unsigned int regionclass (size_t size) {
+  if (size <= POOLMAXSIZE)
+    return sizeclass(size);
+  else {
+    unsigned int c = POOLCLASSES;
+    size_t s = POOLMAXSIZE * 2;
+    while (s < size) {
+      s *= 2;
+      c++;
+    }
+    return c;
+  }
+}
+
+
+static size_t regionsize (unsigned int c) {
+  if (c < POOLCLASSES)
+    return classsize(c);
+  else
+    return POOLMAXSIZE << (c - POOLCLASSES + 1);
+}
+
+
+static void regionlink (RegionBlock **list, RegionBlock *b) {
+  b->h.prev = NULL;
+  b->h.next = *list;
+  if (*list != NULL)
+    (*list)->h.prev = b;
+  *list = b;
+}
+
+
+/*
+** Add a new chunk with room for at least 'size' bytes. Each chunk is
+** twice as large as the previous one, up to REGIONMAXCHUNK.
+*/
+static int regiongrow (Region *r, size_t size) {
+  size_t csize = REGIONCHUNK;
+  RegionBlock *c;
+  if (r->chunks != NULL && r->chunks->h.size < REGIONMAXCHUNK)
+    csize = r->chunks->h.size * 2;
+  else if (r->chunks != NULL)
+    csize = REGIONMAXCHUNK;
+  while (csize < size + sizeof(RegionBlock))
+    csize *= 2;
+  c = cast(RegionBlock *, malloc(csize));
+  if (c == NULL)
+    return 0;
+  c->h.size = csize;
+  regionlink(&r->chunks, c);
+  r->top = cast_charp(c + 1);
+  r->limit = cast_charp(c) + csize;
+  return 1;
+}
+
+
+static void *regionalloc (Region *r, size_t size) {
+  if (size <= REGIONBIG) {
+    unsigned int c = regionclass(size);
+    void *b = r->freelist[c];
+    if (b != NULL)  /* reuse a freed block? */
+      r->freelist[c] = *cast(void **, b);
+    else {
+      size = regionsize(c);
+      if (cast_sizet(r->limit - r->top) < size && !regiongrow(r, size))
+        return NULL;
+      b = r->top;
+      r->top += size;
+    }
+    return b;
+  }
+  else {
+    RegionBlock *b = cast(RegionBlock *, malloc(sizeof(RegionBlock) + size));
+    if (b == NULL)
+      return NULL;
+    b->h.size = size;
+    regionlink(&r->big, b);
+    return b + 1;
+  }
+}
+
+
+static void regionfree (Region *r, void *b, size_t size) {
+  if (size <= REGIONBIG) {
+    unsigned int c = regionclass(size);
+    *cast(void **, b) = r->freelist[c];
+    r->freelist[c] = b;
+  }
+  else {
+    RegionBlock *bb = cast(RegionBlock *, b) - 1;
+    if (bb->h.prev)
+      bb->h.prev->h.next = bb->h.next;
+    else
+      r->big = bb->h.next;
+    if (bb->h.next)
+      bb->h.next->h.prev = bb->h.prev;
+    free(bb);
+  }
+}
+
+
+static void freeblocklist (RegionBlock *b) {
+  while (b != NULL) {
+    RegionBlock *next = b->h.next;
+    free(b);
+    b = next;
+  }
+}
+
+
+static void regionrelease (Region *r) {
+  freeblocklist(r->big);
+  freeblocklist(r->chunks);
+  free(r);
+}
+
+
+static void *region_alloc (void *ud, void *ptr, size_t osize,
+                                                size_t nsize) {
+  Region *r = cast(Region *, ud);
+  if (ptr == NULL) {
+    if (nsize == 0) {  /* no block to free? */
+      if (osize == LUA_ALLOCRELEASE)
+        regionrelease(r);
+      return NULL;
+    }
+    if ((ptr = regionalloc(r, nsize)) != NULL)
+      r->nblocks++;
+    return ptr;
+  }
+  else if (nsize == 0) {
+    regionfree(r, ptr, osize);
+    if (--r->nblocks == 0)
+      regionrelease(r);
+    return NULL;
+  }
+  else if (osize <= REGIONBIG && nsize <= REGIONBIG &&
+           regionclass(osize) == regionclass(nsize))
+    return ptr;  /* block already has the right size */
+  else {
+    void *nb = regionalloc(r, nsize);
+    if (nb == NULL)
+      return NULL;  /* keep the old block */
+    memcpy(nb, ptr, (osize < nsize) ? osize : nsize);
+    regionfree(r, ptr, osize);
+    return nb;
+  }
+}
+
+
+/*
+** Create a state whose memory comes from a new region. A guard count
+** keeps the region alive while the state is being created.
+*/
+LUALIB_API lua_State *luaL_newregionstate (void) {
+  Region *r = cast(Region *, malloc(sizeof(Region)));
+  lua_State *L;
+  if (r == NULL)
+    return NULL;
+  memset(r, 0, sizeof(Region));
+  r->nblocks = 1;  /* creation guard */
+  L = lua_newstate(region_alloc, r, luai_makeseed());
+  if (--r->nblocks == 0)  /* creation failed? */
+    regionrelease(r);
+  else {
+    lua_atpanic(L, &panic);
+    lua_setwarnf(L, warnfoff, L);  /* default is warnings off */
+    lua_gc(L, LUA_GCBULKFREE, 1);  /* 'lua_close' sends LUA_ALLOCRELEASE */
+  }
+  return L;
+}
+
+/* }====================================================== */
+
+
 LUALIB_API lua_State *luaL_newstate (void) {
+#if defined(LUA_USE_POOLALLOC)
+  return luaL_newpoolstate();
+#else
   lua_State *L = lua_newstate(l_alloc, NULL, luai_makeseed());
   if (l_likely(L)) {
     lua_atpanic(L, &panic);
     lua_setwarnf(L, warnfoff, L);  /* default is warnings off */
+    lua_gc(L, LUA_GCSAFEALLOC, 1);  /* 'l_alloc' is thread safe */
   }
   return L;
+#endif
 }
 
 
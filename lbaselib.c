@@ -188,10 +188,311 @@ static int pushmode (lua_State *L, int oldmode) {
     luaL_pushfail(L);  /* invalid call to 'lua_gc' */
   else
     lua_pushstring(L, (oldmode == LUA_GCINC) ? "incremental"
+                    : (oldmode == LUA_GCGEN) ? "generational" : "adaptive");
+  return 1;
+}
+
+
+/*
+** {======================================================
+** Collector statistics
+** =======================================================
+*/
+
+/*
+** Estimates the time below which fall 'perc' percent of the 'count'
+** durations in distribution 'bins': the upper limit of the bin where
+** that fraction is reached.
+*/
+static lua_Unsigned percentile (const lua_Unsigned *bins,
+                                lua_Unsigned count, lua_Unsigned max,
+                                int perc) {
+  lua_Unsigned limit = (count * (lua_Unsigned)perc + 99) / 100;
+  lua_Unsigned acc = 0;
+  int i;
+  for (i = 0; i < LUA_GCPAUSEBINS - 1; i++) {
+    acc += bins[i];
+    if (acc >= limit) {
+      lua_Unsigned top = ((lua_Unsigned)1 << i) - 1;  /* largest in bin */
+      return (top < max) ? top : max;
+    }
+  }
+  return max;
+}
+
+
+static void setufield (lua_State *L, const char *k, lua_Unsigned v) {
+  lua_pushinteger(L, l_castU2S(v));
+  lua_setfield(L, -2, k);
+}
+
+
+/*
+** Sets the fields of a distribution in the table on the top.
+*/
+static void setdistfields (lua_State *L, const lua_Unsigned *bins,
+                           lua_Unsigned count, lua_Unsigned total,
+                           lua_Unsigned max) {
+  setufield(L, "count", count);
+  setufield(L, "total", total);
+  setufield(L, "max", max);
+  setufield(L, "p50", percentile(bins, count, max, 50));
+  setufield(L, "p90", percentile(bins, count, max, 90));
+  setufield(L, "p99", percentile(bins, count, max, 99));
+}
+
+
+static void pushpauses (lua_State *L, const lua_GCPauses *p) {
+  int i;
+  lua_createtable(L, LUA_GCPAUSEBINS, 7);
+  for (i = 0; i < LUA_GCPAUSEBINS; i++) {
+    lua_pushinteger(L, l_castU2S(p->bins[i]));
+    lua_rawseti(L, -2, i + 1);
+  }
+  setdistfields(L, p->bins, p->count, p->total, p->max);
+  setufield(L, "over", p->over);
+}
+
+
+/* names of the collector parameters, in the order of LUA_GCP* */
+static const char *const gcparams[] = {
+  "minormul", "majorminor", "minormajor",
+  "pause", "stepmul", "stepsize", "markthreads", "sweepthread",
+  "steptime", "pausegoal", "memgoal", "deferfin", "leanstacks",
+  "threadpool", NULL};
+
+
+static const char *const gcevnames[LUA_GCEVN] = {
+  "propagate", "atomic", "swpallgc", "swpfinobj", "swptobefnz",
+  "swpend", "callfin", "minor", "major"
+};
+
+
+/* names of the kinds of objects, in the order of LUA_BD* */
+static const char *const bdnames[LUA_BDN] = {
+  "shortstring", "longstring", "table", "array", "hash", "luaclosure",
+  "cclosure", "proto", "userdata", "thread", "upvalue", "other"
+};
+
+
+static void pushbreakdown (lua_State *L, const lua_GCBreakdown *b) {
+  int i;
+  lua_createtable(L, 0, LUA_BDN);
+  for (i = 0; i < LUA_BDN; i++) {
+    lua_createtable(L, 0, 2);
+    setufield(L, "count", b->count[i]);
+    setufield(L, "bytes", b->bytes[i]);
+    lua_setfield(L, -2, bdnames[i]);
+  }
+}
+
+
+static void pushstats (lua_State *L, const lua_GCPhaseStats *st) {
+  int e;
+  lua_createtable(L, 0, LUA_GCEVN);
+  for (e = 0; e < LUA_GCEVN; e++) {
+    const lua_GCPhaseStats *s = &st[e];
+    lua_createtable(L, 0, 10);
+    setdistfields(L, s->bins, s->count, s->total, s->max);
+    setufield(L, "marked", s->marked);
+    setufield(L, "swept", s->swept);
+    setufield(L, "freed", s->freed);
+    setufield(L, "finalized", s->finalized);
+    lua_setfield(L, -2, gcevnames[e]);
+  }
+}
+
+
+/*
+** Chrome trace writer: each event becomes a complete ("X") event in
+** a JSON array, which can be loaded in chrome://tracing or Perfetto.
+** The file lives in a userdata kept in the registry, so that its
+** finalizer closes it even if the program never stops the trace.
+*/
+
+#define GCTRACE		"_GCTRACE"
+
+typedef struct GCTrace {
+  FILE *f;  /* trace file (NULL if closed) */
+  int n;  /* number of events written */
+} GCTrace;
+
+
+#define UFMT	"%" LUA_INTEGER_FRMLEN "u"
+
+static void traceevent (void *ud, const lua_GCEvent *ev) {
+  GCTrace *t = (GCTrace *)ud;
+  fprintf(t->f, "%s{\"name\":\"%s\",\"cat\":\"gc\",\"ph\":\"X\","
+                "\"pid\":1,\"tid\":1,\"ts\":" UFMT ",\"dur\":" UFMT ","
+                "\"args\":{\"busy\":" UFMT ",\"marked\":" UFMT ","
+                "\"swept\":" UFMT ",\"freed\":" UFMT ","
+                "\"finalized\":" UFMT "}}",
+          (t->n++ > 0) ? ",\n" : "", gcevnames[ev->what], ev->start,
+          ev->span, ev->busy, ev->marked, ev->swept, ev->freed,
+          ev->finalized);
+}
+
+
+static int closetrace (lua_State *L) {
+  GCTrace *t = (GCTrace *)lua_touserdata(L, 1);
+  if (t->f != NULL) {
+    lua_setgcevents(L, NULL, NULL);
+    fputs("\n]\n", t->f);
+    fclose(t->f);
+    t->f = NULL;
+  }
+  return 0;
+}
+
+
+/*
+** collectgarbage("trace" [, filename]): stops the current trace, if
+** any, and starts a new one if given a file name.
+*/
+static int gctrace (lua_State *L) {
+  const char *fname = luaL_optstring(L, 2, NULL);
+  if (lua_getfield(L, LUA_REGISTRYINDEX, GCTRACE) == LUA_TUSERDATA) {
+    lua_pushcfunction(L, closetrace);
+    lua_insert(L, -2);
+    lua_call(L, 1, 0);  /* close previous trace */
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, GCTRACE);
+  }
+  else
+    lua_pop(L, 1);
+  if (fname != NULL) {
+    GCTrace *t = (GCTrace *)lua_newuserdatauv(L, sizeof(GCTrace), 0);
+    t->f = NULL;
+    t->n = 0;
+    if (luaL_newmetatable(L, GCTRACE)) {
+      lua_pushcfunction(L, closetrace);
+      lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    t->f = fopen(fname, "w");
+    if (t->f == NULL)
+      return luaL_fileresult(L, 0, fname);
+    fputs("[\n", t->f);
+    lua_setfield(L, LUA_REGISTRYINDEX, GCTRACE);
+    lua_setgcevents(L, traceevent, t);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** The last NDECISIONS decisions of the adaptive collector are kept in
+** a ring buffer, in a userdata in the registry.
+*/
+
+#define GCDECISIONS	"_GCDECISIONS"
+
+#define NDECISIONS	32
+
+typedef struct GCDecisions {
+  lua_Unsigned n;  /* number of decisions recorded */
+  lua_GCDecision d[NDECISIONS];
+} GCDecisions;
+
+
+static void logdecision (void *ud, const lua_GCDecision *d) {
+  GCDecisions *log = (GCDecisions *)ud;
+  log->d[log->n++ % NDECISIONS] = *d;
+}
+
+
+static GCDecisions *getdecisions (lua_State *L) {
+  GCDecisions *log;
+  if (lua_getfield(L, LUA_REGISTRYINDEX, GCDECISIONS) == LUA_TUSERDATA)
+    log = (GCDecisions *)lua_touserdata(L, -1);
+  else {
+    lua_pop(L, 1);
+    log = (GCDecisions *)lua_newuserdatauv(L, sizeof(GCDecisions), 0);
+    log->n = 0;
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, GCDECISIONS);
+  }
+  lua_pop(L, 1);
+  return log;
+}
+
+
+/*
+** collectgarbage("decisions"): returns the decisions recorded since the
+** previous call, oldest first, and clears the log.
+*/
+static int gcdecisions (lua_State *L) {
+  GCDecisions *log = getdecisions(L);
+  lua_Unsigned first = (log->n > NDECISIONS) ? log->n - NDECISIONS : 0;
+  lua_Unsigned i;
+  lua_createtable(L, (int)(log->n - first), 0);
+  for (i = first; i < log->n; i++) {
+    const lua_GCDecision *d = &log->d[i % NDECISIONS];
+    lua_createtable(L, 0, 8);
+    lua_pushstring(L, (d->mode == LUA_GCINC) ? "incremental"
                                              : "generational");
+    lua_setfield(L, -2, "mode");
+    if (d->param >= 0) {
+      lua_pushstring(L, gcparams[d->param]);
+      lua_setfield(L, -2, "param");
+      lua_pushinteger(L, d->value);
+      lua_setfield(L, -2, "value");
+    }
+    lua_pushstring(L, d->reason);
+    lua_setfield(L, -2, "reason");
+    setufield(L, "survival", d->survival);
+    setufield(L, "pause", d->pause);
+    setufield(L, "allocrate", d->allocrate);
+    setufield(L, "overhead", d->overhead);
+    lua_rawseti(L, -2, (lua_Integer)(i - first + 1));
+  }
+  log->n = 0;
   return 1;
 }
 
+/* }====================================================== */
+
+
+/*
+** collectgarbage("pressure", n): declares 'n' more bytes of external
+** memory, or releases '-n' bytes if 'n' is negative; returns the total.
+*/
+static int gcpressure (lua_State *L) {
+  lua_Integer n = luaL_optinteger(L, 2, 0);
+  size_t total;
+  if (n >= 0)
+    total = lua_gcaddpressure(L, (size_t)n);
+  else
+    total = lua_gcsubpressure(L, (size_t)(0u - (lua_Unsigned)n));
+  lua_pushinteger(L, (lua_Integer)total);
+  return 1;
+}
+
+
+static int gcrunfinalizers (lua_State *L) {
+  lua_Integer n = luaL_optinteger(L, 2, LUA_MAXINTEGER);
+  int res = lua_gcfinalize(L, (n <= 0) ? 0 : (n < INT_MAX) ? (int)n
+                                                            : INT_MAX);
+  if (res == -1)  /* inside a finalizer? */
+    luaL_pushfail(L);
+  else
+    lua_pushinteger(L, res);
+  return 1;
+}
+
+
+/*
+** options of 'collectgarbage' that do not map to a 'lua_gc' option
+*/
+static const luaL_Reg gcfuncs[] = {
+  {"trace", gctrace},
+  {"decisions", gcdecisions},
+  {"pressure", gcpressure},
+  {"runfinalizers", gcrunfinalizers},
+  {NULL, NULL}
+};
+
 
 /*
 ** check whether call to 'lua_gc' was valid (not inside a finalizer)
@@ -201,11 +502,22 @@ static int pushmode (lua_State *L, int oldmode) {
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "isrunning", "generational", "incremental",
-    "param", NULL};
+    "param", "timedstep", "pauses", "telemetry", "stats", "adaptive",
+    "compact", "breakdown", NULL};
   static const char optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCISRUNNING, LUA_GCGEN, LUA_GCINC,
-    LUA_GCPARAM};
-  int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
+    LUA_GCPARAM, LUA_GCTIMEDSTEP, LUA_GCPAUSES, LUA_GCTELEMETRY,
+    LUA_GCSTATS, LUA_GCADAPT, LUA_GCCOMPACT, LUA_GCBREAKDOWN};
+  const luaL_Reg *f;
+  int o;
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    const char *name = lua_tostring(L, 1);
+    for (f = gcfuncs; f->name != NULL; f++) {
+      if (strcmp(name, f->name) == 0)
+        return f->func(L);
+    }
+  }
+  o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
   switch (o) {
     case LUA_GCCOUNT: {
       int k = lua_gc(L, o);
@@ -221,6 +533,43 @@ static int luaB_collectgarbage (lua_State *L) {
       lua_pushboolean(L, res);
       return 1;
     }
+    case LUA_GCTIMEDSTEP: {
+      int usecs = (int)luaL_checkinteger(L, 2);
+      int res = lua_gc(L, o, usecs);
+      checkvalres(res);
+      lua_pushboolean(L, res);
+      return 1;
+    }
+    case LUA_GCPAUSES: {
+      lua_GCPauses p;
+      int res = lua_gc(L, o, &p, lua_toboolean(L, 2));
+      checkvalres(res);
+      pushpauses(L, &p);
+      return 1;
+    }
+    case LUA_GCTELEMETRY: {
+      int on = lua_isnoneornil(L, 2) ? -1 : lua_toboolean(L, 2);
+      int res = lua_gc(L, o, on);
+      checkvalres(res);
+      lua_pushboolean(L, res);
+      return 1;
+    }
+    case LUA_GCSTATS: {
+      lua_GCPhaseStats st[LUA_GCEVN];
+      int res = lua_gc(L, o, st, lua_toboolean(L, 2));
+      checkvalres(res);
+      if (!res)  /* telemetry is off? */
+        break;
+      pushstats(L, st);
+      return 1;
+    }
+    case LUA_GCBREAKDOWN: {
+      lua_GCBreakdown b;
+      int res = lua_gc(L, o, &b);
+      checkvalres(res);
+      pushbreakdown(L, &b);
+      return 1;
+    }
     case LUA_GCISRUNNING: {
       int res = lua_gc(L, o);
       checkvalres(res);
@@ -233,14 +582,21 @@ static int luaB_collectgarbage (lua_State *L) {
     case LUA_GCINC: {
       return pushmode(L, lua_gc(L, o));
     }
+    case LUA_GCADAPT: {
+      int res = lua_gc(L, o);
+      /* log decisions, unless the host gets them (see 'gcdecisions') */
+      if (res != -1 && lua_getgcdecisions(L, NULL) == NULL)
+        lua_setgcdecisions(L, logdecision, getdecisions(L));
+      return pushmode(L, res);
+    }
     case LUA_GCPARAM: {
-      static const char *const params[] = {
-        "minormul", "majorminor", "minormajor",
-        "pause", "stepmul", "stepsize", NULL};
       static const char pnum[] = {
         LUA_GCPMINORMUL, LUA_GCPMAJORMINOR, LUA_GCPMINORMAJOR,
-        LUA_GCPPAUSE, LUA_GCPSTEPMUL, LUA_GCPSTEPSIZE};
-      int p = pnum[luaL_checkoption(L, 2, NULL, params)];
+        LUA_GCPPAUSE, LUA_GCPSTEPMUL, LUA_GCPSTEPSIZE, LUA_GCPMARKTHREADS,
+        LUA_GCPSWEEPTHREAD, LUA_GCPSTEPTIME, LUA_GCPPAUSEGOAL,
+        LUA_GCPMEMGOAL, LUA_GCPDEFERFIN, LUA_GCPLEANSTACKS,
+        LUA_GCPTHREADPOOL};
+      int p = pnum[luaL_checkoption(L, 2, NULL, gcparams)];
       lua_Integer value = luaL_optinteger(L, 3, -1);
       lua_pushinteger(L, lua_gc(L, o, p, (int)value));
       return 1;
@@ -449,10 +449,321 @@ static int db_traceback (lua_State *L) {
 }
 
 
+static int snapwriter (lua_State *L, const void *b, size_t size, void *f) {
+  (void)L;  /* not used */
+  return (fwrite(b, 1, size, (FILE *)f) != size);
+}
+
+
+/*
+** debug.heapsnapshot(filename): writes a snapshot of all reachable
+** objects to the given file (see 'lua_heapsnapshot').
+*/
+static int db_heapsnapshot (lua_State *L) {
+  const char *fname = luaL_checkstring(L, 1);
+  FILE *f = fopen(fname, "wb");
+  int status;
+  if (f == NULL)
+    return luaL_fileresult(L, 0, fname);
+  status = lua_heapsnapshot(L, snapwriter, f);
+  if (fclose(f) != 0 && status == LUA_OK)
+    status = -1;  /* could not flush the file */
+  if (status == LUA_ERRMEM)
+    return luaL_error(L, "not enough memory");
+  return luaL_fileresult(L, status == LUA_OK, fname);
+}
+
+
+/*
+** {======================================================
+** Allocation profile
+** =======================================================
+*/
+
+
+static lua_Integer roundint (lua_Number x) {
+  return (lua_Integer)(x + 0.5);
+}
+
+
+static void setintfield (lua_State *L, const char *k, lua_Number v) {
+  lua_pushinteger(L, roundint(v));
+  lua_setfield(L, -2, k);
+}
+
+
+/*
+** Push a list with one entry for each site of the profile.
+*/
+static void pushallocprofile (lua_State *L) {
+  lua_AllocSite site;
+  int n;
+  lua_newtable(L);
+  for (n = 1; lua_getallocsite(L, n, &site); n++) {
+    lua_Debug ar;
+    int i;
+    lua_createtable(L, 0, 9);
+    lua_pushstring(L, site.type);
+    lua_setfield(L, -2, "type");
+    setintfield(L, "samples", (lua_Number)site.samples);
+    setintfield(L, "allocs", site.allocs);
+    setintfield(L, "allocbytes", site.allocbytes);
+    setintfield(L, "frees", site.frees);
+    setintfield(L, "freebytes", site.freebytes);
+    setintfield(L, "live", site.allocs - site.frees);
+    setintfield(L, "livebytes", site.allocbytes - site.freebytes);
+    lua_createtable(L, site.nframes, 0);
+    for (i = 0; lua_getallocframe(L, n, i, &ar); i++) {
+      if (*ar.what == 'C')
+        lua_pushliteral(L, "[C]");
+      else
+        lua_pushfstring(L, "%s:%d", ar.short_src, ar.currentline);
+      lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "stack");
+    lua_rawseti(L, -2, n);
+  }
+}
+
+
+/*
+** Minimal encoder for the protocol buffers of the pprof format
+** ('profile.proto'). Each message is built in a 'PBuf' (all messages
+** written here are small) and the top-level fields go to a list of
+** strings that is written at the end.
+*/
+
+#define PBMAX	1024
+
+typedef struct PBuf {
+  size_t n;
+  char b[PBMAX];
+} PBuf;
+
+
+typedef struct PProf {
+  int strs, funcs, locs;  /* indices of the tables mapping to ids */
+  int parts;  /* index of the list of top-level fields */
+  lua_Integer nstrs, nfuncs, nlocs;
+  int nparts;
+} PProf;
+
+
+static void pbvarint (PBuf *p, lua_Unsigned v) {
+  while (v >= 0x80) {
+    p->b[p->n++] = (char)((v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  p->b[p->n++] = (char)v;
+}
+
+
+static void pbint (PBuf *p, int field, lua_Integer v) {
+  pbvarint(p, (lua_Unsigned)field << 3);
+  pbvarint(p, (lua_Unsigned)v);
+}
+
+
+static void pbbytes (PBuf *p, int field, const char *s, size_t l) {
+  pbvarint(p, ((lua_Unsigned)field << 3) | 2);
+  pbvarint(p, l);
+  memcpy(p->b + p->n, s, l);
+  p->n += l;
+}
+
+
+/* add message 'm' as field 'field' of the profile */
+static void pbaddpart (lua_State *L, PProf *pp, int field, const PBuf *m) {
+  PBuf p;
+  p.n = 0;
+  pbbytes(&p, field, m->b, m->n);
+  lua_pushlstring(L, p.b, p.n);
+  lua_rawseti(L, pp->parts, ++pp->nparts);
+}
+
+
+/*
+** Get in '*id' the id of key 'k' in table 'map'. Returns 0 if the key
+** is new, in which case it gets id '*n' (and '*n' is incremented).
+*/
+static int pbgetid (lua_State *L, int map, const char *k,
+                            lua_Integer *n, lua_Integer *id) {
+  if (lua_getfield(L, map, k) == LUA_TNUMBER) {
+    *id = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return 1;
+  }
+  lua_pop(L, 1);
+  *id = (*n)++;
+  lua_pushinteger(L, *id);
+  lua_setfield(L, map, k);
+  return 0;
+}
+
+
+/* index of string 's' in the string table */
+static lua_Integer pbstr (lua_State *L, PProf *pp, const char *s) {
+  lua_Integer id;
+  if (!pbgetid(L, pp->strs, s, &pp->nstrs, &id)) {
+    PBuf m;
+    m.n = strlen(s);
+    memcpy(m.b, s, m.n);
+    pbaddpart(L, pp, 6, &m);  /* string_table */
+  }
+  return id;
+}
+
+
+static void pbvaluetype (lua_State *L, PProf *pp, int field,
+                         const char *type, const char *unit) {
+  PBuf m;
+  lua_Integer t = pbstr(L, pp, type);
+  lua_Integer u = pbstr(L, pp, unit);
+  m.n = 0;
+  pbint(&m, 1, t);
+  pbint(&m, 2, u);
+  pbaddpart(L, pp, field, &m);
+}
+
+
+/* id of the location of frame 'ar' */
+static lua_Integer pblocation (lua_State *L, PProf *pp, lua_Debug *ar) {
+  const char *name;
+  lua_Integer fid, lid;
+  if (*ar->what == 'C') {
+    name = lua_pushliteral(L, "[C]");
+    ar->currentline = 0;
+  }
+  else
+    name = lua_pushfstring(L, "%s:%d", ar->short_src, ar->linedefined);
+  if (!pbgetid(L, pp->funcs, name, &pp->nfuncs, &fid)) {
+    PBuf m;
+    lua_Integer sname = pbstr(L, pp, name);
+    lua_Integer fname = pbstr(L, pp, ar->short_src);
+    m.n = 0;
+    pbint(&m, 1, fid);  /* id */
+    pbint(&m, 2, sname);  /* name */
+    pbint(&m, 3, sname);  /* system_name */
+    pbint(&m, 4, fname);  /* filename */
+    pbint(&m, 5, ar->linedefined > 0 ? ar->linedefined : 0);  /* start */
+    pbaddpart(L, pp, 5, &m);  /* function */
+  }
+  if (!pbgetid(L, pp->locs, lua_pushfstring(L, "%I:%d", fid, ar->currentline),
+               &pp->nlocs, &lid)) {
+    PBuf m, line;
+    line.n = 0;
+    pbint(&line, 1, fid);  /* function_id */
+    pbint(&line, 2, ar->currentline);  /* line */
+    m.n = 0;
+    pbint(&m, 1, lid);  /* id */
+    pbbytes(&m, 4, line.b, line.n);  /* line */
+    pbaddpart(L, pp, 4, &m);  /* location */
+  }
+  lua_pop(L, 2);  /* name and key */
+  return lid;
+}
+
+
+/*
+** Write the profile in the pprof format, with the values of a Go heap
+** profile: allocated and live objects and bytes.
+*/
+static int writepprof (lua_State *L, const char *fname) {
+  PProf pp;
+  lua_AllocSite site;
+  FILE *f;
+  int n, i, ok;
+  lua_settop(L, 2);
+  pp.strs = 3; pp.funcs = 4; pp.locs = 5; pp.parts = 6;
+  for (i = 0; i < 4; i++)
+    lua_newtable(L);
+  pp.nstrs = 0;
+  pp.nfuncs = pp.nlocs = 1;  /* ids must not be 0 */
+  pp.nparts = 0;
+  pbstr(L, &pp, "");  /* first string must be empty */
+  pbvaluetype(L, &pp, 1, "alloc_objects", "count");
+  pbvaluetype(L, &pp, 1, "alloc_space", "bytes");
+  pbvaluetype(L, &pp, 1, "inuse_objects", "count");
+  pbvaluetype(L, &pp, 1, "inuse_space", "bytes");
+  for (n = 1; lua_getallocsite(L, n, &site); n++) {
+    lua_Debug ar;
+    PBuf m, ids, values, label;
+    lua_Integer key = pbstr(L, &pp, "type");
+    lua_Integer type = pbstr(L, &pp, site.type);
+    ids.n = 0;
+    for (i = 0; lua_getallocframe(L, n, i, &ar); i++)
+      pbvarint(&ids, (lua_Unsigned)pblocation(L, &pp, &ar));
+    values.n = 0;
+    pbvarint(&values, (lua_Unsigned)roundint(site.allocs));
+    pbvarint(&values, (lua_Unsigned)roundint(site.allocbytes));
+    pbvarint(&values, (lua_Unsigned)roundint(site.allocs - site.frees));
+    pbvarint(&values,
+             (lua_Unsigned)roundint(site.allocbytes - site.freebytes));
+    label.n = 0;
+    pbint(&label, 1, key);  /* key */
+    pbint(&label, 2, type);  /* str */
+    m.n = 0;
+    pbbytes(&m, 1, ids.b, ids.n);  /* location_id (packed) */
+    pbbytes(&m, 2, values.b, values.n);  /* value (packed) */
+    pbbytes(&m, 3, label.b, label.n);  /* label */
+    pbaddpart(L, &pp, 2, &m);  /* sample */
+  }
+  f = fopen(fname, "wb");
+  if (f == NULL)
+    return luaL_fileresult(L, 0, fname);
+  ok = 1;
+  for (i = 1; ok && i <= pp.nparts; i++) {
+    size_t l;
+    const char *s;
+    lua_rawgeti(L, pp.parts, i);
+    s = lua_tolstring(L, -1, &l);
+    ok = (fwrite(s, 1, l, f) == l);
+    lua_pop(L, 1);
+  }
+  ok = (fclose(f) == 0) && ok;
+  return luaL_fileresult(L, ok, fname);
+}
+
+
+/*
+** debug.allocprofile([opt [, arg]]): controls the allocation profiler
+** (see 'lua_allocprofile'). "start" (with an optional mean distance
+** between samples), "stop" and "reset" return the previous distance
+** (0 if it was not sampling); "get" returns the profile; "pprof"
+** writes the profile to file 'arg' in the pprof format.
+*/
+static int db_allocprofile (lua_State *L) {
+  static const char *const opts[] = {"get", "start", "stop", "reset",
+                                      "pprof", NULL};
+  static const int what[] = {0, LUA_APSTART, LUA_APSTOP, LUA_APRESET};
+  int o = luaL_checkoption(L, 1, "get", opts);
+  switch (o) {
+    case 0: {
+      pushallocprofile(L);
+      return 1;
+    }
+    case 4: {
+      return writepprof(L, luaL_checkstring(L, 2));
+    }
+    default: {
+      lua_Integer rate = luaL_optinteger(L, 2, 0);
+      luaL_argcheck(L, rate >= 0, 2, "negative rate");
+      lua_pushinteger(L, (lua_Integer)lua_allocprofile(L, what[o],
+                                                     (size_t)rate));
+      return 1;
+    }
+  }
+}
+
+/* }====================================================== */
+
+
 static const luaL_Reg dblib[] = {
   {"debug", db_debug},
   {"getuservalue", db_getuservalue},
   {"gethook", db_gethook},
+  {"heapsnapshot", db_heapsnapshot},
+  {"allocprofile", db_allocprofile},
   {"getinfo", db_getinfo},
   {"getlocal", db_getlocal},
   {"getregistry", db_getregistry},
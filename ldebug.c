@@ -10,6 +10,7 @@
 #include "lprefix.h"
 
 
+#include <math.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <string.h>
@@ -969,3 +970,491 @@ int luaG_traceexec (lua_State *L, const Instruction *pc) {
   return 1;  /* keep 'trap' on */
 }
 
+
+
+/*
+** {======================================================
+** Allocation profiler
+** =======================================================
+*/
+
+/*
+** The profiler samples allocations as a Poisson process over the
+** allocated bytes: 'g->allocleft' counts down the bytes up to the next
+** sample point, drawn from an exponential distribution with mean
+** 'rate', and the allocation that crosses that point is sampled. A
+** sample records the stack of the running thread and the type of the
+** block, and the block stays in a table of live samples until it is
+** freed. A sampled block of 's' bytes stands for 1/(1 - exp(-s/rate))
+** blocks like it, so that the totals are unbiased estimates. Samples
+** with equal stacks and types are aggregated in "sites", which share
+** their frames. All memory of the profiler comes directly from the
+** allocator, outside the accounting of the collector; when it cannot
+** get memory, the profiler just drops the sample.
+*/
+
+/* default mean distance between samples, in bytes */
+#if !defined(LUAI_ALLOCRATE)
+#define LUAI_ALLOCRATE	(512 * 1024)
+#endif
+
+/* maximum number of frames recorded for a sample (innermost ones) */
+#define APMAXDEPTH	32
+
+/* counts in the filter saturate at this value */
+#define MAXFILTER	255
+
+
+#define aprealloc(g,b,os,ns)	((*(g)->frealloc)((g)->ud, b, os, ns))
+
+
+typedef struct APFrame {
+  unsigned int hash;
+  int linedefined;
+  int line;  /* current line */
+  const char *what;
+  char source[LUA_IDSIZE];
+} APFrame;
+
+
+typedef struct APSite {
+  unsigned int hash;
+  int tag;  /* type of the blocks (0 for blocks that are not objects) */
+  int nframes;
+  int frames[APMAXDEPTH];  /* indices in 'frames', innermost first */
+  size_t samples;
+  lua_Number allocs, allocbytes;  /* estimated allocations */
+  lua_Number frees, freebytes;  /* estimated frees */
+} APSite;
+
+
+typedef struct APLive {
+  void *block;  /* sampled block (NULL in empty entries) */
+  int site;
+  lua_Number weight;  /* number of blocks this sample stands for */
+  size_t size;
+} APLive;
+
+
+/*
+** Index for frames or sites: an open-addressing table with the
+** position of each entry plus one (0 in empty slots).
+*/
+typedef struct APIndex {
+  int *slot;
+  unsigned int size;  /* a power of 2 */
+} APIndex;
+
+
+typedef struct AllocProfile {
+  size_t rate;  /* mean distance between samples (0 when stopped) */
+  l_uint32 rand;  /* state of the random generator */
+  APFrame *frames;
+  int nframes, sizeframes;
+  APIndex frameindex;
+  APSite *sites;
+  int nsites, sizesites;
+  APIndex siteindex;
+  APLive *live;  /* live samples (open addressing by block) */
+  size_t nlive, sizelive;
+  lu_byte filter[1 << APFILTERBITS];  /* live samples by 'luaG_apfilter' */
+} AllocProfile;
+
+
+/*
+** Draw the distance to the next sample. (A xorshift generator is good
+** enough here.)
+*/
+static void nextsample (global_State *g, AllocProfile *ap) {
+  l_uint32 r = ap->rand;
+  lua_Number u;
+  r ^= (r << 13) & 0xffffffffu;
+  r ^= r >> 17;
+  r ^= (r << 5) & 0xffffffffu;
+  ap->rand = r;
+  u = cast_num((r >> 8) + 1) / cast_num(1 << 24);  /* in (0, 1] */
+  g->allocleft = cast(l_mem, -l_mathop(log)(u) * cast_num(ap->rate)) + 1;
+}
+
+
+/*
+** Make room for element 'n' in an array of the profiler, returning the
+** array (maybe moved) or NULL if there is no memory.
+*/
+static void *apgrow (global_State *g, void *a, int n, int *size,
+                     size_t elemsize) {
+  if (n >= *size) {
+    int nsize = (*size > 0) ? 2 * *size : 64;
+    a = aprealloc(g, a, cast_sizet(*size) * elemsize,
+                        cast_sizet(nsize) * elemsize);
+    if (a != NULL)
+      *size = nsize;
+  }
+  return a;
+}
+
+
+/*
+** Make room in index 'ix' for entry number 'n'. The hash of each
+** entry in 'recs' (records of 'recsize' bytes) is its first field.
+*/
+static int apgrowindex (global_State *g, APIndex *ix, int n,
+                        const void *recs, size_t recsize) {
+  if (2 * cast_uint(n + 1) > ix->size) {  /* keep load under 1/2 */
+    unsigned int nsize = (ix->size > 0) ? 2 * ix->size : 128;
+    int *ns = cast(int *, aprealloc(g, NULL, 0, nsize * sizeof(int)));
+    int i;
+    if (ns == NULL)
+      return 0;
+    memset(ns, 0, nsize * sizeof(int));
+    for (i = 0; i < n; i++) {
+      const char *rec = cast(const char *, recs) + cast_sizet(i) * recsize;
+      unsigned int j = *cast(const unsigned int *, rec) & (nsize - 1);
+      while (ns[j] != 0)  /* entries are all different */
+        j = (j + 1) & (nsize - 1);
+      ns[j] = i + 1;
+    }
+    aprealloc(g, ix->slot, ix->size * sizeof(int), 0);
+    ix->slot = ns;
+    ix->size = nsize;
+  }
+  return 1;
+}
+
+
+/*
+** Return the index of the frame for 'ci', adding it if needed, or -1
+** if there is no memory.
+*/
+static int getframe (global_State *g, AllocProfile *ap, CallInfo *ci) {
+  APFrame f;
+  unsigned int i;
+  int e;
+  APFrame *nframes;
+  if (isLua(ci)) {
+    const Proto *p = ci_func(ci)->p;
+    if (p->source)
+      luaO_chunkid(f.source, getstr(p->source), tsslen(p->source));
+    else
+      luaO_chunkid(f.source, "=?", LL("=?"));
+    f.linedefined = p->linedefined;
+    f.line = getcurrentline(ci);
+    f.what = (f.linedefined == 0) ? "main" : "Lua";
+  }
+  else {
+    luaO_chunkid(f.source, "=[C]", LL("=[C]"));
+    f.linedefined = f.line = -1;
+    f.what = "C";
+  }
+  f.hash = luaS_hash(f.source, strlen(f.source), cast_uint(f.line)) ^
+           cast_uint(f.linedefined);
+  if (!apgrowindex(g, &ap->frameindex, ap->nframes, ap->frames,
+                   sizeof(APFrame)))
+    return -1;
+  for (i = f.hash & (ap->frameindex.size - 1);
+       (e = ap->frameindex.slot[i]) != 0;
+       i = (i + 1) & (ap->frameindex.size - 1)) {
+    const APFrame *old = &ap->frames[e - 1];
+    if (old->hash == f.hash && old->line == f.line &&
+        old->linedefined == f.linedefined &&
+        strcmp(old->source, f.source) == 0)
+      return e - 1;  /* found it */
+  }
+  nframes = cast(APFrame *, apgrow(g, ap->frames, ap->nframes,
+                                   &ap->sizeframes, sizeof(APFrame)));
+  if (nframes == NULL)
+    return -1;
+  ap->frames = nframes;
+  ap->frames[ap->nframes] = f;
+  ap->frameindex.slot[i] = ++ap->nframes;
+  return ap->nframes - 1;
+}
+
+
+/*
+** Return the index of the site for blocks of type 'tag' allocated by
+** the current stack of 'L', adding it if needed, or -1 if there is no
+** memory.
+*/
+static int getsite (lua_State *L, AllocProfile *ap, int tag) {
+  global_State *g = G(L);
+  APSite s;
+  CallInfo *ci;
+  unsigned int i;
+  int e;
+  APSite *nsites;
+  s.tag = tag;
+  s.nframes = 0;
+  s.hash = cast_uint(tag);
+  for (ci = L->ci; ci != &L->base_ci && s.nframes < APMAXDEPTH;
+       ci = ci->previous) {
+    int f = getframe(g, ap, ci);
+    if (f < 0)
+      return -1;
+    s.frames[s.nframes++] = f;
+    s.hash = s.hash * 31 + cast_uint(f);
+  }
+  if (!apgrowindex(g, &ap->siteindex, ap->nsites, ap->sites,
+                   sizeof(APSite)))
+    return -1;
+  for (i = s.hash & (ap->siteindex.size - 1);
+       (e = ap->siteindex.slot[i]) != 0;
+       i = (i + 1) & (ap->siteindex.size - 1)) {
+    const APSite *old = &ap->sites[e - 1];
+    if (old->hash == s.hash && old->tag == s.tag &&
+        old->nframes == s.nframes &&
+        memcmp(old->frames, s.frames, cast_sizet(s.nframes) * sizeof(int)) == 0)
+      return e - 1;  /* found it */
+  }
+  nsites = cast(APSite *, apgrow(g, ap->sites, ap->nsites, &ap->sizesites,
+                                 sizeof(APSite)));
+  if (nsites == NULL)
+    return -1;
+  ap->sites = nsites;
+  s.samples = 0;
+  s.allocs = s.allocbytes = s.frees = s.freebytes = 0;
+  ap->sites[ap->nsites] = s;
+  ap->siteindex.slot[i] = ++ap->nsites;
+  return ap->nsites - 1;
+}
+
+
+static size_t livehash (const void *block) {
+  unsigned int h = (point2uint(block) >> 3) * 2654435769u;
+  return h ^ (h >> 15);
+}
+
+
+static APLive *liveslot (APLive *live, size_t size, const void *block) {
+  size_t i = livehash(block) & (size - 1);
+  while (live[i].block != NULL && live[i].block != block)
+    i = (i + 1) & (size - 1);  /* linear probing */
+  return &live[i];
+}
+
+
+static int addlive (global_State *g, AllocProfile *ap, void *block,
+                    int site, lua_Number weight, size_t size) {
+  APLive *e;
+  if (2 * (ap->nlive + 1) > ap->sizelive) {  /* keep load under 1/2 */
+    size_t nsize = (ap->sizelive > 0) ? 2 * ap->sizelive : 256;
+    APLive *nl = cast(APLive *, aprealloc(g, NULL, 0,
+                                          nsize * sizeof(APLive)));
+    size_t i;
+    if (nl == NULL)
+      return 0;
+    memset(nl, 0, nsize * sizeof(APLive));
+    for (i = 0; i < ap->sizelive; i++) {
+      if (ap->live[i].block != NULL)
+        *liveslot(nl, nsize, ap->live[i].block) = ap->live[i];
+    }
+    aprealloc(g, ap->live, ap->sizelive * sizeof(APLive), 0);
+    ap->live = nl;
+    ap->sizelive = nsize;
+  }
+  e = liveslot(ap->live, ap->sizelive, block);
+  if (e->block == NULL) {
+    lu_byte *c = &ap->filter[luaG_apfilter(block)];
+    if (*c < MAXFILTER)
+      (*c)++;
+    ap->nlive++;
+  }
+  e->block = block;
+  e->site = site;
+  e->weight = weight;
+  e->size = size;
+  return 1;
+}
+
+
+/*
+** Remove entry 'e' from the live samples, moving back the entries
+** after it that would not be found otherwise.
+*/
+static void removelive (AllocProfile *ap, APLive *e) {
+  size_t mask = ap->sizelive - 1;
+  size_t i = cast_sizet(e - ap->live);
+  size_t j = i;
+  lu_byte *c = &ap->filter[luaG_apfilter(e->block)];
+  if (*c < MAXFILTER)  /* (saturated counts stay) */
+    (*c)--;
+  for (;;) {
+    size_t k;
+    j = (j + 1) & mask;
+    if (ap->live[j].block == NULL)
+      break;
+    k = livehash(ap->live[j].block) & mask;  /* its home slot */
+    if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+      continue;  /* entry 'j' can stay */
+    ap->live[i] = ap->live[j];
+    i = j;
+  }
+  ap->live[i].block = NULL;
+  ap->nlive--;
+}
+
+
+/*
+** Called when an allocation crosses the sample point. While 'gcstopem'
+** is set the stack may be unusable (it may hold offsets while being
+** reallocated) and the allocation belongs to the collector anyway, so
+** the sample goes to the next allocation.
+*/
+void luaG_allocsample (lua_State *L, void *block, size_t size, int tag) {
+  global_State *g = G(L);
+  AllocProfile *ap = g->allocprof;
+  if (ap == NULL || ap->rate == 0)
+    g->allocleft = MAX_LMEM;  /* not sampling */
+  else if (!g->gcstopem) {
+    lua_Number w = 1 / (1 - l_mathop(exp)(-cast_num(size) /
+                                          cast_num(ap->rate)));
+    int site = getsite(L, ap, tag);
+    if (site >= 0 && addlive(g, ap, block, site, w, size)) {
+      APSite *s = &ap->sites[site];
+      s->samples++;
+      s->allocs += w;
+      s->allocbytes += w * cast_num(size);
+    }
+    nextsample(g, ap);
+  }
+}
+
+
+/*
+** Called for the freed blocks that pass the filter.
+*/
+void luaG_allocfree (global_State *g, void *block) {
+  AllocProfile *ap = g->allocprof;
+  if (ap->nlive > 0 && block != NULL) {
+    APLive *e = liveslot(ap->live, ap->sizelive, block);
+    if (e->block != NULL) {  /* a sampled block? */
+      APSite *s = &ap->sites[e->site];
+      s->frees += e->weight;
+      s->freebytes += e->weight * cast_num(e->size);
+      removelive(ap, e);
+    }
+  }
+}
+
+
+/*
+** Called for the moved blocks that pass the filter (see 'luaM_move').
+** A sample keeps its data at the new address; the removal leaves room
+** for the new entry, so 'addlive' does not need to grow the table.
+*/
+void luaG_allocmove (global_State *g, void *block, void *newblock) {
+  AllocProfile *ap = g->allocprof;
+  if (ap->nlive > 0) {
+    APLive *e = liveslot(ap->live, ap->sizelive, block);
+    if (e->block != NULL) {  /* a sampled block? */
+      APLive sample = *e;
+      removelive(ap, e);
+      addlive(g, ap, newblock, sample.site, sample.weight, sample.size);
+    }
+  }
+}
+
+
+void luaG_freeallocprofile (global_State *g) {
+  AllocProfile *ap = g->allocprof;
+  if (ap != NULL) {
+    aprealloc(g, ap->frames, cast_sizet(ap->sizeframes) * sizeof(APFrame), 0);
+    aprealloc(g, ap->frameindex.slot, ap->frameindex.size * sizeof(int), 0);
+    aprealloc(g, ap->sites, cast_sizet(ap->sizesites) * sizeof(APSite), 0);
+    aprealloc(g, ap->siteindex.slot, ap->siteindex.size * sizeof(int), 0);
+    aprealloc(g, ap->live, ap->sizelive * sizeof(APLive), 0);
+    aprealloc(g, ap, sizeof(AllocProfile), 0);
+    g->allocprof = NULL;
+    g->allocfilter = NULL;
+  }
+  g->allocleft = MAX_LMEM;
+}
+
+
+LUA_API size_t lua_allocprofile (lua_State *L, int what, size_t rate) {
+  global_State *g;
+  AllocProfile *ap;
+  size_t old;
+  lua_lock(L);
+  g = G(L);
+  ap = g->allocprof;
+  old = (ap != NULL) ? ap->rate : 0;
+  switch (what) {
+    case LUA_APSTART: {
+      if (ap == NULL) {
+        ap = cast(AllocProfile *, aprealloc(g, NULL, 0,
+                                            sizeof(AllocProfile)));
+        if (ap == NULL)
+          luaD_throw(L, LUA_ERRMEM);
+        memset(ap, 0, sizeof(AllocProfile));
+        ap->rand = cast(l_uint32, g->seed) | 1;  /* must not be 0 */
+        g->allocprof = ap;
+        g->allocfilter = ap->filter;
+      }
+      ap->rate = (rate > 0) ? rate : LUAI_ALLOCRATE;
+      nextsample(g, ap);
+      break;
+    }
+    case LUA_APSTOP: {
+      if (ap != NULL)
+        ap->rate = 0;
+      g->allocleft = MAX_LMEM;
+      break;
+    }
+    case LUA_APRESET: {
+      luaG_freeallocprofile(g);
+      break;
+    }
+    default: api_check(L, 0, "invalid option");
+  }
+  lua_unlock(L);
+  return old;
+}
+
+
+static const APSite *getapsite (lua_State *L, int n) {
+  AllocProfile *ap = G(L)->allocprof;
+  if (ap == NULL || n < 1 || n > ap->nsites)
+    return NULL;
+  else
+    return &ap->sites[n - 1];
+}
+
+
+LUA_API int lua_getallocsite (lua_State *L, int n, lua_AllocSite *site) {
+  const APSite *s;
+  lua_lock(L);
+  s = getapsite(L, n);
+  if (s != NULL) {
+    site->type = (s->tag == 0) ? "memory" : luaT_typename(s->tag);
+    site->nframes = s->nframes;
+    site->samples = s->samples;
+    site->allocs = s->allocs;
+    site->allocbytes = s->allocbytes;
+    site->frees = s->frees;
+    site->freebytes = s->freebytes;
+  }
+  lua_unlock(L);
+  return (s != NULL);
+}
+
+
+LUA_API int lua_getallocframe (lua_State *L, int n, int level,
+                               lua_Debug *ar) {
+  const APSite *s;
+  int res = 0;
+  lua_lock(L);
+  s = getapsite(L, n);
+  if (s != NULL && 0 <= level && level < s->nframes) {
+    const APFrame *f = &G(L)->allocprof->frames[s->frames[level]];
+    ar->what = f->what;
+    ar->linedefined = f->linedefined;
+    ar->currentline = f->line;
+    memcpy(ar->short_src, f->source, sizeof(f->source));
+    res = 1;
+  }
+  lua_unlock(L);
+  return res;
+}
+
+/* }====================================================== */
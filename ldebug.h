@@ -36,6 +36,18 @@
 #endif
 
 
+/*
+** Filter for the blocks sampled by the allocation profiler: the
+** profiler counts its live samples by this hash of their addresses,
+** so that most frees need only one test.
+*/
+#define APFILTERBITS	12
+
+#define luaG_apfilter(b)  \
+	((((point2uint(b) >> 3) * 2654435769u) & 0xffffffffu)  \
+	   >> (32 - APFILTERBITS))
+
+
 LUAI_FUNC int luaG_getfuncline (const Proto *f, int pc);
 LUAI_FUNC const char *luaG_findlocal (lua_State *L, CallInfo *ci, int n,
                                                     StkId *pos);
@@ -59,6 +71,12 @@ LUAI_FUNC const char *luaG_addinfo (lua_State *L, const char *msg,
 LUAI_FUNC l_noret luaG_errormsg (lua_State *L);
 LUAI_FUNC int luaG_traceexec (lua_State *L, const Instruction *pc);
 LUAI_FUNC int luaG_tracecall (lua_State *L);
+LUAI_FUNC void luaG_allocsample (lua_State *L, void *block, size_t size,
+                                               int tag);
+LUAI_FUNC void luaG_allocfree (global_State *g, void *block);
+LUAI_FUNC void luaG_allocmove (global_State *g, void *block,
+                                                void *newblock);
+LUAI_FUNC void luaG_freeallocprofile (global_State *g);
 
 
 #endif
@@ -321,12 +321,30 @@ int luaD_reallocstack (lua_State *L, int newsize, int raiseerror) {
   L->stack.p = newstack;
   correctstack(L, oldstack);  /* change offsets back to pointers */
   L->stack_last.p = L->stack.p + newsize;
+  luaC_bdadd(G(L), LUA_BDTHREAD, 0,
+             cast(l_mem, newsize - oldsize) * cast(l_mem, sizeof(StackValue)));
   for (i = oldsize + EXTRA_STACK; i < newsize + EXTRA_STACK; i++)
     setnilvalue(s2v(newstack + i)); /* erase new segment */
   return 1;
 }
 
 
+/*
+** Let the allocator move the stack (see 'luaC_compact'), correcting
+** all pointers into it. Returns true if the stack moved.
+*/
+int luaD_movestack (lua_State *L) {
+  StkId oldstack = L->stack.p;
+  int size = stacksize(L);
+  relstack(L);  /* change pointers to offsets */
+  L->stack.p = cast(StkId, luaM_move(L, oldstack, cast_sizet(size +
+                               EXTRA_STACK) * sizeof(StackValue)));
+  correctstack(L, oldstack);  /* change offsets back to pointers */
+  L->stack_last.p = L->stack.p + size;
+  return (L->stack.p != oldstack);
+}
+
+
 /*
 ** Try to grow the stack by at least 'n' elements. When 'raiseerror'
 ** is true, raises any error; otherwise, return 0 in case of errors.
@@ -404,6 +422,26 @@ void luaD_shrinkstack (lua_State *L) {
 }
 
 
+/*
+** Reduce the stack of an idle thread (not running, nor resuming
+** another one) to the size it uses, and free its spare CallInfos
+** (option LUA_GCPLEANSTACKS). Other threads are handled by
+** 'luaD_shrinkstack', which leaves room for growth.
+*/
+void luaD_trimstack (lua_State *L) {
+  if (L->status == LUA_YIELD || L->ci == &L->base_ci) {
+    int inuse = stackinuse(L);
+    if (inuse < stacksize(L))
+      luaD_reallocstack(L, inuse, 0);  /* ok if that fails */
+    else
+      condmovestack(L,(void)0,(void)0);  /* (change only for debugging) */
+    luaE_trimCI(L);
+  }
+  else
+    luaD_shrinkstack(L);
+}
+
+
 void luaD_inctop (lua_State *L) {
   L->top.p++;
   luaD_checkstack(L, 1);
@@ -283,6 +283,17 @@ lu_mem luaF_protosize (Proto *p) {
 }
 
 
+/*
+** Add the vectors of a complete prototype to the live counters. (While
+** a prototype is built, its vectors change size and count as "other".)
+*/
+void luaF_countproto (lua_State *L, Proto *p) {
+  lua_assert(!(p->flag & PF_COUNTED));
+  p->flag |= PF_COUNTED;
+  luaC_bdadd(G(L), LUA_BDPROTO, 0, luaF_protosize(p) - sizeof(Proto));
+}
+
+
 void luaF_freeproto (lua_State *L, Proto *f) {
   if (!(f->flag & PF_FIXED)) {
     luaM_freearray(L, f->code, cast_sizet(f->sizecode));
@@ -293,7 +304,7 @@ void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->k, cast_sizet(f->sizek));
   luaM_freearray(L, f->locvars, cast_sizet(f->sizelocvars));
   luaM_freearray(L, f->upvalues, cast_sizet(f->sizeupvalues));
-  luaM_free(L, f);
+  luaM_freeobject(L, f, sizeof(Proto), LUA_TPROTO);
 }
 
 
@@ -14,6 +14,7 @@
 
 #include "lua.h"
 
+#include "lapi.h"
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
@@ -49,15 +50,15 @@
 
 /* macro to erase all color bits then set only the current white bit */
 #define makewhite(g,x)	\
-  (x->marked = cast_byte((x->marked & ~maskcolors) | luaC_white(g)))
+  (gcbits(x) = cast_byte((gcbits(x) & ~maskcolors) | luaC_white(g)))
 
 /* make an object gray (neither white nor black) */
-#define set2gray(x)	resetbits(x->marked, maskcolors)
+#define set2gray(x)	resetbits(gcbits(x), maskcolors)
 
 
 /* make an object black (coming from any color) */
 #define set2black(x)  \
-  (x->marked = cast_byte((x->marked & ~WHITEBITS) | bitmask(BLACKBIT)))
+  (gcbits(x) = cast_byte((gcbits(x) & ~WHITEBITS) | bitmask(BLACKBIT)))
 
 
 #define valiswhite(x)   (iscollectable(x) && iswhite(gcvalue(x)))
@@ -92,9 +93,21 @@
 #define markobjectN(g,t)	{ if (t) markobject(g,t); }
 
 
+/*
+** Change 'GCmarked' without losing, for telemetry, the bytes marked
+** so far
+*/
+#define setGCmarked(g,v)  \
+	{ if (l_unlikely((g)->telemetry)) telmarked(g, v); \
+	  else (g)->GCmarked = (v); }
+
+
 static void reallymarkobject (global_State *g, GCObject *o);
+static l_mem traverseobj (global_State *g, GCObject *o);
+static void freeobj (lua_State *L, GCObject *o);
 static void atomic (lua_State *L);
 static void entersweep (lua_State *L);
+static void telmarked (global_State *g, l_mem v);
 
 
 /*
@@ -160,6 +173,23 @@ static l_mem objsize (GCObject *o) {
 }
 
 
+/*
+** Allocation for the collector's own structures (mark stack, card
+** sets). A failure is not an error, as callers have a fallback, so
+** there cannot be an emergency collection (which would run in the
+** middle of a barrier or of a collection step).
+*/
+static void *gcrealloc (global_State *g, void *block, size_t osize,
+                                                     size_t nsize) {
+  lu_byte oldstopem = g->gcstopem;
+  void *nblock;
+  g->gcstopem = 1;  /* avoid emergency collections */
+  nblock = luaM_realloc_(mainthread(g), block, osize, nsize);
+  g->gcstopem = oldstopem;
+  return nblock;
+}
+
+
 static GCObject **getgclist (GCObject *o) {
   switch (o->tt) {
     case LUA_VTABLE: return &gco2t(o)->gclist;
@@ -290,22 +320,104 @@ void luaC_fix (lua_State *L, GCObject *o) {
 }
 
 
+/*
+** Kind of an object in the live counters (see 'luaC_bdadd')
+*/
+static int bdkind (lu_byte tt) {
+  switch (tt) {
+    case LUA_VSHRSTR: return LUA_BDSHRSTR;
+    case LUA_VLNGSTR: return LUA_BDLNGSTR;
+    case LUA_VTABLE: return LUA_BDTABLE;
+    case LUA_VLCL: return LUA_BDLCL;
+    case LUA_VCCL: return LUA_BDCCL;
+    case LUA_VPROTO: return LUA_BDPROTO;
+    case LUA_VUSERDATA: return LUA_BDUDATA;
+    case LUA_VTHREAD: return LUA_BDTHREAD;
+    case LUA_VUPVAL: return LUA_BDUPVAL;
+    default: lua_assert(0); return LUA_BDOTHER;
+  }
+}
+
+
+/*
+** Remove a dying object, with all it owns, from the live counters.
+** (Called by the mutator, even when the object is freed by the
+** background sweeper.)
+*/
+static void bdfree (lua_State *L, GCObject *o) {
+  global_State *g = G(L);
+  switch (o->tt) {
+    case LUA_VTABLE: {
+      luaH_countparts(L, gco2t(o), -1);
+      luaC_bdadd(g, LUA_BDTABLE, -1, -cast(l_mem, sizeof(Table)));
+      break;
+    }
+    case LUA_VPROTO: {
+      Proto *p = gco2p(o);
+      l_mem sz = (p->flag & PF_COUNTED) ? cast(l_mem, luaF_protosize(p))
+                                        : cast(l_mem, sizeof(Proto));
+      luaC_bdadd(g, LUA_BDPROTO, -1, -sz);
+      break;
+    }
+    default:
+      luaC_bdadd(g, bdkind(o->tt), -1, -objsize(o));
+  }
+}
+
+
+void luaC_getbreakdown (lua_State *L, lua_GCBreakdown *b) {
+  global_State *g = G(L);
+  l_mem other = gettotalbytes(g);
+  int i;
+  for (i = 0; i < LUA_BDOTHER; i++) {
+    b->count[i] = l_castS2U(g->bdcount[i]);
+    b->bytes[i] = l_castS2U(g->bdbytes[i]);
+    other -= g->bdbytes[i];
+  }
+  for (; i < LUA_BDN; i++)
+    b->count[i] = b->bytes[i] = 0;
+  b->bytes[LUA_BDOTHER] = l_castS2U(other);
+}
+
+
 /*
 ** create a new collectable object (with given type, size, and offset)
 ** and link it to 'allgc' list.
 */
 GCObject *luaC_newobjdt (lua_State *L, lu_byte tt, size_t sz, size_t offset) {
   global_State *g = G(L);
+#if defined(LUA_USE_SIDEMARKS)
+  lu_byte slot;
+  char *p = cast_charp(luaM_newheapobj(L, sz, novariant(tt), &slot));
+  GCObject *o = cast(GCObject *, p + offset);
+  lua_assert(offset == 0 || slot != HEAPBIG);
+  o->marked = slot;
+#else
   char *p = cast_charp(luaM_newobject(L, novariant(tt), sz));
   GCObject *o = cast(GCObject *, p + offset);
-  o->marked = luaC_white(g);
+#endif
+  gcbits(o) = luaC_white(g);
   o->tt = tt;
   o->next = g->allgc;
   g->allgc = o;
+  luaC_bdadd(g, bdkind(tt), 1, sz);
   return o;
 }
 
 
+/*
+** Link an object that was swept but not freed (see 'luaE_poolthread')
+** back into 'allgc', as a new object.
+*/
+void luaC_relink (lua_State *L, GCObject *o) {
+  global_State *g = G(L);
+  gcbits(o) = luaC_white(g);
+  o->next = g->allgc;
+  g->allgc = o;
+  luaC_bdadd(g, bdkind(o->tt), 1, 0);  /* bytes are added by the caller */
+}
+
+
 /*
 ** create a new collectable object with no offset.
 */
@@ -316,6 +428,158 @@ GCObject *luaC_newobj (lua_State *L, lu_byte tt, size_t sz) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** Pending ephemeron entries
+** =======================================================
+*/
+
+/*
+** While 'convergeephemerons' runs, each entry "white key -> white
+** value" found by 'traverseephemeron' goes to a side table that maps
+** the key to the list of its pending values. When the key is marked,
+** 'reallymarkobject' calls 'ephrelease', which moves that list to a
+** work list; the values in it are marked as soon as there are no more
+** gray objects. So, each entry is handled a constant number of times,
+** and convergence is linear on the number of entries, instead of
+** needing a new pass over all ephemeron tables for each link of a
+** chain. The table is allocated with 'gcrealloc'; if it cannot grow,
+** the entry is dropped and 'failed' makes 'convergeephemerons' fall
+** back to repeated traversals.
+*/
+
+typedef struct EphKey {
+  GCObject *key;  /* NULL in empty slots */
+  int first, last;  /* list of pending values (first < 0 if released) */
+} EphKey;
+
+typedef struct EphValue {
+  GCObject *value;
+  int next;  /* next value of the same key (or in the work list) */
+} EphValue;
+
+typedef struct EphPending {
+  EphKey *keys;  /* hash table with open addressing */
+  unsigned int sizekeys;  /* size of 'keys' (a power of 2) */
+  unsigned int nkeys;  /* number of keys in 'keys' */
+  EphValue *values;
+  unsigned int sizevalues;
+  unsigned int nvalues;
+  int work;  /* list of released values, not marked yet */
+  int failed;  /* true if some entry was not recorded */
+} EphPending;
+
+
+/* initial size of the arrays in an 'EphPending' */
+#define EPHMINSIZE	64
+
+/* maximum size of these arrays (indices are ints) */
+#define EPHMAXSIZE	cast_uint(INT_MAX / sizeof(EphKey))
+
+
+static EphKey *ephslot (EphKey *keys, unsigned int size, GCObject *o) {
+  unsigned int i = (point2uint(o) >> 3) * 2654435769u;
+  for (i &= size - 1; keys[i].key != NULL && keys[i].key != o;
+       i = (i + 1) & (size - 1))
+    ;
+  return &keys[i];
+}
+
+
+static int ephgrowkeys (global_State *g, EphPending *ep) {
+  unsigned int osize = ep->sizekeys;
+  unsigned int nsize = (osize == 0) ? EPHMINSIZE : 2 * osize;
+  unsigned int i;
+  EphKey *nk;
+  if (nsize <= osize || nsize > EPHMAXSIZE)
+    return 0;  /* overflow */
+  nk = cast(EphKey *, gcrealloc(g, NULL, 0, nsize * sizeof(EphKey)));
+  if (nk == NULL)
+    return 0;
+  for (i = 0; i < nsize; i++)
+    nk[i].key = NULL;
+  for (i = 0; i < osize; i++) {  /* reinsert old keys */
+    if (ep->keys[i].key != NULL)
+      *ephslot(nk, nsize, ep->keys[i].key) = ep->keys[i];
+  }
+  gcrealloc(g, ep->keys, osize * sizeof(EphKey), 0);
+  ep->keys = nk;
+  ep->sizekeys = nsize;
+  return 1;
+}
+
+
+static int ephgrowvalues (global_State *g, EphPending *ep) {
+  unsigned int osize = ep->sizevalues;
+  unsigned int nsize = (osize == 0) ? EPHMINSIZE : 2 * osize;
+  EphValue *nv;
+  if (nsize <= osize || nsize > EPHMAXSIZE)
+    return 0;  /* overflow */
+  nv = cast(EphValue *, gcrealloc(g, ep->values, osize * sizeof(EphValue),
+                                                 nsize * sizeof(EphValue)));
+  if (nv == NULL)
+    return 0;
+  ep->values = nv;
+  ep->sizevalues = nsize;
+  return 1;
+}
+
+
+/*
+** Record that 'value' must be marked when 'key' (still white) is.
+*/
+static void ephadd (global_State *g, GCObject *key, GCObject *value) {
+  EphPending *ep = g->ephpending;
+  EphKey *k;
+  int v;
+  if ((ep->nvalues == ep->sizevalues && !ephgrowvalues(g, ep)) ||
+      (2 * (ep->nkeys + 1) > ep->sizekeys && !ephgrowkeys(g, ep))) {
+    ep->failed = 1;  /* table must be traversed again */
+    return;
+  }
+  v = cast_int(ep->nvalues++);
+  ep->values[v].value = value;
+  ep->values[v].next = -1;
+  k = ephslot(ep->keys, ep->sizekeys, key);
+  if (k->key == NULL) {  /* new key? */
+    k->key = key;
+    k->first = v;
+    ep->nkeys++;
+  }
+  else {  /* append to the list of that key */
+    lua_assert(k->first >= 0);  /* a white key cannot have been released */
+    ep->values[k->last].next = v;
+  }
+  k->last = v;
+}
+
+
+/*
+** Object 'o' has just been marked; if it is a key with pending
+** values, move them to the work list. (They are not marked here, to
+** avoid a recursion as deep as the chain.)
+*/
+static void ephrelease (global_State *g, GCObject *o) {
+  EphPending *ep = g->ephpending;
+  if (ep->nkeys > 0) {
+    EphKey *k = ephslot(ep->keys, ep->sizekeys, o);
+    if (k->key != NULL && k->first >= 0) {
+      ep->values[k->last].next = ep->work;
+      ep->work = k->first;
+      k->first = -1;
+    }
+  }
+}
+
+
+static void ephfree (global_State *g, EphPending *ep) {
+  gcrealloc(g, ep->keys, ep->sizekeys * sizeof(EphKey), 0);
+  gcrealloc(g, ep->values, ep->sizevalues * sizeof(EphValue), 0);
+}
+
+/* }====================================================== */
+
+
 
 /*
 ** {======================================================
@@ -324,14 +588,108 @@ GCObject *luaC_newobj (lua_State *L, lu_byte tt, size_t sz) {
 */
 
 
+/*
+** Gray objects waiting for a traversal go to a growable stack, instead
+** of being threaded through their 'gclist' fields, so that popping an
+** object does not need to read it. Objects popped from the stack pass
+** through a small FIFO window, 'graywindow', where they are prefetched;
+** an object is traversed only when GRAYWINDOW other objects have
+** entered the window after it, which gives the prefetch time to bring
+** it to the cache. The intrusive list 'g->gray' is still used when the
+** stack cannot grow, for the 'grayagain' list in the atomic phase, and
+** to hand work to parallel markers.
+*/
+
+/* initial (and minimum kept) size of the mark stack */
+#define GRAYSTACKMIN	256
+
+#if defined(__GNUC__)
+#define prefetchobj(o)	__builtin_prefetch(o)
+#else
+#define prefetchobj(o)	((void)(o))
+#endif
+
+
+#define hasgray(g)  \
+	((g)->ngraystack > 0 || (g)->nwindow > 0 || (g)->gray != NULL)
+
+
+static int growgraystack (global_State *g) {
+  unsigned int osize = g->sizegraystack;
+  unsigned int nsize = (osize == 0) ? GRAYSTACKMIN : 2 * osize;
+  GCObject **ns;
+  if (nsize <= osize)  /* overflow? */
+    return 0;
+  ns = cast(GCObject **, gcrealloc(g, g->graystack, osize * sizeof(GCObject *),
+                                                   nsize * sizeof(GCObject *)));
+  if (ns == NULL)
+    return 0;
+  g->graystack = ns;
+  g->sizegraystack = nsize;
+  return 1;
+}
+
+
+/*
+** Free a large mark stack (which must be empty).
+*/
+static void shrinkgraystack (global_State *g) {
+  lua_assert(!hasgray(g));
+  if (g->sizegraystack > GRAYSTACKMIN) {
+    gcrealloc(g, g->graystack, g->sizegraystack * sizeof(GCObject *), 0);
+    g->graystack = NULL;
+    g->sizegraystack = 0;
+  }
+}
+
+
+/*
+** Make a white object gray and push it to be traversed later.
+*/
+static void pushgray (global_State *g, GCObject *o) {
+  if (l_unlikely(g->ngraystack == g->sizegraystack) && !growgraystack(g))
+    linkobjgclist(o, g->gray);  /* no space; use the list */
+  else {
+    set2gray(o);
+    g->graystack[g->ngraystack++] = o;
+  }
+}
+
+
+/*
+** Get the next gray object to be traversed, refilling the window from
+** the stack (or from the list) first.
+*/
+static GCObject *popgray (global_State *g) {
+  GCObject *o;
+  while (g->nwindow < GRAYWINDOW) {
+    if (g->ngraystack > 0)
+      o = g->graystack[--g->ngraystack];
+    else if (g->gray != NULL) {
+      o = g->gray;
+      g->gray = *getgclist(o);  /* remove from 'gray' list */
+    }
+    else
+      break;  /* no more objects */
+    prefetchobj(o);
+    g->graywindow[(g->windowfirst + g->nwindow++) % GRAYWINDOW] = o;
+  }
+  lua_assert(g->nwindow > 0);
+  o = g->graywindow[g->windowfirst];
+  g->windowfirst = (g->windowfirst + 1) % GRAYWINDOW;
+  g->nwindow--;
+  return o;
+}
+
+
 /*
 ** Mark an object.  Userdata with no user values, strings, and closed
 ** upvalues are visited and turned black here.  Open upvalues are
 ** already indirectly linked through their respective threads in the
 ** 'twups' list, so they don't go to the gray list; nevertheless, they
 ** are kept gray to avoid barriers, as their values will be revisited
-** by the thread or by 'remarkupvals'.  Other objects are added to the
-** gray list to be visited (and turned black) later.  Both userdata and
+** by the thread or by 'remarkupvals'.  Other objects are pushed into
+** the mark stack to be visited (and turned black) later.  Both userdata and
 ** upvalues can call this function recursively, but this recursion goes
 ** for at most two levels: An upvalue cannot refer to another upvalue
 ** (only closures can), and a userdata's metatable must be a table.
@@ -364,11 +722,13 @@ static void reallymarkobject (global_State *g, GCObject *o) {
     }  /* FALLTHROUGH */
     case LUA_VLCL: case LUA_VCCL: case LUA_VTABLE:
     case LUA_VTHREAD: case LUA_VPROTO: {
-      linkobjgclist(o, g->gray);  /* to be visited later */
+      pushgray(g, o);  /* to be visited later */
       break;
     }
     default: lua_assert(0); break;
   }
+  if (l_unlikely(g->ephpending != NULL))  /* converging ephemerons? */
+    ephrelease(g, o);  /* 'o' may be a key with pending values */
 }
 
 
@@ -427,6 +787,7 @@ static void remarkupvals (global_State *g) {
 
 
 static void cleargraylists (global_State *g) {
+  g->ngraystack = g->nwindow = 0;
   g->gray = g->grayagain = NULL;
   g->weak = g->allweak = g->ephemeron = NULL;
 }
@@ -439,7 +800,7 @@ static void cleargraylists (global_State *g) {
 */
 static void restartcollection (global_State *g) {
   cleargraylists(g);
-  g->GCmarked = 0;
+  setGCmarked(g, 0);
   markobject(g, mainthread(g));
   markvalue(g, &g->l_registry);
   markmt(g);
@@ -451,132 +812,678 @@ static void restartcollection (global_State *g) {
 
 /*
 ** {======================================================
-** Traverse functions
+** Collector threads
 ** =======================================================
 */
 
+#if defined(LUA_USE_PARALLELMARK) || defined(LUA_USE_SWEEPTHREAD)
+
+#include <pthread.h>
+#include <signal.h>
+
 
 /*
-** Check whether object 'o' should be kept in the 'grayagain' list for
-** post-processing by 'correctgraylist'. (It could put all old objects
-** in the list and leave all the work to 'correctgraylist', but it is
-** more efficient to avoid adding elements that will be removed.) Only
-** TOUCHED1 objects need to be in the list. TOUCHED2 doesn't need to go
-** back to a gray list, but then it must become OLD. (That is what
-** 'correctgraylist' does when it finds a TOUCHED2 object.)
-** This function is a no-op in incremental mode, as objects cannot be
-** marked as touched in that mode.
+** Start a thread for the collector. The thread blocks all signals, so
+** that they keep going to the application threads. Returns true on
+** success.
 */
-static void genlink (global_State *g, GCObject *o) {
-  lua_assert(isblack(o));
-  if (getage(o) == G_TOUCHED1) {  /* touched in this cycle? */
-    linkobjgclist(o, g->grayagain);  /* link it back in 'grayagain' */
-  }  /* everything else do not need to be linked back */
-  else if (getage(o) == G_TOUCHED2)
-    setage(o, G_OLD);  /* advance age */
+static int startgcthread (pthread_t *t, void *(*f) (void *), void *ud) {
+  sigset_t all, old;
+  int res;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  res = pthread_create(t, NULL, f, ud);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return (res == 0);
 }
 
+#endif
+
+/* }====================================================== */
+
 
 /*
-** Traverse a table with weak values and link it to proper list. During
-** propagate phase, keep it in 'grayagain' list, to be revisited in the
-** atomic phase. In the atomic phase, if table has any white value,
-** put it in 'weak' list, to be cleared; otherwise, call 'genlink'
-** to check table age in generational mode.
+** {======================================================
+** Parallel marking
+** =======================================================
 */
-static void traverseweakvalue (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
-  /* if there is array part, assume it may have white values (it is not
-     worth traversing it now just to check) */
-  int hasclears = (h->asize > 0);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-    if (isempty(gval(n)))  /* entry is empty? */
-      clearkey(n);  /* clear its key */
-    else {
-      lua_assert(!keyisnil(n));
-      markkey(g, n);
-      if (!hasclears && iscleared(g, gcvalueN(gval(n))))  /* a white value? */
-        hasclears = 1;  /* table will have to be cleared */
-    }
-  }
-  if (g->gcstate == GCSpropagate)
-    linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
-  else if (hasclears)
-      linkgclist(h, g->weak);  /* has to be cleared later */
-  else
-    genlink(g, obj2gco(h));
+
+#if defined(LUA_USE_PARALLELMARK)
+
+/*
+** When enabled (see option 'LUA_GCPMARKTHREADS'), 'propagateall' hands
+** its gray list to a team of markers: the collector itself plus some
+** helper threads. The mutator is stopped during these phases, so
+** objects change only by the markers' own actions. A marker claims a
+** white object by changing its color with an atomic compare-and-swap;
+** only the marker that wins the claim traverses the object, so all
+** other updates to an object (its color, age, 'gclist' and, for
+** tables, its dead keys) are done by a single thread. Each marker keeps
+** its gray objects in a private stack; when that stack overflows, or
+** when other markers are idle, it moves half of it to a shared list,
+** where idle markers steal their work.
+**
+** Markers only do plain traversals. Objects that need more than that
+** (weak tables, which must go to the lists of weak tables, and threads,
+** whose traversal may reallocate their stacks) are kept gray and
+** handed back to the collector, which traverses them serially after
+** the parallel phase. Objects that 'genlink' would link back into
+** 'grayagain' go first to private lists.
+*/
+
+
+/* maximum number of helper threads */
+#define MAXHELPERS	64
+
+/* size of the private gray stack of each marker */
+#define PMSTACK		512
+
+/*
+** Number of objects traversed serially before calling the helpers;
+** small collections do not pay for the synchronization.
+*/
+#define PMSERIAL	2000
+
+
+#define pmload(p)	__atomic_load_n(p, __ATOMIC_RELAXED)
+#define pmstore(p,v)	__atomic_store_n(p, v, __ATOMIC_RELAXED)
+
+/* colors can change under other markers, so read them atomically */
+#define pmiswhite(x)	(pmload(&gcbits(x)) & WHITEBITS)
+
+
+typedef struct GCMarker {
+  struct GCMarkers *ms;  /* team of this marker */
+  GCObject *grayagain;  /* objects to be linked into 'grayagain' */
+  GCObject *deferred;  /* objects to be traversed by the collector */
+  l_mem marked;  /* number of bytes marked by this marker */
+  unsigned int phase;  /* last phase done by this marker */
+  int n;  /* number of objects in 'stack' */
+  pthread_t thread;
+  GCObject *stack[PMSTACK];  /* private gray stack */
+} GCMarker;
+
+
+typedef struct GCMarkers {
+  global_State *g;
+  pthread_mutex_t lock;
+  pthread_cond_t start;  /* signals a new phase to helpers */
+  pthread_cond_t work;  /* signals new shared work or end of phase */
+  pthread_cond_t done;  /* signals that all helpers ended the phase */
+  GCObject *shared;  /* gray objects available to any marker */
+  unsigned int phase;  /* number of the current phase */
+  int nhelpers;  /* number of helper threads */
+  int nwanted;  /* number of helpers asked for */
+  int nrunning;  /* number of helpers still in the current phase */
+  int nidle;  /* number of markers looking for work */
+  int finished;  /* true when there is no more work in this phase */
+  int quit;  /* true when helpers must exit */
+  GCMarker m[1];  /* the collector (m[0]) plus helpers */
+} GCMarkers;
+
+
+#define sizemarkers(n)  \
+	(offsetof(GCMarkers, m) + cast_sizet((n) + 1) * sizeof(GCMarker))
+
+
+/*
+** Try to turn a white object into gray (or black, if 'black'). Returns
+** true iff this call changed its color; in that case, the calling
+** marker owns the object.
+*/
+static int pmclaim (GCObject *o, int black) {
+  lu_byte old = pmload(&gcbits(o));
+  lu_byte nw;
+  do {
+    if (!(old & WHITEBITS))
+      return 0;  /* already marked by someone else */
+    nw = cast_byte(old & ~maskcolors);
+    if (black)
+      nw = cast_byte(nw | bitmask(BLACKBIT));
+  } while (!__atomic_compare_exchange_n(&gcbits(o), &old, nw, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 1;
 }
 
 
 /*
-** Traverse the array part of a table.
+** Move the bottom half of the private stack of 'm' (the objects pushed
+** first, which tend to have the largest subgraphs still unvisited) to
+** the shared list, and wake up idle markers.
 */
-static int traversearray (global_State *g, Table *h) {
-  unsigned asize = h->asize;
-  int marked = 0;  /* true if some object is marked in this traversal */
-  unsigned i;
-  for (i = 0; i < asize; i++) {
-    GCObject *o = gcvalarr(h, i);
-    if (o != NULL && iswhite(o)) {
-      marked = 1;
-      reallymarkobject(g, o);
-    }
+static void pmshare (GCMarker *m) {
+  GCMarkers *ms = m->ms;
+  int half = m->n / 2;
+  int i;
+  GCObject *l;
+  pthread_mutex_lock(&ms->lock);
+  l = ms->shared;
+  for (i = 0; i < half; i++) {
+    GCObject *o = m->stack[i];
+    *getgclist(o) = l;
+    l = o;
   }
-  return marked;
+  pmstore(&ms->shared, l);
+  pthread_cond_broadcast(&ms->work);
+  pthread_mutex_unlock(&ms->lock);
+  m->n -= half;
+  memmove(m->stack, m->stack + half, cast_sizet(m->n) * sizeof(GCObject *));
 }
 
 
 /*
-** Traverse an ephemeron table and link it to proper list. Returns true
-** iff any object was marked during this traversal (which implies that
-** convergence has to continue). During propagation phase, keep table
-** in 'grayagain' list, to be visited again in the atomic phase. In
-** the atomic phase, if table has any white->white entry, it has to
-** be revisited during ephemeron convergence (as that key may turn
-** black). Otherwise, if it has any white key, table has to be cleared
-** (in the atomic phase). In generational mode, some tables
-** must be kept in some gray list for post-processing; this is done
-** by 'genlink'.
+** Get some work from the shared list into the (empty) private stack of
+** 'm'. If there is none, wait for it; the phase ends when all markers
+** are waiting. Returns false at the end of the phase.
 */
-static int traverseephemeron (global_State *g, Table *h, int inv) {
-  int hasclears = 0;  /* true if table has white keys */
-  int hasww = 0;  /* true if table has entry "white-key -> white-value" */
-  unsigned int i;
-  unsigned int nsize = sizenode(h);
-  int marked = traversearray(g, h);  /* traverse array part */
-  /* traverse hash part; if 'inv', traverse descending
-     (see 'convergeephemerons') */
-  for (i = 0; i < nsize; i++) {
-    Node *n = inv ? gnode(h, nsize - 1 - i) : gnode(h, i);
-    if (isempty(gval(n)))  /* entry is empty? */
-      clearkey(n);  /* clear its key */
-    else if (iscleared(g, gckeyN(n))) {  /* key is not marked (yet)? */
-      hasclears = 1;  /* table must be cleared */
-      if (valiswhite(gval(n)))  /* value not marked yet? */
-        hasww = 1;  /* white-white entry */
+static int pmsteal (GCMarker *m) {
+  GCMarkers *ms = m->ms;
+  int found;
+  pthread_mutex_lock(&ms->lock);
+  pmstore(&ms->nidle, ms->nidle + 1);
+  for (;;) {
+    if (ms->shared != NULL) {  /* some work available? */
+      GCObject *l = ms->shared;
+      while (l != NULL && m->n < PMSTACK / 2) {
+        m->stack[m->n++] = l;
+        l = *getgclist(l);
+      }
+      pmstore(&ms->shared, l);
+      pmstore(&ms->nidle, ms->nidle - 1);
+      found = 1;
+      break;
     }
-    else if (valiswhite(gval(n))) {  /* value not marked yet? */
-      marked = 1;
-      reallymarkobject(g, gcvalue(gval(n)));  /* mark it now */
+    else if (ms->finished || ms->nidle == ms->nhelpers + 1) {
+      ms->finished = 1;  /* everybody is idle; phase is over */
+      pthread_cond_broadcast(&ms->work);
+      found = 0;
+      break;
     }
+    pthread_cond_wait(&ms->work, &ms->lock);
   }
-  /* link table into proper list */
-  if (g->gcstate == GCSpropagate)
-    linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
-  else if (hasww)  /* table has white->white entries? */
-    linkgclist(h, g->ephemeron);  /* have to propagate again */
-  else if (hasclears)  /* table has white keys? */
-    linkgclist(h, g->allweak);  /* may have to clean white keys */
-  else
-    genlink(g, obj2gco(h));  /* check whether collector still needs to see it */
-  return marked;
+  pthread_mutex_unlock(&ms->lock);
+  return found;
 }
 
 
-static void traversestrongtable (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
-  traversearray(g, h);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
+/* push an object owned by 'm' into its private stack */
+static void pmpush (GCMarker *m, GCObject *o) {
+  if (m->n == PMSTACK)  /* stack is full? */
+    pmshare(m);  /* move part of it to other markers */
+  m->stack[m->n++] = o;
+}
+
+
+#define pmmarkvalue(m,v)  \
+	{ if (iscollectable(v) && pmiswhite(gcvalue(v))) pmmark(m, gcvalue(v)); }
+
+#define pmmarkobjectN(m,t)  \
+	{ if ((t) && pmiswhite(t)) pmmark(m, obj2gco(t)); }
+
+
+/*
+** Parallel version of 'reallymarkobject'.
+*/
+static void pmmark (GCMarker *m, GCObject *o) {
+  switch (o->tt) {
+    case LUA_VSHRSTR:
+    case LUA_VLNGSTR: {
+      if (pmclaim(o, 1))
+        m->marked += objsize(o);
+      break;
+    }
+    case LUA_VUPVAL: {
+      UpVal *uv = gco2upv(o);
+      if (pmclaim(o, !upisopen(uv))) {  /* open upvalues are kept gray */
+        m->marked += objsize(o);
+        pmmarkvalue(m, uv->v.p);
+      }
+      break;
+    }
+    case LUA_VUSERDATA: {
+      Udata *u = gco2u(o);
+      if (u->nuvalue == 0) {  /* no user values? */
+        if (pmclaim(o, 1)) {
+          m->marked += objsize(o);
+          pmmarkobjectN(m, u->metatable);
+        }
+        break;
+      }
+      /* else... */
+    }  /* FALLTHROUGH */
+    default: {
+      if (pmclaim(o, 0)) {
+        m->marked += objsize(o);
+        pmpush(m, o);  /* to be visited later */
+      }
+      break;
+    }
+  }
+}
+
+
+/*
+** Parallel version of 'genlink'.
+*/
+static void pmgenlink (GCMarker *m, GCObject *o) {
+  lu_byte age = getage(o);
+  if (age == G_TOUCHED1) {
+    *getgclist(o) = m->grayagain;
+    m->grayagain = o;
+    pmstore(&gcbits(o), cast_byte(gcbits(o) & ~maskcolors));  /* gray */
+  }
+  else if (age == G_TOUCHED2)
+    pmstore(&gcbits(o), cast_byte((gcbits(o) & ~AGEBITS) | G_OLD));
+}
+
+
+/*
+** Check whether table 'h' can have weak entries, without the writes
+** done by 'gfasttm'. (Any mode string counts as weak here; the
+** collector does the real check.)
+*/
+static int pmisweak (GCMarker *m, Table *h) {
+  Table *mt = h->metatable;
+  if (checknoTM(mt, TM_MODE))
+    return 0;
+  else {
+    const TValue *mode = luaH_Hgetshortstr(mt, m->ms->g->tmname[TM_MODE]);
+    return ttisshrstring(mode);
+  }
+}
+
+
+static void pmtraversetable (GCMarker *m, Table *h) {
+  Node *n, *limit = gnodelast(h);
+  unsigned int i;
+  unsigned int asize = h->asize;
+  for (i = 0; i < asize; i++) {
+    GCObject *o = gcvalarr(h, i);
+    if (o != NULL && pmiswhite(o))
+      pmmark(m, o);
+  }
+  for (n = gnode(h, 0); n < limit; n++) {
+    if (isempty(gval(n)))  /* entry is empty? */
+      clearkey(n);  /* clear its key */
+    else {
+      lua_assert(!keyisnil(n));
+      if (keyiscollectable(n) && pmiswhite(gckey(n))) pmmark(m, gckey(n));
+      pmmarkvalue(m, gval(n));
+    }
+  }
+}
+
+
+/*
+** Traverse a gray object owned by 'm'. Objects that the markers do not
+** handle stay gray and go to the 'deferred' list.
+*/
+static void pmtraverse (GCMarker *m, GCObject *o) {
+  int i;
+  if (o->tt == LUA_VTHREAD ||
+      (o->tt == LUA_VTABLE && pmisweak(m, gco2t(o)))) {
+    *getgclist(o) = m->deferred;
+    m->deferred = o;
+    return;
+  }
+  pmstore(&gcbits(o), cast_byte(gcbits(o) | bitmask(BLACKBIT)));
+  switch (o->tt) {
+    case LUA_VTABLE: {
+      Table *h = gco2t(o);
+      pmmarkobjectN(m, h->metatable);
+      pmtraversetable(m, h);
+      pmgenlink(m, o);
+      break;
+    }
+    case LUA_VUSERDATA: {
+      Udata *u = gco2u(o);
+      pmmarkobjectN(m, u->metatable);
+      for (i = 0; i < u->nuvalue; i++)
+        pmmarkvalue(m, &u->uv[i].uv);
+      pmgenlink(m, o);
+      break;
+    }
+    case LUA_VLCL: {
+      LClosure *cl = gco2lcl(o);
+      pmmarkobjectN(m, cl->p);
+      for (i = 0; i < cl->nupvalues; i++)
+        pmmarkobjectN(m, cl->upvals[i]);
+      break;
+    }
+    case LUA_VCCL: {
+      CClosure *cl = gco2ccl(o);
+      for (i = 0; i < cl->nupvalues; i++)
+        pmmarkvalue(m, &cl->upvalue[i]);
+      break;
+    }
+    case LUA_VPROTO: {
+      Proto *f = gco2p(o);
+      pmmarkobjectN(m, f->source);
+      for (i = 0; i < f->sizek; i++)
+        pmmarkvalue(m, &f->k[i]);
+      for (i = 0; i < f->sizeupvalues; i++)
+        pmmarkobjectN(m, f->upvalues[i].name);
+      for (i = 0; i < f->sizep; i++)
+        pmmarkobjectN(m, f->p[i]);
+      for (i = 0; i < f->sizelocvars; i++)
+        pmmarkobjectN(m, f->locvars[i].varname);
+      break;
+    }
+    default: lua_assert(0);
+  }
+}
+
+
+/*
+** Main loop of a marker: traverse its private stack, sharing work with
+** idle markers, until there is no more work anywhere.
+*/
+static void pmdrain (GCMarker *m) {
+  GCMarkers *ms = m->ms;
+  do {
+    while (m->n > 0) {
+      pmtraverse(m, m->stack[--m->n]);
+      if (m->n > 1 && pmload(&ms->nidle) > 0 && pmload(&ms->shared) == NULL)
+        pmshare(m);  /* feed idle markers */
+    }
+  } while (pmsteal(m));
+}
+
+
+static void *pmhelper (void *ud) {
+  GCMarker *m = cast(GCMarker *, ud);
+  GCMarkers *ms = m->ms;
+  pthread_mutex_lock(&ms->lock);
+  for (;;) {
+    while (m->phase == ms->phase && !ms->quit)
+      pthread_cond_wait(&ms->start, &ms->lock);
+    if (ms->quit)
+      break;
+    m->phase = ms->phase;
+    pthread_mutex_unlock(&ms->lock);
+    pmdrain(m);
+    pthread_mutex_lock(&ms->lock);
+    if (--ms->nrunning == 0)
+      pthread_cond_signal(&ms->done);
+  }
+  pthread_mutex_unlock(&ms->lock);
+  return NULL;
+}
+
+
+/*
+** Stop all helper threads and free the team.
+*/
+static void stopmarkers (global_State *g) {
+  GCMarkers *ms = g->markers;
+  if (ms != NULL) {
+    int i;
+    pthread_mutex_lock(&ms->lock);
+    ms->quit = 1;
+    pthread_cond_broadcast(&ms->start);
+    pthread_mutex_unlock(&ms->lock);
+    for (i = 1; i <= ms->nhelpers; i++)
+      pthread_join(ms->m[i].thread, NULL);
+    pthread_cond_destroy(&ms->done);
+    pthread_cond_destroy(&ms->work);
+    pthread_cond_destroy(&ms->start);
+    pthread_mutex_destroy(&ms->lock);
+    luaM_freemem(mainthread(g), ms, sizemarkers(ms->nwanted));
+    g->markers = NULL;
+  }
+}
+
+
+/*
+** Create a team with 'n' helpers. Failures are not errors: the team
+** gets the helpers that could be created, or is not created at all.
+*/
+static void startmarkers (global_State *g, int n) {
+  GCMarkers *ms = cast(GCMarkers *,
+                  luaM_realloc_(mainthread(g), NULL, 0, sizemarkers(n)));
+  int i;
+  if (ms == NULL)
+    return;  /* not enough memory; go serial */
+  ms->g = g;
+  pthread_mutex_init(&ms->lock, NULL);
+  pthread_cond_init(&ms->start, NULL);
+  pthread_cond_init(&ms->work, NULL);
+  pthread_cond_init(&ms->done, NULL);
+  ms->shared = NULL;
+  ms->phase = 0;
+  ms->quit = 0;
+  for (i = 0; i <= n; i++) {
+    GCMarker *m = &ms->m[i];
+    m->ms = ms;
+    m->grayagain = m->deferred = NULL;
+    m->marked = 0;
+    m->phase = 0;
+    m->n = 0;
+  }
+  for (i = 1; i <= n; i++) {
+    if (!startgcthread(&ms->m[i].thread, pmhelper, &ms->m[i]))
+      break;  /* use only the helpers already created */
+  }
+  ms->nhelpers = i - 1;
+  ms->nwanted = n;
+  g->markers = ms;
+}
+
+
+/*
+** Move all objects in the stack and in the window to the 'gray' list.
+*/
+static void graytolist (global_State *g) {
+  while (g->nwindow > 0) {
+    GCObject *o = g->graywindow[g->windowfirst];
+    g->windowfirst = (g->windowfirst + 1) % GRAYWINDOW;
+    g->nwindow--;
+    *getgclist(o) = g->gray;
+    g->gray = o;
+  }
+  while (g->ngraystack > 0) {
+    GCObject *o = g->graystack[--g->ngraystack];
+    *getgclist(o) = g->gray;
+    g->gray = o;
+  }
+}
+
+
+/*
+** Propagate marks from the gray list in parallel. Returns false if
+** there are no helpers, so that the caller does the work. Otherwise,
+** the gray list is empty when the parallel phase ends, but the
+** traversal of deferred objects may fill it again.
+*/
+static int parallelmark (global_State *g) {
+  GCMarkers *ms = g->markers;
+  l_mem n = applygcparam(g, MARKTHREADS, 100);
+  int i;
+  lua_assert(g->gcstate == GCSatomic);
+  if (n > MAXHELPERS)
+    n = MAXHELPERS;
+  if (ms == NULL ? n > 0 : n != ms->nwanted) {  /* number has changed? */
+    stopmarkers(g);
+    if (n > 0 && !g->gcemergency)
+      startmarkers(g, cast_int(n));
+    ms = g->markers;
+  }
+  if (ms == NULL || ms->nhelpers == 0)
+    return 0;
+  graytolist(g);
+  pthread_mutex_lock(&ms->lock);
+  pmstore(&ms->shared, g->gray);  /* gray list is available to all markers */
+  g->gray = NULL;
+  ms->nidle = 0;
+  ms->finished = 0;
+  ms->nrunning = ms->nhelpers;
+  ms->phase++;
+  pthread_cond_broadcast(&ms->start);
+  pthread_mutex_unlock(&ms->lock);
+  pmdrain(&ms->m[0]);  /* collector works as a marker, too */
+  pthread_mutex_lock(&ms->lock);
+  while (ms->nrunning > 0)  /* wait for the helpers */
+    pthread_cond_wait(&ms->done, &ms->lock);
+  pthread_mutex_unlock(&ms->lock);
+  for (i = 0; i <= ms->nhelpers; i++) {  /* collect results */
+    GCMarker *m = &ms->m[i];
+    GCObject *o;
+    g->GCmarked += m->marked;
+    m->marked = 0;
+    while ((o = m->grayagain) != NULL) {
+      m->grayagain = *getgclist(o);
+      *getgclist(o) = g->grayagain;
+      g->grayagain = o;
+    }
+    while ((o = m->deferred) != NULL) {  /* traverse deferred objects */
+      m->deferred = *getgclist(o);
+      nw2black(o);
+      traverseobj(g, o);  /* new gray objects go to the mark stack */
+    }
+  }
+  return 1;
+}
+
+#else
+
+#define stopmarkers(g)		((void)0)
+
+#endif
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Traverse functions
+** =======================================================
+*/
+
+
+/*
+** Check whether object 'o' should be kept in the 'grayagain' list for
+** post-processing by 'correctgraylist'. (It could put all old objects
+** in the list and leave all the work to 'correctgraylist', but it is
+** more efficient to avoid adding elements that will be removed.) Only
+** TOUCHED1 objects need to be in the list. TOUCHED2 doesn't need to go
+** back to a gray list, but then it must become OLD. (That is what
+** 'correctgraylist' does when it finds a TOUCHED2 object.)
+** This function is a no-op in incremental mode, as objects cannot be
+** marked as touched in that mode.
+*/
+static void genlink (global_State *g, GCObject *o) {
+  lua_assert(isblack(o));
+  if (getage(o) == G_TOUCHED1) {  /* touched in this cycle? */
+    linkobjgclist(o, g->grayagain);  /* link it back in 'grayagain' */
+  }  /* everything else do not need to be linked back */
+  else if (getage(o) == G_TOUCHED2)
+    setage(o, G_OLD);  /* advance age */
+}
+
+
+/*
+** Traverse a table with weak values and link it to proper list. During
+** propagate phase, keep it in 'grayagain' list, to be revisited in the
+** atomic phase. In the atomic phase, if table has any white value,
+** put it in 'weak' list, to be cleared; otherwise, call 'genlink'
+** to check table age in generational mode.
+*/
+static void traverseweakvalue (global_State *g, Table *h) {
+  Node *n, *limit = gnodelast(h);
+  /* if there is array part, assume it may have white values (it is not
+     worth traversing it now just to check) */
+  int hasclears = (h->asize > 0);
+  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
+    if (isempty(gval(n)))  /* entry is empty? */
+      clearkey(n);  /* clear its key */
+    else {
+      lua_assert(!keyisnil(n));
+      markkey(g, n);
+      if (!hasclears && iscleared(g, gcvalueN(gval(n))))  /* a white value? */
+        hasclears = 1;  /* table will have to be cleared */
+    }
+  }
+  if (g->gcstate == GCSpropagate)
+    linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
+  else if (hasclears)
+      linkgclist(h, g->weak);  /* has to be cleared later */
+  else
+    genlink(g, obj2gco(h));
+}
+
+
+/*
+** Traverse the array part of a table.
+*/
+static int traversearray (global_State *g, Table *h) {
+  unsigned asize = h->asize;
+  int marked = 0;  /* true if some object is marked in this traversal */
+  unsigned i;
+  for (i = 0; i < asize; i++) {
+    GCObject *o = gcvalarr(h, i);
+    if (o != NULL && iswhite(o)) {
+      marked = 1;
+      reallymarkobject(g, o);
+    }
+  }
+  return marked;
+}
+
+
+/*
+** Traverse an ephemeron table and link it to proper list. Returns true
+** iff any object was marked during this traversal (which implies that
+** convergence has to continue). During propagation phase, keep table
+** in 'grayagain' list, to be visited again in the atomic phase. In
+** the atomic phase, if table has any white->white entry, it has to
+** be revisited during ephemeron convergence (as that key may turn
+** black). Otherwise, if it has any white key, table has to be cleared
+** (in the atomic phase). In generational mode, some tables
+** must be kept in some gray list for post-processing; this is done
+** by 'genlink'.
+*/
+static int traverseephemeron (global_State *g, Table *h, int inv) {
+  int hasclears = 0;  /* true if table has white keys */
+  int hasww = 0;  /* true if table has entry "white-key -> white-value" */
+  unsigned int i;
+  unsigned int nsize = sizenode(h);
+  int marked = traversearray(g, h);  /* traverse array part */
+  /* traverse hash part; if 'inv', traverse descending
+     (see 'convergeephemerons') */
+  for (i = 0; i < nsize; i++) {
+    Node *n = inv ? gnode(h, nsize - 1 - i) : gnode(h, i);
+    if (isempty(gval(n)))  /* entry is empty? */
+      clearkey(n);  /* clear its key */
+    else if (iscleared(g, gckeyN(n))) {  /* key is not marked (yet)? */
+      hasclears = 1;  /* table must be cleared */
+      if (valiswhite(gval(n))) {  /* value not marked yet? */
+        hasww = 1;  /* white-white entry */
+        if (g->ephpending != NULL)  /* keep it for 'ephrelease' */
+          ephadd(g, gckeyN(n), gcvalue(gval(n)));
+      }
+    }
+    else if (valiswhite(gval(n))) {  /* value not marked yet? */
+      marked = 1;
+      reallymarkobject(g, gcvalue(gval(n)));  /* mark it now */
+    }
+  }
+  /* link table into proper list */
+  if (g->gcstate == GCSpropagate)
+    linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
+  else if (hasww)  /* table has white->white entries? */
+    linkgclist(h, g->ephemeron);  /* have to propagate again */
+  else if (hasclears)  /* table has white keys? */
+    linkgclist(h, g->allweak);  /* may have to clean white keys */
+  else
+    genlink(g, obj2gco(h));  /* check whether collector still needs to see it */
+  return marked;
+}
+
+
+static void traversestrongtable (global_State *g, Table *h) {
+  Node *n, *limit = gnodelast(h);
+  traversearray(g, h);
+  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
     if (isempty(gval(n)))  /* entry is empty? */
       clearkey(n);  /* clear its key */
     else {
@@ -639,138 +1546,686 @@ static l_mem traverseudata (global_State *g, Udata *u) {
 
 
 /*
-** Traverse a prototype. (While a prototype is being build, its
-** arrays can be larger than needed; the extra slots are filled with
-** NULL, so the use of 'markobjectN')
+** Traverse a prototype. (While a prototype is being build, its
+** arrays can be larger than needed; the extra slots are filled with
+** NULL, so the use of 'markobjectN')
+*/
+static l_mem traverseproto (global_State *g, Proto *f) {
+  int i;
+  markobjectN(g, f->source);
+  for (i = 0; i < f->sizek; i++)  /* mark literals */
+    markvalue(g, &f->k[i]);
+  for (i = 0; i < f->sizeupvalues; i++)  /* mark upvalue names */
+    markobjectN(g, f->upvalues[i].name);
+  for (i = 0; i < f->sizep; i++)  /* mark nested protos */
+    markobjectN(g, f->p[i]);
+  for (i = 0; i < f->sizelocvars; i++)  /* mark local-variable names */
+    markobjectN(g, f->locvars[i].varname);
+  return 1 + f->sizek + f->sizeupvalues + f->sizep + f->sizelocvars;
+}
+
+
+static l_mem traverseCclosure (global_State *g, CClosure *cl) {
+  int i;
+  for (i = 0; i < cl->nupvalues; i++)  /* mark its upvalues */
+    markvalue(g, &cl->upvalue[i]);
+  return 1 + cl->nupvalues;
+}
+
+/*
+** Traverse a Lua closure, marking its prototype and its upvalues.
+** (Both can be NULL while closure is being created.)
+*/
+static l_mem traverseLclosure (global_State *g, LClosure *cl) {
+  int i;
+  markobjectN(g, cl->p);  /* mark its prototype */
+  for (i = 0; i < cl->nupvalues; i++) {  /* visit its upvalues */
+    UpVal *uv = cl->upvals[i];
+    markobjectN(g, uv);  /* mark upvalue */
+  }
+  return 1 + cl->nupvalues;
+}
+
+
+/*
+** Traverse a thread, marking the elements in the stack up to its top
+** and cleaning the rest of the stack in the final traversal. That
+** ensures that the entire stack have valid (non-dead) objects.
+** Threads have no barriers. In gen. mode, old threads must be visited
+** at every cycle, because they might point to young objects.  In inc.
+** mode, the thread can still be modified before the end of the cycle,
+** and therefore it must be visited again in the atomic phase. To ensure
+** these visits, threads must return to a gray list if they are not new
+** (which can only happen in generational mode) or if the traverse is in
+** the propagate phase (which can only happen in incremental mode).
+*/
+static l_mem traversethread (global_State *g, lua_State *th) {
+  UpVal *uv;
+  StkId o = th->stack.p;
+  if (isold(th) || g->gcstate == GCSpropagate)
+    linkgclist(th, g->grayagain);  /* insert into 'grayagain' list */
+  if (o == NULL)
+    return 0;  /* stack not completely built yet */
+  lua_assert(g->gcstate == GCSatomic ||
+             th->openupval == NULL || isintwups(th));
+  for (; o < th->top.p; o++)  /* mark live elements in the stack */
+    markvalue(g, s2v(o));
+  for (uv = th->openupval; uv != NULL; uv = uv->u.open.next)
+    markobject(g, uv);  /* open upvalues cannot be collected */
+  if (g->gcstate == GCSatomic) {  /* final traversal? */
+    if (!g->gcemergency) {  /* do not change stack in emergency cycle */
+      if (leanstacks(g))
+        luaD_trimstack(th);
+      else
+        luaD_shrinkstack(th);
+    }
+    for (o = th->top.p; o < th->stack_last.p + EXTRA_STACK; o++)
+      setnilvalue(s2v(o));  /* clear dead stack slice */
+    /* 'remarkupvals' may have removed thread from 'twups' list */
+    if (!isintwups(th) && th->openupval != NULL) {
+      th->twups = g->twups;  /* link it back to the list */
+      g->twups = th;
+    }
+  }
+  return 1 + (th->top.p - th->stack.p);
+}
+
+
+/*
+** Traverse a (now black) object. Return an estimate of the number of
+** slots traversed.
+*/
+static l_mem traverseobj (global_State *g, GCObject *o) {
+  switch (o->tt) {
+    case LUA_VTABLE: return traversetable(g, gco2t(o));
+    case LUA_VUSERDATA: return traverseudata(g, gco2u(o));
+    case LUA_VLCL: return traverseLclosure(g, gco2lcl(o));
+    case LUA_VCCL: return traverseCclosure(g, gco2ccl(o));
+    case LUA_VPROTO: return traverseproto(g, gco2p(o));
+    case LUA_VTHREAD: return traversethread(g, gco2th(o));
+    default: lua_assert(0); return 0;
+  }
+}
+
+
+/*
+** traverse one gray object, turning it to black. Return an estimate
+** of the number of slots traversed.
+*/
+static l_mem propagatemark (global_State *g) {
+  GCObject *o = popgray(g);
+  nw2black(o);
+  return traverseobj(g, o);
+}
+
+
+/*
+** Traverse all gray objects. With parallel marking, start serially
+** and call the helpers only when there is enough work to share.
+*/
+static void propagateall (global_State *g) {
+#if defined(LUA_USE_PARALLELMARK)
+  int n = 0;  /* number of objects traversed serially */
+  while (hasgray(g)) {
+    if (n < PMSERIAL) {
+      propagatemark(g);
+      n++;
+    }
+    else if (parallelmark(g))
+      n = 0;  /* deferred objects may have refilled the gray list */
+    else {
+      while (hasgray(g))
+        propagatemark(g);
+    }
+  }
+#else
+  while (hasgray(g))
+    propagatemark(g);
+#endif
+}
+
+
+/*
+** Propagate marks from keys to values in all ephemeron tables. Each
+** table is traversed once, with its white-white entries going to the
+** side table in 'g->ephpending'; after that, marking a key releases its
+** values (see 'ephrelease'), which are marked when there are no more
+** gray objects. (Propagation here is serial, as parallel markers do
+** not go through 'reallymarkobject'.) Tables reached in this process
+** are traversed with the side table active, too. If some entry could
+** not be recorded, traverse all ephemeron tables until convergence,
+** that is, until nothing new is marked. 'dir' inverts the direction of
+** the traversals, trying to speed up convergence on chains in the same
+** table.
+*/
+static void convergeephemerons (global_State *g) {
+  EphPending ep;
+  GCObject *w = g->ephemeron;  /* get ephemeron list */
+  int changed;
+  int dir = 0;
+  ep.keys = NULL; ep.values = NULL;
+  ep.sizekeys = ep.nkeys = ep.sizevalues = ep.nvalues = 0;
+  ep.work = -1;
+  ep.failed = 0;
+  g->ephpending = &ep;
+  g->ephemeron = NULL;  /* tables may return to this list when traversed */
+  while (w != NULL) {  /* record pending entries of all tables */
+    Table *h = gco2t(w);
+    w = h->gclist;
+    nw2black(h);  /* out of the list (for now) */
+    traverseephemeron(g, h, 0);
+  }
+  for (;;) {
+    while (hasgray(g))
+      propagatemark(g);
+    if (ep.work < 0)  /* no more released values? */
+      break;
+    else {
+      EphValue *v = &ep.values[ep.work];
+      ep.work = v->next;
+      markobject(g, v->value);
+    }
+  }
+  g->ephpending = NULL;
+  ephfree(g, &ep);
+  if (!ep.failed)
+    return;  /* all entries were handled */
+  do {
+    GCObject *next = g->ephemeron;  /* get ephemeron list */
+    g->ephemeron = NULL;  /* tables may return to this list when traversed */
+    changed = 0;
+    while ((w = next) != NULL) {  /* for each ephemeron table */
+      Table *h = gco2t(w);
+      next = h->gclist;  /* list is rebuilt during loop */
+      nw2black(h);  /* out of the list (for now) */
+      if (traverseephemeron(g, h, dir)) {  /* marked some value? */
+        propagateall(g);  /* propagate changes */
+        changed = 1;  /* will have to revisit all ephemeron tables */
+      }
+    }
+    dir = !dir;  /* invert direction next time */
+  } while (changed);  /* repeat until no more changes */
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Background freeing
+** =======================================================
+*/
+
+#if defined(LUA_USE_SWEEPTHREAD)
+
+/*
+** When enabled (see option 'LUA_GCPSWEEPTHREAD') and the allocator is
+** declared thread safe (see 'luaC_setallocsafe'), the sweep functions
+** still unlink dead objects from their lists, but hand most of them to
+** a background thread that releases their memory. Everything that
+** touches live structures (removing short strings from the string
+** table, unlinking open upvalues, freeing threads) is still done by
+** the mutator, so that thread sees only unreachable objects and the
+** allocator. It frees them through a private 'global_State' that
+** shares the allocator but keeps its own (ignored) debt. The mutator
+** credits the size of each object to the debt when it hands the object
+** over, as 'freeobj' would do, so the pace of the collector does not
+** depend on when the thread runs. Full collections wait for the thread,
+** so that they return with all memory really freed.
+*/
+
+
+/* number of objects collected by the mutator before a hand-off */
+#define SWEEPBATCH	512
+
+
+typedef struct GCSweeper {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t work;  /* signals new objects to free or exit */
+  pthread_cond_t idle;  /* signals that the thread has nothing to do */
+  GCObject *queue;  /* objects handed to the thread */
+  GCObject *batch;  /* objects still being collected by the mutator */
+  GCObject *lastbatch;  /* last object in 'batch' */
+  int nbatch;  /* number of objects in 'batch' */
+  int busy;  /* true while the thread is freeing objects */
+  int quit;  /* true when the thread must exit */
+  global_State fg;  /* state used by the thread to free objects */
+} GCSweeper;
+
+
+/*
+** Objects that only own memory can be freed by the thread. (External
+** strings call their own deallocation function, which need not be
+** thread safe.)
+*/
+static int canfreelater (GCObject *o) {
+  switch (o->tt) {
+    case LUA_VTABLE: case LUA_VLCL: case LUA_VCCL:
+    case LUA_VPROTO: case LUA_VUSERDATA: case LUA_VSHRSTR:
+      return 1;
+    case LUA_VLNGSTR:
+      return (gco2ts(o)->shrlen != LSTRMEM);
+    default:  /* threads and upvalues */
+      return 0;
+  }
+}
+
+
+static void *sweeperthread (void *ud) {
+  GCSweeper *sw = cast(GCSweeper *, ud);
+  lua_State *L = mainthread(&sw->fg);
+  pthread_mutex_lock(&sw->lock);
+  for (;;) {
+    GCObject *o;
+    while (sw->queue == NULL && !sw->quit)
+      pthread_cond_wait(&sw->work, &sw->lock);
+    if (sw->queue == NULL)  /* nothing left and must quit? */
+      break;
+    o = sw->queue;
+    sw->queue = NULL;
+    sw->busy = 1;
+    pthread_mutex_unlock(&sw->lock);
+    while (o != NULL) {
+      GCObject *next = o->next;
+      if (o->tt == LUA_VSHRSTR)  /* already out of the string table */
+        luaM_freeobject(L, o, sizestrshr(cast_uint(gco2ts(o)->shrlen)),
+                        LUA_TSTRING);
+      else
+        freeobj(L, o);
+      o = next;
+    }
+    sw->fg.GCdebt = 0;  /* already accounted by the mutator */
+    pthread_mutex_lock(&sw->lock);
+    sw->busy = 0;
+    if (sw->queue == NULL)
+      pthread_cond_broadcast(&sw->idle);
+  }
+  pthread_mutex_unlock(&sw->lock);
+  return NULL;
+}
+
+
+/*
+** Hand the current batch to the thread.
+*/
+static void flushsweeper (global_State *g) {
+  GCSweeper *sw = g->sweeper;
+  if (sw != NULL && sw->batch != NULL) {
+    pthread_mutex_lock(&sw->lock);
+    sw->lastbatch->next = sw->queue;
+    sw->queue = sw->batch;
+    pthread_cond_signal(&sw->work);
+    pthread_mutex_unlock(&sw->lock);
+    sw->batch = sw->lastbatch = NULL;
+    sw->nbatch = 0;
+  }
+}
+
+
+/*
+** Wait until the thread has freed everything handed to it.
+*/
+static void waitsweeper (global_State *g) {
+  GCSweeper *sw = g->sweeper;
+  if (sw != NULL) {
+    flushsweeper(g);
+    pthread_mutex_lock(&sw->lock);
+    while (sw->queue != NULL || sw->busy)
+      pthread_cond_wait(&sw->idle, &sw->lock);
+    pthread_mutex_unlock(&sw->lock);
+  }
+}
+
+
+static void stopsweeper (global_State *g) {
+  GCSweeper *sw = g->sweeper;
+  if (sw != NULL) {
+    waitsweeper(g);
+    pthread_mutex_lock(&sw->lock);
+    sw->quit = 1;
+    pthread_cond_signal(&sw->work);
+    pthread_mutex_unlock(&sw->lock);
+    pthread_join(sw->thread, NULL);
+    pthread_cond_destroy(&sw->idle);
+    pthread_cond_destroy(&sw->work);
+    pthread_mutex_destroy(&sw->lock);
+    g->sweeper = NULL;
+    luaM_free(mainthread(g), sw);
+  }
+}
+
+
+static void startsweeper (global_State *g) {
+  GCSweeper *sw = cast(GCSweeper *,
+                  luaM_realloc_(mainthread(g), NULL, 0, sizeof(GCSweeper)));
+  if (sw == NULL)
+    return;  /* not enough memory; free objects directly */
+  pthread_mutex_init(&sw->lock, NULL);
+  pthread_cond_init(&sw->work, NULL);
+  pthread_cond_init(&sw->idle, NULL);
+  sw->queue = sw->batch = sw->lastbatch = NULL;
+  sw->nbatch = 0;
+  sw->busy = sw->quit = 0;
+  sw->fg.frealloc = g->frealloc;
+  sw->fg.ud = g->ud;
+  sw->fg.GCtotalbytes = sw->fg.GCdebt = 0;
+  sw->fg.allocleft = MAX_LMEM;
+  sw->fg.allocprof = NULL;
+  sw->fg.allocfilter = NULL;
+  mainthread(&sw->fg)->l_G = &sw->fg;
+  if (startgcthread(&sw->thread, sweeperthread, sw))
+    g->sweeper = sw;
+  else {
+    pthread_cond_destroy(&sw->idle);
+    pthread_cond_destroy(&sw->work);
+    pthread_mutex_destroy(&sw->lock);
+    luaM_free(mainthread(g), sw);
+  }
+}
+
+
+/*
+** Start or stop the thread according to the current parameter and
+** allocator; called before each sweep.
+*/
+static void checksweeper (global_State *g) {
+  int on = (applygcparam(g, SWEEPTHREAD, 100) != 0 && g->allocsafe);
+  if (!on)
+    stopsweeper(g);
+  else if (g->sweeper == NULL && !g->gcemergency)
+    startsweeper(g);
+}
+
+
+/*
+** Free a dead object already removed from its list, maybe in the
+** background. (While there is an allocation profile, objects are freed
+** here, so that the profile sees their blocks go.)
+*/
+static void sweepfree (lua_State *L, GCObject *o) {
+  global_State *g = G(L);
+  GCSweeper *sw = g->sweeper;
+  if (o->tt == LUA_VTHREAD && luaE_poolthread(L, gco2th(o)))
+    return;  /* kept for reuse */
+  bdfree(L, o);
+  if (sw == NULL || g->gcemergency || g->allocprof != NULL ||
+      !canfreelater(o))
+    freeobj(L, o);
+  else {
+    g->GCdebt += objsize(o);  /* account it as freed */
+    if (o->tt == LUA_VSHRSTR)
+      luaS_remove(L, gco2ts(o));  /* string table belongs to the mutator */
+    o->next = sw->batch;
+    if (sw->batch == NULL)
+      sw->lastbatch = o;
+    sw->batch = o;
+    if (++sw->nbatch == SWEEPBATCH)
+      flushsweeper(g);
+  }
+}
+
+
+void luaC_setallocsafe (lua_State *L, int safe) {
+  global_State *g = G(L);
+  if (!safe)
+    stopsweeper(g);  /* thread cannot use the allocator anymore */
+  g->allocsafe = cast_byte(safe != 0);
+}
+
+#else
+
+#define flushsweeper(g)		((void)0)
+#define waitsweeper(g)		((void)0)
+#define stopsweeper(g)		((void)0)
+#define checksweeper(g)		((void)0)
+
+static void sweepfree (lua_State *L, GCObject *o) {
+  if (o->tt == LUA_VTHREAD && luaE_poolthread(L, gco2th(o)))
+    return;  /* kept for reuse */
+  bdfree(L, o);
+  freeobj(L, o);
+}
+
+void luaC_setallocsafe (lua_State *L, int safe) {
+  G(L)->allocsafe = cast_byte(safe != 0);
+}
+
+#endif
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Telemetry
+** =======================================================
+*/
+
+/*
+** Monotonic clock for timing the collector, in microseconds. Only
+** differences between readings are used, so it can wrap around.
+*/
+#if !defined(luai_gcclock)
+
+#include <time.h>
+
+#if defined(LUA_USE_POSIX) && defined(CLOCK_MONOTONIC)
+
+static lua_Unsigned luai_gcclock (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return cast(lua_Unsigned, ts.tv_sec) * 1000000u +
+         cast(lua_Unsigned, ts.tv_nsec / 1000);
+}
+
+#else		/* ISO C only has processor time */
+
+#define luai_gcclock()  \
+	(cast(lua_Unsigned, clock()) * 1000000u / CLOCKS_PER_SEC)
+
+#endif
+
+#endif
+
+
+/*
+** Bin of a time distribution where a duration of 'd' microseconds
+** falls: bin 'i' holds durations in [2^(i-1), 2^i).
+*/
+static unsigned int timebin (lua_Unsigned d) {
+  if (d >= (1u << (LUA_GCPAUSEBINS - 2)))
+    return LUA_GCPAUSEBINS - 1;  /* last bin takes all long durations */
+  else
+    return cast_uint(luaO_ceillog2(cast_uint(d) + 1));
+}
+
+
+/*
+** Telemetry records each phase of an incremental cycle, and each
+** minor or major collection in generational mode, as an event. Phases
+** are detected lazily: after each single step, and when the collector
+** returns to the program, the collector state is compared with the
+** event being recorded. Collections in generational mode do not run
+** single steps, so they open and close their events explicitly.
+** The 'busy' time of an event counts only the time inside the
+** collector; its 'freed' bytes are the decrease in the total while the
+** collector was working, not counting what finalizers allocated.
+** When telemetry is off, 'g->telemetry' is NULL and each hook costs a
+** single test.
 */
-static l_mem traverseproto (global_State *g, Proto *f) {
-  int i;
-  markobjectN(g, f->source);
-  for (i = 0; i < f->sizek; i++)  /* mark literals */
-    markvalue(g, &f->k[i]);
-  for (i = 0; i < f->sizeupvalues; i++)  /* mark upvalue names */
-    markobjectN(g, f->upvalues[i].name);
-  for (i = 0; i < f->sizep; i++)  /* mark nested protos */
-    markobjectN(g, f->p[i]);
-  for (i = 0; i < f->sizelocvars; i++)  /* mark local-variable names */
-    markobjectN(g, f->locvars[i].varname);
-  return 1 + f->sizek + f->sizeupvalues + f->sizep + f->sizelocvars;
+
+typedef struct GCTelemetry {
+  lua_GCEventFunction f;  /* function to receive events (may be NULL) */
+  void *ud;  /* auxiliary data to 'f' */
+  lua_GCEvent ev;  /* event being recorded ('ev.what' < 0 if none) */
+  lua_Unsigned resumed;  /* clock when the collector last resumed */
+  l_mem marked;  /* 'GCmarked' when last added to the event */
+  l_mem total;  /* total bytes when the collector last resumed */
+  l_mem freed;  /* bytes freed so far in the event */
+  int depth;  /* nesting of collector entries */
+  lua_GCPhaseStats stats[LUA_GCEVN];
+} GCTelemetry;
+
+
+#define telenter(g)	{ if (l_unlikely((g)->telemetry)) telenter_(g); }
+#define telleave(g)	{ if (l_unlikely((g)->telemetry)) telleave_(g); }
+#define telstep(g)	{ if (l_unlikely((g)->telemetry)) telstep_(g); }
+#define telswitch(g,w)	{ if (l_unlikely((g)->telemetry)) telswitch_(g,w); }
+#define telswept(g,n)  \
+	{ if (l_unlikely((g)->telemetry)) (g)->telemetry->ev.swept += l_castS2U(n); }
+
+
+/* event for each collector state ('GCSpause' has none) */
+static const int stateevent[] = {
+  LUA_GCEVPROPAGATE, LUA_GCEVATOMIC, LUA_GCEVATOMIC, LUA_GCEVSWPALLGC,
+  LUA_GCEVSWPFINOBJ, LUA_GCEVSWPTOBEFNZ, LUA_GCEVSWPEND, LUA_GCEVCALLFIN,
+  -1
+};
+
+
+static void telresume (global_State *g, GCTelemetry *tel, lua_Unsigned now) {
+  tel->resumed = now;
+  tel->total = gettotalbytes(g);
 }
 
 
-static l_mem traverseCclosure (global_State *g, CClosure *cl) {
-  int i;
-  for (i = 0; i < cl->nupvalues; i++)  /* mark its upvalues */
-    markvalue(g, &cl->upvalue[i]);
-  return 1 + cl->nupvalues;
+static void telsuspend (global_State *g, GCTelemetry *tel,
+                        lua_Unsigned now) {
+  tel->ev.busy += now - tel->resumed;
+  tel->freed += tel->total - gettotalbytes(g);
 }
 
+
 /*
-** Traverse a Lua closure, marking its prototype and its upvalues.
-** (Both can be NULL while closure is being created.)
+** Closes the event being recorded, if any, and opens an event 'what'
+** (none if negative).
 */
-static l_mem traverseLclosure (global_State *g, LClosure *cl) {
-  int i;
-  markobjectN(g, cl->p);  /* mark its prototype */
-  for (i = 0; i < cl->nupvalues; i++) {  /* visit its upvalues */
-    UpVal *uv = cl->upvals[i];
-    markobjectN(g, uv);  /* mark upvalue */
+static void telswitch_ (global_State *g, int what) {
+  GCTelemetry *tel = g->telemetry;
+  lua_GCEvent *ev = &tel->ev;
+  lua_Unsigned now = luai_gcclock();
+  if (tel->depth > 0)  /* inside the collector? */
+    telsuspend(g, tel, now);
+  if (ev->what >= 0) {
+    lua_GCPhaseStats *s = &tel->stats[ev->what];
+    ev->span = now - ev->start;
+    telmarked(g, g->GCmarked);  /* add marked bytes */
+    ev->freed = (tel->freed > 0) ? l_castS2U(tel->freed) : 0;
+    s->count++;
+    s->total += ev->busy;
+    if (ev->busy > s->max)
+      s->max = ev->busy;
+    s->marked += ev->marked;
+    s->swept += ev->swept;
+    s->freed += ev->freed;
+    s->finalized += ev->finalized;
+    s->bins[timebin(ev->busy)]++;
+    if (tel->f)
+      tel->f(tel->ud, ev);
   }
-  return 1 + cl->nupvalues;
+  memset(ev, 0, sizeof(*ev));
+  ev->what = what;
+  ev->start = now;
+  tel->marked = g->GCmarked;
+  tel->freed = 0;
+  if (tel->depth > 0)
+    telresume(g, tel, now);
 }
 
 
 /*
-** Traverse a thread, marking the elements in the stack up to its top
-** and cleaning the rest of the stack in the final traversal. That
-** ensures that the entire stack have valid (non-dead) objects.
-** Threads have no barriers. In gen. mode, old threads must be visited
-** at every cycle, because they might point to young objects.  In inc.
-** mode, the thread can still be modified before the end of the cycle,
-** and therefore it must be visited again in the atomic phase. To ensure
-** these visits, threads must return to a gray list if they are not new
-** (which can only happen in generational mode) or if the traverse is in
-** the propagate phase (which can only happen in incremental mode).
+** Adds the bytes marked since the last call to the current event and
+** sets 'GCmarked' to 'v'.
 */
-static l_mem traversethread (global_State *g, lua_State *th) {
-  UpVal *uv;
-  StkId o = th->stack.p;
-  if (isold(th) || g->gcstate == GCSpropagate)
-    linkgclist(th, g->grayagain);  /* insert into 'grayagain' list */
-  if (o == NULL)
-    return 0;  /* stack not completely built yet */
-  lua_assert(g->gcstate == GCSatomic ||
-             th->openupval == NULL || isintwups(th));
-  for (; o < th->top.p; o++)  /* mark live elements in the stack */
-    markvalue(g, s2v(o));
-  for (uv = th->openupval; uv != NULL; uv = uv->u.open.next)
-    markobject(g, uv);  /* open upvalues cannot be collected */
-  if (g->gcstate == GCSatomic) {  /* final traversal? */
-    if (!g->gcemergency)
-      luaD_shrinkstack(th); /* do not change stack in emergency cycle */
-    for (o = th->top.p; o < th->stack_last.p + EXTRA_STACK; o++)
-      setnilvalue(s2v(o));  /* clear dead stack slice */
-    /* 'remarkupvals' may have removed thread from 'twups' list */
-    if (!isintwups(th) && th->openupval != NULL) {
-      th->twups = g->twups;  /* link it back to the list */
-      g->twups = th;
-    }
+static void telmarked (global_State *g, l_mem v) {
+  GCTelemetry *tel = g->telemetry;
+  if (g->GCmarked > tel->marked)
+    tel->ev.marked += l_castS2U(g->GCmarked - tel->marked);
+  g->GCmarked = tel->marked = v;
+}
+
+
+/*
+** Checks whether the collector entered a new phase. (Events for whole
+** collections are closed only explicitly.)
+*/
+static void telstep_ (global_State *g) {
+  GCTelemetry *tel = g->telemetry;
+  if (tel->ev.what < LUA_GCEVMINOR) {
+    int what = (g->gckind == KGC_GENMINOR) ? -1 : stateevent[g->gcstate];
+    if (what != tel->ev.what)
+      telswitch_(g, what);
   }
-  return 1 + (th->top.p - th->stack.p);
+}
+
+
+static void telenter_ (global_State *g) {
+  GCTelemetry *tel = g->telemetry;
+  if (tel->depth++ == 0)
+    telresume(g, tel, luai_gcclock());
+}
+
+
+static void telleave_ (global_State *g) {
+  GCTelemetry *tel = g->telemetry;
+  if (tel->depth == 1)  /* leaving the collector? */
+    telstep_(g);  /* state may have changed outside single steps */
+  if (tel->depth > 0 && --tel->depth == 0)
+    telsuspend(g, tel, luai_gcclock());
 }
 
 
 /*
-** traverse one gray object, turning it to black. Return an estimate
-** of the number of slots traversed.
+** A finalizer ran; 'before' was the total number of bytes before it.
 */
-static l_mem propagatemark (global_State *g) {
-  GCObject *o = g->gray;
-  nw2black(o);
-  g->gray = *getgclist(o);  /* remove from 'gray' list */
-  switch (o->tt) {
-    case LUA_VTABLE: return traversetable(g, gco2t(o));
-    case LUA_VUSERDATA: return traverseudata(g, gco2u(o));
-    case LUA_VLCL: return traverseLclosure(g, gco2lcl(o));
-    case LUA_VCCL: return traverseCclosure(g, gco2ccl(o));
-    case LUA_VPROTO: return traverseproto(g, gco2p(o));
-    case LUA_VTHREAD: return traversethread(g, gco2th(o));
-    default: lua_assert(0); return 0;
+static void telfinalizer (global_State *g, l_mem before) {
+  GCTelemetry *tel = g->telemetry;
+  tel->ev.finalized++;
+  if (tel->depth > 0)  /* do not count what it allocated as not freed */
+    tel->total += gettotalbytes(g) - before;
+}
+
+
+void luaC_settelemetry (lua_State *L, int on) {
+  global_State *g = G(L);
+  if (on && g->telemetry == NULL) {
+    GCTelemetry *tel = luaM_new(L, GCTelemetry);
+    memset(tel, 0, sizeof(*tel));
+    tel->ev.what = -1;  /* no event yet */
+    g->telemetry = tel;
+  }
+  else if (!on && g->telemetry != NULL) {
+    luaM_free(L, g->telemetry);
+    g->telemetry = NULL;
   }
 }
 
 
-static void propagateall (global_State *g) {
-  while (g->gray)
-    propagatemark(g);
+void luaC_setgcevents (lua_State *L, lua_GCEventFunction f, void *ud) {
+  global_State *g = G(L);
+  if (f != NULL)
+    luaC_settelemetry(L, 1);
+  if (g->telemetry != NULL) {
+    g->telemetry->f = f;
+    g->telemetry->ud = ud;
+  }
 }
 
 
 /*
-** Traverse all ephemeron tables propagating marks from keys to values.
-** Repeat until it converges, that is, nothing new is marked. 'dir'
-** inverts the direction of the traversals, trying to speed up
-** convergence on chains in the same table.
+** Copies the statistics to 's' (if not NULL) and clears them if
+** 'reset'. Returns false if telemetry is off.
 */
-static void convergeephemerons (global_State *g) {
-  int changed;
-  int dir = 0;
-  do {
-    GCObject *w;
-    GCObject *next = g->ephemeron;  /* get ephemeron list */
-    g->ephemeron = NULL;  /* tables may return to this list when traversed */
-    changed = 0;
-    while ((w = next) != NULL) {  /* for each ephemeron table */
-      Table *h = gco2t(w);
-      next = h->gclist;  /* list is rebuilt during loop */
-      nw2black(h);  /* out of the list (for now) */
-      if (traverseephemeron(g, h, dir)) {  /* marked some value? */
-        propagateall(g);  /* propagate changes */
-        changed = 1;  /* will have to revisit all ephemeron tables */
-      }
-    }
-    dir = !dir;  /* invert direction next time */
-  } while (changed);  /* repeat until no more changes */
+int luaC_getgcstats (lua_State *L, lua_GCPhaseStats *s, int reset) {
+  GCTelemetry *tel = G(L)->telemetry;
+  if (tel == NULL)
+    return 0;
+  if (s != NULL)
+    memcpy(s, tel->stats, sizeof(tel->stats));
+  if (reset)
+    memset(tel->stats, 0, sizeof(tel->stats));
+  return 1;
 }
 
 /* }====================================================== */
@@ -829,7 +2284,7 @@ static void clearbyvalues (global_State *g, GCObject *l, GCObject *f) {
 static void freeupval (lua_State *L, UpVal *uv) {
   if (upisopen(uv))
     luaF_unlinkupval(uv);
-  luaM_free(L, uv);
+  luaM_freeobject(L, uv, sizeof(UpVal), LUA_TUPVAL);
 }
 
 
@@ -844,12 +2299,12 @@ static void freeobj (lua_State *L, GCObject *o) {
       break;
     case LUA_VLCL: {
       LClosure *cl = gco2lcl(o);
-      luaM_freemem(L, cl, sizeLclosure(cl->nupvalues));
+      luaM_freeobject(L, cl, sizeLclosure(cl->nupvalues), LUA_TFUNCTION);
       break;
     }
     case LUA_VCCL: {
       CClosure *cl = gco2ccl(o);
-      luaM_freemem(L, cl, sizeCclosure(cl->nupvalues));
+      luaM_freeobject(L, cl, sizeCclosure(cl->nupvalues), LUA_TFUNCTION);
       break;
     }
     case LUA_VTABLE:
@@ -860,20 +2315,23 @@ static void freeobj (lua_State *L, GCObject *o) {
       break;
     case LUA_VUSERDATA: {
       Udata *u = gco2u(o);
-      luaM_freemem(L, o, sizeudata(u->nuvalue, u->len));
+      luaM_freeobject(L, o, sizeudata(u->nuvalue, u->len), LUA_TUSERDATA);
       break;
     }
     case LUA_VSHRSTR: {
       TString *ts = gco2ts(o);
       luaS_remove(L, ts);  /* remove it from hash table */
-      luaM_freemem(L, ts, sizestrshr(cast_uint(ts->shrlen)));
+      luaM_freeobject(L, ts, sizestrshr(cast_uint(ts->shrlen)), LUA_TSTRING);
       break;
     }
     case LUA_VLNGSTR: {
       TString *ts = gco2ts(o);
-      if (ts->shrlen == LSTRMEM)  /* must free external string? */
+      if (ts->shrlen == LSTRMEM) {  /* must free external string? */
         (*ts->falloc)(ts->ud, ts->contents, ts->u.lnglen + 1, 0);
-      luaM_freemem(L, ts, luaS_sizelngstr(ts->u.lnglen, ts->shrlen));
+        G(L)->nextstr--;
+      }
+      luaM_freeobject(L, ts, luaS_sizelngstr(ts->u.lnglen, ts->shrlen),
+                      LUA_TSTRING);
       break;
     }
     default: lua_assert(0);
@@ -893,18 +2351,20 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, l_mem countin) {
   global_State *g = G(L);
   int ow = otherwhite(g);
   int white = luaC_white(g);  /* current white */
-  while (*p != NULL && countin-- > 0) {
+  l_mem i;
+  for (i = 0; *p != NULL && i < countin; i++) {
     GCObject *curr = *p;
-    int marked = curr->marked;
+    int marked = gcbits(curr);
     if (isdeadm(ow, marked)) {  /* is 'curr' dead? */
       *p = curr->next;  /* remove 'curr' from list */
-      freeobj(L, curr);  /* erase 'curr' */
+      sweepfree(L, curr);  /* erase 'curr' */
     }
     else {  /* change mark to 'white' and age to 'new' */
-      curr->marked = cast_byte((marked & ~maskgcbits) | white | G_NEW);
+      gcbits(curr) = cast_byte((marked & ~maskgcbits) | white | G_NEW);
       p = &curr->next;  /* go to next element */
     }
   }
+  telswept(g, i);
   return (*p == NULL) ? NULL : p;
 }
 
@@ -937,9 +2397,18 @@ static void checkSizes (lua_State *L, global_State *g) {
     if (g->strt.nuse < g->strt.size / 4)  /* string table too big? */
       luaS_resize(L, g->strt.size / 2);
   }
+#if defined(LUA_USE_SIDEMARKS)
+  luaM_trimheap(L);
+#endif
+  shrinkgraystack(g);
+  (*g->frealloc)(g->ud, NULL, LUA_ALLOCIDLE, 0);  /* hint allocator */
 }
 
 
+/* true when finalizers wait for 'luaC_runfinalizers' */
+#define deferfin(g)	((g)->gcparams[LUA_GCPDEFERFIN] != 0)
+
+
 /*
 ** Get the next udata to be finalized from the 'tobefnz' list, and
 ** link it back into the 'allgc' list.
@@ -950,7 +2419,7 @@ static GCObject *udata2finalize (global_State *g) {
   g->tobefnz = o->next;  /* remove it from 'tobefnz' list */
   o->next = g->allgc;  /* return it to 'allgc' list */
   g->allgc = o;
-  resetbit(o->marked, FINALIZEDBIT);  /* object is "normal" again */
+  resetbit(gcbits(o), FINALIZEDBIT);  /* object is "normal" again */
   if (issweepphase(g))
     makewhite(g, o);  /* "sweep" object */
   else if (getage(o) == G_OLD1)
@@ -976,6 +2445,7 @@ static void GCTM (lua_State *L) {
     TStatus status;
     lu_byte oldah = L->allowhook;
     lu_byte oldgcstp  = g->gcstp;
+    l_mem before = gettotalbytes(g);
     g->gcstp |= GCSTPGC;  /* avoid GC steps */
     L->allowhook = 0;  /* stop debug hooks during GC metamethod */
     setobj2s(L, L->top.p++, tm);  /* push finalizer... */
@@ -989,103 +2459,391 @@ static void GCTM (lua_State *L) {
       luaE_warnerror(L, "__gc");
       L->top.p--;  /* pops error object */
     }
+    if (g->telemetry)
+      telfinalizer(g, before);
+  }
+}
+
+
+/*
+** call all pending finalizers
+*/
+static void callallpendingfinalizers (lua_State *L) {
+  global_State *g = G(L);
+  while (g->tobefnz)
+    GCTM(L);
+}
+
+
+/*
+** find last 'next' field in list 'p' list (to add elements in its end)
+*/
+static GCObject **findlast (GCObject **p) {
+  while (*p != NULL)
+    p = &(*p)->next;
+  return p;
+}
+
+
+/*
+** Move all unreachable objects (or 'all' objects) that need
+** finalization from list 'finobj' to list 'tobefnz' (to be finalized).
+** (Note that objects after 'finobjold1' cannot be white, so they
+** don't need to be traversed. In incremental mode, 'finobjold1' is NULL,
+** so the whole list is traversed.)
+*/
+static void separatetobefnz (global_State *g, int all) {
+  GCObject *curr;
+  GCObject **p = &g->finobj;
+  GCObject **lastnext = findlast(&g->tobefnz);
+  while ((curr = *p) != g->finobjold1) {  /* traverse all finalizable objects */
+    lua_assert(tofinalize(curr));
+    if (!(iswhite(curr) || all))  /* not being collected? */
+      p = &curr->next;  /* don't bother with it */
+    else {
+      if (curr == g->finobjsur)  /* removing 'finobjsur'? */
+        g->finobjsur = curr->next;  /* correct it */
+      *p = curr->next;  /* remove 'curr' from 'finobj' list */
+      curr->next = *lastnext;  /* link at the end of 'tobefnz' list */
+      *lastnext = curr;
+      lastnext = &curr->next;
+    }
+  }
+}
+
+
+/*
+** If pointer 'p' points to 'o', move it to the next element.
+*/
+static void checkpointer (GCObject **p, GCObject *o) {
+  if (o == *p)
+    *p = o->next;
+}
+
+
+/*
+** Correct pointers to objects inside 'allgc' list when
+** object 'o' is being removed from the list.
+*/
+static void correctpointers (global_State *g, GCObject *o) {
+  checkpointer(&g->survival, o);
+  checkpointer(&g->old1, o);
+  checkpointer(&g->reallyold, o);
+  checkpointer(&g->firstold1, o);
+}
+
+
+/*
+** if object 'o' has a finalizer, remove it from 'allgc' list (must
+** search the list to find it) and link it in 'finobj' list.
+*/
+void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
+  global_State *g = G(L);
+  if (tofinalize(o) ||                 /* obj. is already marked... */
+      gfasttm(g, mt, TM_GC) == NULL ||    /* or has no finalizer... */
+      (g->gcstp & GCSTPCLS))                   /* or closing state? */
+    return;  /* nothing to be done */
+  else {  /* move 'o' to 'finobj' list */
+    GCObject **p;
+    if (issweepphase(g)) {
+      makewhite(g, o);  /* "sweep" object 'o' */
+      if (g->sweepgc == &o->next)  /* should not remove 'sweepgc' object */
+        g->sweepgc = sweeptolive(L, g->sweepgc);  /* change 'sweepgc' */
+    }
+    else
+      correctpointers(g, o);
+    /* search for pointer pointing to 'o' */
+    for (p = &g->allgc; *p != o; p = &(*p)->next) { /* empty */ }
+    *p = o->next;  /* remove 'o' from 'allgc' list */
+    o->next = g->finobj;  /* link it in 'finobj' list */
+    g->finobj = o;
+    l_setbit(gcbits(o), FINALIZEDBIT);  /* mark it as such */
+  }
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Card Marking
+** =======================================================
+*/
+
+/*
+** A card set keeps one byte per card (a slice of 2^CARDBITS slots,
+** counting the array part first and then the hash part) of a large old
+** table. A write of a young value into the table sets the card to
+** CARDDIRTY; each minor collection traverses the non-clean cards and
+** then shifts them right. So, like a touched object, a card is visited
+** in the two collections following a write, which is enough for young
+** values to become old. Sets are kept in a hash table indexed by the
+** table address and are freed when all their cards are clean or when
+** the collector leaves minor mode, as major collections traverse whole
+** tables anyway.
+*/
+typedef struct CardSet {
+  struct CardSet *next;  /* next set in the same bucket */
+  Table *t;  /* owner of the cards */
+  unsigned int ncards;
+  lu_byte cards[1];  /* card states */
+} CardSet;
+
+
+#define CARDDIRTY	2	/* card written since last minor collection */
+
+#define tableslots(t)	((t)->asize + allocsizenode(t))
+
+#define cardsetsize(n)	(offsetof(CardSet, cards) + (n))
+
+#define cardbucket(g,t)	(point2uint(t) & ((g)->sizecardsets - 1))
+
+
+/*
+** Returns the link that points to the card set of table 't' (or to
+** the NULL at the end of its bucket, if 't' has no set).
+*/
+static CardSet **findcards (global_State *g, Table *t) {
+  CardSet **p = &g->cardsets[cardbucket(g, t)];
+  while (*p != NULL && (*p)->t != t)
+    p = &(*p)->next;
+  return p;
+}
+
+
+/*
+** Doubles the size of the hash of card sets. If that fails, chains
+** just get longer.
+*/
+static void growcardsets (lua_State *L, global_State *g) {
+  unsigned int osize = g->sizecardsets;
+  unsigned int nsize = (osize == 0) ? 8 : 2 * osize;
+  CardSet **nh = cast(CardSet **,
+                      gcrealloc(g, NULL, 0, nsize * sizeof(CardSet *)));
+  unsigned int i;
+  if (nh == NULL)
+    return;
+  for (i = 0; i < nsize; i++)
+    nh[i] = NULL;
+  for (i = 0; i < osize; i++) {  /* rehash old sets */
+    CardSet *cs = g->cardsets[i];
+    while (cs != NULL) {
+      CardSet *next = cs->next;
+      unsigned int b = point2uint(cs->t) & (nsize - 1);
+      cs->next = nh[b];
+      nh[b] = cs;
+      cs = next;
+    }
+  }
+  if (osize > 0)
+    luaM_freearray(L, g->cardsets, osize);
+  g->cardsets = nh;
+  g->sizecardsets = nsize;
+}
+
+
+/*
+** Returns the card set of table 't', creating it if needed. Returns
+** NULL if it cannot allocate a new set.
+*/
+static CardSet *getcards (lua_State *L, Table *t) {
+  global_State *g = G(L);
+  unsigned int ncards;
+  CardSet *cs;
+  CardSet **p;
+  if (hascards(t))
+    return *findcards(g, t);
+  if (g->ncardsets >= g->sizecardsets)
+    growcardsets(L, g);
+  if (g->sizecardsets == 0)
+    return NULL;
+  ncards = ((tableslots(t) - 1) >> CARDBITS) + 1;
+  cs = cast(CardSet *, gcrealloc(g, NULL, 0, cardsetsize(ncards)));
+  if (cs == NULL)
+    return NULL;
+  cs->t = t;
+  cs->ncards = ncards;
+  memset(cs->cards, 0, ncards);
+  p = &g->cardsets[cardbucket(g, t)];
+  cs->next = *p;
+  *p = cs;
+  g->ncardsets++;
+  t->flags |= BITCARDS;
+  return cs;
+}
+
+
+/*
+** Frees the card set pointed by link 'p'.
+*/
+static void freecards (lua_State *L, CardSet **p) {
+  global_State *g = G(L);
+  CardSet *cs = *p;
+  *p = cs->next;
+  cs->t->flags &= cast_byte(~BITCARDS);
+  g->ncardsets--;
+  luaM_freemem(L, cs, cardsetsize(cs->ncards));
+}
+
+
+/*
+** Back barrier for table 't', with the key of the written slot. In
+** minor mode, large old tables without weak entries get the slot's card
+** marked; everything else goes through the usual back barrier. (A
+** table that has a card set stays black, so that later writes into it
+** fire the barrier again.)
+*/
+void luaC_barriertab_ (lua_State *L, Table *t, const TValue *k) {
+  global_State *g = G(L);
+  lua_assert(isblack(t) && !isdead(g, t));
+  if (g->gckind == KGC_GENMINOR && getage(t) == G_OLD &&
+      tableslots(t) >= CARDMINSLOTS &&
+      gfasttm(g, t->metatable, TM_MODE) == NULL) {
+    unsigned slot = luaH_slotindex(t, k);
+    if (slot != ~0u) {
+      CardSet *cs = getcards(L, t);
+      if (cs != NULL) {
+        cs->cards[slot >> CARDBITS] |= CARDDIRTY;
+        return;
+      }
+    }
   }
+  luaC_barrierback_(L, obj2gco(t));
+}
+
+
+void luaC_barriertabi_ (lua_State *L, Table *t, lua_Integer i) {
+  TValue k;
+  setivalue(&k, i);
+  luaC_barriertab_(L, t, &k);
+}
+
+
+void luaC_barriertabs_ (lua_State *L, Table *t, TString *s) {
+  TValue k;
+  setsvalue(L, &k, s);
+  luaC_barriertab_(L, t, &k);
 }
 
 
 /*
-** call all pending finalizers
+** An entry of table 't' moved to position 'slot' without a barrier.
 */
-static void callallpendingfinalizers (lua_State *L) {
-  global_State *g = G(L);
-  while (g->tobefnz)
-    GCTM(L);
+void luaC_touchslot (lua_State *L, Table *t, unsigned slot) {
+  CardSet *cs = *findcards(G(L), t);
+  lua_assert(hascards(t) && slot < tableslots(t));
+  cs->cards[slot >> CARDBITS] |= CARDDIRTY;
 }
 
 
 /*
-** find last 'next' field in list 'p' list (to add elements in its end)
+** Table 't' is being resized, so its cards would lose their meaning.
+** Its pending young values are covered by a regular back barrier
+** (unless the table is already in a gray list).
 */
-static GCObject **findlast (GCObject **p) {
-  while (*p != NULL)
-    p = &(*p)->next;
-  return p;
+void luaC_dropcards (lua_State *L, Table *t) {
+  lua_assert(hascards(t));
+  if (isblack(t))
+    luaC_barrierback_(L, obj2gco(t));
+  freecards(L, findcards(G(L), t));
 }
 
 
+#if defined(LUA_DEBUG)
+
 /*
-** Move all unreachable objects (or 'all' objects) that need
-** finalization from list 'finobj' to list 'tobefnz' (to be finalized).
-** (Note that objects after 'finobjold1' cannot be white, so they
-** don't need to be traversed. In incremental mode, 'finobjold1' is NULL,
-** so the whole list is traversed.)
+** True iff slot 'slot' of table 't' is in a card that minor
+** collections will still visit. (Used by the debug checks.)
 */
-static void separatetobefnz (global_State *g, int all) {
-  GCObject *curr;
-  GCObject **p = &g->finobj;
-  GCObject **lastnext = findlast(&g->tobefnz);
-  while ((curr = *p) != g->finobjold1) {  /* traverse all finalizable objects */
-    lua_assert(tofinalize(curr));
-    if (!(iswhite(curr) || all))  /* not being collected? */
-      p = &curr->next;  /* don't bother with it */
-    else {
-      if (curr == g->finobjsur)  /* removing 'finobjsur'? */
-        g->finobjsur = curr->next;  /* correct it */
-      *p = curr->next;  /* remove 'curr' from 'finobj' list */
-      curr->next = *lastnext;  /* link at the end of 'tobefnz' list */
-      *lastnext = curr;
-      lastnext = &curr->next;
-    }
+int luaC_isdirtyslot (global_State *g, Table *t, unsigned slot) {
+  if (!hascards(t))
+    return 0;
+  else {
+    CardSet *cs = *findcards(g, t);
+    return cs->cards[slot >> CARDBITS] != 0;
   }
 }
 
+#endif
+
 
 /*
-** If pointer 'p' points to 'o', move it to the next element.
+** Mark the values (and keys) in the non-clean cards of a set and age
+** these cards. Return true iff some card is still not clean.
 */
-static void checkpointer (GCObject **p, GCObject *o) {
-  if (o == *p)
-    *p = o->next;
+static int markcardset (global_State *g, CardSet *cs) {
+  Table *h = cs->t;
+  unsigned int asize = h->asize;
+  unsigned int nslots = tableslots(h);
+  int dirty = 0;
+  unsigned int c;
+  for (c = 0; c < cs->ncards; c++) {
+    if (cs->cards[c] != 0) {
+      unsigned int i = c << CARDBITS;
+      unsigned int lim = i + (1u << CARDBITS);
+      if (lim > nslots)
+        lim = nslots;
+      for (; i < lim && i < asize; i++) {  /* slots in the array part */
+        GCObject *o = gcvalarr(h, i);
+        if (o != NULL && iswhite(o))
+          reallymarkobject(g, o);
+      }
+      for (; i < lim; i++) {  /* slots in the hash part */
+        Node *n = gnode(h, i - asize);
+        if (isempty(gval(n)))
+          clearkey(n);
+        else {
+          markkey(g, n);
+          markvalue(g, gval(n));
+        }
+      }
+      cs->cards[c] >>= 1;  /* age the card */
+      dirty |= cs->cards[c];
+    }
+  }
+  return dirty;
 }
 
 
 /*
-** Correct pointers to objects inside 'allgc' list when
-** object 'o' is being removed from the list.
+** Traverse the dirty cards of all card sets at the start of a young
+** collection. A table that became weak since its cards were created
+** goes back to the usual back barrier.
 */
-static void correctpointers (global_State *g, GCObject *o) {
-  checkpointer(&g->survival, o);
-  checkpointer(&g->old1, o);
-  checkpointer(&g->reallyold, o);
-  checkpointer(&g->firstold1, o);
+static void markcards (lua_State *L, global_State *g) {
+  unsigned int b;
+  for (b = 0; b < g->sizecardsets; b++) {
+    CardSet **p = &g->cardsets[b];
+    while (*p != NULL) {
+      Table *h = (*p)->t;
+      if (getmode(g, h) != 0) {  /* weak table? */
+        if (isblack(h))
+          luaC_barrierback_(L, obj2gco(h));
+        freecards(L, p);
+      }
+      else if (markcardset(g, *p))
+        p = &(*p)->next;
+      else  /* all cards are clean */
+        freecards(L, p);
+    }
+  }
 }
 
 
 /*
-** if object 'o' has a finalizer, remove it from 'allgc' list (must
-** search the list to find it) and link it in 'finobj' list.
+** Free all card sets (when leaving minor mode).
 */
-void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
-  global_State *g = G(L);
-  if (tofinalize(o) ||                 /* obj. is already marked... */
-      gfasttm(g, mt, TM_GC) == NULL ||    /* or has no finalizer... */
-      (g->gcstp & GCSTPCLS))                   /* or closing state? */
-    return;  /* nothing to be done */
-  else {  /* move 'o' to 'finobj' list */
-    GCObject **p;
-    if (issweepphase(g)) {
-      makewhite(g, o);  /* "sweep" object 'o' */
-      if (g->sweepgc == &o->next)  /* should not remove 'sweepgc' object */
-        g->sweepgc = sweeptolive(L, g->sweepgc);  /* change 'sweepgc' */
-    }
-    else
-      correctpointers(g, o);
-    /* search for pointer pointing to 'o' */
-    for (p = &g->allgc; *p != o; p = &(*p)->next) { /* empty */ }
-    *p = o->next;  /* remove 'o' from 'allgc' list */
-    o->next = g->finobj;  /* link it in 'finobj' list */
-    g->finobj = o;
-    l_setbit(o->marked, FINALIZEDBIT);  /* mark it as such */
+static void freeallcards (lua_State *L, global_State *g) {
+  unsigned int b;
+  for (b = 0; b < g->sizecardsets; b++) {
+    while (g->cardsets[b] != NULL)
+      freecards(L, &g->cardsets[b]);
+  }
+  lua_assert(g->ncardsets == 0);
+  if (g->sizecardsets > 0) {
+    luaM_freearray(L, g->cardsets, g->sizecardsets);
+    g->cardsets = NULL;
+    g->sizecardsets = 0;
   }
 }
 
@@ -1111,22 +2869,44 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
 ** * KGC_GENMAJOR
 **     GCmarked: number of bytes that became old since last major collection.
 **     GCmajorminor: number of bytes marked in last major collection.
+** External memory (see 'luaC_addpressure') is not in these counters;
+** it is added to them wherever they stand for the live bytes.
 */
 
 
 /*
 ** Set the "time" to wait before starting a new incremental cycle;
 ** cycle will start when number of bytes in use hits the threshold of
-** approximately (marked * pause / 100).
+** approximately ((marked + external) * pause / 100).
 */
 static void setpause (global_State *g) {
-  l_mem threshold = applygcparam(g, PAUSE, g->GCmarked);
+  l_mem threshold = applygcparam(g, PAUSE, g->GCmarked + g->GCextbytes);
   l_mem debt = threshold - gettotalbytes(g);
   if (debt < 0) debt = 0;
   luaE_setdebt(g, debt);
 }
 
 
+/*
+** Change by 'n' bytes the external memory: memory that the program
+** keeps on behalf of Lua objects outside the allocator, such as the
+** buffers of userdata. These bytes count as allocated (and freed) like
+** any block, so they bring collections forward, and as live bytes in
+** the thresholds that grow with the heap. The program cannot release
+** more than it declared, and the total cannot overflow.
+*/
+void luaC_addpressure (lua_State *L, l_mem n) {
+  global_State *g = G(L);
+  l_mem room = MAX_LMEM - gettotalbytes(g);
+  if (n > room)
+    n = room;
+  else if (n < -g->GCextbytes)
+    n = -g->GCextbytes;
+  g->GCextbytes += n;
+  g->GCdebt -= n;
+}
+
+
 /*
 ** Sweep a list of objects to enter generational mode.  Deletes dead
 ** objects and turns the non dead to old. All non-dead threads---which
@@ -1136,11 +2916,12 @@ static void setpause (global_State *g) {
 static void sweep2old (lua_State *L, GCObject **p) {
   GCObject *curr;
   global_State *g = G(L);
-  while ((curr = *p) != NULL) {
+  l_mem n = 0;
+  for (; (curr = *p) != NULL; n++) {
     if (iswhite(curr)) {  /* is 'curr' dead? */
       lua_assert(isdead(g, curr));
       *p = curr->next;  /* remove 'curr' from list */
-      freeobj(L, curr);  /* erase 'curr' */
+      sweepfree(L, curr);  /* erase 'curr' */
     }
     else {  /* all surviving objects become old */
       setage(curr, G_OLD);
@@ -1155,6 +2936,7 @@ static void sweep2old (lua_State *L, GCObject **p) {
       p = &curr->next;  /* go to next element */
     }
   }
+  telswept(g, n);
 }
 
 
@@ -1182,19 +2964,20 @@ static GCObject **sweepgen (lua_State *L, global_State *g, GCObject **p,
     G_TOUCHED2   /* from G_TOUCHED2 (do not change) */
   };
   l_mem addedold = 0;
+  l_mem n = 0;
   int white = luaC_white(g);
   GCObject *curr;
-  while ((curr = *p) != limit) {
+  for (; (curr = *p) != limit; n++) {
     if (iswhite(curr)) {  /* is 'curr' dead? */
       lua_assert(!isold(curr) && isdead(g, curr));
       *p = curr->next;  /* remove 'curr' from list */
-      freeobj(L, curr);  /* erase 'curr' */
+      sweepfree(L, curr);  /* erase 'curr' */
     }
     else {  /* correct mark and age */
       int age = getage(curr);
       if (age == G_NEW) {  /* new objects go back to white */
-        int marked = curr->marked & ~maskgcbits;  /* erase GC bits */
-        curr->marked = cast_byte(marked | G_SURVIVAL | white);
+        int marked = gcbits(curr) & ~maskgcbits;  /* erase GC bits */
+        gcbits(curr) = cast_byte(marked | G_SURVIVAL | white);
       }
       else {  /* all other objects will be old, and so keep their color */
         lua_assert(age != G_OLD1);  /* advanced in 'markold' */
@@ -1209,6 +2992,7 @@ static GCObject **sweepgen (lua_State *L, global_State *g, GCObject **p,
     }
   }
   *paddedold += addedold;
+  telswept(g, n);
   return p;
 }
 
@@ -1293,7 +3077,7 @@ static void finishgencycle (lua_State *L, global_State *g) {
   correctgraylists(g);
   checkSizes(L, g);
   g->gcstate = GCSpropagate;  /* skip restart */
-  if (!g->gcemergency)
+  if (!g->gcemergency && !deferfin(g))
     callallpendingfinalizers(L);
 }
 
@@ -1304,6 +3088,7 @@ static void finishgencycle (lua_State *L, global_State *g) {
 ** in generational mode.
 */
 static void minor2inc (lua_State *L, global_State *g, lu_byte kind) {
+  freeallcards(L, g);  /* major collections traverse whole tables */
   g->GCmajorminor = g->GCmarked;  /* number of live bytes */
   g->gckind = kind;
   g->reallyold = g->old1 = g->survival = NULL;
@@ -1321,10 +3106,13 @@ static void minor2inc (lua_State *L, global_State *g, lu_byte kind) {
 ** collection. (This number is kept in 'GCmajorminor'.)
 */
 static int checkminormajor (global_State *g) {
-  l_mem limit = applygcparam(g, MINORMAJOR, g->GCmajorminor);
+  l_mem limit = applygcparam(g, MINORMAJOR,
+                             g->GCmajorminor + g->GCextmajor);
   if (limit == 0)
     return 0;  /* special case: 'minormajor' 0 stops major collections */
-  return (g->GCmarked >= limit);
+  /* external memory kept by young objects only goes away in major
+     collections once they get old, so its growth counts as old bytes */
+  return (g->GCmarked + (g->GCextbytes - g->GCextmajor) >= limit);
 }
 
 /*
@@ -1338,14 +3126,17 @@ static void youngcollection (lua_State *L, global_State *g) {
   GCObject **psurvival;  /* to point to first non-dead survival object */
   GCObject *dummy;  /* dummy out parameter to 'sweepgen' */
   lua_assert(g->gcstate == GCSpropagate);
+  telswitch(g, LUA_GCEVMINOR);
   if (g->firstold1) {  /* are there regular OLD1 objects? */
     markold(g, g->firstold1, g->reallyold);  /* mark them */
     g->firstold1 = NULL;  /* no more OLD1 objects (for now) */
   }
   markold(g, g->finobj, g->finobjrold);
   markold(g, g->tobefnz, NULL);
+  markcards(L, g);
 
   atomic(L);  /* will lose 'g->marked' */
+  checksweeper(g);
 
   /* sweep nursery and get a pointer to its last live element */
   g->gcstate = GCSswpallgc;
@@ -1366,17 +3157,20 @@ static void youngcollection (lua_State *L, global_State *g) {
   g->finobjsur = g->finobj;  /* all news are survivals */
 
   sweepgen(L, g, &g->tobefnz, NULL, &dummy, &addedold1);
+  flushsweeper(g);
+  luaS_migrate(L, GCSWEEPMAX);  /* resize of 'strt' */
 
   /* keep total number of added old1 bytes */
-  g->GCmarked = marked + addedold1;
+  setGCmarked(g, marked + addedold1);
 
   /* decide whether to shift to major mode */
   if (checkminormajor(g)) {
     minor2inc(L, g, KGC_GENMAJOR);  /* go to major mode */
-    g->GCmarked = 0;  /* avoid pause in first major cycle (see 'setpause') */
+    setGCmarked(g, 0);  /* avoid pause in first major cycle (see 'setpause') */
   }
   else
     finishgencycle(L, g);  /* still in minor mode; finish it */
+  telswitch(g, -1);
 }
 
 
@@ -1388,6 +3182,7 @@ static void youngcollection (lua_State *L, global_State *g) {
 */
 static void atomic2gen (lua_State *L, global_State *g) {
   cleargraylists(g);
+  checksweeper(g);
   /* sweep all elements making them old */
   g->gcstate = GCSswpallgc;
   sweep2old(L, &g->allgc);
@@ -1400,10 +3195,12 @@ static void atomic2gen (lua_State *L, global_State *g) {
   g->finobjrold = g->finobjold1 = g->finobjsur = g->finobj;
 
   sweep2old(L, &g->tobefnz);
+  flushsweeper(g);
 
   g->gckind = KGC_GENMINOR;
   g->GCmajorminor = g->GCmarked;  /* "base" for number of bytes */
-  g->GCmarked = 0;  /* to count the number of added old1 bytes */
+  g->GCextmajor = g->GCextbytes;
+  setGCmarked(g, 0);  /* to count the number of added old1 bytes */
   finishgencycle(L, g);
 }
 
@@ -1415,7 +3212,8 @@ static void atomic2gen (lua_State *L, global_State *g) {
 ** after the last major collection.
 */
 static void setminordebt (global_State *g) {
-  luaE_setdebt(g, applygcparam(g, MINORMUL, g->GCmajorminor));
+  luaE_setdebt(g, applygcparam(g, MINORMUL,
+                               g->GCmajorminor + g->GCextmajor));
 }
 
 
@@ -1426,11 +3224,13 @@ static void setminordebt (global_State *g) {
 ** collection.
 */
 static void entergen (lua_State *L, global_State *g) {
+  telswitch(g, LUA_GCEVMAJOR);
   luaC_runtilstate(L, GCSpause, 1);  /* prepare to start a new cycle */
   luaC_runtilstate(L, GCSpropagate, 1);  /* start new cycle */
   atomic(L);  /* propagates all and then do the atomic stuff */
   atomic2gen(L, g);
   setminordebt(g);  /* set debt assuming next cycle will be minor */
+  telswitch(g, -1);
 }
 
 
@@ -1442,12 +3242,14 @@ void luaC_changemode (lua_State *L, int newmode) {
   if (g->gckind == KGC_GENMAJOR)  /* doing major collections? */
     g->gckind = KGC_INC;  /* already incremental but in name */
   if (newmode != g->gckind) {  /* does it need to change? */
+    telenter(g);
     if (newmode == KGC_INC)  /* entering incremental mode? */
       minor2inc(L, g, KGC_INC);  /* entering incremental mode */
     else {
       lua_assert(newmode == KGC_GENMINOR);
       entergen(L, g);
     }
+    telleave(g);
   }
 }
 
@@ -1471,9 +3273,9 @@ static void fullgen (lua_State *L, global_State *g) {
 static int checkmajorminor (lua_State *L, global_State *g) {
   if (g->gckind == KGC_GENMAJOR) {  /* generational mode? */
     l_mem numbytes = gettotalbytes(g);
-    l_mem addedbytes = numbytes - g->GCmajorminor;
+    l_mem addedbytes = numbytes - (g->GCmajorminor + g->GCextmajor);
     l_mem limit = applygcparam(g, MAJORMINOR, addedbytes);
-    l_mem tobecollected = numbytes - g->GCmarked;
+    l_mem tobecollected = numbytes - (g->GCmarked + g->GCextbytes);
     if (tobecollected > limit) {
       atomic2gen(L, g);  /* return to generational mode */
       setminordebt(g);
@@ -1481,6 +3283,7 @@ static int checkmajorminor (lua_State *L, global_State *g) {
     }
   }
   g->GCmajorminor = g->GCmarked;  /* prepare for next collection */
+  g->GCextmajor = g->GCextbytes;
   return 0;  /* stay doing incremental collections */
 }
 
@@ -1503,7 +3306,11 @@ static int checkmajorminor (lua_State *L, global_State *g) {
 */
 static void entersweep (lua_State *L) {
   global_State *g = G(L);
+  checksweeper(g);
   g->gcstate = GCSswpallgc;
+  /* a full collection can interrupt a propagation; drop pending marks */
+  g->ngraystack = g->nwindow = 0;
+  g->gray = NULL;
   lua_assert(g->sweepgc == NULL);
   g->sweepgc = sweeptolive(L, &g->allgc);
 }
@@ -1522,6 +3329,22 @@ static void deletelist (lua_State *L, GCObject *p, GCObject *limit) {
 }
 
 
+/*
+** Call the deallocators of all external strings in list 'p' (up to
+** element 'limit'), without freeing the objects themselves. Used when
+** closing a state whose allocator frees all blocks at once.
+*/
+static void freeexternals (GCObject *p, GCObject *limit) {
+  for (; p != limit; p = p->next) {
+    if (p->tt == LUA_VLNGSTR) {
+      TString *ts = gco2ts(p);
+      if (ts->shrlen == LSTRMEM)
+        (*ts->falloc)(ts->ud, ts->contents, ts->u.lnglen + 1, 0);
+    }
+  }
+}
+
+
 /*
 ** Call all finalizers of the objects in the given Lua state, and
 ** then free all objects, except for the main thread.
@@ -1529,14 +3352,29 @@ static void deletelist (lua_State *L, GCObject *p, GCObject *limit) {
 void luaC_freeallobjects (lua_State *L) {
   global_State *g = G(L);
   g->gcstp = GCSTPCLS;  /* no extra finalizers after here */
+  luaC_settelemetry(L, 0);
+  luaC_setadaptive(L, 0);
   luaC_changemode(L, KGC_INC);
   separatetobefnz(g, 1);  /* separate all objects with finalizers */
   lua_assert(g->finobj == NULL);
   callallpendingfinalizers(L);
-  deletelist(L, g->allgc, obj2gco(mainthread(g)));
-  lua_assert(g->finobj == NULL);  /* no new finalizers */
-  deletelist(L, g->fixedgc, NULL);  /* collect fixed objects */
-  lua_assert(g->strt.nuse == 0);
+  if (g->bulkfree) {  /* allocator will free all blocks at once? */
+    lua_assert(g->finobj == NULL);  /* no new finalizers */
+    if (g->nextstr > 0) {  /* external strings need their deallocators */
+      freeexternals(g->allgc, obj2gco(mainthread(g)));
+      freeexternals(g->fixedgc, NULL);
+    }
+  }
+  else {
+    deletelist(L, g->allgc, obj2gco(mainthread(g)));
+    lua_assert(g->finobj == NULL);  /* no new finalizers */
+    deletelist(L, g->fixedgc, NULL);  /* collect fixed objects */
+    lua_assert(g->strt.nuse == 0);
+  }
+  if (g->graystack != NULL)  /* state may be closed in the middle of a cycle */
+    luaM_freearray(L, g->graystack, g->sizegraystack);
+  stopmarkers(g);
+  stopsweeper(g);
 }
 
 
@@ -1576,8 +3414,9 @@ static void atomic (lua_State *L) {
   clearbyvalues(g, g->weak, origweak);
   clearbyvalues(g, g->allweak, origall);
   luaS_clearcache(g);
+  luaE_trimpool(L);  /* the pool may have become smaller */
   g->currentwhite = cast_byte(otherwhite(g));  /* flip current white */
-  lua_assert(g->gray == NULL);
+  lua_assert(!hasgray(g));
 }
 
 
@@ -1587,9 +3426,12 @@ static void atomic (lua_State *L) {
 */
 static void sweepstep (lua_State *L, global_State *g,
                        lu_byte nextstate, GCObject **nextlist, int fast) {
-  if (g->sweepgc)
+  if (g->sweepgc) {
     g->sweepgc = sweeplist(L, g->sweepgc, fast ? MAX_LMEM : GCSWEEPMAX);
+    luaS_migrate(L, fast ? INT_MAX : GCSWEEPMAX);  /* resize of 'strt' */
+  }
   else {  /* enter next state */
+    flushsweeper(g);
     g->gcstate = nextstate;
     g->sweepgc = nextlist;
   }
@@ -1627,7 +3469,7 @@ static l_mem singlestep (lua_State *L, int fast) {
       break;
     }
     case GCSpropagate: {
-      if (fast || g->gray == NULL) {
+      if (fast || !hasgray(g)) {
         g->gcstate = GCSenteratomic;  /* finish propagate phase */
         stepresult = 1;
       }
@@ -1667,7 +3509,7 @@ static l_mem singlestep (lua_State *L, int fast) {
       break;
     }
     case GCScallfin: {  /* call finalizers */
-      if (g->tobefnz && !g->gcemergency) {
+      if (g->tobefnz && !g->gcemergency && !deferfin(g)) {
         g->gcstopem = 0;  /* ok collections during finalizers */
         GCTM(L);  /* call one finalizer */
         stepresult = CWUFIN;
@@ -1678,54 +3520,553 @@ static l_mem singlestep (lua_State *L, int fast) {
       }
       break;
     }
-    default: lua_assert(0); return 0;
+    default: lua_assert(0); return 0;
+  }
+  g->gcstopem = 0;
+  telstep(g);
+  return stepresult;
+}
+
+
+/*
+** Advances the garbage collector until it reaches the given state.
+** (The option 'fast' is only for testing; in normal code, 'fast'
+** here is always true.)
+*/
+void luaC_runtilstate (lua_State *L, int state, int fast) {
+  global_State *g = G(L);
+  lua_assert(g->gckind == KGC_INC);
+  while (state != g->gcstate)
+    singlestep(L, fast);
+}
+
+
+/*
+** Call up to 'n' pending finalizers, outside any collection step; with
+** option LUA_GCPDEFERFIN, this is the only place where they run,
+** besides the closing of the state. Objects left in 'tobefnz' stay
+** there, marked by each new cycle, until they get their turn. As
+** 'udata2finalize' moves objects out of 'tobefnz', that list cannot be
+** in the middle of a sweep, so that sweep is finished first. Returns
+** the number of finalizers called.
+*/
+int luaC_runfinalizers (lua_State *L, int n) {
+  global_State *g = G(L);
+  int done = 0;
+  lua_assert(!(g->gcstp & (GCSTPGC | GCSTPCLS)));
+  while (g->gcstate == GCSswptobefnz)
+    singlestep(L, 1);
+  while (done < n && g->tobefnz != NULL) {
+    GCTM(L);
+    done++;
+  }
+  return done;
+}
+
+
+
+/*
+** Performs a basic incremental step. The step size is
+** converted from bytes to "units of work"; then the function loops
+** running single steps until adding that many units of work or
+** finishing a cycle (pause state). Finally, it sets the debt that
+** controls when next step will be performed.
+*/
+static void incstep (lua_State *L, global_State *g) {
+  l_mem stepsize = applygcparam(g, STEPSIZE, 100);
+  l_mem work2do = applygcparam(g, STEPMUL, stepsize / cast_int(sizeof(void*)));
+  l_mem stres;
+  int fast = (work2do == 0);  /* special case: do a full collection */
+  do {  /* repeat until enough work */
+    stres = singlestep(L, fast);  /* perform one single step */
+    if (stres == step2minor)  /* returned to minor collections? */
+      return;  /* nothing else to be done here */
+    else if (stres == step2pause || (stres == atomicstep && !fast))
+      break;  /* end of cycle or atomic */
+    else
+      work2do -= stres;
+  } while (fast || work2do > 0);
+  if (g->gcstate == GCSpause)
+    setpause(g);  /* pause until next cycle */
+  else
+    luaE_setdebt(g, stepsize);
+}
+
+
+/*
+** {======================================================
+** Time-budgeted steps
+** =======================================================
+*/
+
+/*
+** When LUA_GCPSTEPTIME is not zero, each automatic step in incremental
+** mode should not pause the program for longer than that many
+** microseconds. The collector keeps an estimate of its own speed
+** ('GCrate', in units of work per millisecond), and it shortens the
+** step size until the work of a step fits in the budget. A shorter
+** step is also followed by a proportionally shorter interval, so the
+** collector keeps its pace. The clock is read a few times during a
+** step, and the step stops early if the budget runs out anyway. (The
+** atomic phase and minor collections cannot be split, so they are
+** only measured.)
+*/
+
+/* smallest step size that a time budget can impose */
+#define GCMINSTEPSIZE	cast(l_mem, 16 * sizeof(Table))
+
+/* number of clock readings expected for a step that fits its budget */
+#define GCCLOCKCHECKS	4
+
+/* maximum value for 'GCrate' (keeps 'workfor' free of overflows) */
+#define MAXGCRATE	(MAX_LMEM / 1000)
+
+
+/*
+** Units of work the collector can do in 'usecs' microseconds, given
+** its measured speed. (Avoids overflows with 32-bit 'l_mem'.)
+*/
+static l_mem workfor (global_State *g, l_mem usecs) {
+  l_mem rate = g->GCrate;
+  if (usecs / 1000 >= MAX_LMEM / rate - 1)
+    return MAX_LMEM;
+  else
+    return (usecs / 1000) * rate + (usecs % 1000) * (rate / 8) / 125;
+}
+
+
+/*
+** Updates the speed estimate with a step that did 'work' units of
+** work in 'usecs' microseconds. New measures enter a moving average,
+** so that a single odd step does not change much the step sizes.
+*/
+static void updaterate (global_State *g, l_mem work, l_mem usecs) {
+  if (usecs > 0 && work > 0) {
+    l_mem rate;
+    if (work / usecs >= MAXGCRATE / 1000)
+      rate = MAXGCRATE;
+    else {
+      rate = (work / usecs) * 1000;
+      if (usecs < 1000000)  /* remainder part cannot overflow? */
+        rate += (work % usecs) * 1000 / usecs;
+    }
+    rate = g->GCrate - g->GCrate / 4 + rate / 4;
+    g->GCrate = (rate > 0) ? rate : 1;
+  }
+}
+
+
+/*
+** Runs single steps until doing 'work2do' units of work, until
+** 'budget' microseconds have passed since 'start', or until the
+** collector reaches the atomic phase or the end of a cycle. Returns
+** the result of the last single step.
+*/
+static l_mem timedsteps (lua_State *L, global_State *g, l_mem work2do,
+                         lua_Unsigned start, l_mem budget) {
+  l_mem check = workfor(g, budget) / GCCLOCKCHECKS + 1;
+  l_mem nextcheck = check;
+  l_mem done = 0;
+  l_mem stres;
+  do {
+    stres = singlestep(L, 0);
+    if (stres < 0)  /* atomic step, end of cycle or minor collections? */
+      break;
+    done += stres;
+    if (done >= nextcheck) {  /* time to look at the clock? */
+      if (cast(l_mem, luai_gcclock() - start) >= budget)
+        break;  /* budget is over */
+      nextcheck = done + check;
+    }
+  } while (done < work2do);
+  if (stres != atomicstep && stres != step2minor)  /* a regular step? */
+    updaterate(g, done, cast(l_mem, luai_gcclock() - start));
+  return stres;
+}
+
+
+/*
+** Basic incremental step with a time budget. Like 'incstep', but the
+** step size is halved until its work fits in the budget.
+*/
+static void timedstep (lua_State *L, global_State *g, lua_Unsigned start) {
+  l_mem budget = applygcparam(g, STEPTIME, 100);
+  l_mem stepsize = applygcparam(g, STEPSIZE, 100);
+  l_mem work2do = applygcparam(g, STEPMUL, stepsize / cast_int(sizeof(void*)));
+  l_mem fit = workfor(g, budget);
+  if (work2do == 0) {  /* special case: do a full collection */
+    incstep(L, g);  /* no budget for that */
+    return;
+  }
+  while (work2do > fit && stepsize > GCMINSTEPSIZE) {  /* step too long? */
+    stepsize /= 2;
+    work2do = applygcparam(g, STEPMUL, stepsize / cast_int(sizeof(void*)));
+  }
+  if (timedsteps(L, g, work2do, start, budget) == step2minor)
+    return;  /* nothing else to be done here */
+  if (g->gcstate == GCSpause)
+    setpause(g);  /* pause until next cycle */
+  else
+    luaE_setdebt(g, stepsize);
+}
+
+
+/*
+** Adds the pause of a step started at 'start' to the distribution of
+** pauses.
+*/
+static void recordpause (global_State *g, lua_Unsigned start) {
+  lua_GCPauses *p = &g->gcpauses;
+  lua_Unsigned d = luai_gcclock() - start;
+  p->count++;
+  p->total += d;
+  if (d > p->max)
+    p->max = d;
+  if (d > l_castS2U(applygcparam(g, STEPTIME, 100)))
+    p->over++;
+  p->bins[timebin(d)]++;
+}
+
+
+/*
+** Performs collector work for about 'budget' microseconds (an
+** explicit step). Returns true if the step finished a cycle.
+*/
+int luaC_timedstep (lua_State *L, l_mem budget) {
+  global_State *g = G(L);
+  lua_Unsigned start = luai_gcclock();
+  lua_assert(!g->gcemergency);
+  telenter(g);
+  if (g->gckind == KGC_GENMINOR) {  /* minor collections are indivisible */
+    youngcollection(L, g);
+    setminordebt(g);
+  }
+  else {
+    l_mem stres;
+    do {  /* continue after the atomic step, if there is time left */
+      stres = timedsteps(L, g, MAX_LMEM, start, budget);
+    } while (stres == atomicstep &&
+             cast(l_mem, luai_gcclock() - start) < budget);
+    if (stres != step2minor) {
+      if (g->gcstate == GCSpause)
+        setpause(g);  /* pause until next cycle */
+      else
+        luaE_setdebt(g, applygcparam(g, STEPSIZE, 100));
+    }
+  }
+  telleave(g);
+  return (g->gcstate == GCSpause);
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Adaptive mode
+** =======================================================
+*/
+
+/*
+** In adaptive mode, the collector measures each incremental cycle
+** (and each minor collection) and chooses by itself its mode and
+** some of its parameters. The survival rate is the part of the bytes
+** allocated during a cycle that are still alive at its end: in minor
+** collections, the bytes that became old; in incremental cycles, the
+** growth of the live bytes since the previous cycle. A low rate means
+** that most objects die young, which favors generational mode; a high
+** rate means that minor collections mostly promote survivors, which
+** favors incremental mode. A switch needs some consecutive cycles
+** asking for it; that number doubles when a switch comes soon after
+** the previous one, so that the collector does not keep flapping
+** between modes (each switch to generational mode costs a full
+** collection). The goals in parameters PAUSEGOAL and MEMGOAL
+** tune the nursery size (MINORMUL) in generational mode, and the
+** pause (PAUSE) and the step budget (STEPTIME) in incremental mode.
+** Only automatic steps are measured.
+*/
+
+typedef struct GCAdaptive {
+  lua_Unsigned cyclestart;  /* clock when the current cycle started */
+  lua_Unsigned pause;  /* longest step in the current cycle */
+  l_mem allocated;  /* bytes allocated in the current cycle */
+  l_mem debt;  /* 'GCdebt' when the last step ended */
+  l_mem peak;  /* largest total seen in the current cycle */
+  l_mem live;  /* live bytes after the previous cycle (-1 if unknown) */
+  int streak;  /* consecutive cycles that asked for the other mode */
+  int needed;  /* value of 'streak' needed to switch modes */
+  int cycles;  /* cycles since the last switch */
+} GCAdaptive;
+
+
+/* survival rates (%) below/above which each mode is favored */
+#define ADAPTGENSURV	25
+#define ADAPTINCSURV	60
+
+/* consecutive cycles that must agree before switching modes */
+#define ADAPTSTREAK	3
+#define ADAPTMAXSTREAK	256
+
+/* limits for the parameters tuned in adaptive mode */
+#define ADAPTMINMUL	5
+#define ADAPTMAXMUL	100
+#define ADAPTMINPAUSE	110
+#define ADAPTMAXPAUSE	1000
+
+
+/*
+** 'x' as a percentage of 'y' (0 if either is not positive).
+*/
+static lua_Unsigned percent (l_mem x, l_mem y) {
+  if (x <= 0 || y <= 0)
+    return 0;
+  while (x > MAX_LMEM / 100) {  /* avoid overflows */
+    x >>= 1;
+    y >>= 1;
+  }
+  return l_castS2U(x * 100 / ((y > 0) ? y : 1));
+}
+
+
+/*
+** Bytes alive after a cycle, including external memory. In minor mode,
+** it is the base from the last major collection plus the bytes that
+** became old since then.
+*/
+static l_mem livebytes (global_State *g) {
+  if (g->gckind == KGC_GENMINOR)
+    return g->GCmajorminor + g->GCmarked + g->GCextbytes;
+  else
+    return g->GCmarked + g->GCextbytes;
+}
+
+
+/*
+** Whether 'v' is more than 1/8 away from 'old' (parameters are stored
+** with some rounding, so smaller changes are not worth reporting).
+*/
+static int farfrom (l_mem v, l_mem old) {
+  return (v > old + old / 8 || v < old - old / 8);
+}
+
+
+static void reportdecision (global_State *g, lua_GCDecision *d, int param,
+                            l_mem value, const char *reason) {
+  d->param = param;
+  d->value = cast_int(value);
+  d->reason = reason;
+  if (g->decisionf != NULL)
+    g->decisionf(g->decisionud, d);
+}
+
+
+static void tuneparam (global_State *g, lua_GCDecision *d, int param,
+                       l_mem value, const char *reason) {
+  g->gcparams[param] = luaO_codeparam(cast_uint(value));
+  reportdecision(g, d, param, value, reason);
+}
+
+
+/*
+** Generational mode: both the heap overhead and, roughly, the length
+** of minor collections grow with the nursery size, so 'minormul' is
+** scaled toward the goals (at most doubling in each decision).
+*/
+static void tunegen (global_State *g, lua_GCDecision *d) {
+  l_mem pausegoal = applygcparam(g, PAUSEGOAL, 100);
+  l_mem memgoal = applygcparam(g, MEMGOAL, 100);
+  l_mem mul = applygcparam(g, MINORMUL, 100);
+  l_mem newmul = 2 * mul;
+  const char *reason = NULL;
+  if (memgoal > 100 && d->overhead > 100) {
+    newmul = mul * (memgoal - 100) / cast(l_mem, d->overhead - 100);
+    reason = "memory goal";
+  }
+  if (pausegoal > 0 && d->pause > 0) {
+    l_mem m = mul * pausegoal / cast(l_mem, d->pause);
+    if (reason == NULL || m < newmul) {
+      newmul = m;
+      reason = "pause goal";
+    }
+  }
+  if (reason != NULL) {
+    if (newmul > 2 * mul)
+      newmul = 2 * mul;
+    if (newmul > ADAPTMAXMUL)
+      newmul = ADAPTMAXMUL;
+    else if (newmul < ADAPTMINMUL)
+      newmul = ADAPTMINMUL;
+    if (farfrom(newmul, mul))
+      tuneparam(g, d, LUA_GCPMINORMUL, newmul, reason);
   }
-  g->gcstopem = 0;
-  return stepresult;
 }
 
 
 /*
-** Advances the garbage collector until it reaches the given state.
-** (The option 'fast' is only for testing; in normal code, 'fast'
-** here is always true.)
+** Incremental mode: the heap peaks at about 'pause'% of the live
+** bytes, so 'pause' is scaled toward the memory goal. Long pauses
+** get a time budget for each step (but the atomic step cannot be
+** split, so it can still exceed the goal).
 */
-void luaC_runtilstate (lua_State *L, int state, int fast) {
-  global_State *g = G(L);
-  lua_assert(g->gckind == KGC_INC);
-  while (state != g->gcstate)
-    singlestep(L, fast);
+static void tuneinc (global_State *g, lua_GCDecision *d) {
+  l_mem pausegoal = applygcparam(g, PAUSEGOAL, 100);
+  l_mem memgoal = applygcparam(g, MEMGOAL, 100);
+  if (memgoal > 100 && d->overhead > 0) {
+    l_mem pause = applygcparam(g, PAUSE, 100);
+    l_mem newpause = pause * memgoal / cast(l_mem, d->overhead);
+    if (newpause > ADAPTMAXPAUSE)
+      newpause = ADAPTMAXPAUSE;
+    else if (newpause < ADAPTMINPAUSE)
+      newpause = ADAPTMINPAUSE;
+    if (farfrom(newpause, pause))
+      tuneparam(g, d, LUA_GCPPAUSE, newpause, "memory goal");
+  }
+  if (pausegoal > 0 && d->pause > l_castS2U(pausegoal)) {
+    l_mem budget = applygcparam(g, STEPTIME, 100);
+    if (budget == 0 || budget > pausegoal)
+      tuneparam(g, d, LUA_GCPSTEPTIME, pausegoal, "pause goal");
+  }
 }
 
 
+/*
+** Checks whether the cycle 'd' asks for the other mode; returns the
+** reason, or NULL if the current mode is fine. (A major collection
+** with low survival will return to minor mode by itself.)
+*/
+static const char *othermode (global_State *g, lua_GCDecision *d) {
+  if (g->gckind == KGC_GENMINOR) {
+    l_mem pausegoal = applygcparam(g, PAUSEGOAL, 100);
+    if (d->survival > ADAPTINCSURV)
+      return "high survival";
+    else if (pausegoal > 0 && d->pause > l_castS2U(pausegoal) &&
+             applygcparam(g, MINORMUL, 100) <= ADAPTMINMUL)
+      return "pause goal";  /* cannot shrink the nursery any further */
+  }
+  else if (g->gckind == KGC_GENMAJOR) {
+    if (d->survival > ADAPTINCSURV)
+      return "high survival";
+  }
+  else if (d->survival < ADAPTGENSURV)
+    return "low survival";
+  return NULL;
+}
+
 
 /*
-** Performs a basic incremental step. The step size is
-** converted from bytes to "units of work"; then the function loops
-** running single steps until adding that many units of work or
-** finishing a cycle (pause state). Finally, it sets the debt that
-** controls when next step will be performed.
+** End of a cycle where 'survived' of the bytes allocated during it
+** are still alive: tune parameters and maybe switch modes.
 */
-static void incstep (lua_State *L, global_State *g) {
-  l_mem stepsize = applygcparam(g, STEPSIZE, 100);
-  l_mem work2do = applygcparam(g, STEPMUL, stepsize / cast_int(sizeof(void*)));
-  l_mem stres;
-  int fast = (work2do == 0);  /* special case: do a full collection */
-  do {  /* repeat until enough work */
-    stres = singlestep(L, fast);  /* perform one single step */
-    if (stres == step2minor)  /* returned to minor collections? */
-      return;  /* nothing else to be done here */
-    else if (stres == step2pause || (stres == atomicstep && !fast))
-      break;  /* end of cycle or atomic */
-    else
-      work2do -= stres;
-  } while (fast || work2do > 0);
-  if (g->gcstate == GCSpause)
-    setpause(g);  /* pause until next cycle */
+static void adaptcycle (lua_State *L, global_State *g, l_mem survived) {
+  GCAdaptive *a = g->adaptive;
+  lua_Unsigned elapsed = luai_gcclock() - a->cyclestart;
+  lua_GCDecision d;
+  const char *reason;
+  d.mode = (g->gckind == KGC_INC) ? LUA_GCINC : LUA_GCGEN;
+  d.survival = percent(survived, a->allocated);
+  d.pause = a->pause;
+  d.allocrate = (elapsed > 0)
+              ? l_castS2U(a->allocated / 1024) * 1000000u / elapsed : 0;
+  d.overhead = percent(a->peak, livebytes(g));
+  if (g->gckind == KGC_GENMINOR)
+    tunegen(g, &d);
   else
-    luaE_setdebt(g, stepsize);
+    tuneinc(g, &d);
+  reason = othermode(g, &d);
+  if (a->cycles < ADAPTMAXSTREAK * 4)
+    a->cycles++;
+  if (reason == NULL)
+    a->streak = 0;
+  else if (++a->streak >= a->needed) {
+    int kind = (g->gckind == KGC_INC) ? KGC_GENMINOR : KGC_INC;
+    if (a->cycles < a->needed * 4)  /* previous switch was recent? */
+      a->needed = (a->needed < ADAPTMAXSTREAK / 2) ? a->needed * 2
+                                                   : ADAPTMAXSTREAK;
+    else
+      a->needed = ADAPTSTREAK;
+    a->streak = a->cycles = 0;
+    luaC_changemode(L, kind);
+    d.mode = (kind == KGC_INC) ? LUA_GCINC : LUA_GCGEN;
+    reportdecision(g, &d, -1, 0, reason);
+  }
+}
+
+
+/*
+** Called before an automatic step: counts the bytes allocated since
+** the previous step.
+*/
+static void adaptbegin (global_State *g) {
+  GCAdaptive *a = g->adaptive;
+  l_mem total = gettotalbytes(g);
+  if (a->debt > g->GCdebt)
+    a->allocated += a->debt - g->GCdebt;
+  if (total > a->peak)
+    a->peak = total;
+}
+
+
+/*
+** Called after an automatic step that started at clock 'start' in
+** mode 'kind', with 'marked' in 'GCmarked'. A cycle ends with each
+** minor collection, and when an incremental cycle reaches the pause.
+** Changes of mode inside the collector (between minor and major
+** collections) only restart the measures.
+*/
+static void adaptend (lua_State *L, global_State *g, lua_Unsigned start,
+                      int kind, l_mem marked) {
+  GCAdaptive *a = g->adaptive;
+  lua_Unsigned d = luai_gcclock() - start;
+  int ended = 0;
+  if (d > a->pause)
+    a->pause = d;
+  if (kind == KGC_GENMINOR && g->gckind == KGC_GENMINOR) {
+    adaptcycle(L, g, g->GCmarked - marked);  /* bytes that became old */
+    ended = 1;
+  }
+  else if (kind == g->gckind && g->gcstate == GCSpause) {
+    if (a->live >= 0)  /* know the previous live bytes? */
+      adaptcycle(L, g, g->GCmarked - a->live);
+    ended = 1;
+  }
+  else if (kind != g->gckind)  /* collector changed mode by itself */
+    ended = 1;
+  if (ended) {  /* restart measures */
+    a->cyclestart = luai_gcclock();
+    a->pause = 0;
+    a->allocated = 0;
+    a->peak = 0;
+    /* live bytes are unknown after leaving minor mode */
+    a->live = (g->gckind == kind || g->gckind == KGC_GENMINOR)
+            ? livebytes(g) : -1;
+  }
+  a->debt = g->GCdebt;
+}
+
+
+void luaC_setadaptive (lua_State *L, int on) {
+  global_State *g = G(L);
+  if (on && g->adaptive == NULL) {
+    GCAdaptive *a = luaM_new(L, GCAdaptive);
+    a->cyclestart = luai_gcclock();
+    a->pause = 0;
+    a->allocated = 0;
+    a->debt = g->GCdebt;
+    a->peak = 0;
+    a->live = -1;  /* unknown until the end of a cycle */
+    a->streak = 0;
+    a->needed = ADAPTSTREAK;
+    a->cycles = ADAPTMAXSTREAK * 4;  /* no recent switch */
+    g->adaptive = a;
+  }
+  else if (!on && g->adaptive != NULL) {
+    luaM_free(L, g->adaptive);
+    g->adaptive = NULL;
+  }
 }
 
+/* }====================================================== */
+
 
 #if !defined(luai_tracegc)
 #define luai_tracegc(L,f)		((void)0)
@@ -1744,17 +4085,33 @@ void luaC_step (lua_State *L) {
       luaE_setdebt(g, 20000);
   }
   else {
+    int timed = (g->gcparams[LUA_GCPSTEPTIME] != 0);  /* has a budget? */
+    int adaptive = (g->adaptive != NULL);
+    lua_Unsigned start = (timed || adaptive) ? luai_gcclock() : 0;
+    int kind = g->gckind;
+    l_mem marked = g->GCmarked;
     luai_tracegc(L, 1);  /* for internal debugging */
+    if (adaptive)
+      adaptbegin(g);
+    telenter(g);
     switch (g->gckind) {
       case KGC_INC: case KGC_GENMAJOR:
-        incstep(L, g);
+        if (timed)
+          timedstep(L, g, start);
+        else
+          incstep(L, g);
         break;
       case KGC_GENMINOR:
         youngcollection(L, g);
         setminordebt(g);
         break;
     }
+    telleave(g);
+    if (adaptive)
+      adaptend(L, g, start, kind, marked);
     luai_tracegc(L, 0);  /* for internal debugging */
+    if (timed)
+      recordpause(g, start);
   }
 }
 
@@ -1785,7 +4142,10 @@ static void fullinc (lua_State *L, global_State *g) {
 void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
   lua_assert(!g->gcemergency);
+  if (isemergency)
+    waitsweeper(g);  /* get back all memory it is freeing */
   g->gcemergency = cast_byte(isemergency);  /* set flag */
+  telenter(g);
   switch (g->gckind) {
     case KGC_GENMINOR: fullgen(L, g); break;
     case KGC_INC: fullinc(L, g); break;
@@ -1795,9 +4155,539 @@ void luaC_fullgc (lua_State *L, int isemergency) {
       g->gckind = KGC_GENMAJOR;
       break;
   }
+  waitsweeper(g);  /* a full collection frees everything it can */
+  telleave(g);
   g->gcemergency = 0;
 }
 
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** Compaction
+** =======================================================
+*/
+
+/*
+** A compaction offers the allocator to move the blocks owned by live
+** objects, reallocating each one to its own size (see 'luaM_move'),
+** and fixes the pointers to the blocks that moved. An allocator that
+** knows its fragmentation can then move blocks out of sparse pages;
+** other allocators just keep them. The movable blocks are the array
+** and hash parts of tables, the stacks of threads and the array of the
+** string table. Objects themselves do not move, so pointers given by
+** the API stay valid, and neither do the vectors of prototypes, as
+** running functions keep pointers to their code and constants. The
+** compaction starts with a full collection, so that garbage is not
+** moved, and ends with a call to the allocator with 'osize'
+** LUA_ALLOCCOMPACT, when it can return free memory to the system.
+** Returns the number of blocks that moved.
+*/
+l_mem luaC_compact (lua_State *L) {
+  global_State *g = G(L);
+  GCObject **lists[4];
+  l_mem moved = 0;
+  int i;
+  luaC_fullgc(L, 0);
+  lists[0] = &g->allgc; lists[1] = &g->finobj;
+  lists[2] = &g->tobefnz; lists[3] = &g->fixedgc;
+  for (i = 0; i < 4; i++) {
+    GCObject *o;
+    for (o = *lists[i]; o != NULL; o = o->next) {
+      switch (o->tt) {
+        case LUA_VTABLE:
+          moved += luaH_compact(L, gco2t(o));
+          break;
+        case LUA_VTHREAD: {
+          lua_State *th = gco2th(o);
+          if (th->stack.p != NULL)  /* (not being built) */
+            moved += luaD_movestack(th);
+          break;
+        }
+        default: break;  /* nothing else moves */
+      }
+    }
+  }
+  moved += luaD_movestack(mainthread(g));  /* not in any list */
+  moved += luaS_compact(L);
+  (*g->frealloc)(g->ud, NULL, LUA_ALLOCCOMPACT, 0);
+  return moved;
+}
+
+/* }====================================================== */
+
+
+
+
+/*
+** {======================================================
+** Heap Snapshot
+** =======================================================
+*/
+
+/*
+** A snapshot walks every object reachable from the registry, the main
+** thread, the metatables of basic types and the objects being
+** finalized, following the same references as the mark phase. It
+** writes the graph as JSON, one node per line:
+**   {"id":3,"type":"table","size":56,"edges":[[4,"x"],[5,"[1]"]]}
+** Id 0 is a synthetic root. Nodes may also have a "name" (a short
+** description of the object) and tables a "weak" mode ("k", "v" or
+** "kv"). The walk keeps its own set of visited objects, so it does not
+** touch colors or gray lists, and it stops the collector while it runs.
+*/
+
+/* size of the output buffer */
+#define SNAPBUFFSIZE	1024
+
+/* maximum length of labels and names (longer ones are cut) */
+#define SNAPLABELMAX	40
+
+/* 'obj2gco' for pointers that may be NULL */
+#define obj2gcoN(o)	((o) == NULL ? NULL : obj2gco(o))
+
+typedef struct SnapEntry {
+  GCObject *o;
+  size_t id;
+} SnapEntry;
+
+typedef struct HeapSnap {
+  lua_State *L;
+  global_State *g;
+  lua_Writer writer;
+  void *data;
+  int status;  /* error from 'writer', or LUA_ERRMEM */
+  SnapEntry *map;  /* visited objects (open addressing) */
+  size_t sizemap;  /* size of 'map' (a power of 2) */
+  size_t nobjs;  /* number of visited objects */
+  GCObject **stack;  /* visited objects not yet written */
+  size_t sizestack;
+  size_t nstack;
+  size_t nnodes;  /* nodes written */
+  int nedges;  /* edges written for the current node */
+  size_t n;  /* bytes in 'buff' */
+  char buff[SNAPBUFFSIZE];
+} HeapSnap;
+
+
+static void snapflush (HeapSnap *S) {
+  if (S->status == LUA_OK && S->n > 0) {
+    lua_unlock(S->L);
+    S->status = (*S->writer)(S->L, S->buff, S->n, S->data);
+    lua_lock(S->L);
+  }
+  S->n = 0;
+}
+
+
+static void snapaddmem (HeapSnap *S, const char *s, size_t l) {
+  while (l > 0) {
+    size_t m = SNAPBUFFSIZE - S->n;
+    if (m > l)
+      m = l;
+    memcpy(S->buff + S->n, s, m);
+    S->n += m;
+    s += m;
+    l -= m;
+    if (S->n == SNAPBUFFSIZE)
+      snapflush(S);
+  }
+}
+
+#define snapaddlit(S,s)	snapaddmem(S, "" s, sizeof(s) - 1)
+
+
+static void snapaddint (HeapSnap *S, lua_Integer i) {
+  char buff[LUA_N2SBUFFSZ];
+  TValue v;
+  setivalue(&v, i);
+  snapaddmem(S, buff, luaO_tostringbuff(&v, buff));
+}
+
+
+/*
+** Adds a JSON string with the (at most SNAPLABELMAX) first bytes of
+** 's'. Bytes outside printable ASCII are escaped as "\u00XX".
+*/
+static void snapaddstr (HeapSnap *S, const char *s, size_t l) {
+  static const char hex[] = "0123456789abcdef";
+  size_t i;
+  int cut = (l > SNAPLABELMAX);
+  snapaddlit(S, "\"");
+  for (i = 0; i < l && i < SNAPLABELMAX; i++) {
+    unsigned char c = cast(unsigned char, s[i]);
+    if (c == '"' || c == '\\') {
+      char esc[2];
+      esc[0] = '\\';
+      esc[1] = cast_char(c);
+      snapaddmem(S, esc, 2);
+    }
+    else if (c < 0x20 || c >= 0x7F) {
+      char esc[6];
+      memcpy(esc, "\\u00", 4);
+      esc[4] = hex[c >> 4];
+      esc[5] = hex[c & 0xF];
+      snapaddmem(S, esc, 6);
+    }
+    else
+      snapaddmem(S, cast_charp(&c), 1);
+  }
+  if (cut)
+    snapaddlit(S, "...");
+  snapaddlit(S, "\"");
+}
+
+
+static void *snaprealloc (HeapSnap *S, void *block, size_t osize,
+                          size_t nsize) {
+  void *res = gcrealloc(S->g, block, osize, nsize);
+  if (res == NULL && nsize > 0)
+    S->status = LUA_ERRMEM;
+  return res;
+}
+
+
+static SnapEntry *snapslot (SnapEntry *map, size_t size, GCObject *o) {
+  size_t i = point2uint(o) & (size - 1);
+  while (map[i].o != NULL && map[i].o != o)
+    i = (i + 1) & (size - 1);  /* linear probing */
+  return &map[i];
+}
+
+
+/*
+** Returns the id of object 'o', marking it as visited and pushing it
+** to be written if it is new.
+*/
+static size_t snapvisit (HeapSnap *S, GCObject *o) {
+  SnapEntry *e;
+  if (2 * (S->nobjs + 1) > S->sizemap) {  /* keep load under 1/2 */
+    size_t nsize = (S->sizemap > 0) ? 2 * S->sizemap : 1024;
+    SnapEntry *nmap = cast(SnapEntry *, snaprealloc(S, NULL, 0,
+                                         nsize * sizeof(SnapEntry)));
+    size_t i;
+    if (nmap == NULL)
+      return 0;
+    memset(nmap, 0, nsize * sizeof(SnapEntry));
+    for (i = 0; i < S->sizemap; i++) {
+      if (S->map[i].o != NULL)
+        *snapslot(nmap, nsize, S->map[i].o) = S->map[i];
+    }
+    snaprealloc(S, S->map, S->sizemap * sizeof(SnapEntry), 0);
+    S->map = nmap;
+    S->sizemap = nsize;
+  }
+  e = snapslot(S->map, S->sizemap, o);
+  if (e->o == NULL) {  /* new object? */
+    if (S->nstack == S->sizestack) {
+      size_t nsize = (S->sizestack > 0) ? 2 * S->sizestack : 256;
+      GCObject **nstack = cast(GCObject **, snaprealloc(S, S->stack,
+                                   S->sizestack * sizeof(GCObject *),
+                                   nsize * sizeof(GCObject *)));
+      if (nstack == NULL)
+        return 0;
+      S->stack = nstack;
+      S->sizestack = nsize;
+    }
+    e->o = o;
+    e->id = ++S->nobjs;
+    S->stack[S->nstack++] = o;
+  }
+  return e->id;
+}
+
+
+static void snapedge (HeapSnap *S, GCObject *o, const char *label,
+                      size_t l) {
+  if (o != NULL && S->status == LUA_OK) {
+    size_t id = snapvisit(S, o);
+    if (S->nedges++ > 0)
+      snapaddlit(S, ",");
+    snapaddlit(S, "[");
+    snapaddint(S, cast(lua_Integer, id));
+    snapaddlit(S, ",");
+    snapaddstr(S, label, l);
+    snapaddlit(S, "]");
+  }
+}
+
+#define snapedgelit(S,o,l)	snapedge(S, o, "" l, sizeof(l) - 1)
+
+
+/*
+** Edge to the value of table entry with key 'key', labeled with the key
+** (strings as themselves, other keys in brackets).
+*/
+static void snapfield (HeapSnap *S, GCObject *o, const TValue *key) {
+  char buff[LUA_N2SBUFFSZ + 2];
+  size_t l;
+  if (o == NULL)
+    return;
+  if (ttisstring(key)) {
+    TString *ts = tsvalue(key);
+    snapedge(S, o, getstr(ts), tsslen(ts));
+    return;
+  }
+  buff[0] = '[';
+  if (ttisnumber(key))
+    l = luaO_tostringbuff(key, buff + 1);
+  else {
+    const char *tn = luaT_typename(ttype(key));
+    l = strlen(tn);
+    memcpy(buff + 1, tn, l);
+  }
+  buff[l + 1] = ']';
+  snapedge(S, o, buff, l + 2);
+}
+
+
+static void snapbegin (HeapSnap *S, size_t id, const char *type,
+                       l_mem size) {
+  if (S->nnodes++ > 0)
+    snapaddlit(S, ",\n");
+  snapaddlit(S, "{\"id\":");
+  snapaddint(S, cast(lua_Integer, id));
+  snapaddlit(S, ",\"type\":\"");
+  snapaddmem(S, type, strlen(type));
+  snapaddlit(S, "\",\"size\":");
+  snapaddint(S, size);
+}
+
+
+static void snapname (HeapSnap *S, const char *name, size_t l) {
+  snapaddlit(S, ",\"name\":");
+  snapaddstr(S, name, l);
+}
+
+
+/*
+** Name for a function or prototype: its source and line.
+*/
+static void snapfuncname (HeapSnap *S, Proto *p) {
+  if (p != NULL && p->source != NULL) {
+    char buff[LUA_IDSIZE + LUA_N2SBUFFSZ];
+    size_t l;
+    TValue line;
+    luaO_chunkid(buff, getstr(p->source), tsslen(p->source));
+    l = strlen(buff);
+    buff[l++] = ':';
+    setivalue(&line, p->linedefined);
+    l += luaO_tostringbuff(&line, buff + l);
+    snapname(S, buff, l);
+  }
+}
+
+
+/*
+** Name for a userdata: the '__name' field of its metatable, if any.
+*/
+static void snapudataname (HeapSnap *S, Table *mt) {
+  if (mt != NULL) {
+    Node *n, *limit = gnodelast(mt);
+    for (n = gnode(mt, 0); n < limit; n++) {
+      if (keyisshrstr(n) && strcmp(getstr(keystrval(n)), "__name") == 0 &&
+          ttisstring(gval(n))) {
+        TString *ts = tsvalue(gval(n));
+        snapname(S, getstr(ts), tsslen(ts));
+        return;
+      }
+    }
+  }
+}
+
+
+static void snaptable (HeapSnap *S, Table *h) {
+  static const char *const modes[] = {"", "v", "k", "kv"};
+  unsigned i;
+  Node *n, *limit = gnodelast(h);
+  int mode = getmode(S->g, h);
+  if (mode != 0) {
+    snapaddlit(S, ",\"weak\":\"");
+    snapaddmem(S, modes[mode], strlen(modes[mode]));
+    snapaddlit(S, "\"");
+  }
+  snapaddlit(S, ",\"edges\":[");
+  snapedgelit(S, obj2gcoN(h->metatable), "(metatable)");
+  for (i = 0; i < h->asize; i++) {
+    TValue key;
+    setivalue(&key, l_castU2S(i) + 1);
+    snapfield(S, gcvalarr(h, i), &key);
+  }
+  for (n = gnode(h, 0); n < limit; n++) {
+    if (!isempty(gval(n))) {  /* (empty entries may have dead keys) */
+      TValue key;
+      getnodekey(S->L, &key, n);
+      snapedgelit(S, gckeyN(n), "(key)");
+      snapfield(S, gcvalueN(gval(n)), &key);
+    }
+  }
+}
+
+
+static void snapLclosure (HeapSnap *S, LClosure *cl) {
+  int i;
+  snapfuncname(S, cl->p);
+  snapaddlit(S, ",\"edges\":[");
+  snapedgelit(S, obj2gcoN(cl->p), "(proto)");
+  for (i = 0; i < cl->nupvalues; i++) {
+    TString *name = (cl->p != NULL && i < cl->p->sizeupvalues)
+                  ? cl->p->upvalues[i].name : NULL;
+    if (cl->upvals[i] == NULL)
+      continue;  /* closure being created */
+    if (name != NULL)
+      snapedge(S, obj2gcoN(cl->upvals[i]), getstr(name), tsslen(name));
+    else
+      snapedgelit(S, obj2gcoN(cl->upvals[i]), "(upvalue)");
+  }
+}
+
+
+static void snapproto (HeapSnap *S, Proto *f) {
+  int i;
+  snapfuncname(S, f);
+  snapaddlit(S, ",\"edges\":[");
+  snapedgelit(S, obj2gcoN(f->source), "(source)");
+  for (i = 0; i < f->sizek; i++)
+    snapedgelit(S, gcvalueN(&f->k[i]), "(constant)");
+  for (i = 0; i < f->sizeupvalues; i++)
+    snapedgelit(S, obj2gcoN(f->upvalues[i].name), "(upvalue name)");
+  for (i = 0; i < f->sizep; i++)
+    snapedgelit(S, obj2gcoN(f->p[i]), "(proto)");
+  for (i = 0; i < f->sizelocvars; i++)
+    snapedgelit(S, obj2gcoN(f->locvars[i].varname), "(local name)");
+}
+
+
+static void snapthread (HeapSnap *S, lua_State *th) {
+  UpVal *uv;
+  StkId o;
+  if (th == mainthread(S->g))
+    snapname(S, "main thread", 11);
+  snapaddlit(S, ",\"edges\":[");
+  if (th->stack.p == NULL)
+    return;  /* stack not completely built yet */
+  for (o = th->stack.p; o < th->top.p; o++)
+    snapedgelit(S, gcvalueN(s2v(o)), "(stack)");
+  for (uv = th->openupval; uv != NULL; uv = uv->u.open.next)
+    snapedgelit(S, obj2gco(uv), "(open upvalue)");
+}
+
+
+/*
+** Writes object 'o' and visits its references.
+*/
+static void snapobject (HeapSnap *S, GCObject *o) {
+  int i;
+  snapbegin(S, snapslot(S->map, S->sizemap, o)->id,
+            (o->tt == LUA_VPROTO) ? "proto"
+          : (o->tt == LUA_VUPVAL) ? "upvalue"
+          : luaT_typename(novariant(o->tt)),
+            objsize(o));
+  S->nedges = 0;
+  switch (o->tt) {
+    case LUA_VSHRSTR: case LUA_VLNGSTR: {
+      TString *ts = gco2ts(o);
+      snapname(S, getstr(ts), tsslen(ts));
+      snapaddlit(S, ",\"edges\":[");
+      break;
+    }
+    case LUA_VTABLE: snaptable(S, gco2t(o)); break;
+    case LUA_VLCL: snapLclosure(S, gco2lcl(o)); break;
+    case LUA_VCCL: {
+      CClosure *cl = gco2ccl(o);
+      snapaddlit(S, ",\"edges\":[");
+      for (i = 0; i < cl->nupvalues; i++)
+        snapedgelit(S, gcvalueN(&cl->upvalue[i]), "(upvalue)");
+      break;
+    }
+    case LUA_VUSERDATA: {
+      Udata *u = gco2u(o);
+      snapudataname(S, u->metatable);
+      snapaddlit(S, ",\"edges\":[");
+      snapedgelit(S, obj2gcoN(u->metatable), "(metatable)");
+      for (i = 0; i < u->nuvalue; i++)
+        snapedgelit(S, gcvalueN(&u->uv[i].uv), "(user value)");
+      break;
+    }
+    case LUA_VUPVAL: {
+      UpVal *uv = gco2upv(o);
+      snapaddlit(S, ",\"edges\":[");
+      snapedgelit(S, gcvalueN(uv->v.p), "(value)");
+      break;
+    }
+    case LUA_VPROTO: snapproto(S, gco2p(o)); break;
+    case LUA_VTHREAD: snapthread(S, gco2th(o)); break;
+    default: lua_assert(0);
+  }
+  snapaddlit(S, "]}");
+}
+
+
+/*
+** Writes the synthetic root, with edges to all roots of the mark phase.
+*/
+static void snaproots (HeapSnap *S) {
+  global_State *g = S->g;
+  GCObject *o;
+  int i;
+  snapbegin(S, 0, "root", 0);
+  snapaddlit(S, ",\"edges\":[");
+  S->nedges = 0;
+  snapedgelit(S, gcvalueN(&g->l_registry), "(registry)");
+  snapedgelit(S, obj2gco(mainthread(g)), "(main thread)");
+  for (i = 0; i < LUA_NUMTYPES; i++) {
+    if (g->mt[i] != NULL) {
+      const char *tn = luaT_typename(i);
+      char buff[40];
+      size_t l = strlen(tn);
+      memcpy(buff, "(metatable ", 11);
+      memcpy(buff + 11, tn, l);
+      buff[l + 11] = ')';
+      snapedge(S, obj2gcoN(g->mt[i]), buff, l + 12);
+    }
+  }
+  for (o = g->tobefnz; o != NULL; o = o->next)
+    snapedgelit(S, o, "(to be finalized)");
+  snapaddlit(S, "]}");
+}
+
+
+/*
+** Writes a snapshot of the heap through 'writer'. Returns the first
+** non-zero result of 'writer', LUA_ERRMEM if the walk could not
+** allocate its auxiliary structures, or LUA_OK. The walk keeps raw
+** pointers to objects across calls to 'writer', so the collector
+** stays stopped until its end: otherwise an allocation in 'writer'
+** could run a step that frees objects the walk has yet to write
+** (e.g., dead entries of weak tables).
+*/
+int luaC_heapsnapshot (lua_State *L, lua_Writer writer, void *data) {
+  HeapSnap S;
+  lu_byte oldgcstp = G(L)->gcstp;
+  G(L)->gcstp |= GCSTPGC;  /* avoid GC steps */
+  S.L = L;
+  S.g = G(L);
+  S.writer = writer;
+  S.data = data;
+  S.status = LUA_OK;
+  S.map = NULL;
+  S.sizemap = S.nobjs = 0;
+  S.stack = NULL;
+  S.sizestack = S.nstack = 0;
+  S.nnodes = 0;
+  S.n = 0;
+  snapaddlit(&S, "{\"version\":1,\"nodes\":[\n");
+  snaproots(&S);
+  while (S.nstack > 0 && S.status == LUA_OK)
+    snapobject(&S, S.stack[--S.nstack]);
+  snapaddlit(&S, "\n]}\n");
+  snapflush(&S);
+  snaprealloc(&S, S.map, S.sizemap * sizeof(SnapEntry), 0);
+  snaprealloc(&S, S.stack, S.sizestack * sizeof(GCObject *), 0);
+  G(L)->gcstp = oldgcstp;  /* restore state */
+  return S.status;
+}
+
+/* }====================================================== */
+
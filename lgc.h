@@ -72,8 +72,8 @@
 
 
 /*
-** Layout for bit use in 'marked' field. First three bits are
-** used for object "age" in generational mode. Last bit is used
+** Layout for bit use in the GC bits of an object. First three bits
+** are used for object "age" in generational mode. Last bit is used
 ** by tests.
 */
 #define WHITE0BIT	3  /* object is white (type 0) */
@@ -88,20 +88,44 @@
 #define WHITEBITS	bit2mask(WHITE0BIT, WHITE1BIT)
 
 
-#define iswhite(x)      testbits((x)->marked, WHITEBITS)
-#define isblack(x)      testbit((x)->marked, BLACKBIT)
+/*
+** 'gcbits(o)' is the byte with the GC bits of object 'o'. Usually
+** that is its 'marked' field. With LUA_USE_SIDEMARKS, the 'marked' field
+** holds the index of the object in the side array of its heap page
+** (see lmem.h), so that the collector does not write into the object.
+** Big objects keep their GC bits just before them, and the main thread
+** keeps them in the global state.
+*/
+#if defined(LUA_USE_SIDEMARKS)
+
+#define gcbitsp(o)  \
+	((o)->marked < HEAPMAIN ? &luaM_heappage(o)->bits[(o)->marked] :  \
+	 (o)->marked == HEAPBIG ? cast(lu_byte *, o) - sizeof(HeapBig) :  \
+	 &cast(lua_State *, o)->l_G->mainbits)
+
+#define gcbits(o)	(*gcbitsp(o))
+
+#else
+
+#define gcbits(o)	((o)->marked)
+
+#endif
+
+
+#define iswhite(x)      testbits(gcbits(x), WHITEBITS)
+#define isblack(x)      testbit(gcbits(x), BLACKBIT)
 #define isgray(x)  /* neither white nor black */  \
-	(!testbits((x)->marked, WHITEBITS | bitmask(BLACKBIT)))
+	(!testbits(gcbits(x), WHITEBITS | bitmask(BLACKBIT)))
 
-#define tofinalize(x)	testbit((x)->marked, FINALIZEDBIT)
+#define tofinalize(x)	testbit(gcbits(x), FINALIZEDBIT)
 
 #define otherwhite(g)	((g)->currentwhite ^ WHITEBITS)
 #define isdeadm(ow,m)	((m) & (ow))
-#define isdead(g,v)	isdeadm(otherwhite(g), (v)->marked)
+#define isdead(g,v)	isdeadm(otherwhite(g), gcbits(v))
 
-#define changewhite(x)	((x)->marked ^= WHITEBITS)
+#define changewhite(x)	(gcbits(x) ^= WHITEBITS)
 #define nw2black(x)  \
-	check_exp(!iswhite(x), l_setbit((x)->marked, BLACKBIT))
+	check_exp(!iswhite(x), l_setbit(gcbits(x), BLACKBIT))
 
 #define luaC_white(g)	cast_byte((g)->currentwhite & WHITEBITS)
 
@@ -117,8 +141,8 @@
 
 #define AGEBITS		7  /* all age bits (111) */
 
-#define getage(o)	((o)->marked & AGEBITS)
-#define setage(o,a)  ((o)->marked = cast_byte(((o)->marked & (~AGEBITS)) | a))
+#define getage(o)	(gcbits(o) & AGEBITS)
+#define setage(o,a)  (gcbits(o) = cast_byte((gcbits(o) & (~AGEBITS)) | a))
 #define isold(o)	(getage(o) > G_SURVIVAL)
 
 
@@ -201,9 +225,44 @@
 #define LUAI_GCSTEPSIZE	(200 * sizeof(Table))
 
 
+/* both modes */
+
+/* Number of helper threads for parallel marking (0 marks serially) */
+#define LUAI_GCMARKTHREADS	0
+
+/* Whether to free dead objects in a background thread */
+#define LUAI_GCSWEEPTHREAD	0
+
+/* Time budget for each step, in microseconds (0 means no budget) */
+#define LUAI_GCSTEPTIME		0
+
+/* Whether finalizers run only when the program asks for them */
+#define LUAI_GCDEFERFIN		0
+
+/* Whether threads keep their stacks as small as possible */
+#define LUAI_GCLEANSTACKS	0
+
+/* Maximum number of dead threads kept for reuse */
+#define LUAI_GCTHREADPOOL	0
+
+
+/* goals for adaptive mode (0 means no goal) */
+
+/* Longest acceptable pause, in microseconds */
+#define LUAI_GCPAUSEGOAL	0
+
+/* Largest acceptable heap, as a percentage of the live bytes */
+#define LUAI_GCMEMGOAL		0
+
+/* Initial guess for the collector speed, in work units per millisecond */
+#define LUAI_GCRATE		50000
+
+
 #define setgcparam(g,p,v)  (g->gcparams[LUA_GCP##p] = luaO_codeparam(v))
 #define applygcparam(g,p,x)  luaO_applyparam(g->gcparams[LUA_GCP##p], x)
 
+#define leanstacks(g)	((g)->gcparams[LUA_GCPLEANSTACKS] != 0)
+
 /* }====================================================== */
 
 
@@ -216,6 +275,16 @@
 #define gcrunning(g)	((g)->gcstp == 0)
 
 
+/*
+** Add 'n' objects and 'b' bytes to kind 'k' (LUA_BD*) in the live
+** counters of 'g' (see 'lua_GCBreakdown'). Objects are counted when
+** created and when freed; vectors they own are counted where they are
+** resized while the object is alive.
+*/
+#define luaC_bdadd(g,k,n,b)  \
+	((g)->bdcount[k] += (n), (g)->bdbytes[k] += cast(l_mem, b))
+
+
 /*
 ** Does one step of collection when debt becomes zero. 'pre'/'pos'
 ** allows some adjustments to be done only when needed. macro
@@ -251,18 +320,65 @@
 #define luaC_barrierback(L,p,v) (  \
 	iscollectable(v) ? luaC_objbarrierback(L, p, gcvalue(v)) : cast_void(0))
 
+/*
+** Barriers for a value 'v' stored into table 't' under key 'k' (or
+** integer key 'i', or string key 's'). In generational mode, a large old table does not
+** go back to 'grayagain' as a whole; only the card (a slice of
+** 2^CARDBITS slots) holding the key is marked dirty, and minor
+** collections traverse only dirty cards. Tables with less than
+** CARDMINSLOTS slots use the usual back barrier.
+*/
+#define CARDBITS	7
+#define CARDMINSLOTS	(8u << CARDBITS)
+
+#define luaC_barriertab(L,t,k,v) (  \
+	(iscollectable(v) && isblack(t) && iswhite(gcvalue(v))) ?  \
+	luaC_barriertab_(L,t,k) : cast_void(0))
+
+#define luaC_barriertabi(L,t,i,v) (  \
+	(iscollectable(v) && isblack(t) && iswhite(gcvalue(v))) ?  \
+	luaC_barriertabi_(L,t,i) : cast_void(0))
+
+#define luaC_barriertabs(L,t,s,v) (  \
+	(iscollectable(v) && isblack(t) && iswhite(gcvalue(v))) ?  \
+	luaC_barriertabs_(L,t,s) : cast_void(0))
+
 LUAI_FUNC void luaC_fix (lua_State *L, GCObject *o);
 LUAI_FUNC void luaC_freeallobjects (lua_State *L);
 LUAI_FUNC void luaC_step (lua_State *L);
+LUAI_FUNC int luaC_timedstep (lua_State *L, l_mem budget);
 LUAI_FUNC void luaC_runtilstate (lua_State *L, int state, int fast);
 LUAI_FUNC void luaC_fullgc (lua_State *L, int isemergency);
+LUAI_FUNC void luaC_addpressure (lua_State *L, l_mem n);
+LUAI_FUNC l_mem luaC_compact (lua_State *L);
+LUAI_FUNC int luaC_runfinalizers (lua_State *L, int n);
 LUAI_FUNC GCObject *luaC_newobj (lua_State *L, lu_byte tt, size_t sz);
+LUAI_FUNC void luaC_relink (lua_State *L, GCObject *o);
 LUAI_FUNC GCObject *luaC_newobjdt (lua_State *L, lu_byte tt, size_t sz,
                                                  size_t offset);
 LUAI_FUNC void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v);
 LUAI_FUNC void luaC_barrierback_ (lua_State *L, GCObject *o);
+LUAI_FUNC void luaC_barriertab_ (lua_State *L, Table *t, const TValue *k);
+LUAI_FUNC void luaC_barriertabi_ (lua_State *L, Table *t, lua_Integer i);
+LUAI_FUNC void luaC_barriertabs_ (lua_State *L, Table *t, TString *s);
+LUAI_FUNC void luaC_touchslot (lua_State *L, Table *t, unsigned slot);
+LUAI_FUNC void luaC_dropcards (lua_State *L, Table *t);
 LUAI_FUNC void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt);
 LUAI_FUNC void luaC_changemode (lua_State *L, int newmode);
+LUAI_FUNC void luaC_setallocsafe (lua_State *L, int safe);
+LUAI_FUNC void luaC_settelemetry (lua_State *L, int on);
+LUAI_FUNC void luaC_setgcevents (lua_State *L, lua_GCEventFunction f,
+                                 void *ud);
+LUAI_FUNC int luaC_getgcstats (lua_State *L, lua_GCPhaseStats *s,
+                               int reset);
+LUAI_FUNC void luaC_setadaptive (lua_State *L, int on);
+LUAI_FUNC int luaC_heapsnapshot (lua_State *L, lua_Writer writer,
+                                 void *data);
+LUAI_FUNC void luaC_getbreakdown (lua_State *L, lua_GCBreakdown *b);
+
+#if defined(LUA_DEBUG)
+LUAI_FUNC int luaC_isdirtyslot (global_State *g, Table *t, unsigned slot);
+#endif
 
 
 #endif
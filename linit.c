@@ -36,6 +36,7 @@ static const luaL_Reg stdlibs[] = {
   {LUA_STRLIBNAME, luaopen_string},
   {LUA_TABLIBNAME, luaopen_table},
   {LUA_UTF8LIBNAME, luaopen_utf8},
+  {LUA_RELIBNAME, luaopen_re},
 #ifdef __rtems__
   {LUA_RTEMSLIBNAME, luaopen_rtems},
   {LUA_PCILIBNAME, luaopen_pci},
@@ -61,7 +62,7 @@ LUALIB_API void luaL_openselectedlibs (lua_State *L, int load, int preload) {
       lua_setfield(L, -2, lib->name);  /* add library to PRELOAD table */
     }
   }
-  lua_assert((mask >> 1) == LUA_UTF8LIBK);
+  lua_assert((mask >> 1) == LUA_RELIBK);
   lua_pop(L, 1);  /* remove PRELOAD table */
 }
 
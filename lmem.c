@@ -60,6 +60,21 @@
 
 
 
+/*
+** Hooks for the allocation profiler (see 'luaG_allocsample'): each new
+** block counts down the bytes to the next sample, and each freed block
+** that passes the filter may be a sample leaving the profile.
+*/
+#define profalloc(L,g,b,size,tag)  \
+  { if (l_unlikely(((g)->allocleft -= cast(l_mem, size)) < 0))  \
+      luaG_allocsample(L, b, size, tag); }
+
+#define proffree(g,b)  \
+  { if (l_unlikely((g)->allocfilter != NULL) &&  \
+        (g)->allocfilter[luaG_apfilter(b)] != 0)  \
+      luaG_allocfree(g, b); }
+
+
 #if defined(EMERGENCYGCTESTS)
 /*
 ** First allocation will fail except when freeing a block (frees never
@@ -150,6 +165,7 @@ l_noret luaM_toobig (lua_State *L) {
 void luaM_free_ (lua_State *L, void *block, size_t osize) {
   global_State *g = G(L);
   lua_assert((osize == 0) == (block == NULL));
+  proffree(g, block);
   callfrealloc(g, block, osize, 0);
   g->GCdebt += cast(l_mem, osize);
 }
@@ -185,6 +201,28 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
   }
   lua_assert((nsize == 0) == (newblock == NULL));
   g->GCdebt -= cast(l_mem, nsize) - cast(l_mem, osize);
+  if (block != NULL)
+    proffree(g, block);
+  if (nsize > 0)
+    profalloc(L, g, newblock, nsize, 0);
+  return newblock;
+}
+
+
+/*
+** Reallocate a block to its own size, which lets the allocator move it
+** (see 'luaC_compact'). A failure is not an error: the block stays
+** where it was. The accounting does not change, and a sample of the
+** allocation profiler follows its block.
+*/
+void *luaM_move (lua_State *L, void *block, size_t size) {
+  global_State *g = G(L);
+  void *newblock = callfrealloc(g, block, size, size);
+  if (newblock == NULL)
+    return block;  /* keep it */
+  if (newblock != block && l_unlikely(g->allocfilter != NULL) &&
+      g->allocfilter[luaG_apfilter(block)] != 0)
+    luaG_allocmove(g, block, newblock);
   return newblock;
 }
 
@@ -210,6 +248,292 @@ void *luaM_malloc_ (lua_State *L, size_t size, int tag) {
         luaM_error(L);
     }
     g->GCdebt -= cast(l_mem, size);
+    profalloc(L, g, newblock, size, tag);
     return newblock;
   }
 }
+
+
+#if defined(LUA_USE_SIDEMARKS)
+
+/*
+** {==================================================================
+** Heap for collectable objects
+** ===================================================================
+*/
+
+/* free slots are chained through 'bits'; this value ends the chain */
+#define NOSLOT		HEAPBIG
+
+/* maximum number of slots in a page */
+#define MAXSLOTS	HEAPMAIN
+
+#define heapclass(sz)	(((sz) + 15) / 16 - 1)
+#define classsize(c)	(((c) + 1) * 16)
+
+/* offset of the first slot in a page */
+#define FIRSTSLOT	((sizeof(HeapPage) + 15) & ~cast_sizet(15))
+
+/*
+** Objects in pages do not go through the allocator; these hooks let a
+** debug allocator count them anyway, and fail their creation (when
+** 'luai_heapnew' returns 0), as if they did (see 'ltests.h').
+*/
+#if !defined(luai_heapnew)
+#define luai_heapnew(tag)	((void)(tag), 1)
+#define luai_heapfree(tag)	((void)(tag))
+#endif
+
+
+typedef struct HeapArena {
+  struct HeapArena *next, *prev;  /* list of arenas with free pages */
+  void *block;  /* block from the allocator */
+  HeapPage *free;  /* list of free pages */
+  int nfree;  /* number of free pages */
+  int npages;  /* total number of pages */
+  lu_byte bits[HEAPARENA + 1][MAXSLOTS];  /* GC bits for each page */
+} HeapArena;
+
+
+/*
+** Allocate a block for the heap, with an emergency collection if
+** needed. The heap accounts its objects in 'GCdebt', not its blocks.
+*/
+static void *heapalloc (lua_State *L, size_t size, int tag) {
+  global_State *g = G(L);
+  void *b = firsttry(g, NULL, cast_sizet(tag), size);
+  if (l_unlikely(b == NULL)) {
+    b = tryagain(L, NULL, cast_sizet(tag), size);
+    if (b == NULL)
+      luaM_error(L);
+  }
+  return b;
+}
+
+
+static void arenalink (global_State *g, HeapArena *a) {
+  a->prev = NULL;
+  a->next = g->arenas;
+  if (a->next != NULL)
+    a->next->prev = a;
+  g->arenas = a;
+}
+
+
+static void arenaunlink (global_State *g, HeapArena *a) {
+  if (a->prev != NULL)
+    a->prev->next = a->next;
+  else
+    g->arenas = a->next;
+  if (a->next != NULL)
+    a->next->prev = a->prev;
+}
+
+
+/*
+** Create a new arena, cutting its block in pages aligned to their size.
+*/
+static HeapArena *newarena (lua_State *L) {
+  global_State *g = G(L);
+  size_t bsize = (HEAPARENA + 1) * HEAPPAGE;
+  HeapArena *a = cast(HeapArena *, heapalloc(L, sizeof(HeapArena), 0));
+  char *p;
+  a->block = firsttry(g, NULL, 0, bsize);
+  if (l_unlikely(a->block == NULL)) {
+    a->block = tryagain(L, NULL, 0, bsize);
+    if (a->block == NULL) {
+      callfrealloc(g, a, sizeof(HeapArena), 0);
+      luaM_error(L);
+    }
+  }
+  p = cast_charp(a->block);
+  p += (HEAPPAGE - (cast_sizet(p) & (HEAPPAGE - 1))) & (HEAPPAGE - 1);
+  a->free = NULL;
+  a->npages = 0;
+  while (p + HEAPPAGE <= cast_charp(a->block) + bsize) {
+    HeapPage *pg = cast(HeapPage *, p);
+    pg->bits = a->bits[a->npages];
+    pg->next = a->free;
+    a->free = pg;
+    a->npages++;
+    p += HEAPPAGE;
+  }
+  a->nfree = a->npages;
+  arenalink(g, a);
+  return a;
+}
+
+
+static void freearena (global_State *g, HeapArena *a) {
+  arenaunlink(g, a);
+  callfrealloc(g, a->block, (HEAPARENA + 1) * HEAPPAGE, 0);
+  callfrealloc(g, a, sizeof(HeapArena), 0);
+}
+
+
+static void pagelink (global_State *g, HeapPage *pg) {
+  pg->prev = NULL;
+  pg->next = g->heapavail[pg->cls];
+  if (pg->next != NULL)
+    pg->next->prev = pg;
+  g->heapavail[pg->cls] = pg;
+}
+
+
+static void pageunlink (global_State *g, HeapPage *pg) {
+  if (pg->prev != NULL)
+    pg->prev->next = pg->next;
+  else
+    g->heapavail[pg->cls] = pg->next;
+  if (pg->next != NULL)
+    pg->next->prev = pg->prev;
+}
+
+
+/*
+** Get a page for size class 'cls' from the first arena with free
+** pages, and chain all its slots in its free list.
+*/
+static HeapPage *newpage (lua_State *L, unsigned int cls) {
+  global_State *g = G(L);
+  HeapArena *a = g->arenas;
+  HeapPage *pg;
+  size_t size = classsize(cls);
+  size_t n = (HEAPPAGE - FIRSTSLOT) / size;
+  unsigned int i;
+  if (a == NULL || a->nfree == 0)
+    a = newarena(L);
+  pg = a->free;
+  a->free = pg->next;
+  if (--a->nfree == 0)
+    arenaunlink(g, a);  /* keep only arenas with free pages in the list */
+  if (n > MAXSLOTS)
+    n = MAXSLOTS;
+  pg->arena = a;
+  pg->size = cast(unsigned short, size);
+  pg->cls = cast_byte(cls);
+  pg->used = 0;
+  pg->freeslot = 0;
+  for (i = 0; i < n; i++)
+    pg->bits[i] = cast_byte(i + 1);
+  pg->bits[n - 1] = NOSLOT;
+  pagelink(g, pg);
+  return pg;
+}
+
+
+/*
+** Return an empty page to its arena.
+*/
+static void freepage (global_State *g, HeapPage *pg) {
+  HeapArena *a = pg->arena;
+  pageunlink(g, pg);
+  pg->next = a->free;
+  a->free = pg;
+  if (a->nfree++ == 0)
+    arenalink(g, a);  /* arena has free pages again */
+}
+
+
+/*
+** Create a block of 'size' bytes for a collectable object, returning in
+** 'slot' the value for its 'marked' field.
+*/
+void *luaM_newheapobj (lua_State *L, size_t size, int tag, lu_byte *slot) {
+  global_State *g = G(L);
+  void *b;
+  if (size > HEAPMAXSMALL) {
+    HeapBig *h = cast(HeapBig *, heapalloc(L, sizeof(HeapBig) + size, tag));
+    *slot = HEAPBIG;
+    b = h + 1;
+  }
+  else {
+    unsigned int cls = cast_uint(heapclass(size));
+    HeapPage *pg;
+    lu_byte s;
+    if (l_unlikely(!luai_heapnew(tag))) {  /* creation failed? */
+      if (!cantryagain(g))
+        luaM_error(L);
+      luaC_fullgc(L, 1);  /* try to free some memory... */
+      if (!luai_heapnew(tag))  /* try again */
+        luaM_error(L);
+    }
+    pg = g->heapavail[cls];
+    if (pg == NULL)
+      pg = newpage(L, cls);
+    s = pg->freeslot;
+    pg->freeslot = pg->bits[s];
+    pg->used++;
+    if (pg->freeslot == NOSLOT)  /* page is full? */
+      pageunlink(g, pg);
+    *slot = s;
+    b = cast_charp(pg) + FIRSTSLOT + cast_sizet(s) * pg->size;
+  }
+  g->GCdebt -= cast(l_mem, size);
+  profalloc(L, g, b, size, tag);
+  return b;
+}
+
+
+void luaM_freeheapobj (lua_State *L, void *block, size_t size, int tag) {
+  global_State *g = G(L);
+  proffree(g, block);
+  if (size > HEAPMAXSMALL) {
+    HeapBig *h = cast(HeapBig *, block) - 1;
+    callfrealloc(g, h, sizeof(HeapBig) + size, 0);
+  }
+  else {
+    HeapPage *pg = luaM_heappage(block);
+    size_t s = (cast_sizet(cast_charp(block) - cast_charp(pg)) - FIRSTSLOT)
+             / pg->size;
+    luai_heapfree(tag);
+    if (pg->freeslot == NOSLOT)  /* page was full? */
+      pagelink(g, pg);
+    pg->bits[s] = pg->freeslot;
+    pg->freeslot = cast_byte(s);
+    /* return empty page to its arena, unless it is the only one */
+    if (--pg->used == 0 && (pg->prev != NULL || pg->next != NULL))
+      freepage(g, pg);
+  }
+  g->GCdebt += cast(l_mem, size);
+}
+
+
+/*
+** Free all empty arenas but one. Called at the end of each cycle.
+*/
+void luaM_trimheap (lua_State *L) {
+  global_State *g = G(L);
+  HeapArena *a = g->arenas;
+  int keep = 1;
+  while (a != NULL) {
+    HeapArena *next = a->next;
+    if (a->nfree == a->npages && keep-- <= 0)
+      freearena(g, a);
+    a = next;
+  }
+}
+
+
+/*
+** Free the whole heap. Called when closing the state, after all objects
+** were freed, so all pages are empty and all arenas are in the list.
+*/
+void luaM_freeheap (lua_State *L) {
+  global_State *g = G(L);
+  int i;
+  for (i = 0; i < HEAPCLASSES; i++) {  /* return pages kept by classes */
+    while (g->heapavail[i] != NULL) {
+      lua_assert(g->heapavail[i]->used == 0);
+      freepage(g, g->heapavail[i]);
+    }
+  }
+  while (g->arenas != NULL) {
+    lua_assert(g->arenas->nfree == g->arenas->npages);
+    freearena(g, g->arenas);
+  }
+}
+
+/* }================================================================== */
+
+#endif
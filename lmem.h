@@ -91,6 +91,64 @@ LUAI_FUNC void *luaM_growaux_ (lua_State *L, void *block, int nelems,
 LUAI_FUNC void *luaM_shrinkvector_ (lua_State *L, void *block, int *nelem,
                                     int final_n, unsigned size_elem);
 LUAI_FUNC void *luaM_malloc_ (lua_State *L, size_t size, int tag);
+LUAI_FUNC void *luaM_move (lua_State *L, void *block, size_t size);
+
+
+#if defined(LUA_USE_SIDEMARKS)
+
+/*
+** Heap for collectable objects. Objects up to HEAPMAXSMALL bytes live
+** in pages of HEAPPAGE bytes, aligned to their size and holding objects
+** of a single size class. The GC bits of the objects in a page are kept
+** in the side array 'bits', indexed by the 'marked' field of the
+** objects. These arrays live outside the pages, in the arena records,
+** so that marking does not write into the pages at all. Bigger objects
+** get their own blocks, preceded by a 'HeapBig' with their GC bits.
+** Pages come from arenas of HEAPARENA pages (or one more, if the block
+** of the arena happens to be aligned).
+*/
+#define HEAPPAGE	((size_t)8192)
+#define HEAPMAXSMALL	512
+#define HEAPCLASSES	(HEAPMAXSMALL / 16)
+#define HEAPARENA	16
+
+/* special values for the 'marked' field (all other values are slots) */
+#define HEAPMAIN	254	/* main thread */
+#define HEAPBIG		255	/* big object */
+
+typedef struct HeapPage {
+  struct HeapPage *next, *prev;  /* list of pages with free slots */
+  struct HeapArena *arena;  /* arena owning this page */
+  lu_byte *bits;  /* GC bits of each slot (in the arena record) */
+  unsigned short size;  /* size of each slot */
+  lu_byte cls;  /* size class */
+  lu_byte used;  /* number of slots in use */
+  lu_byte freeslot;  /* first free slot (free slots chained in 'bits') */
+} HeapPage;
+
+typedef union HeapBig {
+  lu_byte bits;  /* GC bits of the object */
+  LUAI_MAXALIGN;  /* keep the object aligned */
+} HeapBig;
+
+#define luaM_heappage(p)  \
+	cast(HeapPage *, cast_charp(p) - (cast_sizet(p) & (HEAPPAGE - 1)))
+
+#define luaM_freeobject(L,b,s,tag)	luaM_freeheapobj(L, (b), (s), tag)
+
+LUAI_FUNC void *luaM_newheapobj (lua_State *L, size_t size, int tag,
+                                                lu_byte *slot);
+LUAI_FUNC void luaM_freeheapobj (lua_State *L, void *block, size_t size,
+                                               int tag);
+LUAI_FUNC void luaM_trimheap (lua_State *L);
+LUAI_FUNC void luaM_freeheap (lua_State *L);
+
+#else
+
+#define luaM_freeobject(L,b,s,tag)	luaM_free_(L, (b), (s))
+
+#endif
+
 
 #endif
 
@@ -212,6 +212,245 @@ static int isneg (const char **s) {
 
 
 
+/*
+** {==================================================================
+** Support for fast conversions between floats and decimal numerals
+** ===================================================================
+*/
+
+/*
+** These conversions need 64-bit integers and IEEE doubles. Without
+** them, Lua uses only 'lua_str2number' and 'sprintf'.
+*/
+#if LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE && !defined(LUA_USE_C89)
+
+#define L_FASTNUMCONV
+
+#include <stdint.h>
+
+typedef uint64_t l_uint64;
+
+#include "lpow10.h"
+
+
+/*
+** Computes the 128-bit product 'a' * 'b'.
+*/
+static void mul128 (l_uint64 a, l_uint64 b, l_uint64 *hi, l_uint64 *lo) {
+#if defined(__SIZEOF_INT128__)
+  __extension__ typedef unsigned __int128 l_uint128;
+  l_uint128 p = (l_uint128)a * b;
+  *hi = (l_uint64)(p >> 64);
+  *lo = (l_uint64)p;
+#else  /* do it by hand, in 32-bit halves */
+  l_uint64 a0 = a & 0xffffffffu, a1 = a >> 32;
+  l_uint64 b0 = b & 0xffffffffu, b1 = b >> 32;
+  l_uint64 p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0;
+  l_uint64 mid = (p00 >> 32) + (p01 & 0xffffffffu) + (p10 & 0xffffffffu);
+  *hi = a1 * b1 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+  *lo = (mid << 32) | (p00 & 0xffffffffu);
+#endif
+}
+
+
+/*
+** Number of leading zero bits in 'x' (which cannot be zero)
+*/
+static int clz64 (l_uint64 x) {
+#if defined(__GNUC__) && !defined(LUA_NOBUILTIN)
+  return __builtin_clzll(x);
+#else
+  int n = 0;
+  if (x >> 32 == 0) { n += 32; x <<= 32; }
+  if (x >> 48 == 0) { n += 16; x <<= 16; }
+  if (x >> 56 == 0) { n += 8; x <<= 8; }
+  while (!(x >> 63)) { n++; x <<= 1; }
+  return n;
+#endif
+}
+
+
+/*
+** Clinger's fast path needs floating-point operations to be done in
+** the precision of their types, without excess precision.
+*/
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define L_CLINGER
+
+/* powers of ten represented exactly as doubles */
+static const double exactpowten[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#endif
+
+
+/* maximum number of significant digits read by 'l_str2dec' */
+#define MAXDECDIG	19
+
+/* limit for exponents and leading fractional zeros in 'l_str2dec' */
+#define MAXDECEXP	10000
+
+
+/*
+** Computes the IEEE representation of the double nearest to 'w'*10^'q',
+** using the Eisel-Lemire algorithm (D. Lemire, "Number Parsing at a
+** Gigabyte per Second"). It multiplies 'w' by a truncated 128-bit
+** approximation of 10^q, so that the result may be a little below
+** the true product. Returns 0 when that uncertainty could affect the
+** rounding; the caller then must use an exact algorithm.
+*/
+static int eisellemire (l_uint64 w, int q, l_uint64 *res) {
+  const l_uint64 *g;
+  l_uint64 hi, lo, m;
+  int lz, upperbit, e;
+  if (w == 0 || q < POWTEN_MIN) {  /* result rounds to zero? */
+    *res = 0;
+    return 1;
+  }
+  else if (q > DBL_MAX_10_EXP) {  /* result overflows? */
+    *res = (l_uint64)0x7ff << 52;  /* infinity */
+    return 1;
+  }
+  lz = clz64(w);
+  w <<= lz;  /* normalize 'w' */
+  g = powten[q - POWTEN_MIN];
+  mul128(w, g[0], &hi, &lo);
+  if ((hi & 0x1ff) == 0x1ff) {  /* low bits may change rounding? */
+    l_uint64 hi2, lo2;
+    mul128(w, g[1], &hi2, &lo2);  /* use the other 64 bits of 10^q */
+    lo += hi2;
+    hi += (lo < hi2);  /* carry */
+    if ((hi & 0x1ff) == 0x1ff && lo >= ~(l_uint64)0 - 1)
+      return 0;  /* error can still propagate to the kept bits */
+  }
+  upperbit = cast_int(hi >> 63);
+  m = hi >> (upperbit + 9);  /* 53 bits plus a rounding bit */
+  /* binary exponent: floor(q * log2(10)) + 63 (with a bias to keep the
+     shift well defined for negative values) plus corrections */
+  e = cast_int(((int64_t)q * 217706 + ((int64_t)1 << 32)) >> 16) - 65536
+      + 63 + upperbit - lz + 1023;
+  if (e <= 0) {  /* subnormal? */
+    if (-e + 1 >= 64) {  /* too small? */
+      *res = 0;
+      return 1;
+    }
+    m >>= -e + 1;
+    m += (m & 1);  /* round */
+    m >>= 1;
+    /* rounding may have made it a normal number */
+    *res = m;  /* also sets exponent 1 if 'm' got the 2^52 bit */
+    return 1;
+  }
+  if (lo <= 1 && 0 <= q && q <= 23 && (m & 3) == 1 &&
+      (m << (upperbit + 9)) == hi)  /* exactly halfway? */
+    m &= ~(l_uint64)1;  /* round to even (down) */
+  m += (m & 1);  /* round (half up) */
+  m >>= 1;
+  if (m >= (l_uint64)2 << 52) {  /* rounding overflowed the mantissa? */
+    m >>= 1;
+    e++;
+  }
+  if (e >= 0x7ff)  /* overflow? */
+    *res = (l_uint64)0x7ff << 52;  /* infinity */
+  else
+    *res = (m & (((l_uint64)1 << 52) - 1)) | ((l_uint64)e << 52);
+  return 1;
+}
+
+
+/*
+** Fast conversion of a decimal numeral to a number, reading the
+** numeral only once. Integral numerals that fit in a lua_Integer
+** go to integers; others go to floats, using Clinger's fast path
+** (one exact floating-point operation) when possible and the
+** Eisel-Lemire algorithm otherwise. Returns NULL for anything it
+** cannot handle (hexadecimals, numerals with too many digits or with
+** exponents or leading zeros beyond MAXDECEXP, other radix marks, and
+** all invalid numerals), which must then go through the general
+** conversions.
+*/
+static const char *l_str2dec (const char *s, TValue *o) {
+  l_uint64 w = 0;  /* significant digits */
+  int nd = 0;  /* number of significant digits */
+  int q = 0;  /* decimal exponent */
+  int isfloat = 0;
+  int neg;
+  const char *s0;  /* start of the digits */
+  while (lisspace(cast_uchar(*s))) s++;  /* skip initial spaces */
+  neg = isneg(&s);
+  s0 = s;
+  while (*s == '0') s++;  /* skip leading zeros */
+  for (; lisdigit(cast_uchar(*s)); s++, nd++)  /* integral part */
+    w = w * 10 + cast_uint(*s - '0');
+  if (*s == '.') {
+    isfloat = 1;
+    s++;  /* skip dot */
+    if (nd == 0) {  /* no significant digits yet? */
+      for (; *s == '0'; s++) {  /* skip leading zeros */
+        if (--q < -MAXDECEXP)
+          return NULL;  /* too many zeros */
+      }
+    }
+    for (; lisdigit(cast_uchar(*s)); s++, nd++, q--)  /* fractional part */
+      w = w * 10 + cast_uint(*s - '0');
+  }
+  if (nd > MAXDECDIG)
+    return NULL;  /* too many digits ('w' may have overflowed) */
+  else if (s == s0 || (s == s0 + 1 && isfloat))
+    return NULL;  /* no digits */
+  if (*s == 'e' || *s == 'E') {  /* exponent part? */
+    int exp = 0;
+    int neg1;
+    s++;  /* skip 'e' */
+    neg1 = isneg(&s);
+    if (!lisdigit(cast_uchar(*s)))
+      return NULL;  /* must have at least one digit */
+    for (; lisdigit(cast_uchar(*s)); s++) {
+      exp = exp * 10 + (*s - '0');
+      if (exp >= MAXDECEXP)
+        return NULL;  /* exponent too large */
+    }
+    q += (neg1) ? -exp : exp;
+    isfloat = 1;
+  }
+  while (lisspace(cast_uchar(*s))) s++;  /* skip trailing spaces */
+  if (*s != '\0')
+    return NULL;
+  if (!isfloat && w <= cast(l_uint64, LUA_MAXINTEGER) + cast_uint(neg)) {
+    lua_Unsigned u = cast(lua_Unsigned, w);
+    setivalue(o, l_castU2S((neg) ? 0u - u : u));
+  }
+  else {
+    double n;
+#if defined(L_CLINGER)
+    if (w <= (l_uint64)1 << 53 && -22 <= q && q <= 22) {  /* exact? */
+      n = cast_num(w);  /* exact conversion */
+      if (q < 0) n /= exactpowten[-q];  /* one correctly-rounded op. */
+      else n *= exactpowten[q];
+    }
+    else
+#endif
+    {
+      l_uint64 bits;
+      if (!eisellemire(w, q, &bits))
+        return NULL;  /* use an exact algorithm */
+      memcpy(&n, &bits, sizeof(n));
+    }
+    setfltvalue(o, (neg) ? -n : n);
+  }
+  return s;
+}
+
+#else
+
+#define l_str2dec(s,o)		NULL
+
+#endif
+/* }====================================================== */
+
+
 /*
 ** {==================================================================
 ** Lua's implementation for 'lua_strx2number'
@@ -381,7 +620,10 @@ static const char *l_str2int (const char *s, lua_Integer *result) {
 size_t luaO_str2num (const char *s, TValue *o) {
   lua_Integer i; lua_Number n;
   const char *e;
-  if ((e = l_str2int(s, &i)) != NULL) {  /* try as an integer */
+  if ((e = l_str2dec(s, o)) != NULL) {  /* common decimal numeral? */
+    /* already converted */
+  }
+  else if ((e = l_str2int(s, &i)) != NULL) {  /* try as an integer */
     setivalue(o, i);
   }
   else if ((e = l_str2d(s, &n)) != NULL) {  /* else try as a float */
@@ -425,24 +667,284 @@ int luaO_utf8esc (char *buff, l_uint32 x) {
 #endif
 
 
+/* all pairs of decimal digits, from "00" to "99" */
+static const char digitpairs[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+
+/*
+** {==================================================================
+** Lua's implementation for 'lua_integer2str'
+** ===================================================================
+*/
+
+#if !defined(lua_integer2str)
+
+/*
+** Convert an integer to a decimal numeral, producing two digits per
+** division. The digits are generated from right to left in a temporary
+** buffer, as the length of the numeral is not known in advance.
+*/
+static int lua_integer2str (char *buff, size_t sz, lua_Integer n) {
+  char temp[3 * sizeof(lua_Integer)];  /* enough for all digits */
+  char *p = temp + sizeof(temp);
+  lua_Unsigned u = l_castS2U(n);
+  int len;
+  (void)sz;  /* buffer always has space for an integer */
+  if (n < 0)
+    u = 0u - u;  /* absolute value (also correct for LUA_MININTEGER) */
+  while (u >= 100) {
+    const char *d = digitpairs + (u % 100) * 2;
+    u /= 100;
+    *--p = d[1];
+    *--p = d[0];
+  }
+  if (u >= 10) {
+    const char *d = digitpairs + u * 2;
+    *--p = d[1];
+    *--p = d[0];
+  }
+  else
+    *--p = cast_char('0' + u);
+  if (n < 0)
+    *--p = '-';
+  len = cast_int(temp + sizeof(temp) - p);
+  memcpy(buff, p, cast_sizet(len));
+  buff[len] = '\0';
+  return len;
+}
+
+#endif
+/* }====================================================== */
+
+
+/*
+** {==================================================================
+** Shortest round-trip conversion of floats
+** ===================================================================
+*/
+
+#if defined(LUA_USE_SHORTESTFLOAT)
+
+#if !defined(L_FASTNUMCONV)
+#error "option 'LUA_USE_SHORTESTFLOAT' needs C99 and double floats"
+#endif
+
+
+/*
+** Returns the high 64 bits of 'g' * 'c', where 'g' is a 128-bit
+** fraction, with its lowest bit set when the discarded bits are not
+** all zeros ("round to odd").
+*/
+static l_uint64 roundtoodd (const l_uint64 *g, l_uint64 c) {
+  l_uint64 hi, lo, xhi, xlo;
+  mul128(g[1], c, &xhi, &xlo);
+  mul128(g[0], c, &hi, &lo);
+  lo += xhi;
+  hi += (lo < xhi);  /* carry */
+  return hi | (lo > 1);
+}
+
+
+/*
+** floor(log10(2^e)), floor(log10(3/4 * 2^e)), and floor(log2(10^e)), for
+** all exponents used here. (A bias keeps the shifted values positive,
+** so that the shifts are well defined for negative exponents.)
+*/
+#define flog10pow2(e)  \
+	(cast_int(((int64_t)(e) * 1262611 + ((int64_t)1 << 32)) >> 22) - 1024)
+#define flog10threequarters(e)  \
+	(cast_int(((int64_t)(e) * 1262611 - 524031 + ((int64_t)1 << 32)) >> 22) \
+	  - 1024)
+#define flog2pow10(e)  \
+	(cast_int(((int64_t)(e) * 1741647 + ((int64_t)1 << 32)) >> 19) - 8192)
+
+
+/*
+** Computes the shortest decimal 'm' * 10^'k' that reads back as the
+** finite positive double with significand 'sig' and biased exponent
+** 'bexp', using the Schubfach algorithm (R. Giulietti, "The Schubfach
+** way to render doubles"). When there is more than one such decimal,
+** chooses the one nearest to the original number. The result may
+** have trailing zeros in 'm'.
+*/
+static l_uint64 schubfach (l_uint64 sig, int bexp, int *k) {
+  l_uint64 c, cbl, cb, cbr, vbl, vb, vbr, lower, upper, s;
+  const l_uint64 *g;
+  int q, h, even, closer;
+  if (bexp != 0) {  /* normal number? */
+    c = sig | ((l_uint64)1 << 52);
+    q = bexp - 1075;
+    if (-52 <= q && q <= 0 && (c & (((l_uint64)1 << -q) - 1)) == 0) {
+      *k = 0;  /* small integer; no conversion needed */
+      return c >> -q;
+    }
+  }
+  else {  /* subnormal number */
+    c = sig;
+    q = 1 - 1075;
+  }
+  even = (c % 2 == 0);  /* boundaries are included iff 'c' is even */
+  closer = (sig == 0 && bexp > 1);  /* lower boundary is closer? */
+  cbl = 4 * c - 2 + cast_uint(closer);
+  cb = 4 * c;
+  cbr = 4 * c + 2;
+  *k = closer ? flog10threequarters(q) : flog10pow2(q);
+  h = q + flog2pow10(-*k) + 1;
+  g = powten[-*k - POWTEN_MIN];
+  if (-*k < 0 || -*k > 55) {  /* inexact entry? round it up */
+    l_uint64 g1[2];
+    g1[1] = g[1] + 1;
+    g1[0] = g[0] + (g1[1] == 0);
+    vbl = roundtoodd(g1, cbl << h);
+    vb = roundtoodd(g1, cb << h);
+    vbr = roundtoodd(g1, cbr << h);
+  }
+  else {
+    vbl = roundtoodd(g, cbl << h);
+    vb = roundtoodd(g, cb << h);
+    vbr = roundtoodd(g, cbr << h);
+  }
+  lower = vbl + cast_uint(!even);
+  upper = vbr - cast_uint(!even);
+  s = vb / 4;
+  if (s >= 10) {  /* try one digit less */
+    l_uint64 sp = s / 10;
+    int upin = (lower <= 40 * sp);
+    int wpin = (upper >= 40 * sp + 40);
+    if (upin != wpin) {
+      (*k)++;
+      return sp + cast_uint(wpin);
+    }
+  }
+  {
+    int uin = (lower <= 4 * s);
+    int win = (upper >= 4 * s + 4);
+    if (uin != win)
+      return s + cast_uint(win);
+    else {  /* both or neither are valid; choose the nearest */
+      l_uint64 mid = 4 * s + 2;
+      return s + cast_uint(vb > mid || (vb == mid && (s & 1) != 0));
+    }
+  }
+}
+
+
+/*
+** Convert a finite float to its shortest numeral that reads back as
+** the same number. The numeral is formatted as '%.*g' would do it,
+** using the precision 'tostringbuffFloat' would use for that number
+** of digits ('LUA_NUMBER_FMT' or 'LUA_NUMBER_FMT_N'). So, the result
+** only differs from the 'sprintf' one when that has superfluous digits.
+*/
+static int tostringshortest (lua_Number n, char *buff) {
+  char digs[24];  /* significant digits, right-aligned */
+  char *p = digs + sizeof(digs);
+  l_uint64 bits, m;
+  int k, ndig, x, len = 0;
+  memcpy(&bits, &n, sizeof(bits));
+  if (bits >> 63)
+    buff[len++] = '-';
+  if ((bits << 1) == 0) {  /* zero? */
+    buff[len++] = '0';
+    buff[len] = '\0';
+    return len;
+  }
+  m = schubfach(bits & (((l_uint64)1 << 52) - 1),
+                cast_int((bits >> 52) & 0x7ff), &k);
+  while (m % 10 == 0) {  /* remove trailing zeros */
+    m /= 10;
+    k++;
+  }
+  for (; m >= 100; m /= 100) {
+    const char *d = digitpairs + (m % 100) * 2;
+    *--p = d[1];
+    *--p = d[0];
+  }
+  if (m >= 10) {
+    *--p = digitpairs[m * 2 + 1];
+    *--p = digitpairs[m * 2];
+  }
+  else
+    *--p = cast_char('0' + m);
+  ndig = cast_int(digs + sizeof(digs) - p);
+  x = k + ndig - 1;  /* exponent in scientific notation */
+  if (x < -4 || x >= (ndig <= l_floatatt(DIG) ? l_floatatt(DIG)
+                                               : l_floatatt(DIG) + 2)) {
+    buff[len++] = *p;  /* scientific notation */
+    if (ndig > 1) {
+      buff[len++] = lua_getlocaledecpoint();
+      memcpy(buff + len, p + 1, cast_sizet(ndig - 1));
+      len += ndig - 1;
+    }
+    buff[len++] = 'e';
+    buff[len++] = (x < 0) ? '-' : '+';
+    if (x < 0) x = -x;
+    if (x >= 100)
+      buff[len++] = cast_char('0' + x / 100);
+    buff[len++] = digitpairs[(x % 100) * 2];
+    buff[len++] = digitpairs[(x % 100) * 2 + 1];
+  }
+  else if (x < 0) {  /* 0.000ddd */
+    buff[len++] = '0';
+    buff[len++] = lua_getlocaledecpoint();
+    memset(buff + len, '0', cast_sizet(-x - 1));
+    len += -x - 1;
+    memcpy(buff + len, p, cast_sizet(ndig));
+    len += ndig;
+  }
+  else if (ndig <= x + 1) {  /* integral value: ddd000 */
+    memcpy(buff + len, p, cast_sizet(ndig));
+    len += ndig;
+    memset(buff + len, '0', cast_sizet(x + 1 - ndig));
+    len += x + 1 - ndig;
+  }
+  else {  /* ddd.ddd */
+    memcpy(buff + len, p, cast_sizet(x + 1));
+    len += x + 1;
+    buff[len++] = lua_getlocaledecpoint();
+    memcpy(buff + len, p + x + 1, cast_sizet(ndig - x - 1));
+    len += ndig - x - 1;
+  }
+  buff[len] = '\0';
+  return len;
+}
+
+#endif
+/* }====================================================== */
+
+
 /*
 ** Convert a float to a string, adding it to a buffer. First try with
 ** a not too large number of digits, to avoid noise (for instance,
 ** 1.1 going to "1.1000000000000001"). If that lose precision, so
 ** that reading the result back gives a different number, then do the
-** conversion again with extra precision. Moreover, if the numeral looks
-** like an integer (without a decimal point or an exponent), add ".0" to
-** its end.
+** conversion again with extra precision. (With 'LUA_USE_SHORTESTFLOAT',
+** finite numbers are converted directly to the shortest numeral that
+** reads back correctly.) Moreover, if the numeral looks like an integer
+** (without a decimal point or an exponent), add ".0" to its end.
 */
 static int tostringbuffFloat (lua_Number n, char *buff) {
-  /* first conversion */
-  int len = l_sprintf(buff, LUA_N2SBUFFSZ, LUA_NUMBER_FMT,
+  int len;
+#if defined(LUA_USE_SHORTESTFLOAT)
+  if (isfinite(n))
+    len = tostringshortest(n, buff);
+  else
+#endif
+  {  /* first conversion */
+    lua_Number check;
+    len = l_sprintf(buff, LUA_N2SBUFFSZ, LUA_NUMBER_FMT,
+                                         (LUAI_UACNUMBER)n);
+    check = lua_str2number(buff, NULL);  /* read it back */
+    if (check != n) {  /* not enough precision? */
+      /* convert again with more precision */
+      len = l_sprintf(buff, LUA_N2SBUFFSZ, LUA_NUMBER_FMT_N,
                             (LUAI_UACNUMBER)n);
-  lua_Number check = lua_str2number(buff, NULL);  /* read it back */
-  if (check != n) {  /* not enough precision? */
-    /* convert again with more precision */
-    len = l_sprintf(buff, LUA_N2SBUFFSZ, LUA_NUMBER_FMT_N,
-                          (LUAI_UACNUMBER)n);
+    }
   }
   /* looks like an integer? */
   if (buff[strspn(buff, "-0123456789")] == '\0') {
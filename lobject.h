@@ -584,6 +584,7 @@ typedef struct AbsLineInfo {
 */
 #define PF_ISVARARG	1
 #define PF_FIXED	2  /* prototype has parts in fixed memory */
+#define PF_COUNTED	4  /* vectors are in the live counters */
 
 
 /*
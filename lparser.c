@@ -821,6 +821,7 @@ static void close_func (LexState *ls) {
   luaM_shrinkvector(L, f->p, f->sizep, fs->np, Proto *);
   luaM_shrinkvector(L, f->locvars, f->sizelocvars, fs->ndebugvars, LocVar);
   luaM_shrinkvector(L, f->upvalues, f->sizeupvalues, fs->nups, Upvaldesc);
+  luaF_countproto(L, f);
   ls->fs = fs->prev;
   L->top.p--;  /* pop kcache table */
   luaC_checkGC(L);
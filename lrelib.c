@@ -0,0 +1,1311 @@
+/*
+** $Id: lrelib.c $
+** Regular expressions with linear-time matching
+** See Copyright Notice in lua.h
+*/
+
+#define lrelib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <ctype.h>
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+#include "llimits.h"
+
+
+/*
+** Regular expressions are compiled into programs for a Pike VM
+** (Thompson's construction extended with captures). The VM runs all
+** alternatives in lockstep, so matching takes time proportional to
+** the length of the subject times the size of the program, whatever
+** the regular expression or the subject. Priorities among threads
+** give the leftmost-first semantics of backtracking engines (as
+** Perl, Python, or PCRE). (That bound is per search: 'gmatch' and
+** 'gsub' restart a search after each match, and a search may run up
+** to the end of the subject before settling on a match, so a whole
+** scan can take quadratic time.)
+**
+** Supported syntax: literals; '.' (any byte); '[...]' and '[^...]'
+** sets with ranges; escapes '\d', '\w', '\s' and their complements
+** '\D', '\W', '\S' (also inside sets); '\n', '\t', '\r', '\f', '\v',
+** '\0', '\xHH'; any escaped punctuation; anchors '^' (start of
+** subject) and '$' (end of subject); word boundaries '\b' and '\B';
+** groups '(...)' and non-capturing groups '(?:...)'; alternation '|';
+** and the quantifiers '*', '+', '?', '{n}', '{n,}', and '{n,m}',
+** greedy or lazy (followed by '?').
+*/
+
+
+/*
+** maximum number of captures (groups) in a regular expression.
+** (Same limit used by pattern matching.)
+*/
+#if !defined(LUA_MAXCAPTURES)
+#define LUA_MAXCAPTURES		32
+#endif
+
+/* maximum number of instructions in a compiled regular expression */
+#if !defined(MAXREINST)
+#define MAXREINST	10000
+#endif
+
+/* maximum count in '{n,m}' */
+#define MAXREPEAT	1000
+
+/* maximum nesting of groups */
+#define MAXREDEPTH	200
+
+/* no upper limit for a repetition */
+#define REPINF		(-1)
+
+#define REGEX		"regex"
+
+/* size of a set of bytes, in bytes */
+#define SETSIZE		((UCHAR_MAX / CHAR_BIT) + 1)
+
+#define addtoset(st,c)	((st)[(c) / CHAR_BIT] |= \
+                          cast_byte(1 << ((c) & (CHAR_BIT - 1))))
+#define inset(st,c)	((st)[(c) / CHAR_BIT] & (1 << ((c) & (CHAR_BIT - 1))))
+
+
+/*
+** {======================================================
+** PROGRAMS
+** =======================================================
+*/
+
+/* (instructions up to 'IMatch' do not change the control flow) */
+typedef enum ROpCode {
+  IChar,  /* match byte 'x' */
+  IAny,  /* match any byte */
+  ISet,  /* match a byte in set 'x' */
+  IMatch,  /* found a match */
+  IJmp,  /* go to 'x' */
+  ISplit,  /* go to 'x' and to 'y' (with lower priority) */
+  ISave,  /* save current position in capture slot 'x' */
+  IBol,  /* assert start of subject */
+  IEol,  /* assert end of subject */
+  IWordB,  /* assert word boundary */
+  INWordB  /* assert not a word boundary */
+} ROpCode;
+
+
+typedef struct Inst {
+  lu_byte op;
+  int x, y;
+} Inst;
+
+
+/* entry in the stack used to add threads to a list */
+typedef struct AddEntry {
+  int pc;  /* instruction to follow (-1 for a capture restore) */
+  int slot;  /* capture slot to restore */
+  ptrdiff_t old;  /* value to restore */
+} AddEntry;
+
+
+/*
+** A compiled regular expression. All its arrays live in the same
+** block, after this header: the code, the byte sets used by the
+** code, and the working area for the VM. The working area is never
+** in use while Lua code runs, so it can be shared by all matches.
+*/
+typedef struct Regex {
+  int ninst;  /* number of instructions */
+  int ngroups;  /* number of groups (captures) */
+  int nslots;  /* number of capture slots (2 per group plus 2) */
+  int anchored;  /* true if all matches must start at position 0 */
+  int firstc;  /* single byte that starts all matches, or -1 */
+  int hasfirst;  /* true if 'first' is the set of bytes that start matches */
+  lu_byte first[SETSIZE];
+  const Inst *code;
+  const lu_byte *sets;
+  /* working area */
+  int *pcs[2];  /* instructions for the two thread lists */
+  ptrdiff_t *caps[2];  /* capture slots for the two thread lists */
+  ptrdiff_t *cur;  /* slots of the thread being added */
+  AddEntry *stack;
+  unsigned int *mark;  /* generation when instruction was last visited */
+} Regex;
+
+
+#define isword(c)	(isalnum(c) || (c) == '_')
+
+
+static int iswordboundary (const char *s, size_t len, size_t p) {
+  int a = (p > 0 && isword(cast_uchar(s[p - 1])));
+  int b = (p < len && isword(cast_uchar(s[p])));
+  return (a != b);
+}
+
+
+static void copyslots (ptrdiff_t *to, const ptrdiff_t *from, int n) {
+  while (n-- > 0)
+    *to++ = *from++;
+}
+
+
+/* a list of threads */
+typedef struct TList {
+  int n;  /* number of threads */
+  int *pc;
+  ptrdiff_t *caps;
+} TList;
+
+
+/*
+** Add a thread at instruction 'pc' to list 'l', following all jumps,
+** splits, saves, and assertions at subject position 'p'. The thread's
+** capture slots are in 're->cur'. Instructions already visited in this
+** generation are skipped: they were reached before by a thread with
+** higher priority. That bounds both the size of each list and the
+** stack used here by the number of instructions.
+*/
+static void addthread (Regex *re, TList *l, int pc, const char *s,
+                       size_t len, size_t p, unsigned int gen) {
+  AddEntry *stack = re->stack;
+  ptrdiff_t *cur = re->cur;
+  int top = 0;
+  stack[top++].pc = pc;
+  while (top > 0) {
+    AddEntry *e = &stack[--top];
+    if (e->pc < 0) {  /* restore a capture slot? */
+      cur[e->slot] = e->old;
+      continue;
+    }
+    pc = e->pc;
+    for (;;) {  /* follow 'pc' */
+      const Inst *i = &re->code[pc];
+      if (re->mark[pc] == gen)  /* already visited? */
+        break;
+      re->mark[pc] = gen;
+      switch (i->op) {
+        case IJmp:
+          pc = i->x;
+          continue;
+        case ISplit:
+          stack[top++].pc = i->y;  /* follow 'y' later */
+          pc = i->x;
+          continue;
+        case ISave:
+          stack[top].pc = -1;  /* restore slot after following 'pc' */
+          stack[top].slot = i->x;
+          stack[top++].old = cur[i->x];
+          cur[i->x] = cast(ptrdiff_t, p);
+          pc++;
+          continue;
+        case IBol:
+          if (p != 0) break;
+          pc++;
+          continue;
+        case IEol:
+          if (p != len) break;
+          pc++;
+          continue;
+        case IWordB:
+          if (!iswordboundary(s, len, p)) break;
+          pc++;
+          continue;
+        case INWordB:
+          if (iswordboundary(s, len, p)) break;
+          pc++;
+          continue;
+        default: {  /* IChar, IAny, ISet, IMatch: add thread */
+          l->pc[l->n] = pc;
+          copyslots(l->caps + cast_sizet(l->n) * cast_uint(re->nslots), cur,
+                    re->nslots);
+          l->n++;
+          break;
+        }
+      }
+      break;
+    }
+  }
+}
+
+
+/*
+** Skip to the first position from 'p' where a match can start.
+*/
+static size_t skipfirst (const Regex *re, const char *s, size_t len,
+                         size_t p) {
+  if (re->firstc >= 0) {
+    const char *f = (const char *)memchr(s + p, re->firstc, len - p);
+    return (f == NULL) ? len : ct_diff2sz(f - s);
+  }
+  while (p < len && !inset(re->first, cast_uchar(s[p])))
+    p++;
+  return p;
+}
+
+
+/*
+** Start a new generation of marks. After a wrap around (possible in
+** subjects of a few gigabytes), old marks could match new generations,
+** so clear them all.
+*/
+static unsigned int nextgen (Regex *re, unsigned int gen) {
+  if (l_unlikely(++gen == 0)) {
+    memset(re->mark, 0, cast_uint(re->ninst) * sizeof(unsigned int));
+    gen = 1;
+  }
+  return gen;
+}
+
+
+/*
+** Search for the leftmost-first match of 're' in 's' (with length
+** 'len') starting at position 'init'. If found, fill 'caps' with the
+** capture slots of the match (-1 for groups that did not participate)
+** and return true.
+*/
+static int rexec (Regex *re, const char *s, size_t len, size_t init,
+                  ptrdiff_t *caps) {
+  TList clist, nlist;
+  unsigned int gen = 1;
+  size_t p = init;
+  size_t nslots = cast_uint(re->nslots);
+  int found = 0;
+  int which = 0;
+  memset(re->mark, 0, cast_uint(re->ninst) * sizeof(unsigned int));
+  clist.n = 0;
+  clist.pc = re->pcs[0]; clist.caps = re->caps[0];
+  nlist.pc = re->pcs[1]; nlist.caps = re->caps[1];
+  for (;;) {
+    int i, c;
+    if (!found) {  /* can a new match start here? */
+      if (clist.n == 0) {  /* no thread running? */
+        if (re->anchored && p != 0)
+          break;  /* no more chances */
+        if (re->hasfirst) {
+          p = skipfirst(re, s, len, p);
+          if (p >= len) break;  /* all matches need at least one byte */
+        }
+        gen = nextgen(re, gen);  /* 'p' may have changed */
+      }
+      if (!re->anchored || p == 0) {
+        size_t k;
+        for (k = 0; k < nslots; k++)
+          re->cur[k] = -1;
+        addthread(re, &clist, 0, s, len, p, gen);
+      }
+    }
+    if (clist.n == 0) {  /* no thread running? */
+      if (found || p >= len)
+        break;
+      p++;  /* try next position */
+      continue;
+    }
+    gen = nextgen(re, gen);  /* new generation for 'nlist' */
+    nlist.n = 0;
+    c = (p < len) ? cast_uchar(s[p]) : -1;
+    for (i = 0; i < clist.n; i++) {
+      int pc = clist.pc[i];
+      const Inst *in = &re->code[pc];
+      ptrdiff_t *tcaps = clist.caps + cast_sizet(i) * nslots;
+      switch (in->op) {
+        case IMatch:
+          found = 1;
+          copyslots(caps, tcaps, re->nslots);
+          i = clist.n;  /* cut off threads with lower priority */
+          continue;
+        case IChar:
+          if (c != in->x) continue;
+          break;
+        case IAny:
+          if (c < 0) continue;
+          break;
+        default:
+          lua_assert(in->op == ISet);
+          if (c < 0 || !inset(re->sets + cast_uint(in->x) * SETSIZE, c))
+            continue;
+          break;
+      }
+      pc++;
+      if (re->code[pc].op <= IMatch) {  /* no need to follow 'pc'? */
+        if (re->mark[pc] != gen) {  /* not in the list yet? */
+          re->mark[pc] = gen;
+          nlist.pc[nlist.n] = pc;  /* move thread to new list */
+          copyslots(nlist.caps + cast_sizet(nlist.n) * nslots, tcaps,
+                    re->nslots);
+          nlist.n++;
+        }
+      }
+      else {
+        copyslots(re->cur, tcaps, re->nslots);
+        addthread(re, &nlist, pc, s, len, p + 1, gen);
+      }
+    }
+    which = !which;  /* swap lists */
+    clist.n = nlist.n;
+    clist.pc = re->pcs[which]; clist.caps = re->caps[which];
+    nlist.pc = re->pcs[!which]; nlist.caps = re->caps[!which];
+    if (p >= len)
+      break;
+    p++;
+  }
+  return found;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** COMPILER
+** =======================================================
+*/
+
+typedef struct CompState {
+  lua_State *L;
+  const char *p;  /* current position in the regular expression */
+  const char *p_end;  /* end of the regular expression */
+  Inst *code;
+  int ncode;  /* number of instructions in 'code' */
+  int sizecode;
+  lu_byte *sets;
+  int nsets;  /* number of sets in 'sets' */
+  int sizesets;
+  int codeidx;  /* stack index of the box with 'code' */
+  int setsidx;  /* stack index of the box with 'sets' */
+  int ngroups;
+  int depth;  /* nesting level of groups */
+} CompState;
+
+
+static int reerror (CompState *cs, const char *msg) {
+  return luaL_error(cs->L, "malformed regex (%s)", msg);
+}
+
+
+/*
+** Grow a box at stack index 'idx' (holding 'n' elements of size 'esz')
+** to hold at least 'n + extra' elements (up to 'limit' elements).
+*/
+static void *growbox (lua_State *L, int idx, void *old, int n, int extra,
+                      int *size, int limit, size_t esz) {
+  void *nb;
+  int newsize = *size * 2;
+  if (n + extra > limit)
+    luaL_error(L, "regex too large");
+  if (newsize < n + extra)
+    newsize = n + extra;
+  if (newsize > limit)
+    newsize = limit;
+  nb = lua_newuserdatauv(L, cast_sizet(newsize) * esz, 0);
+  if (n > 0)  /* ('old' may be NULL) */
+    memcpy(nb, old, cast_sizet(n) * esz);
+  lua_replace(L, idx);
+  *size = newsize;
+  return nb;
+}
+
+
+static void checkcode (CompState *cs, int extra) {
+  if (cs->ncode + extra > cs->sizecode)
+    cs->code = (Inst *)growbox(cs->L, cs->codeidx, cs->code, cs->ncode,
+                               extra, &cs->sizecode, MAXREINST, sizeof(Inst));
+}
+
+
+static int emit (CompState *cs, ROpCode op, int x, int y) {
+  Inst *i;
+  checkcode(cs, 1);
+  i = &cs->code[cs->ncode];
+  i->op = cast_byte(op); i->x = x; i->y = y;
+  return cs->ncode++;
+}
+
+
+/* creates a new (empty) set; returns its index */
+static int newset (CompState *cs) {
+  if (cs->nsets >= cs->sizesets)
+    cs->sets = (lu_byte *)growbox(cs->L, cs->setsidx, cs->sets, cs->nsets,
+                                  1, &cs->sizesets, MAXREINST, SETSIZE);
+  memset(cs->sets + cast_uint(cs->nsets) * SETSIZE, 0, SETSIZE);
+  return cs->nsets++;
+}
+
+
+#define getset(cs,n)	((cs)->sets + cast_uint(n) * SETSIZE)
+
+
+/*
+** Add 'delta' to the targets of all jumps in instructions [from, to).
+** Each fragment of code only jumps inside itself (or to its end), so
+** moving a fragment only needs the relocation of its own jumps.
+*/
+static void relocate (CompState *cs, int from, int to, int delta) {
+  for (; from < to; from++) {
+    Inst *i = &cs->code[from];
+    if (i->op == IJmp)
+      i->x += delta;
+    else if (i->op == ISplit) {
+      i->x += delta; i->y += delta;
+    }
+  }
+}
+
+
+/* insert an instruction at position 'at', moving the code after it */
+static void insertinst (CompState *cs, int at, ROpCode op, int x, int y) {
+  Inst *i;
+  checkcode(cs, 1);
+  memmove(cs->code + at + 1, cs->code + at,
+          cast_uint(cs->ncode - at) * sizeof(Inst));
+  cs->ncode++;
+  relocate(cs, at + 1, cs->ncode, 1);
+  i = &cs->code[at];
+  i->op = cast_byte(op); i->x = x; i->y = y;
+}
+
+
+/* append a copy of the fragment [from, from + len) */
+static void dupfrag (CompState *cs, int from, int len) {
+  checkcode(cs, len);
+  memcpy(cs->code + cs->ncode, cs->code + from, cast_uint(len) * sizeof(Inst));
+  relocate(cs, cs->ncode, cs->ncode + len, cs->ncode - from);
+  cs->ncode += len;
+}
+
+
+/*
+** Repeat the fragment starting at 'start' (and going to the end of
+** the code) between 'min' and 'max' times ('max' may be REPINF).
+** Optional copies are nested: 'e{1,3}' becomes 'e(e(e)?)?', so that
+** each position in the subject has a single way to be matched.
+*/
+static void repeat (CompState *cs, int start, int min, int max,
+                    int greedy) {
+  int len = cs->ncode - start;
+  int pending = -1;  /* list of splits to be patched to the end */
+  int i;
+  if (max == REPINF) {
+    if (min == 0) {  /* e* */
+      insertinst(cs, start, ISplit, 0, 0);
+      emit(cs, IJmp, start, 0);
+      if (greedy) {
+        cs->code[start].x = start + 1; cs->code[start].y = cs->ncode;
+      }
+      else {
+        cs->code[start].x = cs->ncode; cs->code[start].y = start + 1;
+      }
+    }
+    else {  /* e{min-1} e+ */
+      int last = start;
+      for (i = 1; i < min; i++) {
+        last = cs->ncode;
+        dupfrag(cs, start, len);
+      }
+      if (greedy)
+        emit(cs, ISplit, last, cs->ncode + 1);
+      else
+        emit(cs, ISplit, cs->ncode + 1, last);
+    }
+    return;
+  }
+  if (max == 0) {  /* e{0} */
+    cs->ncode = start;  /* remove fragment */
+    return;
+  }
+  if (min == 0) {  /* first copy is optional too */
+    insertinst(cs, start, ISplit, start + 1, pending);
+    pending = start;
+    start++;  /* fragment moved */
+  }
+  for (i = 1; i < min; i++)  /* mandatory copies */
+    dupfrag(cs, start, len);
+  for (i = (min > 0) ? min : 1; i < max; i++) {  /* optional copies */
+    pending = emit(cs, ISplit, cs->ncode + 1, pending);
+    dupfrag(cs, start, len);
+  }
+  while (pending >= 0) {  /* patch splits to skip to the end */
+    Inst *in = &cs->code[pending];
+    int next = in->y;
+    if (greedy)
+      in->y = cs->ncode;
+    else {
+      in->y = in->x;
+      in->x = cs->ncode;
+    }
+    pending = next;
+  }
+}
+
+
+static int hexavalue (int c) {
+  if (isdigit(c)) return c - '0';
+  else return (tolower(c) - 'a') + 10;
+}
+
+
+/* add bytes of class 'cl' (one of 'dwsDWS') to 'set' */
+static void addclass (lu_byte *set, int cl) {
+  int c;
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    int res;
+    switch (tolower(cl)) {
+      case 'd': res = isdigit(c); break;
+      case 'w': res = isword(c); break;
+      default: lua_assert(tolower(cl) == 's'); res = isspace(c); break;
+    }
+    if (isupper(cl)) res = !res;
+    if (res) addtoset(set, c);
+  }
+}
+
+
+#define isclassesc(c)	(strchr("dwsDWS", (c)) != NULL)
+
+
+/*
+** Read an escape sequence after a '\'. Return the byte it denotes,
+** or -1 if it is a class (which is then added to 'set').
+*/
+static int escape (CompState *cs, lu_byte *set) {
+  int c;
+  if (cs->p >= cs->p_end)
+    reerror(cs, "ends with '\\'");
+  c = cast_uchar(*cs->p++);
+  if (c != 0 && isclassesc(c)) {
+    addclass(set, c);
+    return -1;
+  }
+  switch (c) {
+    case 'n': return '\n';
+    case 't': return '\t';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    case '0': return '\0';
+    case 'x': {
+      if (cs->p_end - cs->p < 2 || !isxdigit(cast_uchar(cs->p[0])) ||
+                                   !isxdigit(cast_uchar(cs->p[1])))
+        reerror(cs, "hexadecimal digits expected after '\\x'");
+      c = hexavalue(cast_uchar(cs->p[0])) * 16 +
+          hexavalue(cast_uchar(cs->p[1]));
+      cs->p += 2;
+      return c;
+    }
+    default: {
+      if (isalnum(c))
+        luaL_error(cs->L, "invalid escape '\\%c' in regex", c);
+      return c;  /* escaped punctuation */
+    }
+  }
+}
+
+
+/* read a set '[...]'; 'cs->p' is after the '[' */
+static void parseset (CompState *cs) {
+  int n = newset(cs);
+  lu_byte *set;
+  int neg = 0;
+  int first = 1;
+  int c;
+  if (cs->p < cs->p_end && *cs->p == '^') {
+    neg = 1;
+    cs->p++;
+  }
+  for (;;) {
+    set = getset(cs, n);
+    if (cs->p >= cs->p_end)
+      reerror(cs, "missing ']'");
+    c = cast_uchar(*cs->p++);
+    if (c == ']' && !first)
+      break;
+    first = 0;
+    if (c == '\\' && (c = escape(cs, set)) < 0)
+      continue;  /* class already added */
+    if (cs->p_end - cs->p >= 2 && cs->p[0] == '-' && cs->p[1] != ']') {
+      int hi;
+      cs->p++;  /* skip '-' */
+      hi = cast_uchar(*cs->p++);
+      if (hi == '\\' && (hi = escape(cs, set)) < 0)
+        reerror(cs, "class in range");
+      if (hi < c)
+        reerror(cs, "invalid range");
+      for (; c <= hi; c++)
+        addtoset(set, c);
+    }
+    else
+      addtoset(set, c);
+  }
+  if (neg) {
+    int i;
+    for (i = 0; i < (int)SETSIZE; i++)
+      set[i] = cast_byte(~set[i]);
+  }
+  emit(cs, ISet, n, 0);
+}
+
+
+/* read a number in a repetition count; returns -1 if there is none */
+static int getcount (CompState *cs) {
+  int n = -1;
+  while (cs->p < cs->p_end && isdigit(cast_uchar(*cs->p))) {
+    if (n < 0) n = 0;
+    if (n <= MAXREPEAT)  /* else it is already too large */
+      n = n * 10 + (*cs->p - '0');
+    cs->p++;
+  }
+  return n;
+}
+
+
+/*
+** Read a counted repetition '{n}', '{n,}', or '{n,m}'; 'cs->p' is at
+** the '{'. If it is not a valid repetition, return false and leave
+** 'cs->p' unchanged ('{' is then a literal).
+*/
+static int parsecount (CompState *cs, int *min, int *max) {
+  const char *init = cs->p;
+  cs->p++;  /* skip '{' */
+  *min = *max = getcount(cs);
+  if (*min >= 0 && cs->p < cs->p_end && *cs->p == ',') {
+    cs->p++;
+    *max = getcount(cs);
+    if (*max < 0) *max = REPINF;
+  }
+  if (*min < 0 || cs->p >= cs->p_end || *cs->p != '}') {
+    cs->p = init;
+    return 0;
+  }
+  cs->p++;  /* skip '}' */
+  if (*min > MAXREPEAT || *max > MAXREPEAT)
+    luaL_error(cs->L, "repetition count in regex too large (limit is %d)",
+                      MAXREPEAT);
+  if (*max != REPINF && *max < *min)
+    reerror(cs, "invalid repetition range");
+  return 1;
+}
+
+
+/* read quantifiers (if present) to the fragment starting at 'start' */
+static void parsequant (CompState *cs, int start) {
+  int min, max;
+  if (cs->p >= cs->p_end)
+    return;
+  switch (*cs->p) {
+    case '*': min = 0; max = REPINF; cs->p++; break;
+    case '+': min = 1; max = REPINF; cs->p++; break;
+    case '?': min = 0; max = 1; cs->p++; break;
+    case '{':
+      if (!parsecount(cs, &min, &max)) return;
+      break;
+    default: return;
+  }
+  if (cs->p < cs->p_end && *cs->p == '?') {  /* lazy? */
+    cs->p++;
+    repeat(cs, start, min, max, 0);
+  }
+  else
+    repeat(cs, start, min, max, 1);
+  if (cs->p < cs->p_end && strchr("*+?", *cs->p) != NULL)
+    reerror(cs, "multiple repeat");
+}
+
+
+static void parsealt (CompState *cs);
+
+
+static void parseatom (CompState *cs) {
+  int c = cast_uchar(*cs->p++);
+  switch (c) {
+    case '(': {
+      int g = -1;
+      if (++cs->depth > MAXREDEPTH)
+        luaL_error(cs->L, "regex too complex");
+      if (cs->p_end - cs->p >= 2 && cs->p[0] == '?' && cs->p[1] == ':')
+        cs->p += 2;  /* non-capturing group */
+      else {
+        if (cs->ngroups >= LUA_MAXCAPTURES)
+          luaL_error(cs->L, "too many captures");
+        g = ++cs->ngroups;
+        emit(cs, ISave, 2 * g, 0);
+      }
+      parsealt(cs);
+      if (cs->p >= cs->p_end || *cs->p != ')')
+        reerror(cs, "missing ')'");
+      cs->p++;
+      if (g > 0)
+        emit(cs, ISave, 2 * g + 1, 0);
+      cs->depth--;
+      break;
+    }
+    case '[': parseset(cs); break;
+    case '.': emit(cs, IAny, 0, 0); break;
+    case '^': emit(cs, IBol, 0, 0); break;
+    case '$': emit(cs, IEol, 0, 0); break;
+    case '*': case '+': case '?':
+      reerror(cs, "nothing to repeat");
+      break;
+    case '\\': {
+      if (cs->p < cs->p_end && (*cs->p == 'b' || *cs->p == 'B')) {
+        emit(cs, (*cs->p++ == 'b') ? IWordB : INWordB, 0, 0);
+        break;
+      }
+      else {
+        int n = newset(cs);
+        c = escape(cs, getset(cs, n));
+        if (c < 0) {  /* a class? */
+          emit(cs, ISet, n, 0);
+          break;
+        }
+        cs->nsets--;  /* set not used */
+      }
+    }  /* FALLTHROUGH */
+    default:
+      emit(cs, IChar, c, 0);
+      break;
+  }
+}
+
+
+static void parseconcat (CompState *cs) {
+  while (cs->p < cs->p_end && *cs->p != '|' && *cs->p != ')') {
+    int start = cs->ncode;
+    parseatom(cs);
+    parsequant(cs, start);
+  }
+}
+
+
+/*
+** Alternatives 'a|b|c' become
+**    split L1, L2; L1: a; jmp end;
+** L2: split L3, L4; L3: b; jmp end;
+** L4: c; end:
+*/
+static void parsealt (CompState *cs) {
+  int start = cs->ncode;
+  int pending = -1;  /* list of jumps to the end */
+  parseconcat(cs);
+  while (cs->p < cs->p_end && *cs->p == '|') {
+    cs->p++;
+    insertinst(cs, start, ISplit, start + 1, 0);
+    pending = emit(cs, IJmp, pending, 0);
+    cs->code[start].y = cs->ncode;
+    start = cs->ncode;
+    parseconcat(cs);
+  }
+  while (pending >= 0) {  /* patch jumps */
+    int next = cs->code[pending].x;
+    cs->code[pending].x = cs->ncode;
+    pending = next;
+  }
+}
+
+
+/*
+** Compute the bytes that can start a match, to skip quickly the
+** positions where no match can start. Also find whether all matches
+** must start at the beginning of the subject.
+*/
+static void firstbytes (Regex *re) {
+  AddEntry *stack = re->stack;
+  int top = 0;
+  int nbol = 0, nother = 0;  /* number of leaves of each kind */
+  int nbytes = 0;
+  int c;
+  memset(re->mark, 0, cast_uint(re->ninst) * sizeof(unsigned int));
+  memset(re->first, 0, SETSIZE);
+  stack[top++].pc = 0;
+  while (top > 0) {
+    int pc = stack[--top].pc;
+    while (!re->mark[pc]) {
+      const Inst *i = &re->code[pc];
+      re->mark[pc] = 1;
+      switch (i->op) {
+        case IJmp: pc = i->x; continue;
+        case ISplit: stack[top++].pc = i->y; pc = i->x; continue;
+        case ISave: pc++; continue;
+        case IChar: addtoset(re->first, i->x); nother++; break;
+        case ISet: {
+          const lu_byte *set = re->sets + cast_uint(i->x) * SETSIZE;
+          int k;
+          for (k = 0; k < (int)SETSIZE; k++)
+            re->first[k] |= set[k];
+          nother++;
+          break;
+        }
+        case IBol: nbol++; break;
+        default:  /* IAny, IMatch, other assertions: anything goes */
+          nother++;
+          memset(re->first, UCHAR_MAX, SETSIZE);
+          break;
+      }
+      break;
+    }
+  }
+  re->anchored = (nbol > 0 && nother == 0);
+  re->firstc = -1;
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    if (inset(re->first, c)) {
+      nbytes++;
+      re->firstc = c;
+    }
+  }
+  re->hasfirst = (nbol == 0 && nbytes <= UCHAR_MAX);
+  if (nbytes != 1)
+    re->firstc = -1;
+}
+
+
+#define alignup(n)  (((n) + sizeof(ptrdiff_t) - 1) & ~(sizeof(ptrdiff_t) - 1))
+
+
+/*
+** Compile regular expression 'pat' into a new userdata, left on the
+** top of the stack.
+*/
+static Regex *compile (lua_State *L, const char *pat, size_t len) {
+  CompState cs;
+  Regex *re;
+  size_t ninst, nslots, sz, ocode, osets, ocaps, ostack, opcs, omark;
+  cs.L = L;
+  cs.p = pat; cs.p_end = pat + len;
+  cs.ncode = cs.nsets = 0;
+  cs.sizecode = cs.sizesets = 0;
+  cs.ngroups = cs.depth = 0;
+  cs.code = NULL; cs.sets = NULL;
+  lua_pushnil(L);  /* box for code */
+  cs.codeidx = lua_gettop(L);
+  lua_pushnil(L);  /* box for sets */
+  cs.setsidx = lua_gettop(L);
+  emit(&cs, ISave, 0, 0);
+  parsealt(&cs);
+  if (cs.p < cs.p_end)  /* stopped at a ')'? */
+    reerror(&cs, "unmatched ')'");
+  emit(&cs, ISave, 1, 0);
+  emit(&cs, IMatch, 0, 0);
+  /* compute layout of the final block */
+  ninst = cast_uint(cs.ncode);
+  nslots = 2 * cast_uint(cs.ngroups + 1);
+  ocaps = alignup(sizeof(Regex));
+  sz = ocaps + (2 * ninst + 1) * nslots * sizeof(ptrdiff_t);
+  ostack = alignup(sz);
+  sz = ostack + (ninst + 1) * sizeof(AddEntry);
+  ocode = alignup(sz);
+  sz = ocode + ninst * sizeof(Inst);
+  opcs = alignup(sz);
+  sz = opcs + 2 * ninst * sizeof(int);
+  omark = alignup(sz);
+  sz = omark + ninst * sizeof(unsigned int);
+  osets = sz;
+  sz = osets + cast_uint(cs.nsets) * SETSIZE;
+  re = (Regex *)lua_newuserdatauv(L, sz, 0);
+  luaL_setmetatable(L, REGEX);
+  re->ninst = cs.ncode;
+  re->ngroups = cs.ngroups;
+  re->nslots = cast_int(nslots);
+  re->caps[0] = (ptrdiff_t *)((char *)re + ocaps);
+  re->caps[1] = re->caps[0] + ninst * nslots;
+  re->cur = re->caps[1] + ninst * nslots;
+  re->stack = (AddEntry *)((char *)re + ostack);
+  re->code = (Inst *)((char *)re + ocode);
+  re->pcs[0] = (int *)((char *)re + opcs);
+  re->pcs[1] = re->pcs[0] + ninst;
+  re->mark = (unsigned int *)((char *)re + omark);
+  re->sets = (lu_byte *)re + osets;
+  memcpy((char *)re + ocode, cs.code, ninst * sizeof(Inst));
+  if (cs.nsets > 0)
+    memcpy((char *)re + osets, cs.sets, cast_uint(cs.nsets) * SETSIZE);
+  firstbytes(re);
+  lua_replace(L, cs.codeidx);  /* move regex to the place of first box */
+  lua_pop(L, 1);  /* remove other box */
+  return re;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** LIBRARY
+** =======================================================
+*/
+
+
+/*
+** Get the regular expression at index 'arg', which can be a compiled
+** one or a string. Strings are compiled and kept in a cache (first
+** upvalue of the library functions) with weak values. The compiled
+** regex replaces the string in the stack, which keeps it alive.
+*/
+static Regex *getregex (lua_State *L, int arg) {
+  size_t len;
+  const char *pat;
+  Regex *re;
+  if (lua_type(L, arg) != LUA_TSTRING)
+    return (Regex *)luaL_checkudata(L, arg, REGEX);
+  pat = lua_tolstring(L, arg, &len);
+  lua_pushvalue(L, arg);
+  if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TUSERDATA)  /* cached? */
+    re = (Regex *)lua_touserdata(L, -1);
+  else {
+    lua_pop(L, 1);  /* remove result from 'rawget' */
+    re = compile(L, pat, len);
+    lua_pushvalue(L, arg);  /* key: source string */
+    lua_pushvalue(L, -2);  /* value: compiled regex */
+    lua_rawset(L, lua_upvalueindex(1));  /* cache[pat] = re */
+  }
+  lua_replace(L, arg);
+  return re;
+}
+
+
+/*
+** translate a relative initial string position
+** (negative means back from end): clip result to [1, inf).
+*/
+static size_t re_posrelat (lua_Integer pos, size_t len) {
+  if (pos > 0)
+    return (size_t)pos;
+  else if (pos == 0)
+    return 1;
+  else if (pos < -(lua_Integer)len)  /* inverted comparison */
+    return 1;  /* clip to 1 */
+  else return len + (size_t)pos + 1;
+}
+
+
+/* no match ended yet */
+#define NOMATCH		(~(size_t)0)
+
+
+static void pushonecapture (lua_State *L, const char *s,
+                            const ptrdiff_t *caps, int g) {
+  if (caps[2 * g] < 0 || caps[2 * g + 1] < 0)  /* group did not match? */
+    luaL_pushfail(L);
+  else
+    lua_pushlstring(L, s + caps[2 * g],
+                       cast_sizet(caps[2 * g + 1] - caps[2 * g]));
+}
+
+
+/*
+** Push the captures of a match; if there are no groups and 'whole' is
+** true, push the whole match.
+*/
+static int pushcaptures (lua_State *L, const Regex *re, const char *s,
+                         const ptrdiff_t *caps, int whole) {
+  int g;
+  if (re->ngroups == 0) {
+    if (!whole) return 0;
+    pushonecapture(L, s, caps, 0);
+    return 1;
+  }
+  luaL_checkstack(L, re->ngroups, "too many captures");
+  for (g = 1; g <= re->ngroups; g++)
+    pushonecapture(L, s, caps, g);
+  return re->ngroups;
+}
+
+
+static int re_find_aux (lua_State *L, int find) {
+  size_t ls;
+  const char *s = luaL_checklstring(L, 1, &ls);
+  Regex *re = getregex(L, 2);
+  size_t init = re_posrelat(luaL_optinteger(L, 3, 1), ls) - 1;
+  ptrdiff_t caps[2 * (LUA_MAXCAPTURES + 1)];
+  if (init <= ls && rexec(re, s, ls, init, caps)) {
+    if (find) {
+      lua_pushinteger(L, cast_st2S(cast_sizet(caps[0])) + 1);  /* start */
+      lua_pushinteger(L, cast_st2S(cast_sizet(caps[1])));  /* end */
+      return pushcaptures(L, re, s, caps, 0) + 2;
+    }
+    else
+      return pushcaptures(L, re, s, caps, 1);
+  }
+  luaL_pushfail(L);  /* not found */
+  return 1;
+}
+
+
+static int re_find (lua_State *L) {
+  return re_find_aux(L, 1);
+}
+
+
+static int re_match (lua_State *L) {
+  return re_find_aux(L, 0);
+}
+
+
+/* state for 'gmatch' */
+typedef struct re_GMatchState {
+  size_t src;  /* current position */
+  size_t lastmatch;  /* end of last match */
+} re_GMatchState;
+
+
+static int re_gmatch_aux (lua_State *L) {
+  size_t ls;
+  const char *s = lua_tolstring(L, lua_upvalueindex(1), &ls);
+  Regex *re = (Regex *)lua_touserdata(L, lua_upvalueindex(2));
+  re_GMatchState *gm = (re_GMatchState *)lua_touserdata(L, lua_upvalueindex(3));
+  ptrdiff_t caps[2 * (LUA_MAXCAPTURES + 1)];
+  size_t src;
+  for (src = gm->src; src <= ls; src++) {
+    if (!rexec(re, s, ls, src, caps))
+      break;
+    if (cast_sizet(caps[1]) != gm->lastmatch) {
+      gm->src = gm->lastmatch = cast_sizet(caps[1]);
+      return pushcaptures(L, re, s, caps, 1);
+    }
+    /* else empty match right after the previous one; try again */
+  }
+  gm->src = ls + 1;  /* no more matches */
+  return 0;  /* not found */
+}
+
+
+static int re_gmatch (lua_State *L) {
+  size_t ls;
+  size_t init;
+  re_GMatchState *gm;
+  luaL_checklstring(L, 1, &ls);
+  getregex(L, 2);
+  init = re_posrelat(luaL_optinteger(L, 3, 1), ls) - 1;
+  lua_settop(L, 2);  /* keep string and regex on closure */
+  gm = (re_GMatchState *)lua_newuserdatauv(L, sizeof(re_GMatchState), 0);
+  if (init > ls)  /* start after string's end? */
+    init = ls + 1;
+  gm->src = init; gm->lastmatch = NOMATCH;
+  lua_pushcclosure(L, re_gmatch_aux, 3);
+  return 1;
+}
+
+
+static void re_add_s (lua_State *L, luaL_Buffer *b, const Regex *re,
+                      const char *s, const ptrdiff_t *caps) {
+  size_t l;
+  const char *news = lua_tolstring(L, 3, &l);
+  const char *p;
+  while ((p = (char *)memchr(news, '%', l)) != NULL) {
+    luaL_addlstring(b, news, ct_diff2sz(p - news));
+    p++;  /* skip '%' */
+    if (*p == '%')  /* '%%' */
+      luaL_addchar(b, *p);
+    else if (isdigit(cast_uchar(*p))) {  /* '%n' */
+      int g = *p - '0';
+      if (g > re->ngroups) {
+        if (g == 1)  /* no groups? */
+          g = 0;  /* '%1' is the whole match */
+        else
+          luaL_error(L, "invalid capture index %%%d in replacement string",
+                        g);
+      }
+      if (caps[2 * g] >= 0 && caps[2 * g + 1] >= 0)  /* group matched? */
+        luaL_addlstring(b, s + caps[2 * g],
+                           cast_sizet(caps[2 * g + 1] - caps[2 * g]));
+    }
+    else
+      luaL_error(L, "invalid use of '%c' in replacement string", '%');
+    l -= ct_diff2sz(p + 1 - news);
+    news = p + 1;
+  }
+  luaL_addlstring(b, news, l);
+}
+
+
+/*
+** Add the replacement value to the string buffer 'b'.
+** Return true if the original string was changed. (Function calls and
+** table indexing resulting in nil or false do not change the subject.)
+*/
+static int re_add_value (lua_State *L, luaL_Buffer *b, const Regex *re,
+                         const char *s, const ptrdiff_t *caps, int tr) {
+  switch (tr) {
+    case LUA_TFUNCTION: {  /* call the function */
+      int n;
+      lua_pushvalue(L, 3);  /* push the function */
+      n = pushcaptures(L, re, s, caps, 1);  /* all captures as arguments */
+      lua_call(L, n, 1);  /* call it */
+      break;
+    }
+    case LUA_TTABLE: {  /* index the table */
+      pushonecapture(L, s, caps, (re->ngroups > 0));  /* first capture */
+      lua_gettable(L, 3);
+      break;
+    }
+    default: {  /* LUA_TNUMBER or LUA_TSTRING */
+      re_add_s(L, b, re, s, caps);  /* add value to the buffer */
+      return 1;  /* something changed */
+    }
+  }
+  if (!lua_toboolean(L, -1)) {  /* nil or false? */
+    lua_pop(L, 1);  /* remove value */
+    luaL_addlstring(b, s + caps[0], cast_sizet(caps[1] - caps[0]));
+    return 0;  /* no changes */
+  }
+  else if (l_unlikely(!lua_isstring(L, -1)))
+    return luaL_error(L, "invalid replacement value (a %s)",
+                         luaL_typename(L, -1));
+  else {
+    luaL_addvalue(b);  /* add result to accumulator */
+    return 1;  /* something changed */
+  }
+}
+
+
+static int re_gsub (lua_State *L) {
+  size_t srcl;
+  const char *s = luaL_checklstring(L, 1, &srcl);  /* subject */
+  Regex *re = getregex(L, 2);
+  size_t src = 0;  /* current position */
+  size_t lastmatch = NOMATCH;  /* end of last match */
+  int tr = lua_type(L, 3);  /* replacement type */
+  /* max replacements */
+  lua_Integer max_s = luaL_optinteger(L, 4, cast_st2S(srcl) + 1);
+  lua_Integer n = 0;  /* replacement count */
+  int changed = 0;  /* change flag */
+  ptrdiff_t caps[2 * (LUA_MAXCAPTURES + 1)];
+  luaL_Buffer b;
+  luaL_argexpected(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
+                   tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
+                      "string/function/table");
+  luaL_buffinit(L, &b);
+  while (n < max_s && src <= srcl && rexec(re, s, srcl, src, caps)) {
+    size_t e = cast_sizet(caps[1]);
+    if (e == lastmatch) {  /* empty match right after the previous one? */
+      if (src < srcl)  /* skip one character */
+        luaL_addchar(&b, s[src++]);
+      else break;  /* end of subject */
+      continue;
+    }
+    luaL_addlstring(&b, s + src, cast_sizet(caps[0]) - src);
+    n++;
+    changed = re_add_value(L, &b, re, s, caps, tr) | changed;
+    src = lastmatch = e;
+  }
+  if (!changed)  /* no changes? */
+    lua_pushvalue(L, 1);  /* return original string */
+  else {  /* something changed */
+    luaL_addlstring(&b, s + src, srcl - src);
+    luaL_pushresult(&b);  /* create and return new string */
+  }
+  lua_pushinteger(L, n);  /* number of substitutions */
+  return 2;
+}
+
+
+static int re_compile (lua_State *L) {
+  getregex(L, 1);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/*
+** Methods get the regex as their first argument: swap it with the
+** subject and call the corresponding function.
+*/
+static int swapargs (lua_State *L) {
+  luaL_checkudata(L, 1, REGEX);
+  lua_settop(L, (lua_gettop(L) < 2) ? 2 : lua_gettop(L));
+  lua_pushvalue(L, 1);
+  lua_copy(L, 2, 1);
+  lua_replace(L, 2);
+  return 0;
+}
+
+
+static int re_mfind (lua_State *L) {
+  swapargs(L);
+  return re_find(L);
+}
+
+
+static int re_mmatch (lua_State *L) {
+  swapargs(L);
+  return re_match(L);
+}
+
+
+static int re_mgmatch (lua_State *L) {
+  swapargs(L);
+  return re_gmatch(L);
+}
+
+
+static int re_mgsub (lua_State *L) {
+  swapargs(L);
+  return re_gsub(L);
+}
+
+
+static int re_tostring (lua_State *L) {
+  lua_pushfstring(L, "regex (%p)", luaL_checkudata(L, 1, REGEX));
+  return 1;
+}
+
+
+static const luaL_Reg relib[] = {
+  {"compile", re_compile},
+  {"find", re_find},
+  {"gmatch", re_gmatch},
+  {"gsub", re_gsub},
+  {"match", re_match},
+  {NULL, NULL}
+};
+
+
+/*
+** methods for compiled regular expressions
+*/
+static const luaL_Reg re_meth[] = {
+  {"find", re_mfind},
+  {"gmatch", re_mgmatch},
+  {"gsub", re_mgsub},
+  {"match", re_mmatch},
+  {NULL, NULL}
+};
+
+
+/*
+** metamethods for compiled regular expressions
+*/
+static const luaL_Reg re_metameth[] = {
+  {"__index", NULL},  /* placeholder */
+  {"__tostring", re_tostring},
+  {NULL, NULL}
+};
+
+
+static void re_createmeta (lua_State *L) {
+  luaL_newmetatable(L, REGEX);  /* metatable for compiled regexes */
+  luaL_setfuncs(L, re_metameth, 0);  /* add metamethods to new metatable */
+  luaL_newlibtable(L, re_meth);  /* create method table */
+  lua_pushvalue(L, -3);  /* cache of compiled regexes */
+  luaL_setfuncs(L, re_meth, 1);  /* add regex methods to method table */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
+  lua_pop(L, 1);  /* pop metatable */
+}
+
+
+LUAMOD_API int luaopen_re (lua_State *L) {
+  luaL_newlibtable(L, relib);
+  lua_newtable(L);  /* cache of compiled regexes */
+  lua_createtable(L, 0, 1);  /* its metatable */
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");  /* metatable.__mode = "v" */
+  lua_setmetatable(L, -2);
+  re_createmeta(L);
+  luaL_setfuncs(L, relib, 1);  /* cache is their upvalue */
+  return 1;
+}
+
+/* }====================================================== */
@@ -78,6 +78,7 @@ CallInfo *luaE_extendCI (lua_State *L) {
   ci->next = NULL;
   ci->u.l.trap = 0;
   L->nci++;
+  luaC_bdadd(G(L), LUA_BDTHREAD, 0, sizeof(CallInfo));
   return ci;
 }
 
@@ -97,6 +98,17 @@ static void freeCI (lua_State *L) {
 }
 
 
+/*
+** free all CallInfo structures not in use by a live thread
+*/
+void luaE_trimCI (lua_State *L) {
+  int n = L->nci;
+  freeCI(L);
+  luaC_bdadd(G(L), LUA_BDTHREAD, 0,
+             -cast(l_mem, n - L->nci) * cast(l_mem, sizeof(CallInfo)));
+}
+
+
 /*
 ** free half of the CallInfo structures not in use by a thread,
 ** keeping the first one.
@@ -111,6 +123,7 @@ void luaE_shrinkCI (lua_State *L) {
     ci->next = next2;  /* remove next from the list */
     L->nci--;
     luaM_free(L, next);  /* free next */
+    luaC_bdadd(G(L), LUA_BDTHREAD, 0, -cast(l_mem, sizeof(CallInfo)));
     if (next2 == NULL)
       break;  /* no more elements */
     else {
@@ -155,17 +168,33 @@ static void resetCI (lua_State *L) {
 }
 
 
-static void stack_init (lua_State *L1, lua_State *L) {
+/* initial stack size for new threads */
+#define initstacksize(g)  (leanstacks(g) ? LEAN_STACK_SIZE : BASIC_STACK_SIZE)
+
+
+/*
+** Set up 'stack' (with 'size' slots plus EXTRA_STACK) as the empty
+** stack of thread 'L1'.
+*/
+static void stack_setup (lua_State *L1, StkId stack, int size) {
   int i;
-  /* initialize stack array */
-  L1->stack.p = luaM_newvector(L, BASIC_STACK_SIZE + EXTRA_STACK, StackValue);
-  L1->tbclist.p = L1->stack.p;
-  for (i = 0; i < BASIC_STACK_SIZE + EXTRA_STACK; i++)
-    setnilvalue(s2v(L1->stack.p + i));  /* erase new stack */
-  L1->stack_last.p = L1->stack.p + BASIC_STACK_SIZE;
+  L1->stack.p = stack;
+  L1->tbclist.p = stack;
+  for (i = 0; i < size + EXTRA_STACK; i++)
+    setnilvalue(s2v(stack + i));  /* erase new stack */
+  L1->stack_last.p = stack + size;
   /* initialize first ci */
   resetCI(L1);
-  L1->top.p = L1->stack.p + 1;  /* +1 for 'function' entry */
+  L1->top.p = stack + 1;  /* +1 for 'function' entry */
+}
+
+
+static void stack_init (lua_State *L1, lua_State *L) {
+  int size = initstacksize(G(L));
+  StkId stack = luaM_newvector(L, size + EXTRA_STACK, StackValue);
+  luaC_bdadd(G(L), LUA_BDTHREAD, 0,
+             cast_sizet(size + EXTRA_STACK) * sizeof(StackValue));
+  stack_setup(L1, stack, size);
 }
 
 
@@ -252,6 +281,22 @@ lu_mem luaE_threadsize (lua_State *L) {
 }
 
 
+/*
+** Free pooled threads until there are at most 'max' of them.
+*/
+static void freepool (lua_State *L, l_mem max) {
+  global_State *g = G(L);
+  while (g->npooled > max) {
+    lua_State *L1 = g->threadpool;
+    g->threadpool = L1->twups;
+    g->npooled--;
+    L1->ci = &L1->base_ci;
+    freestack(L1);
+    luaM_freeobject(L, fromstate(L1), sizeof(LX), LUA_TTHREAD);
+  }
+}
+
+
 static void close_state (lua_State *L) {
   global_State *g = G(L);
   if (!completestate(g))  /* closing a partially built state? */
@@ -263,10 +308,22 @@ static void close_state (lua_State *L) {
     luaC_freeallobjects(L);  /* collect all objects */
     luai_userstateclose(L);
   }
-  luaM_freearray(L, G(L)->strt.hash, cast_sizet(G(L)->strt.size));
-  freestack(L);
-  lua_assert(gettotalbytes(g) == sizeof(global_State));
-  (*g->frealloc)(g->ud, g, sizeof(global_State), 0);  /* free main block */
+  luaG_freeallocprofile(g);
+  g->GCdebt += g->GCextbytes;  /* forget external memory still declared */
+  g->GCextbytes = 0;
+  if (g->bulkfree)  /* allocator frees all blocks at once? */
+    (*g->frealloc)(g->ud, NULL, LUA_ALLOCRELEASE, 0);
+  else {
+    freepool(L, 0);
+#if defined(LUA_USE_SIDEMARKS)
+    luaM_freeheap(L);
+#endif
+    luaS_migrate(L, INT_MAX);  /* free old array of a resize */
+    luaM_freearray(L, G(L)->strt.hash, cast_sizet(G(L)->strt.size));
+    freestack(L);
+    lua_assert(gettotalbytes(g) == sizeof(global_State));
+    (*g->frealloc)(g->ud, g, sizeof(global_State), 0);  /* free main block */
+  }
 }
 
 
@@ -274,11 +331,22 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
   global_State *g = G(L);
   GCObject *o;
   lua_State *L1;
+  StkId stack = NULL;
+  int size = 0;
   lua_lock(L);
   luaC_checkGC(L);
-  /* create new thread */
-  o = luaC_newobjdt(L, LUA_TTHREAD, sizeof(LX), offsetof(LX, l));
-  L1 = gco2th(o);
+  if (g->threadpool != NULL) {  /* reuse a dead thread? */
+    L1 = g->threadpool;
+    g->threadpool = L1->twups;
+    g->npooled--;
+    stack = L1->stack.p;  /* keep its stack */
+    size = stacksize(L1);
+    luaC_relink(L, obj2gco(L1));
+  }
+  else {  /* create new thread */
+    o = luaC_newobjdt(L, LUA_TTHREAD, sizeof(LX), offsetof(LX, l));
+    L1 = gco2th(o);
+  }
   /* anchor it on L stack */
   setthvalue2s(L, L->top.p, L1);
   api_incr_top(L);
@@ -291,19 +359,65 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
   memcpy(lua_getextraspace(L1), lua_getextraspace(mainthread(g)),
          LUA_EXTRASPACE);
   luai_userstatethread(L, L1);
-  stack_init(L1, L);  /* init stack */
+  if (stack != NULL) {  /* reused thread? */
+    stack_setup(L1, stack, size);
+    luaC_bdadd(g, LUA_BDTHREAD, 0, luaE_threadsize(L1));
+  }
+  else
+    stack_init(L1, L);  /* init stack */
   lua_unlock(L);
   return L1;
 }
 
 
+/*
+** Keep a dead thread, being swept, in the pool of threads that
+** 'lua_newthread' reuses (option LUA_GCPTHREADPOOL); returns false
+** if the thread must be freed instead. As when freeing it, its
+** upvalues are closed, but its pending to-be-closed variables are
+** not called. Its stack returns to the initial size and it leaves
+** the live counters, so its bytes count as "other" while pooled.
+** Pooled threads are linked through their 'twups' fields.
+*/
+int luaE_poolthread (lua_State *L, lua_State *L1) {
+  global_State *g = G(L);
+  int size = initstacksize(g);
+  if (g->gcemergency || L1->stack.p == NULL ||
+      g->npooled >= applygcparam(g, THREADPOOL, 100))
+    return 0;
+  luaF_closeupval(L1, L1->stack.p);  /* close all upvalues */
+  lua_assert(L1->openupval == NULL);
+  luai_userstatefree(L, L1);
+  resetCI(L1);
+  luaE_trimCI(L1);
+  L1->top.p = L1->stack.p + 1;
+  L1->tbclist.p = L1->stack.p;
+  if (stacksize(L1) != size)
+    luaD_reallocstack(L1, size, 0);  /* ok if that fails */
+  luaC_bdadd(g, LUA_BDTHREAD, -1, -cast(l_mem, luaE_threadsize(L1)));
+  L1->twups = g->threadpool;
+  g->threadpool = L1;
+  g->npooled++;
+  return 1;
+}
+
+
+/*
+** Free the threads over the current size of the pool (which the
+** program may have reduced).
+*/
+void luaE_trimpool (lua_State *L) {
+  freepool(L, applygcparam(G(L), THREADPOOL, 100));
+}
+
+
 void luaE_freethread (lua_State *L, lua_State *L1) {
   LX *l = fromstate(L1);
   luaF_closeupval(L1, L1->stack.p);  /* close all upvalues */
   lua_assert(L1->openupval == NULL);
   luai_userstatefree(L, L1);
   freestack(L1);
-  luaM_free(L, l);
+  luaM_freeobject(L, l, sizeof(LX), LUA_TTHREAD);
 }
 
 
@@ -342,7 +456,14 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud, unsigned seed) {
   L = &g->mainth.l;
   L->tt = LUA_VTHREAD;
   g->currentwhite = bitmask(WHITE0BIT);
+#if defined(LUA_USE_SIDEMARKS)
+  L->marked = HEAPMAIN;  /* its GC bits are in 'mainbits' */
+  g->mainbits = luaC_white(g);
+  memset(g->heapavail, 0, sizeof(g->heapavail));
+  g->arenas = NULL;
+#else
   L->marked = luaC_white(g);
+#endif
   preinit_thread(L, g);
   g->allgc = obj2gco(L);  /* by now, only object is the main thread */
   L->next = NULL;
@@ -354,22 +475,49 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud, unsigned seed) {
   g->seed = seed;
   g->gcstp = GCSTPGC;  /* no GC while building state */
   g->strt.size = g->strt.nuse = 0;
-  g->strt.hash = NULL;
+  g->strt.osize = g->strt.migrated = 0;
+  g->strt.hash = g->strt.ohash = NULL;
   setnilvalue(&g->l_registry);
   g->panic = NULL;
   g->gcstate = GCSpause;
   g->gckind = KGC_INC;
   g->gcstopem = 0;
   g->gcemergency = 0;
+  g->allocsafe = 0;
+  g->bulkfree = 0;
+  g->GCrate = LUAI_GCRATE;
+  memset(&g->gcpauses, 0, sizeof(g->gcpauses));
+  memset(g->bdcount, 0, sizeof(g->bdcount));
+  memset(g->bdbytes, 0, sizeof(g->bdbytes));
+  luaC_bdadd(g, LUA_BDTHREAD, 1, sizeof(LX));  /* main thread */
+  g->telemetry = NULL;
+  g->adaptive = NULL;
+  g->decisionf = NULL;
+  g->decisionud = NULL;
+  g->nextstr = 0;
+  g->threadpool = NULL;
+  g->npooled = 0;
+  g->allocleft = MAX_LMEM;
+  g->allocprof = NULL;
+  g->allocfilter = NULL;
   g->finobj = g->tobefnz = g->fixedgc = NULL;
   g->firstold1 = g->survival = g->old1 = g->reallyold = NULL;
   g->finobjsur = g->finobjold1 = g->finobjrold = NULL;
+  g->cardsets = NULL;
+  g->sizecardsets = g->ncardsets = 0;
   g->sweepgc = NULL;
   g->gray = g->grayagain = NULL;
+  g->graystack = NULL;
+  g->sizegraystack = g->ngraystack = 0;
+  g->windowfirst = g->nwindow = 0;
   g->weak = g->ephemeron = g->allweak = NULL;
+  g->ephpending = NULL;
   g->twups = NULL;
+  g->markers = NULL;
+  g->sweeper = NULL;
   g->GCtotalbytes = sizeof(global_State);
   g->GCmarked = 0;
+  g->GCextbytes = g->GCextmajor = 0;
   g->GCdebt = 0;
   setivalue(&g->nilvalue, 0);  /* to signal that state is not yet built */
   setgcparam(g, PAUSE, LUAI_GCPAUSE);
@@ -378,6 +526,14 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud, unsigned seed) {
   setgcparam(g, MINORMUL, LUAI_GENMINORMUL);
   setgcparam(g, MINORMAJOR, LUAI_MINORMAJOR);
   setgcparam(g, MAJORMINOR, LUAI_MAJORMINOR);
+  setgcparam(g, MARKTHREADS, LUAI_GCMARKTHREADS);
+  setgcparam(g, SWEEPTHREAD, LUAI_GCSWEEPTHREAD);
+  setgcparam(g, STEPTIME, LUAI_GCSTEPTIME);
+  setgcparam(g, PAUSEGOAL, LUAI_GCPAUSEGOAL);
+  setgcparam(g, MEMGOAL, LUAI_GCMEMGOAL);
+  setgcparam(g, DEFERFIN, LUAI_GCDEFERFIN);
+  setgcparam(g, LEANSTACKS, LUAI_GCLEANSTACKS);
+  setgcparam(g, THREADPOOL, LUAI_GCTHREADPOOL);
   for (i=0; i < LUA_NUMTYPES; i++) g->mt[i] = NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
@@ -153,8 +153,20 @@ struct lua_longjmp;  /* defined in ldo.c */
 #endif
 
 
+/*
+** Number of gray objects being prefetched before their traversal
+** (see 'popgray' in lgc.c).
+*/
+#if !defined(GRAYWINDOW)
+#define GRAYWINDOW	8
+#endif
+
+
 #define BASIC_STACK_SIZE        (2*LUA_MINSTACK)
 
+/* initial stack with LUA_GCPLEANSTACKS: just the base C frame */
+#define LEAN_STACK_SIZE         (1 + LUA_MINSTACK)
+
 #define stacksize(th)	cast_int((th)->stack_last.p - (th)->stack.p)
 
 
@@ -164,10 +176,18 @@ struct lua_longjmp;  /* defined in ldo.c */
 #define KGC_GENMAJOR	2	/* generational in major mode */
 
 
+/*
+** A resize of the string table allocates a new array and then moves
+** the old buckets into it a few at a time (see 'luaS_migrate'). While
+** 'ohash' is not NULL, its buckets from 'migrated' on are still in use.
+*/
 typedef struct stringtable {
   TString **hash;  /* array of buckets (linked lists of strings) */
+  TString **ohash;  /* previous array, during a resize */
   int nuse;  /* number of elements */
   int size;  /* number of buckets */
+  int osize;  /* number of buckets in 'ohash' */
+  int migrated;  /* buckets of 'ohash' already moved to 'hash' */
 } stringtable;
 
 
@@ -335,6 +355,9 @@ typedef struct global_State {
   l_mem GCdebt;  /* bytes counted but not yet allocated */
   l_mem GCmarked;  /* number of objects marked in a GC cycle */
   l_mem GCmajorminor;  /* auxiliary counter to control major-minor shifts */
+  l_mem GCextbytes;  /* external memory declared by the program */
+  l_mem GCextmajor;  /* 'GCextbytes' after the last major collection */
+  l_mem GCrate;  /* measured collector speed (work units per millisecond) */
   stringtable strt;  /* hash table for strings */
   TValue l_registry;
   TValue nilvalue;  /* a nil value */
@@ -346,13 +369,22 @@ typedef struct global_State {
   lu_byte gcstopem;  /* stops emergency collections */
   lu_byte gcstp;  /* control whether GC is running */
   lu_byte gcemergency;  /* true if this is an emergency collection */
+  lu_byte allocsafe;  /* true if 'frealloc' can be called by other threads */
+  lu_byte bulkfree;  /* true if 'frealloc' frees all blocks when closing */
   GCObject *allgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* current position of sweep in list */
   GCObject *finobj;  /* list of collectable objects with finalizers */
-  GCObject *gray;  /* list of gray objects */
+  GCObject **graystack;  /* stack of gray objects */
+  unsigned int sizegraystack;  /* size of 'graystack' */
+  unsigned int ngraystack;  /* number of objects in 'graystack' */
+  GCObject *graywindow[GRAYWINDOW];  /* gray objects being prefetched */
+  unsigned int windowfirst;  /* first object in 'graywindow' (a FIFO) */
+  unsigned int nwindow;  /* number of objects in 'graywindow' */
+  GCObject *gray;  /* list of gray objects (when the stack is full) */
   GCObject *grayagain;  /* list of objects to be traversed atomically */
   GCObject *weak;  /* list of tables with weak values */
   GCObject *ephemeron;  /* list of ephemeron tables (weak keys) */
+  struct EphPending *ephpending;  /* see 'convergeephemerons' */
   GCObject *allweak;  /* list of all-weak tables */
   GCObject *tobefnz;  /* list of userdata to be GC */
   GCObject *fixedgc;  /* list of objects not to be collected */
@@ -364,7 +396,30 @@ typedef struct global_State {
   GCObject *finobjsur;  /* list of survival objects with finalizers */
   GCObject *finobjold1;  /* list of old1 objects with finalizers */
   GCObject *finobjrold;  /* list of really old objects with finalizers */
+  struct CardSet **cardsets;  /* hash of card sets of large old tables */
+  unsigned int sizecardsets;  /* size of 'cardsets' */
+  unsigned int ncardsets;  /* number of card sets in 'cardsets' */
   struct lua_State *twups;  /* list of threads with open upvalues */
+  struct GCMarkers *markers;  /* helper threads for parallel marking */
+  struct GCSweeper *sweeper;  /* thread for background freeing */
+  lua_GCPauses gcpauses;  /* distribution of timed step pauses */
+  l_mem bdcount[LUA_BDN];  /* live objects by kind (LUA_BD*) */
+  l_mem bdbytes[LUA_BDN];  /* their bytes */
+  struct GCTelemetry *telemetry;  /* collector events (NULL if off) */
+  struct GCAdaptive *adaptive;  /* mode controller (NULL if not adaptive) */
+  lua_GCDecisionFunction decisionf;  /* receives adaptive decisions */
+  void *decisionud;  /* auxiliary data to 'decisionf' */
+  size_t nextstr;  /* number of external strings with a deallocator */
+  struct lua_State *threadpool;  /* dead threads ready for reuse */
+  l_mem npooled;  /* number of threads in 'threadpool' */
+  l_mem allocleft;  /* bytes to allocate before the next profiler sample */
+  struct AllocProfile *allocprof;  /* allocation profile (NULL if none) */
+  lu_byte *allocfilter;  /* filter of sampled blocks (NULL if no profile) */
+#if defined(LUA_USE_SIDEMARKS)
+  HeapPage *heapavail[HEAPCLASSES];  /* pages with free slots */
+  struct HeapArena *arenas;  /* arenas with free pages */
+  lu_byte mainbits;  /* GC bits of the main thread */
+#endif
   lua_CFunction panic;  /* to be called in unprotected errors */
   TString *memerrmsg;  /* message for memory-allocation errors */
   TString *tmname[TM_N];  /* array with tag-method names */
@@ -444,6 +499,9 @@ LUAI_FUNC void luaE_freethread (lua_State *L, lua_State *L1);
 LUAI_FUNC lu_mem luaE_threadsize (lua_State *L);
 LUAI_FUNC CallInfo *luaE_extendCI (lua_State *L);
 LUAI_FUNC void luaE_shrinkCI (lua_State *L);
+LUAI_FUNC void luaE_trimCI (lua_State *L);
+LUAI_FUNC int luaE_poolthread (lua_State *L, lua_State *L1);
+LUAI_FUNC void luaE_trimpool (lua_State *L);
 LUAI_FUNC void luaE_checkcstack (lua_State *L);
 LUAI_FUNC void luaE_incCstack (lua_State *L);
 LUAI_FUNC void luaE_warning (lua_State *L, const char *msg, int tocont);
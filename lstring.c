@@ -27,6 +27,15 @@
 */
 #define MAXSTRTB	cast_int(luaM_limitN(INT_MAX, TString*))
 
+/*
+** Number of buckets moved by each call to 'internshrstr' during a
+** resize. Growing happens when the table is full, so the old array is
+** gone before the new one fills up.
+*/
+#if !defined(STRMIGRATE)
+#define STRMIGRATE	4
+#endif
+
 /*
 ** Initial size for the string table (must be power of 2).
 ** The Lua core alone registers ~50 strings (reserved words +
@@ -69,47 +78,94 @@ unsigned luaS_hashlongstr (TString *ts) {
 }
 
 
-static void tablerehash (TString **vect, int osize, int nsize) {
-  int i;
-  for (i = osize; i < nsize; i++)  /* clear new elements */
-    vect[i] = NULL;
-  for (i = 0; i < osize; i++) {  /* rehash old part of the array */
-    TString *p = vect[i];
-    vect[i] = NULL;
+/*
+** The list where a string with hash 'h' is (or should be inserted):
+** in the old array if its bucket there was not moved yet.
+*/
+static TString **strbucket (stringtable *tb, unsigned int h) {
+  if (tb->ohash != NULL) {
+    int i = cast_int(lmod(h, tb->osize));
+    if (i >= tb->migrated)
+      return &tb->ohash[i];
+  }
+  return &tb->hash[lmod(h, tb->size)];
+}
+
+
+/*
+** Move up to 'n' buckets of the old array into the new one, freeing
+** the old array after its last bucket. As both sizes are powers of 2,
+** the first old bucket with strings for new bucket 'k' is 'k % osize'.
+** So, the new array is cleared here, as its buckets come into use,
+** and never all at once.
+*/
+void luaS_migrate (lua_State *L, int n) {
+  stringtable *tb = &G(L)->strt;
+  if (tb->ohash == NULL)
+    return;  /* no resize in progress */
+  while (n-- > 0 && tb->migrated < tb->osize) {
+    int i = tb->migrated++;
+    TString *p = tb->ohash[i];
+    int k;
+    for (k = i; k < tb->size; k += tb->osize)
+      tb->hash[k] = NULL;  /* new buckets that come into use */
+    tb->ohash[i] = NULL;
     while (p) {  /* for each string in the list */
       TString *hnext = p->u.hnext;  /* save next */
-      unsigned int h = lmod(p->hash, nsize);  /* new position */
-      p->u.hnext = vect[h];  /* chain it into array */
-      vect[h] = p;
+      TString **list = &tb->hash[lmod(p->hash, tb->size)];
+      p->u.hnext = *list;  /* chain it into new array */
+      *list = p;
       p = hnext;
     }
   }
+  if (tb->migrated == tb->osize) {  /* all buckets moved? */
+    luaM_freearray(L, tb->ohash, cast_sizet(tb->osize));
+    tb->ohash = NULL;
+    tb->osize = tb->migrated = 0;
+  }
 }
 
 
 /*
-** Resize the string table. If allocation fails, keep the current size.
-** (This can degrade performance, but any non-zero size should work
-** correctly.)
+** Resize the string table. The strings move to the new array
+** incrementally (see 'luaS_migrate'), so that a large table does not
+** cause a long pause. A previous resize still in progress is finished
+** first. If allocation fails, keep the current size. (This can degrade
+** performance, but any non-zero size should work correctly.)
 */
 void luaS_resize (lua_State *L, int nsize) {
   stringtable *tb = &G(L)->strt;
-  int osize = tb->size;
   TString **newvect;
-  if (nsize < osize)  /* shrinking table? */
-    tablerehash(tb->hash, osize, nsize);  /* depopulate shrinking part */
-  newvect = luaM_reallocvector(L, tb->hash, osize, nsize, TString*);
-  if (l_unlikely(newvect == NULL)) {  /* reallocation failed? */
-    if (nsize < osize)  /* was it shrinking table? */
-      tablerehash(tb->hash, nsize, osize);  /* restore to original size */
-    /* leave table as it was */
-  }
-  else {  /* allocation succeeded */
-    tb->hash = newvect;
-    tb->size = nsize;
-    if (nsize > osize)
-      tablerehash(newvect, osize, nsize);  /* rehash for new size */
+  luaS_migrate(L, INT_MAX);  /* finish previous resize */
+  newvect = luaM_reallocvector(L, NULL, 0, nsize, TString*);
+  if (l_unlikely(newvect == NULL))  /* allocation failed? */
+    return;  /* leave table as it was */
+  tb->ohash = tb->hash;
+  tb->osize = tb->size;
+  tb->migrated = 0;
+  tb->hash = newvect;
+  tb->size = nsize;
+}
+
+
+/*
+** Let the allocator move the arrays of the string table (see
+** 'luaC_compact'). Returns the number of arrays that moved.
+*/
+int luaS_compact (lua_State *L) {
+  stringtable *tb = &G(L)->strt;
+  TString **old = tb->hash;
+  int moved;
+  tb->hash = cast(TString **, luaM_move(L, old, cast_sizet(tb->size) *
+                                               sizeof(TString *)));
+  moved = (tb->hash != old);
+  if (tb->ohash != NULL) {
+    old = tb->ohash;
+    tb->ohash = cast(TString **, luaM_move(L, old, cast_sizet(tb->osize) *
+                                                  sizeof(TString *)));
+    moved += (tb->ohash != old);
   }
+  return moved;
 }
 
 
@@ -135,7 +191,8 @@ void luaS_init (lua_State *L) {
   int i, j;
   stringtable *tb = &G(L)->strt;
   tb->hash = luaM_newvector(L, MINSTRTABSIZE, TString*);
-  tablerehash(tb->hash, 0, MINSTRTABSIZE);  /* clear array */
+  for (i = 0; i < MINSTRTABSIZE; i++)  /* clear array */
+    tb->hash[i] = NULL;
   tb->size = MINSTRTABSIZE;
   /* pre-create memory-error message */
   g->memerrmsg = luaS_newliteral(L, MEMERRMSG);
@@ -189,7 +246,7 @@ TString *luaS_createlngstrobj (lua_State *L, size_t l) {
 
 void luaS_remove (lua_State *L, TString *ts) {
   stringtable *tb = &G(L)->strt;
-  TString **p = &tb->hash[lmod(ts->hash, tb->size)];
+  TString **p = strbucket(tb, ts->hash);
   while (*p != ts)  /* find previous element */
     p = &(*p)->u.hnext;
   *p = (*p)->u.hnext;  /* remove element from its list */
@@ -216,8 +273,11 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
   global_State *g = G(L);
   stringtable *tb = &g->strt;
   unsigned int h = luaS_hash(str, l, g->seed);
-  TString **list = &tb->hash[lmod(h, tb->size)];
+  TString **list;
   lua_assert(str != NULL);  /* otherwise 'memcmp'/'memcpy' are undefined */
+  if (l_unlikely(tb->ohash != NULL))  /* resize in progress? */
+    luaS_migrate(L, STRMIGRATE);
+  list = strbucket(tb, h);
   for (ts = *list; ts != NULL; ts = ts->u.hnext) {
     if (l == cast_uint(ts->shrlen) &&
         (memcmp(str, getshrstr(ts), l * sizeof(char)) == 0)) {
@@ -228,14 +288,14 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
     }
   }
   /* else must create a new string */
-  if (tb->nuse >= tb->size) {  /* need to grow string table? */
+  if (tb->nuse >= tb->size)  /* need to grow string table? */
     growstrtab(L, tb);
-    list = &tb->hash[lmod(h, tb->size)];  /* rehash with new size */
-  }
   ts = createstrobj(L, sizestrshr(l), LUA_VSHRSTR, h);
   ts->shrlen = cast(ls_byte, l);
   getshrstr(ts)[l] = '\0';  /* ending 0 */
   memcpy(getshrstr(ts), str, l * sizeof(char));
+  /* an emergency collection in 'createstrobj' may move buckets */
+  list = strbucket(tb, h);
   ts->u.hnext = *list;
   *list = ts;
   tb->nuse++;
@@ -349,6 +409,7 @@ TString *luaS_newextlstr (lua_State *L,
     }
     ne.ts->falloc = falloc;
     ne.ts->ud = ud;
+    G(L)->nextstr++;
   }
   ne.ts->shrlen = ne.kind;
   ne.ts->u.lnglen = len;
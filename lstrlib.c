@@ -94,40 +94,180 @@ static int str_sub (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Word-at-a-time kernels for long strings
+** =======================================================
+*/
+
+/*
+** These functions handle 'sizeof(size_t)' bytes at a time (using only
+** portable C), falling back to single bytes at the ends. They need
+** 8-bit bytes; otherwise, 'L_WORDOPS' is undefined and only the byte
+** loops are used.
+*/
+#if UCHAR_MAX == 255 && !defined(L_WORDOPS)
+#define L_WORDOPS
+#endif
+
+#if defined(L_WORDOPS)
+
+typedef size_t l_word;
+
+#define WORDSIZE	sizeof(l_word)
+
+/* a word with all its bytes equal to 'b' */
+#define wordof(b)	((~(l_word)0 / 0xFF) * cast(l_word, b))
+
+/* (using 'memcpy' avoids problems with aliasing and alignment) */
+#define loadword(w,p)	memcpy(&(w), (p), WORDSIZE)
+#define storeword(p,w)	memcpy((p), &(w), WORDSIZE)
+
+
+/*
+** Convert ASCII letters in 'w' to lower case (or upper case when
+** 'upper' is true), keeping all other bytes. For each byte, adding
+** 0x80 - 'A' (or 0x7F - 'Z') to its lower 7 bits sets the byte's high
+** bit when it is at least 'A' (or greater than 'Z'); letters are the
+** ASCII bytes with only the first of these two bits set, and they get
+** their case bit (0x20) flipped.
+*/
+static l_word wordcase (l_word w, int upper) {
+  int first = upper ? 'a' : 'A';
+  l_word low7 = w & wordof(0x7F);
+  l_word ge = low7 + wordof(0x80 - first);
+  l_word gt = low7 + wordof(0x7F - (first + 25));
+  l_word isletter = (ge ^ gt) & ~w & wordof(0x80);
+  return w ^ (isletter >> 2);
+}
+
+
+/* reverse the bytes of a word */
+static l_word wordreverse (l_word w) {
+#if !defined(LUA_NOBUILTIN) && defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
+  if (sizeof(l_word) == 8)
+    return cast(l_word, __builtin_bswap64(cast(unsigned long long, w)));
+  else if (sizeof(l_word) == 4)
+    return cast(l_word, __builtin_bswap32(cast(unsigned int, w)));
+#endif
+  {
+    l_word r = 0;
+    size_t i;
+    for (i = 0; i < WORDSIZE; i++) {
+      r = (r << 8) | (w & 0xFF);
+      w >>= 8;
+    }
+    return r;
+  }
+}
+
+
+/*
+** Case-convert 's' (with length 'l') into 'p' with ASCII rules; returns
+** the number of bytes converted (a multiple of the word size).
+*/
+static size_t asciicase (char *p, const char *s, size_t l, int upper) {
+  size_t i;
+  for (i = 0; l - i >= WORDSIZE; i += WORDSIZE) {
+    l_word w;
+    loadword(w, s + i);
+    w = wordcase(w, upper);
+    storeword(p + i, w);
+  }
+  return i;
+}
+
+
+/*
+** Reverse 's' (with length 'l') into 'p', a word at a time; returns the
+** number of bytes done from each end.
+*/
+static size_t wordsreverse (char *p, const char *s, size_t l) {
+  size_t i;
+  for (i = 0; l - i >= WORDSIZE; i += WORDSIZE) {
+    l_word w;
+    loadword(w, s + l - i - WORDSIZE);
+    w = wordreverse(w);
+    storeword(p + i, w);
+  }
+  return i;
+}
+
+#else
+
+#define asciicase(p,s,l,upper)	0
+#define wordsreverse(p,s,l)	0
+
+#endif
+
+/* }====================================================== */
+
+
 static int str_reverse (lua_State *L) {
   size_t l, i;
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i = 0; i < l; i++)
+  for (i = wordsreverse(p, s, l); i < l; i++)
     p[i] = s[l - i - 1];
   luaL_pushresultsize(&b, l);
   return 1;
 }
 
 
-static int str_lower (lua_State *L) {
+/*
+** Strings shorter than this are converted with direct calls to
+** 'tolower'/'toupper'. Longer ones use a table built with those
+** functions, so they still follow the current locale; when that
+** table turns out to be the ASCII conversion (as in the C locale),
+** they are converted a word at a time.
+*/
+#define CASETABLEMIN	256
+
+static void changecase (lua_State *L, int upper) {
   size_t l;
-  size_t i;
+  size_t i = 0;
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i=0; i<l; i++)
-    p[i] = cast_char(tolower(cast_uchar(s[i])));
+  if (l < CASETABLEMIN) {
+    if (upper) {
+      for (; i < l; i++)
+        p[i] = cast_char(toupper(cast_uchar(s[i])));
+    }
+    else {
+      for (; i < l; i++)
+        p[i] = cast_char(tolower(cast_uchar(s[i])));
+    }
+  }
+  else {
+    unsigned char table[UCHAR_MAX + 1];
+    int isascii = 1;
+    int c;
+    for (c = 0; c <= UCHAR_MAX; c++) {
+      int asc = (upper ? ('a' <= c && c <= 'z') : ('A' <= c && c <= 'Z'))
+              ? c ^ 0x20 : c;
+      table[c] = cast_uchar(upper ? toupper(c) : tolower(c));
+      if (table[c] != asc) isascii = 0;
+    }
+    if (isascii)
+      i = asciicase(p, s, l, upper);
+    for (; i < l; i++)
+      p[i] = cast_char(table[cast_uchar(s[i])]);
+  }
   luaL_pushresultsize(&b, l);
+}
+
+
+static int str_lower (lua_State *L) {
+  changecase(L, 0);
   return 1;
 }
 
 
 static int str_upper (lua_State *L) {
-  size_t l;
-  size_t i;
-  luaL_Buffer b;
-  const char *s = luaL_checklstring(L, 1, &l);
-  char *p = luaL_buffinitsize(L, &b, l);
-  for (i=0; i<l; i++)
-    p[i] = cast_char(toupper(cast_uchar(s[i])));
-  luaL_pushresultsize(&b, l);
+  changecase(L, 1);
   return 1;
 }
 
@@ -145,14 +285,18 @@ static int str_rep (lua_State *L) {
     size_t totallen = ((size_t)n * (l + lsep)) - lsep;
     luaL_Buffer b;
     char *p = luaL_buffinitsize(L, &b, totallen);
-    while (n-- > 1) {  /* first n-1 copies (followed by separator) */
-      memcpy(p, s, l * sizeof(char)); p += l;
-      if (lsep > 0) {  /* empty 'memcpy' is not that cheap */
-        memcpy(p, sep, lsep * sizeof(char));
-        p += lsep;
+    size_t done = l;  /* number of bytes already in the result */
+    memcpy(p, s, l * sizeof(char));  /* first copy */
+    if (n > 1) {
+      memcpy(p + l, sep, lsep * sizeof(char));  /* first separator */
+      done += lsep;
+      /* the result is periodic: keep doubling what is already there */
+      while (done < totallen) {
+        size_t len = (done <= totallen - done) ? done : totallen - done;
+        memcpy(p + done, p, len * sizeof(char));
+        done += len;
       }
     }
-    memcpy(p, s, l * sizeof(char));  /* last copy (not followed by separator) */
     luaL_pushresultsize(&b, totallen);
   }
   return 1;
@@ -1524,15 +1668,15 @@ static KOption getoption (Header *h, const char **fmt, size_t *size) {
 
 /*
 ** Read, classify, and fill other details about the next option.
-** 'psize' is filled with option's size, 'notoalign' with its
-** alignment requirements.
+** 'psize' is filled with option's size, 'palign' with its alignment
+** requirements (a power of 2; 1 means no alignment).
 ** Local variable 'size' gets the size to be aligned. (Kpadal option
 ** always gets its full alignment, other options are limited by
 ** the maximum alignment ('maxalign'). Kchar option needs no alignment
 ** despite its size.
 */
-static KOption getdetails (Header *h, size_t totalsize, const char **fmt,
-                           size_t *psize, unsigned *ntoalign) {
+static KOption getdetails (Header *h, const char **fmt,
+                           size_t *psize, unsigned *palign) {
   KOption opt = getoption(h, fmt, psize);
   size_t align = *psize;  /* usually, alignment follows size */
   if (opt == Kpaddalign) {  /* 'X' gets alignment from following option */
@@ -1540,24 +1684,107 @@ static KOption getdetails (Header *h, size_t totalsize, const char **fmt,
       luaL_argerror(h->L, 1, "invalid next option for option 'X'");
   }
   if (align <= 1 || opt == Kchar)  /* need no alignment? */
-    *ntoalign = 0;
+    *palign = 1;
   else {
     if (align > h->maxalign)  /* enforce maximum alignment */
       align = h->maxalign;
     if (l_unlikely(!ispow2(align))) {  /* not a power of 2? */
-      *ntoalign = 0;  /* to avoid warnings */
+      *palign = 1;  /* to avoid warnings */
       luaL_argerror(h->L, 1, "format asks for alignment not power of 2");
     }
-    else {
-      /* 'szmoda' = totalsize % align */
-      unsigned szmoda = cast_uint(totalsize & (align - 1));
-      *ntoalign = cast_uint((align - szmoda) & (align - 1));
-    }
+    else
+      *palign = cast_uint(align);
   }
   return opt;
 }
 
 
+/*
+** Number of padding bytes needed at position 'pos' to get alignment
+** 'align' (a power of 2).
+*/
+#define ntoalign(pos,align)  \
+	cast_uint(((align) - ((pos) & ((align) - 1))) & ((align) - 1))
+
+
+/*
+** A compiled format: the sequence of its options, each with all the
+** details needed to pack or unpack it. Options that only change the
+** configuration (endianness, maximum alignment, spaces) are resolved
+** at compilation time and do not appear in the sequence.
+*/
+typedef struct KItem {
+  KOption opt;
+  int islittle;
+  unsigned align;  /* alignment requirements (a power of 2) */
+  size_t size;
+} KItem;
+
+typedef struct CFormat {
+  int nitems;  /* number of items */
+  int nvalues;  /* number of items that correspond to values */
+  int varlen;  /* true if format has variable-length items */
+  size_t size;  /* size of fixed-size items (ignoring alignment) */
+  KItem item[1];
+} CFormat;
+
+
+/*
+** Compile format 'fmt' (with length 'len') into a new userdata,
+** left on the top of the stack. Each option uses at least one
+** character, so 'len' items are enough.
+*/
+static CFormat *compileformat (lua_State *L, const char *fmt, size_t len) {
+  Header h;
+  CFormat *cf;
+  luaL_argcheck(L, len <= (MAX_SIZE - offsetof(CFormat, item)) /
+                         sizeof(KItem), 1, "format too long");
+  cf = (CFormat *)lua_newuserdatauv(L, offsetof(CFormat, item) +
+                                       len * sizeof(KItem), 0);
+  cf->nitems = cf->nvalues = cf->varlen = 0;
+  cf->size = 0;
+  initheader(L, &h);
+  while (*fmt != '\0') {
+    KItem *it = &cf->item[cf->nitems];
+    it->opt = getdetails(&h, &fmt, &it->size, &it->align);
+    it->islittle = h.islittle;
+    switch (it->opt) {
+      case Knop: continue;  /* nothing to do at pack/unpack time */
+      case Kpadding: case Kpaddalign: break;
+      case Kstring: case Kzstr: cf->varlen = 1;  /* FALLTHROUGH */
+      default: cf->nvalues++; break;
+    }
+    if (cf->size < MAX_SIZE - it->size)  /* avoid overflows */
+      cf->size += it->size;  /* (value only used as a hint) */
+    cf->nitems++;
+  }
+  return cf;
+}
+
+
+/*
+** Get the compiled version of the format string at index 'arg'. The
+** compiled formats are kept in a cache (first upvalue of the pack
+** functions) with weak values, so they are reused until the next
+** garbage collection. Leaves the compiled format on the top of the
+** stack.
+*/
+static const CFormat *getpackformat (lua_State *L, int arg) {
+  size_t len;
+  const char *fmt = luaL_checklstring(L, arg, &len);
+  CFormat *cf;
+  lua_pushvalue(L, arg);
+  if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TUSERDATA)  /* cached? */
+    return (const CFormat *)lua_touserdata(L, -1);
+  lua_pop(L, 1);  /* remove result from 'rawget' */
+  cf = compileformat(L, fmt, len);
+  lua_pushvalue(L, arg);  /* key: format string */
+  lua_pushvalue(L, -2);  /* value: compiled format */
+  lua_rawset(L, lua_upvalueindex(1));  /* cache[fmt] = cf */
+  return cf;
+}
+
+
 /*
 ** Pack integer 'n' with 'size' bytes and 'islittle' endianness.
 ** The final 'if' handles the case when 'size' is larger than
@@ -1597,105 +1824,205 @@ static void copywithendian (char *dest, const char *src,
 }
 
 
+/*
+** Pack the value at index 'idx' according to item 'it', after the
+** alignment padding. 'totalsize' is the size of the result so far.
+** Errors other than wrong types refer to argument 'arg' (which is
+** 'idx' itself, except for 'packmany').
+*/
+static void packitem (lua_State *L, luaL_Buffer *b, const KItem *it,
+                      int idx, int arg, size_t *totalsize) {
+  size_t size = it->size;
+  unsigned npad = ntoalign(*totalsize, it->align);
+  luaL_argcheck(L, size + npad <= MAX_SIZE - *totalsize, arg,
+                   "result too long");
+  *totalsize += npad + size;
+  while (npad-- > 0)
+   luaL_addchar(b, LUAL_PACKPADBYTE);  /* fill alignment */
+  switch (it->opt) {
+    case Kint: {  /* signed integers */
+      lua_Integer n = luaL_checkinteger(L, idx);
+      if (size < SZINT) {  /* need overflow check? */
+        lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
+        luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
+      }
+      packint(b, (lua_Unsigned)n, it->islittle, cast_uint(size), (n < 0));
+      break;
+    }
+    case Kuint: {  /* unsigned integers */
+      lua_Integer n = luaL_checkinteger(L, idx);
+      if (size < SZINT)  /* need overflow check? */
+        luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
+                         arg, "unsigned overflow");
+      packint(b, (lua_Unsigned)n, it->islittle, cast_uint(size), 0);
+      break;
+    }
+    case Kfloat: {  /* C float */
+      float f = (float)luaL_checknumber(L, idx);  /* get argument */
+      char *buff = luaL_prepbuffsize(b, sizeof(f));
+      /* move 'f' to final result, correcting endianness if needed */
+      copywithendian(buff, (char *)&f, sizeof(f), it->islittle);
+      luaL_addsize(b, size);
+      break;
+    }
+    case Knumber: {  /* Lua float */
+      lua_Number f = luaL_checknumber(L, idx);  /* get argument */
+      char *buff = luaL_prepbuffsize(b, sizeof(f));
+      /* move 'f' to final result, correcting endianness if needed */
+      copywithendian(buff, (char *)&f, sizeof(f), it->islittle);
+      luaL_addsize(b, size);
+      break;
+    }
+    case Kdouble: {  /* C double */
+      double f = (double)luaL_checknumber(L, idx);  /* get argument */
+      char *buff = luaL_prepbuffsize(b, sizeof(f));
+      /* move 'f' to final result, correcting endianness if needed */
+      copywithendian(buff, (char *)&f, sizeof(f), it->islittle);
+      luaL_addsize(b, size);
+      break;
+    }
+    case Kchar: {  /* fixed-size string */
+      size_t len;
+      const char *s = luaL_checklstring(L, idx, &len);
+      luaL_argcheck(L, len <= size, arg, "string longer than given size");
+      luaL_addlstring(b, s, len);  /* add string */
+      if (len < size) {  /* does it need padding? */
+        size_t psize = size - len;  /* pad size */
+        char *buff = luaL_prepbuffsize(b, psize);
+        memset(buff, LUAL_PACKPADBYTE, psize);
+        luaL_addsize(b, psize);
+      }
+      break;
+    }
+    case Kstring: {  /* strings with length count */
+      size_t len;
+      const char *s = luaL_checklstring(L, idx, &len);
+      luaL_argcheck(L, size >= sizeof(lua_Unsigned) ||
+                       len < ((lua_Unsigned)1 << (size * NB)),
+                       arg, "string length does not fit in given size");
+      luaL_argcheck(L, len <= MAX_SIZE - *totalsize, arg, "result too long");
+      /* pack length */
+      packint(b, (lua_Unsigned)len, it->islittle, cast_uint(size), 0);
+      luaL_addlstring(b, s, len);
+      *totalsize += len;
+      break;
+    }
+    case Kzstr: {  /* zero-terminated string */
+      size_t len;
+      const char *s = luaL_checklstring(L, idx, &len);
+      luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
+      luaL_argcheck(L, len < MAX_SIZE - *totalsize, arg, "result too long");
+      luaL_addlstring(b, s, len);
+      luaL_addchar(b, '\0');  /* add zero at the end */
+      *totalsize += len + 1;
+      break;
+    }
+    case Kpadding: luaL_addchar(b, LUAL_PACKPADBYTE);  /* FALLTHROUGH */
+    case Kpaddalign: case Knop:
+      break;
+  }
+}
+
+
+/* true for items that do not correspond to values */
+#define novalue(it)	((it)->opt >= Kpadding)
+
+
 static int str_pack (lua_State *L) {
   luaL_Buffer b;
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);  /* format string */
+  const CFormat *cf;
   int arg = 1;  /* current argument to pack */
   size_t totalsize = 0;  /* accumulate total size of result */
-  initheader(L, &h);
+  int i;
+  luaL_checkstring(L, 1);
   lua_pushnil(L);  /* mark to separate arguments from string buffer */
+  cf = getpackformat(L, 1);
   luaL_buffinit(L, &b);
-  while (*fmt != '\0') {
-    unsigned ntoalign;
-    size_t size;
-    KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
-    luaL_argcheck(L, size + ntoalign <= MAX_SIZE - totalsize, arg,
-                     "result too long");
-    totalsize += ntoalign + size;
-    while (ntoalign-- > 0)
-     luaL_addchar(&b, LUAL_PACKPADBYTE);  /* fill alignment */
-    arg++;
-    switch (opt) {
-      case Kint: {  /* signed integers */
-        lua_Integer n = luaL_checkinteger(L, arg);
-        if (size < SZINT) {  /* need overflow check? */
-          lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
-          luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
-        }
-        packint(&b, (lua_Unsigned)n, h.islittle, cast_uint(size), (n < 0));
-        break;
-      }
-      case Kuint: {  /* unsigned integers */
-        lua_Integer n = luaL_checkinteger(L, arg);
-        if (size < SZINT)  /* need overflow check? */
-          luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
-                           arg, "unsigned overflow");
-        packint(&b, (lua_Unsigned)n, h.islittle, cast_uint(size), 0);
-        break;
-      }
-      case Kfloat: {  /* C float */
-        float f = (float)luaL_checknumber(L, arg);  /* get argument */
-        char *buff = luaL_prepbuffsize(&b, sizeof(f));
-        /* move 'f' to final result, correcting endianness if needed */
-        copywithendian(buff, (char *)&f, sizeof(f), h.islittle);
-        luaL_addsize(&b, size);
-        break;
-      }
-      case Knumber: {  /* Lua float */
-        lua_Number f = luaL_checknumber(L, arg);  /* get argument */
-        char *buff = luaL_prepbuffsize(&b, sizeof(f));
-        /* move 'f' to final result, correcting endianness if needed */
-        copywithendian(buff, (char *)&f, sizeof(f), h.islittle);
-        luaL_addsize(&b, size);
-        break;
-      }
-      case Kdouble: {  /* C double */
-        double f = (double)luaL_checknumber(L, arg);  /* get argument */
-        char *buff = luaL_prepbuffsize(&b, sizeof(f));
-        /* move 'f' to final result, correcting endianness if needed */
-        copywithendian(buff, (char *)&f, sizeof(f), h.islittle);
-        luaL_addsize(&b, size);
-        break;
-      }
-      case Kchar: {  /* fixed-size string */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, len <= size, arg, "string longer than given size");
-        luaL_addlstring(&b, s, len);  /* add string */
-        if (len < size) {  /* does it need padding? */
-          size_t psize = size - len;  /* pad size */
-          char *buff = luaL_prepbuffsize(&b, psize);
-          memset(buff, LUAL_PACKPADBYTE, psize);
-          luaL_addsize(&b, psize);
-        }
-        break;
-      }
-      case Kstring: {  /* strings with length count */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, size >= sizeof(lua_Unsigned) ||
-                         len < ((lua_Unsigned)1 << (size * NB)),
-                         arg, "string length does not fit in given size");
-        /* pack length */
-        packint(&b, (lua_Unsigned)len, h.islittle, cast_uint(size), 0);
-        luaL_addlstring(&b, s, len);
-        totalsize += len;
-        break;
-      }
-      case Kzstr: {  /* zero-terminated string */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
-        luaL_addlstring(&b, s, len);
-        luaL_addchar(&b, '\0');  /* add zero at the end */
-        totalsize += len + 1;
-        break;
+  for (i = 0; i < cf->nitems; i++) {
+    const KItem *it = &cf->item[i];
+    if (!novalue(it)) arg++;  /* item consumes an argument */
+    packitem(L, &b, it, arg, arg, &totalsize);
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+/*
+** Check that the value in slot 6, taken from 't[i]', has the type
+** that item 'it' needs, so that an error refers to the table instead
+** of that internal slot.
+*/
+static void checkmanyvalue (lua_State *L, const KItem *it, lua_Integer i) {
+  const char *msg;
+  int ok;
+  switch (it->opt) {
+    case Kint: case Kuint: {
+      lua_tointegerx(L, 6, &ok);
+      msg = lua_isnumber(L, 6) ? "number has no integer representation"
+                               : "integer expected";
+      break;
+    }
+    case Kfloat: case Knumber: case Kdouble: {
+      ok = lua_isnumber(L, 6);
+      msg = "number expected";
+      break;
+    }
+    case Kchar: case Kstring: case Kzstr: {
+      ok = lua_isstring(L, 6);
+      msg = "string expected";
+      break;
+    }
+    default: return;
+  }
+  if (l_unlikely(!ok))
+    luaL_argerror(L, 2, lua_pushfstring(L, "%s at index %I, got %s", msg,
+                        (LUAI_UACINT)i, luaL_typename(L, 6)));
+}
+
+
+/*
+** string.packmany(fmt, t [, i [, j]]): packs the values t[i], ...,
+** t[j] in records, each record with as many values as 'fmt' needs.
+** The result is the concatenation of 'string.pack(fmt, ...)' for
+** each record.
+*/
+static int str_packmany (lua_State *L) {
+  luaL_Buffer b;
+  const CFormat *cf;
+  lua_Integer i, j;
+  lua_Unsigned nrec;  /* number of records */
+  luaL_checktype(L, 2, LUA_TTABLE);
+  i = luaL_optinteger(L, 3, 1);
+  j = luaL_opt(L, luaL_checkinteger, 4, luaL_len(L, 2));
+  lua_settop(L, 4);
+  cf = getpackformat(L, 1);
+  luaL_argcheck(L, cf->nvalues > 0, 1, "format has no values");
+  if (i > j)
+    nrec = 0;  /* empty interval */
+  else {
+    lua_Unsigned nv = l_castS2U(j) - l_castS2U(i);  /* number of values - 1 */
+    luaL_argcheck(L, nv % cast_uint(cf->nvalues) ==
+                     cast_uint(cf->nvalues - 1), 2,
+                     "number of values is not a multiple of record size");
+    nrec = nv / cast_uint(cf->nvalues) + 1;
+  }
+  lua_pushnil(L);  /* slot for current value (below string buffer) */
+  luaL_buffinit(L, &b);
+  for (; nrec > 0; nrec--) {  /* for each record */
+    size_t totalsize = 0;  /* alignment is relative to each record */
+    int k;
+    for (k = 0; k < cf->nitems; k++) {
+      const KItem *it = &cf->item[k];
+      if (!novalue(it)) {
+        if (l_unlikely(lua_rawgeti(L, 2, i) == LUA_TNIL))
+          luaL_error(L, "missing value at index %I in table",
+                        (LUAI_UACINT)i);
+        lua_replace(L, 6);  /* put it into its slot */
+        checkmanyvalue(L, it, i);
+        i = l_castU2S(l_castS2U(i) + 1u);  /* (avoid overflows) */
       }
-      case Kpadding: luaL_addchar(&b, LUAL_PACKPADBYTE);  /* FALLTHROUGH */
-      case Kpaddalign: case Knop:
-        arg--;  /* undo increment */
-        break;
+      packitem(L, &b, it, 6, 2, &totalsize);
     }
   }
   luaL_pushresult(&b);
@@ -1704,17 +2031,15 @@ static int str_pack (lua_State *L) {
 
 
 static int str_packsize (lua_State *L) {
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);  /* format string */
+  const CFormat *cf = getpackformat(L, 1);
   size_t totalsize = 0;  /* accumulate total size of result */
-  initheader(L, &h);
-  while (*fmt != '\0') {
-    unsigned ntoalign;
-    size_t size;
-    KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
-    luaL_argcheck(L, opt != Kstring && opt != Kzstr, 1,
+  int i;
+  for (i = 0; i < cf->nitems; i++) {
+    const KItem *it = &cf->item[i];
+    size_t size = it->size;
+    luaL_argcheck(L, it->opt != Kstring && it->opt != Kzstr, 1,
                      "variable-length format");
-    size += ntoalign;  /* total space used by option */
+    size += ntoalign(totalsize, it->align);  /* total space used by option */
     luaL_argcheck(L, totalsize <= LUA_MAXINTEGER - size,
                      1, "format result too large");
     totalsize += size;
@@ -1758,79 +2083,142 @@ static lua_Integer unpackint (lua_State *L, const char *str,
 }
 
 
+/*
+** Unpack item 'it' from position 'pos' (after its alignment) of
+** string 'data' (with length 'ld'), pushing the value (if any) on the
+** stack. Returns the position after the item.
+*/
+static size_t unpackitem (lua_State *L, const KItem *it, const char *data,
+                          size_t ld, size_t pos) {
+  size_t size = it->size;
+  unsigned npad = ntoalign(pos, it->align);
+  luaL_argcheck(L, npad + size <= ld - pos, 2, "data string too short");
+  pos += npad;  /* skip alignment */
+  switch (it->opt) {
+    case Kint:
+    case Kuint: {
+      lua_Integer res = unpackint(L, data + pos, it->islittle,
+                                     cast_int(size), (it->opt == Kint));
+      lua_pushinteger(L, res);
+      break;
+    }
+    case Kfloat: {
+      float f;
+      copywithendian((char *)&f, data + pos, sizeof(f), it->islittle);
+      lua_pushnumber(L, (lua_Number)f);
+      break;
+    }
+    case Knumber: {
+      lua_Number f;
+      copywithendian((char *)&f, data + pos, sizeof(f), it->islittle);
+      lua_pushnumber(L, f);
+      break;
+    }
+    case Kdouble: {
+      double f;
+      copywithendian((char *)&f, data + pos, sizeof(f), it->islittle);
+      lua_pushnumber(L, (lua_Number)f);
+      break;
+    }
+    case Kchar: {
+      lua_pushlstring(L, data + pos, size);
+      break;
+    }
+    case Kstring: {
+      lua_Unsigned len = (lua_Unsigned)unpackint(L, data + pos,
+                                        it->islittle, cast_int(size), 0);
+      luaL_argcheck(L, len <= ld - pos - size, 2, "data string too short");
+      lua_pushlstring(L, data + pos + size, cast_sizet(len));
+      pos += cast_sizet(len);  /* skip string */
+      break;
+    }
+    case Kzstr: {
+      size_t len = strlen(data + pos);
+      luaL_argcheck(L, pos + len < ld, 2,
+                       "unfinished string for format 'z'");
+      lua_pushlstring(L, data + pos, len);
+      pos += len + 1;  /* skip string plus final '\0' */
+      break;
+    }
+    case Kpaddalign: case Kpadding: case Knop:
+      break;
+  }
+  return pos + size;
+}
+
+
 static int str_unpack (lua_State *L) {
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);
   size_t ld;
   const char *data = luaL_checklstring(L, 2, &ld);
   size_t pos = posrelatI(luaL_optinteger(L, 3, 1), ld) - 1;
-  int n = 0;  /* number of results */
+  int i;
+  const CFormat *cf;
   luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
-  initheader(L, &h);
-  while (*fmt != '\0') {
-    unsigned ntoalign;
-    size_t size;
-    KOption opt = getdetails(&h, pos, &fmt, &size, &ntoalign);
-    luaL_argcheck(L, ntoalign + size <= ld - pos, 2,
-                    "data string too short");
-    pos += ntoalign;  /* skip alignment */
-    /* stack space for item + next position */
-    luaL_checkstack(L, 2, "too many results");
-    n++;
-    switch (opt) {
-      case Kint:
-      case Kuint: {
-        lua_Integer res = unpackint(L, data + pos, h.islittle,
-                                       cast_int(size), (opt == Kint));
-        lua_pushinteger(L, res);
-        break;
-      }
-      case Kfloat: {
-        float f;
-        copywithendian((char *)&f, data + pos, sizeof(f), h.islittle);
-        lua_pushnumber(L, (lua_Number)f);
-        break;
-      }
-      case Knumber: {
-        lua_Number f;
-        copywithendian((char *)&f, data + pos, sizeof(f), h.islittle);
-        lua_pushnumber(L, f);
-        break;
-      }
-      case Kdouble: {
-        double f;
-        copywithendian((char *)&f, data + pos, sizeof(f), h.islittle);
-        lua_pushnumber(L, (lua_Number)f);
-        break;
-      }
-      case Kchar: {
-        lua_pushlstring(L, data + pos, size);
-        break;
-      }
-      case Kstring: {
-        lua_Unsigned len = (lua_Unsigned)unpackint(L, data + pos,
-                                          h.islittle, cast_int(size), 0);
-        luaL_argcheck(L, len <= ld - pos - size, 2, "data string too short");
-        lua_pushlstring(L, data + pos + size, cast_sizet(len));
-        pos += cast_sizet(len);  /* skip string */
-        break;
-      }
-      case Kzstr: {
-        size_t len = strlen(data + pos);
-        luaL_argcheck(L, pos + len < ld, 2,
-                         "unfinished string for format 'z'");
-        lua_pushlstring(L, data + pos, len);
-        pos += len + 1;  /* skip string plus final '\0' */
-        break;
-      }
-      case Kpaddalign: case Kpadding: case Knop:
-        n--;  /* undo increment */
-        break;
+  lua_settop(L, 3);
+  cf = getpackformat(L, 1);
+  /* stack space for values + next position */
+  luaL_checkstack(L, cf->nvalues + 1, "too many results");
+  for (i = 0; i < cf->nitems; i++)
+    pos = unpackitem(L, &cf->item[i], data, ld, pos);
+  lua_pushinteger(L, cast_st2S(pos) + 1);  /* next position */
+  return cf->nvalues + 1;
+}
+
+
+/* maximum number of values preallocated by 'unpackmany' */
+#if !defined(MAXUNPACKHINT)
+#define MAXUNPACKHINT	4096
+#endif
+
+
+/*
+** string.unpackmany(fmt, s [, pos [, n]]): unpacks 'n' consecutive
+** records from 's', as repeated calls to 'string.unpack(fmt, s, pos)'
+** would do. Without 'n', unpacks records until the end of 's'. Returns
+** a table with all the values in sequence and the index of the first
+** unread byte in 's'.
+*/
+static int str_unpackmany (lua_State *L) {
+  size_t ld;
+  const char *data = luaL_checklstring(L, 2, &ld);
+  size_t pos = posrelatI(luaL_optinteger(L, 3, 1), ld) - 1;
+  int all = lua_isnoneornil(L, 4);  /* unpack until the end? */
+  lua_Integer n = luaL_optinteger(L, 4, 0);  /* number of records */
+  size_t hint;  /* expected number of records */
+  int nv = 0;  /* number of values in result table */
+  const CFormat *cf;
+  luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
+  luaL_argcheck(L, n >= 0, 4, "negative number of records");
+  lua_settop(L, 4);
+  cf = getpackformat(L, 1);
+  luaL_argcheck(L, cf->nvalues > 0, 1, "format has no values");
+  luaL_argcheck(L, all || n <= INT_MAX / cf->nvalues, 4,
+                   "too many records");
+  if (cf->varlen)  /* cannot tell how many records 's' has? */
+    hint = 0;  /* let the table grow */
+  else {
+    hint = (ld - pos) / (cf->size > 0 ? cf->size : 1);  /* records in 's' */
+    if (!all && cast_sizet(n) < hint)
+      hint = cast_sizet(n);
+    if (hint > MAXUNPACKHINT / cast_sizet(cf->nvalues))
+      hint = MAXUNPACKHINT / cast_sizet(cf->nvalues);
+  }
+  lua_createtable(L, cast_int(hint) * cf->nvalues, 0);
+  for (; all ? pos < ld : n-- > 0;) {  /* for each record */
+    size_t oldpos = pos;
+    int i;
+    luaL_argcheck(L, nv <= INT_MAX - cf->nvalues, 2, "too many values");
+    for (i = 0; i < cf->nitems; i++) {
+      const KItem *it = &cf->item[i];
+      pos = unpackitem(L, it, data, ld, pos);
+      if (!novalue(it))
+        lua_rawseti(L, -2, ++nv);
     }
-    pos += size;
+    if (l_unlikely(all && pos == oldpos))  /* no progress? */
+      luaL_argerror(L, 1, "format reads no data");
   }
   lua_pushinteger(L, cast_st2S(pos) + 1);  /* next position */
-  return n + 1;
+  return 2;
 }
 
 /* }====================================================== */
@@ -1851,13 +2239,41 @@ static const luaL_Reg strlib[] = {
   {"reverse", str_reverse},
   {"sub", str_sub},
   {"upper", str_upper},
+  /* placeholders */
+  {"pack", NULL},
+  {"packmany", NULL},
+  {"packsize", NULL},
+  {"unpack", NULL},
+  {"unpackmany", NULL},
+  {NULL, NULL}
+};
+
+
+/* functions that share the cache of compiled formats */
+static const luaL_Reg packfuncs[] = {
   {"pack", str_pack},
+  {"packmany", str_packmany},
   {"packsize", str_packsize},
   {"unpack", str_unpack},
+  {"unpackmany", str_unpackmany},
   {NULL, NULL}
 };
 
 
+/*
+** Create the cache of compiled formats, a table with weak values, and
+** set it as the upvalue of the pack functions.
+*/
+static void createpackcache (lua_State *L) {
+  lua_newtable(L);  /* cache */
+  lua_createtable(L, 0, 1);  /* its metatable */
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");  /* metatable.__mode = "v" */
+  lua_setmetatable(L, -2);
+  luaL_setfuncs(L, packfuncs, 1);  /* cache is their upvalue */
+}
+
+
 static void createmetatable (lua_State *L) {
   /* table to be metatable for strings */
   luaL_newlibtable(L, stringmetamethods);
@@ -1877,6 +2293,7 @@ static void createmetatable (lua_State *L) {
 */
 LUAMOD_API int luaopen_string (lua_State *L) {
   luaL_newlib(L, strlib);
+  createpackcache(L);
   createmetatable(L);
   return 1;
 }
@@ -710,6 +710,8 @@ void luaH_resize (lua_State *L, Table *t, unsigned newasize,
   Value *newarray;
   if (newasize > MAXASIZE)
     luaG_runerror(L, "table overflow");
+  if (hascards(t))  /* slots will move? */
+    luaC_dropcards(L, t);  /* card positions become meaningless */
   /* create new hash part with appropriate size into 'newt' */
   newt.flags = 0;
   setnodevector(L, &newt, nhsize);
@@ -726,9 +728,11 @@ void luaH_resize (lua_State *L, Table *t, unsigned newasize,
     luaM_error(L);  /* raise error (with array unchanged) */
   }
   /* allocation ok; initialize new part of the array */
+  luaH_countparts(L, t, -1);  /* old parts go away... */
   exchangehashpart(t, &newt);  /* 't' has the new hash ('newt' has the old) */
   t->array = newarray;  /* set new array part */
   t->asize = newasize;
+  luaH_countparts(L, t, 1);  /* ...and new ones come */
   if (newarray != NULL)
     *lenhint(t) = newasize / 2u;  /* set an initial hint */
   clearNewSlice(t, oldasize, newasize);
@@ -806,13 +810,58 @@ lu_mem luaH_size (Table *t) {
 }
 
 
+/*
+** Add ('sign' 1) or remove ('sign' -1) the array and hash parts of
+** table 't' to/from the live counters.
+*/
+void luaH_countparts (lua_State *L, Table *t, int sign) {
+  global_State *g = G(L);
+  if (t->asize > 0)
+    luaC_bdadd(g, LUA_BDARRAY, sign,
+                  sign * cast(l_mem, concretesize(t->asize)));
+  if (!isdummy(t))
+    luaC_bdadd(g, LUA_BDHASH, sign, sign * cast(l_mem, sizehash(t)));
+}
+
+
 /*
 ** Frees a table.
 */
 void luaH_free (lua_State *L, Table *t) {
+  lua_assert(!hascards(t));  /* old tables lose their cards before dying */
   freehash(L, t);
   resizearray(L, t, t->asize, 0);
-  luaM_free(L, t);
+  luaM_freeobject(L, t, sizeof(Table), LUA_TTABLE);
+}
+
+
+/*
+** Let the allocator move the array and hash parts of a table (see
+** 'luaC_compact'). Returns the number of parts that moved.
+*/
+int luaH_compact (lua_State *L, Table *t) {
+  int moved = 0;
+  if (t->asize > 0) {
+    Value *op = t->array - t->asize;  /* array's real address */
+    Value *np = cast(Value *, luaM_move(L, op, concretesize(t->asize)));
+    if (np != op) {
+      t->array = np + t->asize;
+      moved++;
+    }
+  }
+  if (!isdummy(t)) {
+    char *op = cast_charp(t->node) - extraLastfree(t);
+    /* 'lastfree' is a pointer into the part */
+    ptrdiff_t lastfree = haslastfree(t) ? getlastfree(t) - t->node : 0;
+    char *np = cast_charp(luaM_move(L, op, sizehash(t)));
+    if (np != op) {
+      t->node = cast(Node *, np + extraLastfree(t));
+      if (haslastfree(t))
+        getlastfree(t) = t->node + lastfree;
+      moved++;
+    }
+  }
+  return moved;
 }
 
 
@@ -844,10 +893,13 @@ static Node *getfreepos (Table *t) {
 ** position or not: if it is not, move colliding node to an empty place
 ** and put new key in its main position; otherwise (colliding node is in
 ** its main position), new key goes to an empty position. Return 0 if
-** could not insert key (could not find a free space).
+** could not insert key (could not find a free space); otherwise, return
+** 1, or 2 plus the index of the free position when the colliding node
+** was moved there (so that card marking can follow the move).
 */
 static int insertkey (Table *t, const TValue *key, TValue *value) {
   Node *mp = mainpositionTV(t, key);
+  int res = 1;
   /* table cannot already contain the key */
   lua_assert(isabstkey(getgeneric(t, key, 0)));
   if (!isempty(gval(mp)) || isdummy(t)) {  /* main position is taken? */
@@ -868,6 +920,7 @@ static int insertkey (Table *t, const TValue *key, TValue *value) {
         gnext(mp) = 0;  /* now 'mp' is free */
       }
       setempty(gval(mp));
+      res = cast_int(f - t->node) + 2;
     }
     else {  /* colliding node is in its own main position */
       /* new node will go into free position */
@@ -881,7 +934,7 @@ static int insertkey (Table *t, const TValue *key, TValue *value) {
   setnodekey(mp, key);
   lua_assert(isempty(gval(mp)));
   setobj2t(cast(lua_State *, 0), gval(mp), value);
-  return 1;
+  return res;
 }
 
 
@@ -909,7 +962,9 @@ static void luaH_newkey (lua_State *L, Table *t, const TValue *key,
       rehash(L, t, key);  /* grow table */
       newcheckedkey(t, key, value);  /* insert key in grown table */
     }
-    luaC_barrierback(L, obj2gco(t), key);
+    else if (done > 1 && hascards(t))  /* moved an entry to a new card? */
+      luaC_touchslot(L, t, t->asize + cast_uint(done - 2));
+    luaC_barriertab(L, t, key, key);
     /* for debugging only: any new key may force an emergency collection */
     condchangemem(L, (void)0, (void)0, 1);
   }
@@ -1032,6 +1087,33 @@ lu_byte luaH_get (Table *t, const TValue *key, TValue *res) {
 }
 
 
+/*
+** Returns the position of the slot holding 'key' in table 't', counting
+** the array part first and then the hash part, or ~0u if the key is
+** absent. (Positions are used by card marking in the collector.)
+*/
+unsigned luaH_slotindex (Table *t, const TValue *key) {
+  const TValue *slot;
+  lua_Integer k;
+  if (ttisinteger(key) || (ttisfloat(key) &&
+                           luaV_flttointeger(fltvalue(key), &k, F2Ieq))) {
+    unsigned ik;
+    if (ttisinteger(key))
+      k = ivalue(key);
+    ik = ikeyinarray(t, k);
+    if (ik > 0)  /* key is in the array part? */
+      return ik - 1;
+    slot = getintfromhash(t, k);
+  }
+  else
+    slot = getgeneric(t, key, 0);
+  if (isabstkey(slot))
+    return ~0u;
+  else
+    return t->asize + cast_uint(nodefromval(slot) - t->node);
+}
+
+
 /*
 ** When a 'pset' cannot be completed, this function returns an encoding
 ** of its result, to be used by 'luaH_finishset'.
@@ -1095,7 +1177,7 @@ int luaH_psetshortstr (Table *t, TString *key, TValue *val) {
     if (ttisnil(val))  /* new value is nil? */
       return HOK;  /* done (value is already nil/absent) */
     if (isabstkey(slot) &&  /* key is absent? */
-       !(isblack(t) && iswhite(key))) {  /* and don't need barrier? */
+       !(isblack(t) && (iswhite(key) || hascards(t)))) {  /* no barrier? */
       TValue tk;  /* key as a TValue */
       setsvalue(cast(lua_State *, NULL), &tk, key);
       if (insertkey(t, &tk, val)) {  /* insert key, if there is space */
@@ -36,6 +36,16 @@
 #define setdummy(t)		((t)->flags |= BITDUMMY)
 
 
+/*
+** Bit BITCARDS set in 'flags' means the table has a card set, which
+** records the slices of the table written since the last minor
+** collections (see 'luaC_barriertab_').
+*/
+
+#define BITCARDS		(1 << 7)
+#define hascards(t)		((t)->flags & BITCARDS)
+
+
 
 /* allocated size for hash nodes */
 #define allocsizenode(t)	(isdummy(t) ? 0 : sizenode(t))
@@ -171,7 +181,10 @@ LUAI_FUNC void luaH_resize (lua_State *L, Table *t, unsigned nasize,
                                                     unsigned nhsize);
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, unsigned nasize);
 LUAI_FUNC lu_mem luaH_size (Table *t);
+LUAI_FUNC unsigned luaH_slotindex (Table *t, const TValue *key);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
+LUAI_FUNC void luaH_countparts (lua_State *L, Table *t, int sign);
+LUAI_FUNC int luaH_compact (lua_State *L, Table *t);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
 LUAI_FUNC lua_Unsigned luaH_getn (Table *t);
 
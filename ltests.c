@@ -270,6 +270,27 @@ void *debug_realloc (void *ud, void *b, size_t oldsize, size_t size) {
 }
 
 
+/*
+** Objects carved from heap pages (see LUA_USE_SIDEMARKS) do not go
+** through 'debug_realloc'; count them here and fake their allocation
+** errors in the same way. Return 0 for an error.
+*/
+int luai_heapnewtest (int tag) {
+  Memcontrol *mc = &l_memcontrol;
+  if (mc->failnext) {
+    mc->failnext = 0;
+    return 0;  /* fake a single memory allocation error */
+  }
+  if (mc->countlimit != ~0UL) {  /* count limit in use? */
+    if (mc->countlimit == 0)
+      return 0;  /* fake a memory allocation error */
+    mc->countlimit--;
+  }
+  mc->objcount[luai_heaptype(tag)]++;
+  return 1;
+}
+
+
 /* }====================================================================== */
 
 
@@ -315,7 +336,7 @@ static void printobj (global_State *g, GCObject *o) {
   printf("||%s(%p)-%c%c(%02X)||",
            ttypename(novariant(o->tt)), (void *)o,
            isdead(g,o) ? 'd' : isblack(o) ? 'b' : iswhite(o) ? 'w' : 'g',
-           "ns01oTt"[getage(o)], o->marked);
+           "ns01oTt"[getage(o)], gcbits(o));
   if (o->tt == LUA_VSHRSTR || o->tt == LUA_VLNGSTR)
     printf(" '%s'", getstr(gco2ts(o)));
 }
@@ -397,6 +418,19 @@ static void checkvalref (global_State *g, GCObject *f, const TValue *t) {
 }
 
 
+/*
+** Slots in dirty cards of an old table can point to young objects;
+** they only have to be alive.
+*/
+static void checkslotref (global_State *g, Table *h, unsigned int slot,
+                                                     const TValue *t) {
+  if (luaC_isdirtyslot(g, h, slot))
+    assert(!iscollectable(t) || (righttt(t) && !isdead(g, gcvalue(t))));
+  else
+    checkvalref(g, obj2gco(h), t);
+}
+
+
 static void checktable (global_State *g, Table *h) {
   unsigned int i;
   unsigned int asize = h->asize;
@@ -406,15 +440,16 @@ static void checktable (global_State *g, Table *h) {
   for (i = 0; i < asize; i++) {
     TValue aux;
     arr2obj(h, i, &aux);
-    checkvalref(g, hgc, &aux);
+    checkslotref(g, h, i, &aux);
   }
   for (n = gnode(h, 0); n < limit; n++) {
     if (!isempty(gval(n))) {
       TValue k;
+      unsigned int slot = asize + cast_uint(n - gnode(h, 0));
       getnodekey(mainthread(g), &k, n);
       assert(!keyisnil(n));
-      checkvalref(g, hgc, &k);
-      checkvalref(g, hgc, gval(n));
+      checkslotref(g, h, slot, &k);
+      checkslotref(g, h, slot, gval(n));
     }
   }
 }
@@ -582,9 +617,9 @@ static l_mem checkgraylist (global_State *g, GCObject *o) {
   cast_void(g);  /* better to keep it if we need to print an object */
   while (o) {
     assert(!!isgray(o) ^ (getage(o) == G_TOUCHED2));
-    assert(!testbit(o->marked, TESTBIT));
+    assert(!testbit(gcbits(o), TESTBIT));
     if (keepinvariant(g))
-      l_setbit(o->marked, TESTBIT);  /* mark that object is in a gray list */
+      l_setbit(gcbits(o), TESTBIT);  /* mark that object is in a gray list */
     total++;
     switch (o->tt) {
       case LUA_VTABLE: o = gco2t(o)->gclist; break;
@@ -603,12 +638,30 @@ static l_mem checkgraylist (global_State *g, GCObject *o) {
 }
 
 
+/*
+** Check objects in the mark stack and in its prefetch window.
+*/
+static l_mem checkgraystack (global_State *g) {
+  unsigned int i;
+  for (i = 0; i < g->ngraystack + g->nwindow; i++) {
+    GCObject *o = (i < g->ngraystack) ? g->graystack[i]
+                : g->graywindow[(g->windowfirst + i - g->ngraystack) %
+                                GRAYWINDOW];
+    assert(isgray(o) && !testbit(gcbits(o), TESTBIT));
+    if (keepinvariant(g))
+      l_setbit(gcbits(o), TESTBIT);  /* mark that object is in a gray list */
+  }
+  return cast(l_mem, g->ngraystack + g->nwindow);
+}
+
+
 /*
 ** Check objects in gray lists.
 */
 static l_mem checkgrays (global_State *g) {
   l_mem total = 0;  /* count number of elements in all lists */
   if (!keepinvariant(g)) return total;
+  total += checkgraystack(g);
   total += checkgraylist(g, g->gray);
   total += checkgraylist(g, g->grayagain);
   total += checkgraylist(g, g->weak);
@@ -634,8 +687,8 @@ static void incifingray (global_State *g, GCObject *o, l_mem *count) {
   /* these are the ones that must be in gray lists */
   if (isgray(o) || getage(o) == G_TOUCHED2) {
     (*count)++;
-    assert(testbit(o->marked, TESTBIT));
-    resetbit(o->marked, TESTBIT);  /* prepare for next cycle */
+    assert(testbit(gcbits(o), TESTBIT));
+    resetbit(gcbits(o), TESTBIT);  /* prepare for next cycle */
   }
 }
 
@@ -668,6 +721,78 @@ static l_mem checklist (global_State *g, int maybedead, int tof,
 }
 
 
+/*
+** Check the live counters against the objects in the lists. (Dead
+** objects leave the counters when they leave the lists.)
+*/
+static void checkbreakdown (global_State *g) {
+  GCObject *lists[4];
+  l_mem count[LUA_BDN] = {0};
+  l_mem bytes[LUA_BDN] = {0};
+  int i;
+  lists[0] = g->allgc; lists[1] = g->finobj;
+  lists[2] = g->tobefnz; lists[3] = g->fixedgc;
+  for (i = 0; i < 4; i++) {
+    GCObject *o;
+    for (o = lists[i]; o != NULL; o = o->next) {
+      int k;
+      lu_mem sz;
+      switch (o->tt) {
+        case LUA_VSHRSTR:
+          k = LUA_BDSHRSTR;
+          sz = sizestrshr(cast_uint(gco2ts(o)->shrlen));
+          break;
+        case LUA_VLNGSTR:
+          k = LUA_BDLNGSTR;
+          sz = luaS_sizelngstr(gco2ts(o)->u.lnglen, gco2ts(o)->shrlen);
+          break;
+        case LUA_VTABLE: {
+          Table *t = gco2t(o);
+          k = LUA_BDTABLE;
+          sz = luaH_size(t);  /* with its parts; see below */
+          count[LUA_BDARRAY] += (t->asize > 0);
+          count[LUA_BDHASH] += !isdummy(t);
+          break;
+        }
+        case LUA_VLCL:
+          k = LUA_BDLCL;
+          sz = sizeLclosure(gco2lcl(o)->nupvalues);
+          break;
+        case LUA_VCCL:
+          k = LUA_BDCCL;
+          sz = sizeCclosure(gco2ccl(o)->nupvalues);
+          break;
+        case LUA_VPROTO:
+          k = LUA_BDPROTO;
+          sz = (gco2p(o)->flag & PF_COUNTED) ? luaF_protosize(gco2p(o))
+                                             : sizeof(Proto);
+          break;
+        case LUA_VUSERDATA:
+          k = LUA_BDUDATA;
+          sz = sizeudata(gco2u(o)->nuvalue, gco2u(o)->len);
+          break;
+        case LUA_VTHREAD:
+          k = LUA_BDTHREAD;
+          sz = luaE_threadsize(gco2th(o));
+          break;
+        default:
+          assert(o->tt == LUA_VUPVAL);
+          k = LUA_BDUPVAL;
+          sz = sizeof(UpVal);
+      }
+      count[k]++;
+      bytes[k] += cast(l_mem, sz);
+    }
+  }
+  /* tables are checked with their parts */
+  bytes[LUA_BDARRAY] = g->bdbytes[LUA_BDARRAY];
+  bytes[LUA_BDHASH] = g->bdbytes[LUA_BDHASH];
+  bytes[LUA_BDTABLE] -= bytes[LUA_BDARRAY] + bytes[LUA_BDHASH];
+  for (i = 0; i < LUA_BDOTHER; i++)
+    assert(count[i] == g->bdcount[i] && bytes[i] == g->bdbytes[i]);
+}
+
+
 int lua_checkmemory (lua_State *L) {
   global_State *g = G(L);
   GCObject *o;
@@ -705,6 +830,7 @@ int lua_checkmemory (lua_State *L) {
   }
   if (keepinvariant(g))
     assert(totalin == totalshould);
+  checkbreakdown(g);
   return 0;
 }
 
@@ -1147,6 +1273,31 @@ static int gc_query (lua_State *L) {
 }
 
 
+static unsigned long ndecisions = 0;
+
+static void countdecision (void *ud, const lua_GCDecision *d) {
+  UNUSED(d);
+  (*cast(unsigned long *, ud))++;
+}
+
+
+/*
+** T.gcdecisions([on]): installs (or removes) a decision function that
+** counts the decisions of the adaptive mode. Returns the count, or
+** false if that function is not the one installed.
+*/
+static int gc_decisions (lua_State *L) {
+  if (!lua_isnone(L, 1))
+    lua_setgcdecisions(L, lua_toboolean(L, 1) ? countdecision : NULL,
+                          &ndecisions);
+  if (lua_getgcdecisions(L, NULL) == countdecision)
+    lua_pushinteger(L, cast_Integer(ndecisions));
+  else
+    lua_pushboolean(L, 0);
+  return 1;
+}
+
+
 static int test_codeparam (lua_State *L) {
   lua_Integer p = luaL_checkinteger(L, 1);
   lua_pushinteger(L, luaO_codeparam(cast_uint(p)));
@@ -1165,6 +1316,7 @@ static int test_applyparam (lua_State *L) {
 static int string_query (lua_State *L) {
   stringtable *tb = &G(L)->strt;
   int s = cast_int(luaL_optinteger(L, 1, 0)) - 1;
+  luaS_migrate(L, INT_MAX);  /* all strings in 'tb->hash' */
   if (s == -1) {
     lua_pushinteger(L ,tb->size);
     lua_pushinteger(L ,tb->nuse);
@@ -1249,6 +1401,13 @@ static int newuserdata (lua_State *L) {
 }
 
 
+static int setpressure (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TUSERDATA);
+  luaL_setpressure(L, 1, cast_sizet(luaL_checkinteger(L, 2)));
+  return 0;
+}
+
+
 static int pushuserdata (lua_State *L) {
   lua_Integer u = luaL_checkinteger(L, 1);
   lua_pushlightuserdata(L, cast_voidp(cast_sizet(u)));
@@ -1299,10 +1458,20 @@ static int makeseed (lua_State *L) {
 }
 
 
+/*
+** Create a new state with the test allocator or, with an argument
+** "pool" or "region", with one of the allocators from lauxlib.
+*/
 static int newstate (lua_State *L) {
+  static const char *const allocs[] = {"debug", "pool", "region", NULL};
   void *ud;
   lua_Alloc f = lua_getallocf(L, &ud);
-  lua_State *L1 = lua_newstate(f, ud, 0);
+  lua_State *L1;
+  switch (luaL_checkoption(L, 1, "debug", allocs)) {
+    case 1: L1 = luaL_newpoolstate(); break;
+    case 2: L1 = luaL_newregionstate(); break;
+    default: L1 = lua_newstate(f, ud, 0); break;
+  }
   if (L1) {
     lua_atpanic(L1, tpanic);
     lua_pushlightuserdata(L, L1);
@@ -1324,7 +1493,10 @@ static int loadlib (lua_State *L) {
   lua_State *L1 = getstate(L);
   int load = cast_int(luaL_checkinteger(L, 2));
   int preload = cast_int(luaL_checkinteger(L, 3));
+  void *ud;
   luaL_openselectedlibs(L1, load, preload);
+  if (lua_getallocf(L1, &ud) != debug_realloc)
+    return 0;  /* library 'T' needs the test allocator */
   luaL_requiref(L1, "T", luaB_opentests, 0);
   lua_assert(lua_type(L1, -1) == LUA_TTABLE);
   /* 'requiref' should not reload module already loaded... */
@@ -2158,6 +2330,7 @@ static const struct luaL_Reg tests_funcs[] = {
   {"makeseed", makeseed},
   {"pushuserdata", pushuserdata},
   {"gcquery", gc_query},
+  {"gcdecisions", gc_decisions},
   {"querystr", string_query},
   {"querytab", table_query},
   {"codeparam", test_codeparam},
@@ -2166,6 +2339,7 @@ static const struct luaL_Reg tests_funcs[] = {
   {"resume", coresume},
   {"s2d", s2d},
   {"sethook", sethook},
+  {"setpressure", setpressure},
   {"stacklevel", stacklevel},
   {"testC", testC},
   {"makeCfunc", makeCfunc},
@@ -62,6 +62,12 @@ typedef struct Memcontrol {
 
 LUA_API Memcontrol l_memcontrol;
 
+/* control also the objects carved from heap pages (LUA_USE_SIDEMARKS) */
+#define luai_heaptype(tag)	((tag) < LUA_NUMTYPES ? (tag) : 0)
+#define luai_heapnew(tag)	luai_heapnewtest(tag)
+#define luai_heapfree(tag)	(l_memcontrol.objcount[luai_heaptype(tag)]--)
+LUAI_FUNC int luai_heapnewtest (int tag);
+
 
 #define luai_tracegc(L,f)		luai_tracegctest(L, f)
 LUAI_FUNC void luai_tracegctest (lua_State *L, int first);
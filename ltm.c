@@ -84,6 +84,17 @@ const TValue *luaT_gettmbyobj (lua_State *L, const TValue *o, TMS event) {
 }
 
 
+/*
+** Return the name of basic type 't' (which may be one of the internal
+** types). Unlike 'ttypename', it can be used in modules that come
+** before this one in a one-file build (see 'onelua.c'), where
+** 'luaT_typenames_' is static.
+*/
+const char *luaT_typename (int t) {
+  return ttypename(t);
+}
+
+
 /*
 ** Return the name of the type of an object. For tables and userdata
 ** with metatable, use their '__name' metafield, if present.
@@ -72,6 +72,7 @@ typedef enum {
 LUAI_DDEC(const char *const luaT_typenames_[LUA_TOTALTYPES];)
 
 
+LUAI_FUNC const char *luaT_typename (int t);
 LUAI_FUNC const char *luaT_objtypename (lua_State *L, const TValue *o);
 
 LUAI_FUNC const TValue *luaT_gettm (Table *events, TMS event, TString *ename);
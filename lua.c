@@ -699,6 +699,7 @@ static void doREPL (lua_State *L) {
       status = docall(L, 0, LUA_MULTRET);
     if (status == LUA_OK) l_print(L);
     else report(L, status);
+    lua_gcfinalize(L, INT_MAX);  /* a safe point for finalizers */
   }
   lua_settop(L, 0);  /* clear stack */
   lua_writeline();
@@ -124,6 +124,23 @@ typedef int (*lua_Writer) (lua_State *L, const void *p, size_t sz, void *ud);
 */
 typedef void * (*lua_Alloc) (void *ud, void *ptr, size_t osize, size_t nsize);
 
+/*
+** At the end of each collection cycle, the collector calls the allocator
+** with a NULL 'ptr', 'nsize' zero, and 'osize' LUA_ALLOCIDLE. (For
+** allocators that ignore it, it is just a free of NULL.) Allocators
+** that cache memory can use it to return memory to the system.
+** When a state whose allocator was declared to free all blocks at once
+** (LUA_GCBULKFREE) is closed, the state does not free its blocks one by
+** one; instead, its last call to the allocator has 'osize'
+** LUA_ALLOCRELEASE, after which the allocator must free everything.
+** A compaction (LUA_GCCOMPACT) reallocates blocks to their own sizes,
+** so that the allocator can move them, and then calls the allocator
+** with 'osize' LUA_ALLOCCOMPACT (and a NULL 'ptr', 'nsize' zero).
+*/
+#define LUA_ALLOCIDLE		LUA_NUMTYPES
+#define LUA_ALLOCRELEASE	(LUA_NUMTYPES + 1)
+#define LUA_ALLOCCOMPACT	(LUA_NUMTYPES + 2)
+
 
 /*
 ** Type for warning functions
@@ -338,6 +355,15 @@ LUA_API void (lua_warning)  (lua_State *L, const char *msg, int tocont);
 #define LUA_GCGEN		7
 #define LUA_GCINC		8
 #define LUA_GCPARAM		9
+#define LUA_GCSAFEALLOC		10
+#define LUA_GCTIMEDSTEP		11
+#define LUA_GCPAUSES		12
+#define LUA_GCTELEMETRY		13
+#define LUA_GCSTATS		14
+#define LUA_GCBULKFREE		15
+#define LUA_GCADAPT		16
+#define LUA_GCCOMPACT		17
+#define LUA_GCBREAKDOWN		18
 
 
 /*
@@ -353,11 +379,154 @@ LUA_API void (lua_warning)  (lua_State *L, const char *msg, int tocont);
 #define LUA_GCPSTEPMUL		4  /* GC "speed" */
 #define LUA_GCPSTEPSIZE		5  /* GC granularity */
 
+/* parameters for both modes */
+#define LUA_GCPMARKTHREADS	6  /* helper threads for marking */
+#define LUA_GCPSWEEPTHREAD	7  /* background freeing */
+#define LUA_GCPSTEPTIME		8  /* time budget for a step (microseconds) */
+
+/* goals for adaptive mode (0 means no goal) */
+#define LUA_GCPPAUSEGOAL	9  /* longest acceptable pause (microseconds) */
+#define LUA_GCPMEMGOAL		10  /* largest heap, as % of live bytes */
+
+/* finalizers run only at explicit calls (lua_gcfinalize) */
+#define LUA_GCPDEFERFIN		11
+
+/* small stacks for new threads, trimmed to their use when idle */
+#define LUA_GCPLEANSTACKS	12
+
+/* dead threads kept for reuse by 'lua_newthread' */
+#define LUA_GCPTHREADPOOL	13
+
 /* number of parameters */
-#define LUA_GCPN		6
+#define LUA_GCPN		14
+
+
+/*
+** Distribution of the pauses of automatic collector steps, measured
+** while LUA_GCPSTEPTIME is not zero. Bin 'i' counts the pauses lasting
+** less than 2^i microseconds but not less than 2^(i-1); the last bin
+** also counts all longer pauses.
+*/
+#define LUA_GCPAUSEBINS		24
+
+typedef struct lua_GCPauses {
+  lua_Unsigned count;  /* number of measured steps */
+  lua_Unsigned total;  /* sum of all pauses (microseconds) */
+  lua_Unsigned max;  /* longest pause (microseconds) */
+  lua_Unsigned over;  /* number of steps that exceeded the budget */
+  lua_Unsigned bins[LUA_GCPAUSEBINS];
+} lua_GCPauses;
+
+
+/*
+** Collector telemetry (see LUA_GCTELEMETRY): events are the phases of
+** incremental cycles and the collections of generational mode.
+*/
+#define LUA_GCEVPROPAGATE	0
+#define LUA_GCEVATOMIC		1
+#define LUA_GCEVSWPALLGC	2
+#define LUA_GCEVSWPFINOBJ	3
+#define LUA_GCEVSWPTOBEFNZ	4
+#define LUA_GCEVSWPEND		5
+#define LUA_GCEVCALLFIN		6
+#define LUA_GCEVMINOR		7  /* minor collection */
+#define LUA_GCEVMAJOR		8  /* whole major collection */
+
+/* number of events */
+#define LUA_GCEVN		9
+
+typedef struct lua_GCEvent {
+  int what;  /* kind of event (LUA_GCEV*) */
+  lua_Unsigned start;  /* clock at its start (microseconds) */
+  lua_Unsigned span;  /* time from start to end, with the program running */
+  lua_Unsigned busy;  /* time spent in the collector (microseconds) */
+  lua_Unsigned marked;  /* bytes marked */
+  lua_Unsigned swept;  /* objects swept */
+  lua_Unsigned freed;  /* bytes freed */
+  lua_Unsigned finalized;  /* finalizers called */
+} lua_GCEvent;
+
+typedef struct lua_GCPhaseStats {
+  lua_Unsigned count;  /* number of events */
+  lua_Unsigned total;  /* sum of their 'busy' times */
+  lua_Unsigned max;  /* longest 'busy' time */
+  lua_Unsigned marked;  /* sums of the counters of all events */
+  lua_Unsigned swept;
+  lua_Unsigned freed;
+  lua_Unsigned finalized;
+  lua_Unsigned bins[LUA_GCPAUSEBINS];  /* distribution of 'busy' times */
+} lua_GCPhaseStats;
+
+/*
+** Function to receive telemetry events. It runs inside the collector,
+** so it must not call the Lua API.
+*/
+typedef void (*lua_GCEventFunction) (void *ud, const lua_GCEvent *ev);
+
+
+
+/*
+** Decisions of the adaptive collector (see LUA_GCADAPT). Each one
+** either switches the mode or retunes one parameter, and carries the
+** measures of the cycle that led to it.
+*/
+typedef struct lua_GCDecision {
+  int mode;  /* mode after the decision (LUA_GCINC or LUA_GCGEN) */
+  int param;  /* parameter changed (LUA_GCP*), or -1 if mode changed */
+  int value;  /* new value of 'param' */
+  const char *reason;  /* static string explaining the decision */
+  lua_Unsigned survival;  /* % of the new bytes that survived */
+  lua_Unsigned pause;  /* longest collector pause (microseconds) */
+  lua_Unsigned allocrate;  /* allocation rate (Kbytes per second) */
+  lua_Unsigned overhead;  /* heap size as % of live bytes */
+} lua_GCDecision;
+
+/*
+** Function to receive decisions. Like lua_GCEventFunction, it runs
+** inside the collector, so it must not call the Lua API.
+*/
+typedef void (*lua_GCDecisionFunction) (void *ud, const lua_GCDecision *d);
+
+
+/*
+** Live objects and bytes by kind (see LUA_GCBREAKDOWN). The bytes of
+** a table count only its header; its array and hash parts have their
+** own entries, whose counts are the numbers of allocated parts. Threads
+** include their stacks, and prototypes their code and debug data.
+** LUA_BDOTHER has the bytes not in any object, such as the string
+** table, the global state and the vectors of functions being compiled.
+*/
+#define LUA_BDSHRSTR		0
+#define LUA_BDLNGSTR		1
+#define LUA_BDTABLE		2
+#define LUA_BDARRAY		3
+#define LUA_BDHASH		4
+#define LUA_BDLCL		5  /* Lua closures */
+#define LUA_BDCCL		6  /* C closures */
+#define LUA_BDPROTO		7
+#define LUA_BDUDATA		8
+#define LUA_BDTHREAD		9
+#define LUA_BDUPVAL		10
+#define LUA_BDOTHER		11
+
+#define LUA_BDN			12
+
+typedef struct lua_GCBreakdown {
+  lua_Unsigned count[LUA_BDN];
+  lua_Unsigned bytes[LUA_BDN];
+} lua_GCBreakdown;
 
 
 LUA_API int (lua_gc) (lua_State *L, int what, ...);
+LUA_API void (lua_setgcevents) (lua_State *L, lua_GCEventFunction f,
+                                void *ud);
+LUA_API void (lua_setgcdecisions) (lua_State *L, lua_GCDecisionFunction f,
+                                   void *ud);
+LUA_API lua_GCDecisionFunction (lua_getgcdecisions) (lua_State *L, void **ud);
+LUA_API int (lua_heapsnapshot) (lua_State *L, lua_Writer writer, void *data);
+LUA_API size_t (lua_gcaddpressure) (lua_State *L, size_t bytes);
+LUA_API size_t (lua_gcsubpressure) (lua_State *L, size_t bytes);
+LUA_API int (lua_gcfinalize) (lua_State *L, int maxcount);
 
 
 /*
@@ -491,6 +660,27 @@ LUA_API int (lua_gethookmask) (lua_State *L);
 LUA_API int (lua_gethookcount) (lua_State *L);
 
 
+/*
+** Allocation profiler
+*/
+#define LUA_APSTOP	0
+#define LUA_APSTART	1
+#define LUA_APRESET	2
+
+typedef struct lua_AllocSite {
+  const char *type;	/* type of the sampled blocks */
+  int nframes;	/* number of frames in the stack */
+  size_t samples;	/* number of samples */
+  lua_Number allocs, allocbytes;	/* estimated allocations */
+  lua_Number frees, freebytes;	/* estimated frees */
+} lua_AllocSite;
+
+LUA_API size_t (lua_allocprofile) (lua_State *L, int what, size_t rate);
+LUA_API int (lua_getallocsite) (lua_State *L, int n, lua_AllocSite *site);
+LUA_API int (lua_getallocframe) (lua_State *L, int n, int level,
+                                 lua_Debug *ar);
+
+
 struct lua_Debug {
   int event;
   const char *name;	/* (n) */
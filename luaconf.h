@@ -440,6 +440,19 @@
 */
 
 
+/*
+@@ LUA_USE_SHORTESTFLOAT makes Lua convert floats to strings with the
+** shortest numeral that reads back as the same number, computed
+** directly instead of through 'LUA_NUMBER_FMT'/'LUA_NUMBER_FMT_N'.
+** This is faster, but it changes the result for some numbers: those
+** that need 16 significant digits (e.g., 1/3), which 'LUA_NUMBER_FMT_N'
+** writes with 17, and subnormal numbers, which 'LUA_NUMBER_FMT' may
+** write with superfluous digits.
+** It needs C99 and 'double' floats.
+*/
+/* #define LUA_USE_SHORTESTFLOAT */
+
+
 /* The following definitions are good for most cases here */
 
 #define l_floor(x)		(l_mathop(floor)(x))
@@ -528,7 +541,8 @@
 @@ LUA_MAXINTEGER is the maximum value for a LUA_INTEGER.
 @@ LUA_MININTEGER is the minimum value for a LUA_INTEGER.
 @@ LUA_MAXUNSIGNED is the maximum value for a LUA_UNSIGNED.
-@@ lua_integer2str converts an integer to a string.
+@@ lua_integer2str converts an integer to a string. Lua provides its
+** own (faster) implementation when this macro is not defined.
 */
 
 
@@ -538,8 +552,10 @@
 
 #define LUAI_UACINT		LUA_INTEGER
 
+/*
 #define lua_integer2str(s,sz,n)  \
 	l_sprintf((s), sz, LUA_INTEGER_FMT, (LUAI_UACINT)(n))
+*/
 
 /*
 ** use LUAI_UACINT here to avoid problems with promotions (which
@@ -700,6 +716,49 @@
 #endif
 
 
+/*
+@@ LUA_USE_PARALLELMARK allows the collector to use helper threads to
+** mark objects in its stop-the-world phases. The number of helpers is
+** set by the GC parameter LUA_GCPMARKTHREADS (zero by default, which
+** keeps the collector single threaded). It needs POSIX threads and the
+** GCC builtins for atomic operations.
+*/
+/* #define LUA_USE_PARALLELMARK */
+
+
+/*
+@@ LUA_USE_SWEEPTHREAD allows the collector to free dead objects in a
+** background thread, enabled by the GC parameter LUA_GCPSWEEPTHREAD.
+** The thread is used only if the allocator is declared thread safe
+** (see LUA_GCSAFEALLOC). It needs POSIX threads and the GCC builtins
+** for atomic operations.
+*/
+/* #define LUA_USE_SWEEPTHREAD */
+
+
+/*
+@@ LUA_USE_POOLALLOC makes 'luaL_newstate' use the pool allocator of
+** the auxiliary library (see 'luaL_newpoolstate'), which serves small
+** blocks from per-state slabs segregated by size. The pool is not
+** thread safe, so it rules out the background sweeper.
+*/
+/* #define LUA_USE_POOLALLOC */
+
+
+/*
+@@ LUA_USE_SIDEMARKS keeps the GC bits of objects (colors and ages) in
+** side arrays of a page-based heap for collectable objects, instead of
+** in the object headers. The collector then marks and sweeps without
+** writing into most objects, so that pages shared after a 'fork' stay
+** shared. It rules out the background sweeper.
+*/
+/* #define LUA_USE_SIDEMARKS */
+
+#if defined(LUA_USE_SIDEMARKS)
+#undef LUA_USE_SWEEPTHREAD	/* heap pages are not thread safe */
+#endif
+
+
 /*
 ** macros to improve jump prediction, used mostly for error handling
 ** and debug facilities. (Some macros in the Lua API use these macros.
@@ -54,8 +54,12 @@ LUAMOD_API int (luaopen_table) (lua_State *L);
 #define LUA_UTF8LIBK	(LUA_TABLIBK << 1)
 LUAMOD_API int (luaopen_utf8) (lua_State *L);
 
+#define LUA_RELIBNAME	"re"
+#define LUA_RELIBK	(LUA_UTF8LIBK << 1)
+LUAMOD_API int (luaopen_re) (lua_State *L);
+
 #define LUA_RTEMSLIBNAME "rtems"
-#define LUA_RTEMSLIBK (LUA_UTF8LIBK << 1)
+#define LUA_RTEMSLIBK (LUA_RELIBK << 1)
 LUAMOD_API int (luaopen_rtems) (lua_State *L);
 
 #define LUA_PCILIBNAME "pci"
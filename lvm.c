@@ -345,7 +345,7 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
         luaH_finishset(L, h, key, val, hres);  /* set new value */
         L->top.p--;
         invalidateTMcache(h);
-        luaC_barrierback(L, obj2gco(h), val);
+        luaC_barriertab(L, h, key, val);
         return;
       }
       /* else will try the metamethod */
@@ -363,7 +363,7 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
     t = tm;  /* else repeat assignment over 'tm' */
     luaV_fastset(t, key, val, hres, luaH_pset);
     if (hres == HOK) {
-      luaV_finishfastset(L, t, val);
+      luaV_finishfastset(L, t, key, val);
       return;  /* done */
     }
     /* else 'return luaV_finishset(L, t, key, val, slot)' (loop) */
@@ -1321,7 +1321,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TString *key = tsvalue(rb);  /* key must be a short string */
         luaV_fastset(upval, key, rc, hres, luaH_psetshortstr);
         if (hres == HOK)
-          luaV_finishfastset(L, upval, rc);
+          luaV_finishfastset(L, upval, rb, rc);
         else
           Protect(luaV_finishset(L, upval, rb, rc, hres));
         vmbreak;
@@ -1338,7 +1338,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
           luaV_fastset(s2v(ra), rb, rc, hres, luaH_pset);
         }
         if (hres == HOK)
-          luaV_finishfastset(L, s2v(ra), rc);
+          luaV_finishfastset(L, s2v(ra), rb, rc);
         else
           Protect(luaV_finishset(L, s2v(ra), rb, rc, hres));
         vmbreak;
@@ -1350,7 +1350,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rc = RKC(i);
         luaV_fastseti(s2v(ra), b, rc, hres);
         if (hres == HOK)
-          luaV_finishfastset(L, s2v(ra), rc);
+          luaV_finishfastseti(L, s2v(ra), b, rc);
         else {
           TValue key;
           setivalue(&key, b);
@@ -1366,7 +1366,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TString *key = tsvalue(rb);  /* key must be a short string */
         luaV_fastset(s2v(ra), key, rc, hres, luaH_psetshortstr);
         if (hres == HOK)
-          luaV_finishfastset(L, s2v(ra), rc);
+          luaV_finishfastset(L, s2v(ra), rb, rc);
         else
           Protect(luaV_finishset(L, s2v(ra), rb, rc, hres));
         vmbreak;
@@ -1888,8 +1888,8 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         for (; n > 0; n--) {
           TValue *val = s2v(ra + n);
           obj2arr(h, last - 1, val);
+          luaC_barriertabi(L, h, last, val);
           last--;
-          luaC_barrierback(L, obj2gco(h), val);
         }
         vmbreak;
       }
@@ -100,9 +100,12 @@ typedef enum {
 
 
 /*
-** Finish a fast set operation (when fast set succeeds).
+** Finish a fast set operation (when fast set succeeds). The key
+** locates the slot for card marking (see 'luaC_barriertab').
 */
-#define luaV_finishfastset(L,t,v)	luaC_barrierback(L, gcvalue(t), v)
+#define luaV_finishfastset(L,t,k,v)	luaC_barriertab(L, hvalue(t), k, v)
+#define luaV_finishfastseti(L,t,k,v)	luaC_barriertabi(L, hvalue(t), k, v)
+#define luaV_finishfastsets(L,t,k,v)	luaC_barriertabs(L, hvalue(t), k, v)
 
 
 /*
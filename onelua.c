@@ -107,6 +107,7 @@
 #include "lstrlib.c"
 #include "ltablib.c"
 #include "lutf8lib.c"
+#include "lrelib.c"
 #include "linit.c"
 #ifdef __rtems__
 #include "lrtemslib.c"
@@ -185,6 +185,7 @@ dofile('cstack.lua')
 dofile('nextvar.lua')
 dofile('pm.lua')
 dofile('utf8.lua')
+dofile('regex.lua')
 dofile('api.lua')
 dofile('memerr.lua')
 assert(dofile('events.lua') == 12)
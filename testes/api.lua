@@ -1177,6 +1177,40 @@ assert(T.doremote(L1, "return a.x") == "1")
 
 T.closestate(L1)
 
+-- state using the pool allocator
+L1 = T.newstate("pool")
+a, b = T.doremote(L1, [[
+  local t = {}
+  local s = ""
+  for i = 1, 20000 do   -- blocks of many sizes, small and large
+    s = s .. "x"
+    if #s > 600 then s = "" end
+    t[i % 100 + 1] = {s, i, {i}}
+  end
+  local u = ""
+  for i = 1, 300 do u = u .. "ab" end   -- growing blocks change class
+  return #u, t[1][2] + t[100][3][1]
+]])
+assert(a == "600" and b == "39999")
+T.closestate(L1)
+
+-- state using the region allocator; closing it releases the region
+-- at once, after running pending finalizers
+L1 = T.newstate("region")
+T.loadlib(L1, ~0, 0)
+a, b = T.doremote(L1, [[
+  local t = {}
+  for i = 1, 20000 do
+    t[i % 100 + 1] = {string.rep("x", i % 600), i, {}}
+  end
+  ext = string.rep("ab", 10000)   -- external string alive at closing
+  setmetatable({}, {__gc = function () end})
+  t = nil; collectgarbage()
+  return #ext, ext:sub(1, 3)
+]])
+assert(a == "20000" and b == "aba")
+T.closestate(L1)
+
 L1 = nil
 
 print('+')
@@ -1058,5 +1058,151 @@ do   -- tests for 'source' in binary dumps
          debug.getinfo(h).source == '=?')
 end
 
+do   print("testing heap snapshots")
+  local hs = dofile("../heapsnap.lua")
+  local fname, fname2 = os.tmpname(), os.tmpname()
+  local weak = setmetatable({}, {__mode = "k"})
+  local data = {field = {}, "abc", weak = weak}
+  local function getdata () return data end
+  SNAP = getdata
+
+  local function snapshot (name)
+    collectgarbage()
+    local state = T and T.gcstate()
+    local count = collectgarbage("count")
+    assert(debug.heapsnapshot(name))
+    -- the walk allocates nothing and does not touch the collector
+    assert(collectgarbage("count") == count)
+    if T then
+      assert(T.gcstate() == state)
+      T.checkmemory()
+    end
+  end
+
+  local function edge (snap, node, label)
+    for _, e in ipairs(node.edges) do
+      if e[2] == label then return snap.nodes[e[1]] end
+    end
+  end
+
+  -- returns the nodes of 'getdata' and 'data'
+  local function find (snap)
+    for _, node in pairs(snap.nodes) do
+      local up = node.type == "function" and edge(snap, node, "data")
+      if up then
+        assert(up.type == "upvalue")
+        return node, edge(snap, up, "(value)")
+      end
+    end
+  end
+
+  -- take both snapshots before decoding any of them, so that the
+  -- walks do not see decoded snapshots (and decode each only once)
+  local key = {}
+  weak[key] = true
+  data[2] = "\0\"\\\n\200" .. string.rep("x", 100)
+  snapshot(fname2)
+  for i = 1, 100 do data.field[i] = {i} end
+  snapshot(fname)
+
+  local snap = hs.analyze(hs.read(fname2))
+  local f, t = find(snap)
+  assert(string.find(f.name, "db.lua:%d+"))
+  assert(t.type == "table" and not t.weak)
+  assert(edge(snap, t, "field").type == "table")
+  assert(edge(snap, t, "[1]").type == "string")
+  assert(edge(snap, t, "[1]").name == "abc")
+  local w = edge(snap, t, "weak")
+  assert(w.weak == "k" and edge(snap, w, "(metatable)").type == "table")
+  assert(snap.retained[t.id] >= t.size + edge(snap, t, "field").size)
+  assert(string.find(snap.path[t.id], "SNAP"))
+
+  -- weak references do not retain
+  local k = edge(snap, w, "(key)")
+  assert(k.type == "table" and snap.idom[k.id] ~= w.id)
+
+  -- strings are escaped and cut
+  assert(edge(snap, t, "[2]").name ==
+         "\0\"\\\n\200" .. string.rep("x", 35) .. "...")
+
+  -- a diff points to what grew
+  local out = {}
+  hs.diff(snap, hs.analyze(hs.read(fname)), 5,
+          function (s) out[#out + 1] = s end)
+  out = table.concat(out)
+  assert(string.find(out, "table%s+%+100 objects"))
+  assert(string.find(out, "SNAP%S*field"))
+
+  SNAP = nil
+  assert(os.remove(fname) and os.remove(fname2))
+  local st, msg = debug.heapsnapshot("/non-existent-dir/file")
+  assert(not st and type(msg) == "string")
+end
+
+
+do   print("testing allocation profiler")
+  local oldrate = debug.allocprofile("reset")
+  assert(debug.allocprofile("start", 64) == 0)
+  local function alloc (n)
+    local t = {}
+    for i = 1, n do t[i] = {} end
+    return t
+  end
+  local keep = alloc(2000)
+  alloc(2000)
+  collectgarbage()
+  assert(debug.allocprofile("stop") == 64)
+  local inner = "db.lua:" .. debug.getinfo(alloc, "S").linedefined + 2
+  local allocs, frees, live, callers = 0, 0, 0, 0
+  for _, site in ipairs(debug.allocprofile()) do
+    assert(site.samples > 0 and site.allocs >= site.samples)
+    assert(site.live == site.allocs - site.frees)
+    if site.type == "table" and site.stack[1] == inner then
+      assert(string.find(site.stack[2], "^db.lua:%d+$"))
+      allocs = allocs + site.allocs
+      frees = frees + site.frees
+      live = live + site.live
+      callers = callers + 1
+    end
+  end
+  -- estimates are close to the real numbers (4000 tables, 2000 freed)
+  assert(callers == 2)
+  assert(3400 < allocs and allocs < 4600)
+  assert(1700 < frees and frees < 2300 and 1700 < live and live < 2300)
+  -- a stopped profile keeps its data and still sees frees, also of
+  -- blocks moved by a compaction
+  collectgarbage("compact")
+  keep = nil
+  collectgarbage()
+  frees = 0
+  for _, site in ipairs(debug.allocprofile()) do
+    if site.type == "table" and site.stack[1] == inner then
+      frees = frees + site.frees
+    elseif site.type == "memory" and site.stack[1] == inner then
+      assert(site.live == 0)   -- arrays of 't'
+    end
+  end
+  assert(3400 < frees and frees < 4600)
+
+  local fname = os.tmpname()
+  assert(debug.allocprofile("pprof", fname))
+  local f = assert(io.open(fname, "rb"))
+  local data = f:read("a")
+  f:close()
+  assert(os.remove(fname))
+  assert(string.sub(data, 1, 2) == "\50\0")   -- empty first string
+  assert(string.find(data, "inuse_space", 1, true))
+  local func = "db.lua:" .. debug.getinfo(alloc, "S").linedefined
+  assert(string.find(data, "\50" .. string.char(#func) .. func, 1, true))
+
+  assert(debug.allocprofile("reset") == 0)
+  assert(#debug.allocprofile() == 0)
+  local st, msg = pcall(debug.allocprofile, "start", -1)
+  assert(not st and string.find(msg, "negative rate"))
+  if T then T.checkmemory() end
+  if oldrate > 0 then debug.allocprofile("start", oldrate) end
+end
+
+
 print"OK"
 
@@ -357,6 +357,41 @@ K = nil
 GC()
 -- assert(next(a) == nil)
 
+do   -- long chains spread over several tables, in random order
+  local function chain (N)
+    local E = {}
+    for i = 1, 5 do E[i] = setmetatable({}, mt) end
+    local keys = {}
+    for i = 1, N do keys[i] = {} end
+    local order = {}
+    for i = 1, N - 1 do order[i] = i end
+    for i = N - 1, 2, -1 do
+      local j = math.random(i)
+      order[i], order[j] = order[j], order[i]
+    end
+    for _, i in ipairs(order) do   -- link 'keys[i]' to 'keys[i + 1]'
+      E[i % 5 + 1][keys[i]] = {keys[i + 1]}
+    end
+    for i = 1, 10 do E[i % 5 + 1][{}] = {{}} end   -- dead entries
+    local first = keys[1]
+    keys = nil
+    collectgarbage()
+    local i, k = 1, first
+    while E[i % 5 + 1][k] do k = E[i % 5 + 1][k][1]; i = i + 1 end
+    assert(i == N)
+    local n = 0
+    for i = 1, 5 do for _ in pairs(E[i]) do n = n + 1 end end
+    assert(n == N - 1)
+    first = nil
+    collectgarbage()
+    for i = 1, 5 do assert(next(E[i]) == nil) end
+  end
+  chain(2000)
+  local oldmode = collectgarbage("generational")
+  chain(2000)
+  collectgarbage(oldmode)
+end
+
 
 -- testing errors during GC
 if T then
@@ -705,6 +740,547 @@ do    -- check that the collector is not reentrant in incremental mode
 end
 
 
+do    print("parallel marking")
+  local othreads = collectgarbage("param", "markthreads", 4)
+  assert(collectgarbage("param", "markthreads") == 4)
+  local N = 20000   -- enough objects to wake up the helpers
+  local strong = {}
+  local eph = setmetatable({}, {__mode = "k"})
+  local weakv = setmetatable({}, {__mode = "v"})
+  local x
+  for i = 1, N do
+    strong[i] = {i, tostring(i) .. "x", function () return i end,
+                 coroutine.create(function () return i end)}
+    weakv[i] = (i % 2 == 0) and strong[i] or {}
+    if i <= 500 then   -- chain of keys reachable only through 'x'
+      local n = {}
+      eph[n] = {x, i}; x = n
+    end
+  end
+  for k, mode in ipairs{"incremental", "generational"} do
+    local omode = collectgarbage(mode)
+    collectgarbage(); collectgarbage()
+    local n, i = x, 500
+    while n do local e = eph[n]; assert(e[2] == i); n = e[1]; i = i - 1 end
+    assert(i == 0)
+    for i = 1, N do
+      local s = strong[i]
+      assert(s[1] == i and s[2] == tostring(i) .. "x" and s[3]() == i)
+      assert(weakv[i] == (i % 2 == 0 and s or nil))
+    end
+    assert(select(2, coroutine.resume(strong[N - k][4])) == N - k)
+    collectgarbage(omode)
+  end
+  x = nil
+  collectgarbage()
+  assert(next(eph) == nil)
+  collectgarbage("param", "markthreads", othreads)
+end
+
+
+do    print("background freeing")
+  local old = collectgarbage("param", "sweepthread", 1)
+  assert(collectgarbage("param", "sweepthread") == 1)
+  for _, mode in ipairs{"incremental", "generational"} do
+    local omode = collectgarbage(mode)
+    collectgarbage()
+    local before = collectgarbage("count")
+    local w = setmetatable({}, {__mode = "v"})
+    for k = 1, 20 do
+      local t = {}
+      for i = 1, 1000 do
+        t[i] = {i, "s" .. i .. "_" .. k, function () return i end}
+        w[#w + 1] = t[i]
+      end
+      assert(t[1000][2] == "s1000_" .. k and t[1000][3]() == 1000)
+    end
+    collectgarbage()
+    assert(next(w) == nil)
+    w = nil
+    collectgarbage()
+    assert(collectgarbage("count") < before + 10)
+    -- dead strings must be out of the string table
+    for i = 1, 1000 do assert(("s" .. i .. "_1"):sub(2) == i .. "_1") end
+    collectgarbage(omode)
+  end
+  collectgarbage("param", "sweepthread", old)
+end
+
+
+do    print("time-budgeted steps")
+  local old = collectgarbage("param", "steptime", 500)
+  assert(collectgarbage("param", "steptime") == 500)
+  collectgarbage("pauses", true)    -- reset distribution
+  for _, mode in ipairs{"incremental", "generational"} do
+    local omode = collectgarbage(mode)
+    local a = {}
+    for i = 1, 100000 do a[i % 1000 + 1] = {i, tostring(i)} end
+    collectgarbage(omode)
+  end
+  local p = collectgarbage("pauses", true)
+  assert(p.count > 0 and #p == 24)
+  local n = 0
+  for i = 1, #p do n = n + p[i] end
+  assert(n == p.count and p.over <= p.count)
+  assert(p.p50 <= p.p90 and p.p90 <= p.p99 and p.p99 <= p.max)
+  assert(p.max <= p.total)
+  collectgarbage("param", "steptime", 0)
+  p = collectgarbage("pauses")
+  assert(p.count == 0 and p.max == 0 and p.p99 == 0)
+  -- explicit steps run until their budget is over or the cycle ends
+  local omode = collectgarbage("incremental")
+  collectgarbage()
+  assert(type(collectgarbage("timedstep", 0)) == "boolean")
+  repeat until collectgarbage("timedstep", 100)
+  assert(collectgarbage("timedstep", 1000000))  -- a full cycle
+  collectgarbage(omode)
+  collectgarbage("param", "steptime", old)
+end
+
+
+do    print("telemetry")
+  assert(collectgarbage("stats") == nil)    -- telemetry is off
+  assert(not collectgarbage("telemetry"))
+  assert(not collectgarbage("telemetry", true))
+  assert(collectgarbage("telemetry"))
+  local fname = os.tmpname()
+  assert(collectgarbage("trace", fname))
+  local nfin = 0
+  local keep = {}
+  for _, mode in ipairs{"incremental", "generational"} do
+    local omode = collectgarbage(mode)
+    for i = 1, 50000 do
+      local t = {i}
+      if i % 10 == 0 then keep[i % 500 + 1] = t end
+      if i % 1000 == 0 then
+        setmetatable({}, {__gc = function () nfin = nfin + 1 end})
+      end
+    end
+    collectgarbage()
+    collectgarbage(omode)
+  end
+  assert(collectgarbage("trace"))   -- stop tracing
+  local st = collectgarbage("stats", true)
+  local fin = 0
+  for _, e in ipairs{"propagate", "atomic", "swpallgc", "swpfinobj",
+                     "swptobefnz", "swpend", "callfin", "minor", "major"} do
+    local s = st[e]
+    assert(s.p50 <= s.p90 and s.p90 <= s.p99 and s.p99 <= s.max)
+    assert(s.max <= s.total)
+    fin = fin + s.finalized
+  end
+  assert(st.atomic.count > 0 and st.major.count > 0)
+  assert(st.propagate.marked > 0 and st.swpallgc.freed > 0)
+  assert(st.swpallgc.swept > 0 and st.propagate.swept == 0)
+  assert(fin >= nfin and nfin > 0)
+  assert(collectgarbage("stats").atomic.count == 0)   -- was reset
+  -- trace is a JSON array of complete events
+  local f = assert(io.open(fname))
+  local t = f:read("a")
+  f:close()
+  os.remove(fname)
+  assert(string.find(t, '^%[\n{"name":"%a+","cat":"gc","ph":"X"'))
+  assert(string.find(t, '"name":"atomic"') and string.find(t, "\n%]\n$"))
+  -- starting a new trace closes the previous one
+  local fname2 = os.tmpname()
+  assert(collectgarbage("trace", fname))
+  collectgarbage()
+  assert(collectgarbage("trace", fname2))
+  assert(collectgarbage("trace"))
+  for _, n in ipairs{fname, fname2} do
+    f = assert(io.open(n))
+    assert(string.find(f:read("a"), "^%[\n.*\n%]\n$"))
+    f:close()
+    os.remove(n)
+  end
+  assert(collectgarbage("telemetry", false))
+  assert(collectgarbage("stats") == nil)
+end
+
+
+do   print("testing adaptive mode")
+  local pause = collectgarbage("param", "pause")
+  local minormul = collectgarbage("param", "minormul")
+  assert(collectgarbage("incremental"))
+  assert(collectgarbage("adaptive") == "incremental")
+  assert(collectgarbage("adaptive") == "adaptive")
+  collectgarbage("decisions")   -- clear the log
+  local function waitfor (f)
+    for i = 1, 1000 do
+      f()
+      local d = collectgarbage("decisions")
+      if #d > 0 then return d end
+    end
+    error("no decision")
+  end
+  -- short-lived objects: incremental cycles see no survivors
+  local d = waitfor(function ()
+    for i = 1, 1000 do local t = {i, {}} end
+  end)
+  d = d[#d]
+  assert(d.mode == "generational" and d.param == nil and
+         d.reason == "low survival" and d.survival < 25)
+  assert(d.overhead > 100 and d.allocrate > 0 and d.pause >= 0)
+  -- kept objects: minor collections mostly promote them
+  local keep = {}
+  d = waitfor(function ()
+    for i = 1, 1000 do keep[#keep + 1] = {} end
+  end)
+  d = d[#d]
+  assert(d.mode == "incremental" and d.reason == "high survival")
+  keep = nil
+  collectgarbage()
+  -- a memory goal tunes the pause of incremental cycles
+  assert(collectgarbage("param", "memgoal", 150) == 0)
+  d = waitfor(function ()
+    for i = 1, 1000 do local t = {i, {}} end
+  end)
+  assert(d[1].param == "pause" and d[1].reason == "memory goal")
+  assert(d[1].value < pause)
+  collectgarbage("param", "memgoal", 0)
+  -- choosing a mode leaves adaptive mode
+  assert(collectgarbage("incremental") == "adaptive")
+  assert(collectgarbage("incremental") == "incremental")
+  collectgarbage("param", "pause", pause)
+  collectgarbage("param", "minormul", minormul)
+  if T then   -- the log does not replace a decision function from C
+    T.gcdecisions(true)
+    assert(collectgarbage("adaptive") == "incremental")
+    assert(T.gcdecisions() and #collectgarbage("decisions") == 0)
+    T.gcdecisions(false)   -- without a function, Lua installs its log
+    assert(collectgarbage("adaptive") == "adaptive")
+    assert(not T.gcdecisions())
+    assert(collectgarbage("incremental") == "adaptive")
+  end
+end
+
+do   -- many gray objects left pending between incremental steps
+  collectgarbage("incremental")
+  local t = {}
+  for i = 1, 5000 do t[i] = {{i}} end
+  collectgarbage()
+  local n = 0
+  repeat
+    n = n + 1
+    if T and n % 8 == 0 then T.checkmemory() end
+  until collectgarbage("step", 0)
+  for i = 1, 5000 do assert(t[i][1][1] == i) end
+end
+
+do   print("testing external memory")
+  local total = collectgarbage("pressure")
+  collectgarbage()
+  collectgarbage("stop")
+  local count = collectgarbage("count")
+  assert(collectgarbage("pressure", 1 << 30) == total + (1 << 30))
+  assert(collectgarbage("count") == count)   -- not memory used by Lua
+  assert(collectgarbage("pressure", -(1 << 30)) == total)
+  assert(collectgarbage("pressure", math.mininteger) == 0)   -- all of it
+  collectgarbage("pressure", total)
+  collectgarbage("restart")
+  -- external memory brings collections forward
+  for _, mode in ipairs{"incremental", "generational"} do
+    collectgarbage(mode)
+    collectgarbage()
+    local done = false
+    setmetatable({}, {__gc = function () done = true end})
+    local n = 0
+    repeat   -- this loop does not allocate
+      collectgarbage("pressure", 1 << 20)
+      n = n + 1
+    until done or n > 100000
+    assert(done)
+    assert(collectgarbage("pressure", -n << 20) == total)
+  end
+  collectgarbage("incremental")
+  if T then   -- external memory of a userdata
+    local u = T.newuserdata(0)
+    T.setpressure(u, 1000)
+    assert(collectgarbage("pressure") == total + 1000)
+    T.setpressure(u, 300)
+    assert(collectgarbage("pressure") == total + 300)
+    u = nil
+    collectgarbage()
+    assert(collectgarbage("pressure") == total)
+  end
+end
+
+do   print("testing compaction")
+  local t = {}
+  for i = 1, 100 do   -- tables with array and hash parts of all sizes
+    local x = {}
+    for j = 1, i do x[j] = j; x["k" .. j] = -j end
+    t[i] = x
+  end
+  for i = 1, 100, 2 do t[i] = nil end   -- leave holes
+  local big = {}
+  for i = 1, 1000 do big[i * 0.5] = i end   -- hash part with 'lastfree'
+  local co = coroutine.wrap(function (a)
+    local x = a
+    local function inc () x = x + 1; return x end   -- open upvalue
+    while true do a = coroutine.yield(inc() + a) end
+  end)
+  assert(co(10) == 21)
+  local function check ()
+    for i = 2, 100, 2 do
+      local x = t[i]
+      assert(#x == i)
+      for j = 1, i do assert(x[j] == j and x["k" .. j] == -j) end
+    end
+    for i = 1, 1000 do assert(big[i * 0.5] == i) end
+    big[0.25] = 0   -- insertion still finds free slots
+    big[0.25] = nil
+  end
+  local moved = collectgarbage("compact")
+  assert(math.type(moved) == "integer" and moved >= 0)
+  -- the test allocator gives a new block for every reallocation
+  assert(not T or moved > 0)
+  check()
+  assert(co(1) == 13)
+  -- from inside a coroutine, with its stack moving
+  moved = coroutine.wrap(function (...)
+    local n = collectgarbage("compact")
+    assert(select("#", ...) == 3 and select(3, ...) == "c")
+    return n
+  end)("a", "b", "c")
+  assert(not T or moved > 0)
+  check()
+  assert(co(2) == 15)
+  assert(string.rep("x", 3) .. "y" == "xxxy")   -- string table works
+  collectgarbage("generational")
+  collectgarbage("compact")
+  check()
+  collectgarbage("incremental")
+end
+
+do   print("testing deferred finalizers")
+  collectgarbage()
+  assert(collectgarbage("runfinalizers") == 0)   -- nothing pending
+  local old = collectgarbage("param", "deferfin", 1)
+  assert(old == 0)
+  local order = {}
+  local mt = {__gc = function (o) order[#order + 1] = o[1] end}
+  for _, mode in ipairs{"incremental", "generational"} do
+    collectgarbage(mode)
+    collectgarbage(); collectgarbage("runfinalizers")   -- clear queue
+    order = {}
+    for i = 1, 10 do setmetatable({i}, mt) end
+    collectgarbage()
+    for i = 1, 100 do collectgarbage("step") end   -- also steps
+    assert(#order == 0)   -- nothing ran
+    local t = {}   -- run them during another cycle
+    for i = 1, 1000 do t[i] = {} end
+    collectgarbage("step")
+    -- (other finalizers, such as the one from 'all.lua', may be queued)
+    while #order < 3 do
+      assert(collectgarbage("runfinalizers", 1) == 1)
+    end
+    assert(order[1] == 10 and order[3] == 8)
+    assert(collectgarbage("runfinalizers", 0) == 0)
+    assert(collectgarbage("runfinalizers") >= 7)
+    for i = 1, 10 do assert(order[i] == 11 - i) end
+  end
+  collectgarbage("incremental")
+  -- finalizers still resurrect, and cannot call it
+  collectgarbage(); collectgarbage("runfinalizers")
+  local res
+  setmetatable({}, {__gc = function (o)
+    res = collectgarbage("runfinalizers")
+    order = o
+  end})
+  collectgarbage()
+  assert(collectgarbage("runfinalizers") >= 1)
+  assert(res == fail and getmetatable(order))
+  order = nil
+  if T then   -- while the collector sweeps the pending objects
+    for i = 1, 100 do setmetatable({i}, mt) end
+    collectgarbage()
+    order = {}
+    T.gcstate("sweeptobefnz")
+    assert(collectgarbage("runfinalizers", 50) == 50)
+    assert(T.gcstate() ~= "sweeptobefnz")
+    collectgarbage()
+    assert(collectgarbage("runfinalizers") >= 50 and #order == 100)
+  end
+  if T then   -- errors become warnings, as usual
+    setmetatable({}, {__gc = function () error("@expected@") end})
+    collectgarbage()
+    warn("@on"); warn("@store")
+    assert(collectgarbage("runfinalizers") >= 1)
+    assert(string.match(_WARN, "@(.-)@") == "expected"); _WARN = false
+    warn("@normal")
+  end
+  -- pending finalizers run when the mode ends
+  setmetatable({}, {__gc = function () res = true end}); res = false
+  collectgarbage()
+  assert(not res)
+  collectgarbage("param", "deferfin", old)
+  collectgarbage()
+  assert(res)
+end
+
+do   print("testing live counters")
+  local function bd ()
+    collectgarbage(); collectgarbage()
+    local b = collectgarbage("breakdown")
+    local total = 0
+    for k, v in pairs(b) do
+      assert(math.type(v.count) == "integer" and v.count >= 0)
+      assert(math.type(v.bytes) == "integer" and v.bytes >= 0)
+      total = total + v.bytes
+    end
+    assert(total <= collectgarbage("count") * 1024)
+    return b
+  end
+  local b0 = bd()
+  assert(b0.thread.count >= 1 and b0.thread.bytes > 0)   -- main thread
+  assert(b0.other.count == 0 and b0.other.bytes > 0)
+  -- each result is a table with one table (with a hash part) per kind
+  local nb = 1
+  for k in pairs(b0) do nb = nb + 1 end
+  local t = {}
+  for i = 1, 100 do
+    t[i] = {i, i, x = i}
+    t[-i] = coroutine.create(function () end)
+    t[i + 0.5] = string.rep("x", 100) .. i
+  end
+  t.f = load("return function (a) return function () return a end end")
+  t.g = t.f()(1)
+  local b1 = bd()
+  assert(b1.table.count == b0.table.count + 101 + nb)
+  assert(b1.array.count == b0.array.count + 101)   -- 't' has one too
+  assert(b1.hash.count == b0.hash.count + 101 + nb)
+  assert(b1.array.bytes > b0.array.bytes + 100 * 2 * 8)
+  assert(b1.thread.count == b0.thread.count + 100)
+  assert(b1.thread.bytes > b0.thread.bytes + 100 * 20 * 16)
+  -- (the source of 't.f' is also a long string)
+  assert(b1.longstring.count == b0.longstring.count + 101)
+  assert(b1.longstring.bytes > b0.longstring.bytes + 100 * 100)
+  assert(b1.proto.count == b0.proto.count + 3)
+  assert(b1.luaclosure.count == b0.luaclosure.count + 102)
+  assert(b1.upvalue.count == b0.upvalue.count + 2)   -- _ENV and 'a'
+  for i = 1, 100 do   -- arrays grow
+    for j = 3, 100 do t[i][j] = j end
+  end
+  local b2 = bd()
+  assert(b2.array.count == b1.array.count)
+  assert(b2.array.bytes > b1.array.bytes + 100 * 90 * 8)
+  t = nil; b1 = nil; b2 = nil
+  local b3 = bd()
+  assert(b3.table.count == b0.table.count + nb)
+  assert(b3.hash.count == b0.hash.count + nb)
+  assert(b3.array.count == b0.array.count and
+         b3.array.bytes == b0.array.bytes)
+  assert(b3.thread.count == b0.thread.count)   -- (stacks change sizes)
+  for _, k in ipairs{"longstring", "proto", "luaclosure", "upvalue",
+                     "userdata", "cclosure"} do
+    assert(b3[k].count == b0[k].count and b3[k].bytes == b0[k].bytes)
+  end
+  if T then   -- the test library checks all counters against the lists
+    T.checkmemory()
+  end
+end
+
+do   print("testing lean stacks")
+  local function handler (a)
+    local n = 0
+    while true do
+      local x, y, z = coroutine.yield(n)
+      n = n + x
+    end
+  end
+  local function threadbytes (n)
+    local t = {}
+    collectgarbage(); collectgarbage()
+    local b0 = collectgarbage("breakdown").thread.bytes
+    for i = 1, n do
+      t[i] = coroutine.wrap(handler)
+      t[i](i)
+    end
+    collectgarbage(); collectgarbage()
+    return (collectgarbage("breakdown").thread.bytes - b0) // n, t
+  end
+  local N = 100
+  local old = collectgarbage("param", "leanstacks", 0)
+  assert(old == 0)
+  local normal = threadbytes(N)
+  collectgarbage("param", "leanstacks", 1)
+  local lean, t = threadbytes(N)
+  assert(lean < normal)
+  -- trimmed threads grow again when needed
+  local function deep (n)
+    if n == 0 then return 0 else return 1 + deep(n - 1) end
+  end
+  for i = 1, N do
+    assert(t[i](1, 2, 3) == 1)
+    assert(t[i](table.unpack({1}, 1, 200)) == 2)
+  end
+  local co = coroutine.wrap(function (...)
+    local n = select("#", ...)
+    while true do n = coroutine.yield(deep(n)) end
+  end)
+  assert(co(table.unpack({}, 1, 100)) == 100)
+  collectgarbage()   -- trims 'co'
+  assert(co(5000) == 5000)
+  collectgarbage()
+  assert(select("#", coroutine.wrap(function (...) return ... end)(
+           table.unpack({}, 1, 1000))) == 1000)
+  collectgarbage("generational")
+  collectgarbage()
+  assert(co(10) == 10 and t[N](1) == 3)
+  collectgarbage("incremental")
+  collectgarbage("param", "leanstacks", old)
+end
+
+do   print("testing thread pool")
+  collectgarbage()
+  local old = collectgarbage("param", "threadpool", 20)
+  assert(old == 0)
+  local closed = false
+  local getx
+  local kept = {}
+  collectgarbage("stop")   -- so that all 30 threads die together
+  for i = 1, 30 do
+    local co = coroutine.wrap(function (a)
+      local x <close> = setmetatable({}, {__close = function ()
+        closed = true
+      end})
+      local v = a
+      getx = function () return v end   -- open upvalue
+      coroutine.yield(1)
+      v = v + 1
+    end)
+    co(i)   -- abandoned while suspended
+    kept[i] = coroutine.create(function () end)
+    coroutine.resume(kept[i])   -- dead, but still referenced
+  end
+  collectgarbage()   -- pools 20 of them
+  assert(not closed)   -- to-be-closed variables are not called...
+  assert(getx() == 30)   -- ...but upvalues are closed
+  local t = T and T.totalmem("thread")
+  local new = {}
+  for i = 1, 20 do
+    new[i] = coroutine.create(function (a) return a * 2 end)
+  end
+  -- pooled threads were reused, and referenced ones were not
+  assert(not T or T.totalmem("thread") == t)
+  collectgarbage("restart")
+  for i = 1, 20 do
+    assert(coroutine.status(new[i]) == "suspended")
+    for j = 1, 30 do assert(new[i] ~= kept[j]) end
+    assert(select(2, coroutine.resume(new[i], i)) == 2 * i)
+  end
+  for i = 1, 30 do assert(coroutine.status(kept[i]) == "dead") end
+  assert(getx() == 30)
+  new = nil; kept = nil
+  collectgarbage()
+  -- a smaller pool frees its extra threads
+  collectgarbage("param", "threadpool", 0)
+  collectgarbage()
+  assert(not T or T.totalmem("thread") < t - 20)
+  collectgarbage("param", "threadpool", old)
+end
+
 collectgarbage(oldmode)
 
 print('OK')
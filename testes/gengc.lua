@@ -37,6 +37,55 @@ do
 end
 
 
+-- large old tables use card marking: a write does not touch the table
+do
+  local U = {}
+  for i = 1, 2000 do U[i] = i end
+  U.k = 0
+  collectgarbage()
+  assert(not T or T.gcage(U) == "old")
+
+  U[1500] = {x = {234}}
+  assert(not T or (T.gcage(U) == "old" and T.gcage(U[1500]) == "new"))
+  collectgarbage("step")
+  assert(not T or (T.gcage(U) == "old" and T.gcage(U[1500]) == "survival"))
+  collectgarbage("step")
+  assert(not T or (T.gcage(U) == "old" and T.gcage(U[1500]) == "old1"))
+  assert(U[1500].x[1] == 234)
+
+  U.k = {}   -- hash part
+  collectgarbage("step")
+  assert(not T or (T.gcage(U) == "old" and T.gcage(U.k) == "survival"))
+
+  -- many writes between minor collections, in both parts of the table
+  for n = 1, 20 do
+    for i = n, 2000, 97 do U[i] = {i} end
+    U.k = {n}
+    collectgarbage("step")
+    if T then T.checkmemory() end
+  end
+  for n = 1, 20 do
+    for i = n, 2000, 97 do assert(U[i][1] == i) end
+  end
+  assert(U.k[1] == 20)
+
+  -- a resize moves all slots: the table is touched as a whole
+  U.newkey = {10}
+  assert(not T or T.gcage(U) == "touched1")
+  collectgarbage("step"); collectgarbage("step")
+  assert(U.newkey[1] == 10 and U[98][1] == 98)
+
+  -- weak tables do not use cards
+  collectgarbage()
+  setmetatable(U, {__mode = "v"})
+  collectgarbage()
+  U[3] = {}
+  assert(not T or T.gcage(U) == "touched1")
+  collectgarbage("step")
+  assert(U[3] == nil)
+end
+
+
 do
   -- ensure that 'firstold1' is corrected when object is removed from
   -- the 'allgc' list
@@ -161,6 +161,58 @@ end
   
 
 
+function ephemeronchain ()
+  print("time of a collection with a long chain in an ephemeron table")
+  local N = 1000
+  while N <= 64000 do
+    local e = setmetatable({}, {__mode = "k"})
+    local keys = {}
+    for i = 1, N do keys[i] = {} end
+    for i = N, 2, -1 do   -- shuffle, so that the chain goes anywhere
+      local j = math.random(i)
+      keys[i], keys[j] = keys[j], keys[i]
+    end
+    for i = 1, N - 1 do e[keys[i]] = keys[i + 1] end
+    local first = keys[1]
+    keys = nil
+    collectgarbage(); collectgarbage()
+    local t = os.clock()
+    collectgarbage()
+    t = os.clock() - t
+    local n = 0
+    for _ in pairs(e) do n = n + 1 end
+    assert(n == N - 1 and first)
+    print(string.format("%6d links: %.4f s", N, t))
+    N = N * 2
+  end
+  print('+')
+end
+
+
+function internlatency ()
+  print("longest time to create a string, while interning many of them")
+  local clock = os.clock
+  local N = 1 << 22
+  local t = {}
+  local worst, total = 0, clock()
+  local n = 1 << 16
+  for i = 1, N do
+    local c = clock()
+    t[i] = "s" .. i
+    c = clock() - c
+    if c > worst then worst = c end
+    if i == n then
+      print(string.format("%8d strings: longest %.2f ms", i, worst * 1000))
+      worst = 0
+      n = n * 2
+    end
+  end
+  print(string.format("total: %.2f s", clock() - total))
+  print('+')
+end
+
+
+
 -- teststring()
 -- controlstruct()
 -- manylines()
@@ -169,5 +221,7 @@ end
 -- toomanyconst()
 -- toomanystr()
 toomanyidx()
+-- ephemeronchain()
+-- internlatency()
 
 print "OK"
@@ -454,6 +454,47 @@ if not _ENV._soft then
   assert(tonumber('0x.' .. string.rep('0', 1000) .. '74p4004') == 0x7.4)
 end
 
+if floatbits == 53 then
+  -- correct rounding of decimal numerals (hard cases)
+  assert(tonumber("9007199254740993.0") == 2^53)   -- halfway; to even
+  assert(tonumber("9007199254740995.0") == 2^53 + 4)   -- halfway; to even
+  assert(tonumber("9007199254740993.0000000001") == 2^53 + 2)
+  assert(tonumber("1e23") == 0x1.52d02c7e14af6p+76)
+  assert(tonumber("8.98846567431158e307") == 0x1p1023)
+  assert(tonumber("1.7976931348623157e308") == 0x1.fffffffffffffp1023)
+  assert(tonumber("1.7976931348623158e308") == 0x1.fffffffffffffp1023)
+  assert(tonumber("1.7976931348623159e308") == math.huge)
+  assert(tonumber("-1e400") == -math.huge)
+  assert(tonumber("2.2250738585072011e-308") == 0x0.fffffffffffffp-1022)
+  assert(tonumber("2.2250738585072012e-308") == 0x1p-1022)
+  assert(tonumber("4.9406564584124654e-324") == 0x1p-1074)
+  assert(tonumber("2.4703282292062328e-324") == 0x1p-1074)
+  assert(tonumber("2.4703282292062327e-324") == 0)
+  assert(tonumber("1e-400") == 0)
+  assert(1 / tonumber("-0.0") == -math.huge)
+  assert(tonumber("0.000001") == 1e-6 and tonumber("1" .. string.rep("0", 30)
+                                            .. "e-30") == 1)
+  assert(tonumber("0." .. string.rep("0", 400) .. "1e401") == 1)
+  -- (zeros and exponents beyond the limits of the fast path)
+  assert(tonumber("0." .. string.rep("0", 200000) .. "1e200001") == 1)
+  assert(tonumber("0." .. string.rep("0", 10005) .. "1e10003") == 1e-3)
+  assert(tonumber("1e100000") == math.huge and tonumber("1e-100000") == 0)
+  assert(eqT(tonumber("00000000000000000000000123"), 123))
+  assert(eqT(tonumber("  -9223372036854775808 "), minint))
+  assert(eqT(tonumber("9223372036854775808"), 2.0^63))
+
+  -- numerals read back as the floats they came from
+  for i = 1, 2000 do
+    local x = string.unpack("d", string.pack("j", math.random(0)))
+    if x == x and math.abs(x) ~= math.huge then   -- not NaN nor inf?
+      assert(tonumber(string.format("%.17g", x)) == x)
+      assert(tonumber(string.format("%.40e", x)) == x)
+      assert(load("return " .. string.format("%.17g", math.abs(x)))()
+             == math.abs(x))
+    end
+  end
+end
+
 -- testing 'tonumber' for invalid formats
 
 local function f (...)
@@ -1126,6 +1167,59 @@ do
     end
   end
 
+  -- is Lua using the shortest numeral that reads back correctly?
+  local shortest = (floatbits == 53 and tostring(1/3) == "0.3333333333333333")
+  if shortest then print("  (using shortest numerals for floats)") end
+
+  -- number of significant digits in a numeral
+  local function sigdigits (s)
+    s = string.gsub(string.match(s, "^%-?([^e]*)"), "%.", "")
+    return #string.match(s, "^0*(.-)0*$")
+  end
+
+  local function check (x)
+    local s = tostring(x)
+    assert(tonumber(s) == x)
+    local nd = sigdigits(s)
+    assert(nd <= sigdigits(string.format("%.17g", x)))
+    if shortest and nd > 1 then   -- one digit less cannot read back as 'x'
+      assert(tonumber(string.format("%." .. (nd - 1) .. "g", x)) ~= x)
+    end
+  end
+
+  -- all binary exponents (including subnormals), with the smallest
+  -- and largest significands and their neighbors
+  if floatbits == 53 then
+    for e = -1074, 1023 do
+      local x = 2.0^e
+      check(x); check(-x)
+      if e > -1074 then check(x - 2.0^math.max(e - 53, -1074)) end
+      if e < 1023 then check(x + 2.0^math.max(e - 52, -1074)) end
+    end
+    assert(tostring(-0.0) == "-0.0")
+    assert(tostring(2^-1074) == "5e-324" or not shortest)
+    assert(tostring(0.1 + 0.2) == "0.30000000000000004")
+    assert(tostring(1e15) == "1e+15" and tostring(1e14) == "100000000000000.0")
+    assert(tostring(2^53) == "9007199254740992.0")
+    assert(tostring(1e-4) == "0.0001" and tostring(1e-5) == "1e-05")
+  end
+
+  -- integers print like '%d'
+  local x = 1
+  for i = 0, Idecdig do
+    for _, y in ipairs{x - 1, x, x + 1, -x + 1, -x, -x - 1} do
+      assert(tostring(y) == string.format("%d", y))
+    end
+    x = x * 10
+  end
+  for i = 1, 1000 do
+    local x = math.random(0) >> math.random(0, intbits - 1)
+    assert(tostring(x) == string.format("%d", x))
+    assert(tostring(-x) == string.format("%d", -x))
+  end
+  assert(tostring(minint) == string.format("%d", minint))
+  assert(tostring(maxint) == string.format("%d", maxint))
+
 end
 -- ]]==================================================================
 
@@ -0,0 +1,181 @@
+-- $Id: testes/regex.lua $
+-- See Copyright Notice in file lua.h
+
+global <const> *
+
+print "testing regular expressions"
+
+local re = require're'
+
+
+local function checkerror (msg, f, ...)
+  local s, err = pcall(f, ...)
+  assert(not s and string.find(err, msg))
+end
+
+
+local function f (s, p)
+  local i, e = re.find(s, p)
+  if i then return string.sub(s, i, e) end
+end
+
+-- basic elements
+assert(f('aloALO', '[a-z]*') == 'alo')
+assert(f('aaab', 'a*') == 'aaa')
+assert(f('aaa', '^.*$') == 'aaa')
+assert(f('aaa', 'b*') == '')
+assert(f('aaa', 'ab*a') == 'aa')
+assert(f('aba', 'ab*a') == 'aba')
+assert(f('aaab', 'a+') == 'aaa')
+assert(f('aaa', '^.+$') == 'aaa')
+assert(not f('aaa', 'b+'))
+assert(not f('aaa', 'ab+a'))
+assert(f('aba', 'ab+a') == 'aba')
+assert(f('a$a', '.\\$') == 'a$')
+assert(f('a$a', '.[$]') == 'a$')
+assert(f('a$a', '$') == '')
+assert(f('aaab', 'a.*b') == 'aaab')
+assert(f('aaab', 'a.*?b') == 'aaab')
+assert(f('aaab', 'a*?') == '')
+assert(f('aaab', 'a+?') == 'a')
+assert(f('abc d', '[^\\s]+$') == 'd')
+assert(f('0alo alo', '\\w+') == '0alo')
+assert(f('alo 123', '\\d{2}') == '12')
+assert(f('alo 123', '\\d{2,}') == '123')
+assert(f('alo 123', '\\d{1,2}?') == '1')
+assert(f('a{2}', 'a{2') == 'a{2')
+assert(f('a\nb', 'a.b') == 'a\nb')
+assert(f('\0\1\2', '\\x01\\x02') == '\1\2')
+assert(f('x]-y', '[]-]+') == ']-')
+assert(f('word wordy', 'word\\b') == 'word')
+assert(re.find('word wordy', 'y\\b') == 10)
+assert(re.find('word wordy', 'word\\B') == 6)
+
+-- alternation and leftmost-first priority
+assert(f('abcd', 'bc|abc') == 'abc')
+assert(f('abcd', 'a|ab') == 'a')
+assert(f('abcd', 'ab|a') == 'ab')
+assert(f('xyz', 'q|r|z') == 'z')
+assert(f('abab', '(?:ab)+') == 'abab')
+assert(not f('abc', '^b|^c'))
+
+-- 'find' and 'match'
+assert(re.find('', '') == 1)
+assert(re.find('alo', '') == 1)
+assert(re.find('alo', '', 10) == nil)
+assert(re.find('aaa', 'a', -1) == 3)
+assert(re.find('aaa', '^a', 2) == nil)   -- '^' is start of subject
+do
+  local a, b, c, d = re.find('  key = value', '(\\w+)\\s*=\\s*(\\w+)')
+  assert(a == 3 and b == 13 and c == 'key' and d == 'value')
+  assert(re.match('  key = value', '\\w+') == 'key')
+  local x, y, z = re.match('ab', '(a)|(b)(c)?')
+  assert(x == 'a' and y == nil and z == nil)
+  assert(select('#', re.match('ab', '(a)|(b)(c)?')) == 3)
+  assert(re.match('date: 2024-01-31', '(\\d+)-(\\d+)-(\\d+)', 7) == '2024')
+end
+
+-- 'gmatch'
+do
+  local t = {}
+  for k, v in re.gmatch('a=1, bb=22, ccc=333', '(\\w+)=(\\d+)') do
+    t[#t + 1] = k .. v
+  end
+  assert(table.concat(t, ' ') == 'a1 bb22 ccc333')
+  local n = 0
+  for w in re.gmatch('one two  three', '[a-z]+') do n = n + 1 end
+  assert(n == 3)
+  local s = ''
+  for w in re.gmatch('abc', 'x*') do s = s .. '-' .. w end
+  assert(s == '----')
+  s = ''
+  for w in re.gmatch('abc', '.', 2) do s = s .. w end
+  assert(s == 'bc')
+end
+
+-- 'gsub'
+assert(re.gsub('hello world', '(\\w+)', '<%1>') == '<hello> <world>')
+assert(re.gsub('hello world', 'o', '%0%0') == 'helloo woorld')
+assert(re.gsub('hello world', 'l+', '%1') == 'hello world')
+assert(re.gsub('abc', '', '-') == '-a-b-c-')
+assert(re.gsub('abc', 'b*', '-') == '-a-c-')
+assert(re.gsub('abc', '^', '>') == '>abc')
+assert(re.gsub('abc', '$', '<') == 'abc<')
+assert(re.gsub('a b c', ' ', '%%') == 'a%b%c')
+assert(re.gsub('alo alo', 'a(x)?', '[%1]') == '[]lo []lo')
+do
+  local s, n = re.gsub('abc def', '\\w+', 'x', 1)
+  assert(s == 'x def' and n == 1)
+  s, n = re.gsub('abc', 'x', 'y')
+  assert(s == 'abc' and n == 0)
+  assert(re.gsub('$x + $y', '\\$(\\w+)', {x = 1, y = 'two'}) == '1 + two')
+  assert(re.gsub('$x + $z', '\\$(\\w+)', {x = 1}) == '1 + $z')
+  assert(re.gsub('1 2 3', '\\d', function (d) return d * 2 end) == '2 4 6')
+  assert(re.gsub('1 2 3', '(\\d)', function (d) return nil end) == '1 2 3')
+  checkerror("invalid replacement value %(a table%)",
+             re.gsub, 'x', 'x', function () return {} end)
+  checkerror("invalid capture index %%2", re.gsub, 'alo', '(a)', '%2')
+  checkerror("invalid use of '%%'", re.gsub, 'alo', '.', '%x')
+end
+
+-- compiled regexes
+do
+  local r = re.compile('(\\d+)\\.(\\d+)')
+  assert(re.compile(r) == r)
+  assert(string.find(tostring(r), '^regex %('))
+  assert(r:match('v 10.25') == '10')
+  assert(select(2, r:match('v 10.25')) == '25')
+  assert(r:find('v 10.25') == 3)
+  assert(r:gsub('1.5 2.5', '%2.%1') == '5.1 5.2')
+  local t = {}
+  for a in r:gmatch('1.1 2.2 3.3') do t[#t + 1] = a end
+  assert(#t == 3 and t[3] == '3')
+  assert(re.find('x 1.2', r) == 3)
+  checkerror("regex expected", r.find, {}, 'x')
+end
+
+-- errors
+checkerror("unmatched '%)'", re.compile, 'a)')
+checkerror("missing '%)'", re.compile, '(a')
+checkerror("missing ']'", re.compile, '[a')
+checkerror("nothing to repeat", re.compile, '*a')
+checkerror("multiple repeat", re.compile, 'a*+')
+checkerror("invalid range", re.compile, '[z-a]')
+checkerror("invalid repetition range", re.compile, 'a{3,2}')
+checkerror("too large", re.compile, 'a{1001}')
+checkerror("too large", re.compile, '(?:a{1000}){1000}')
+checkerror("invalid escape", re.compile, '\\q')
+checkerror("ends with", re.compile, 'a\\')
+checkerror("too many captures", re.compile, string.rep('()', 33))
+checkerror("too complex", re.compile, string.rep('(?:', 300))
+
+-- matching time is linear: these would take ages with backtracking
+do
+  local s = string.rep('a', 5000)
+  assert(not re.find(s, '(a*)*b'))
+  assert(not re.find(s, 'a*a*a*a*a*a*a*a*b'))
+  assert(re.find(s .. 'b', '(a|aa)*b') == 1)
+  assert(not re.find(s, '(x+x+)+y'))
+end
+
+-- iteration with patterns that blow up backtracking engines; each
+-- search is linear, but a search may read up to the end of the subject
+-- before settling on a short match, so a whole scan may be quadratic
+-- (hence the smaller subject)
+do
+  local s = string.rep('a', 1000)
+  local r, n = re.gsub(s, 'a*b|a', 'x')
+  assert(r == string.rep('x', 1000) and n == 1000)
+  r, n = re.gsub(s .. 'b' .. s, '(a|aa)*b|a', 'x')
+  assert(r == string.rep('x', 1001) and n == 1001)
+  n = 0
+  for m in re.gmatch(s, 'a(?:a*b)?') do
+    assert(m == 'a'); n = n + 1
+  end
+  assert(n == 1000)
+  n = 0
+  for m in re.gmatch(s .. 'b', '(?:a|aa)*b|a') do n = n + #m end
+  assert(n == 1001)
+end
+
+print('OK')
@@ -129,6 +129,25 @@ assert(string.reverse"\0001234" == "4321\0")
 
 for i=0,30 do assert(string.len(string.rep('a', i)) == i) end
 
+do  -- long strings (converted a word at a time)
+  local t = {}
+  for i = 0, 255 do t[#t + 1] = string.char(i) end
+  local all = table.concat(t)
+  for _, s in ipairs{all, all:sub(2) .. all:sub(1, 7), all:rep(3, "xY")} do
+    local up = s:gsub(".", function (c) return c:upper() end)
+    local low = s:gsub(".", function (c) return c:lower() end)
+    assert(s:upper() == up and s:lower() == low)
+    local r = {}
+    for i = #s, 1, -1 do r[#r + 1] = s:sub(i, i) end
+    assert(s:reverse() == table.concat(r))
+  end
+  for n = 1, 40 do
+    local r = string.rep("ab", n, "-")
+    assert(#r == 3 * n - 1 and r:sub(-2) == "ab" and not r:find("abab"))
+    assert(string.rep("xyz", n) == ("xyz"):rep(n - 1) .. "xyz")
+  end
+end
+
 assert(type(tostring(nil)) == 'string')
 assert(type(tostring(12)) == 'string')
 assert(string.find(tostring{}, 'table:'))
@@ -542,5 +561,35 @@ else
   assert(z == y)
 end
 
+
+do   print("testing resizes of the string table")
+  -- equal short strings are the same object, so any string interned
+  -- twice (or lost) while buckets move between arrays breaks equality
+  local N = 50000
+  local t = {}
+  for i = 1, N do
+    t[i] = "rs" .. i
+    if i % 97 == 0 then
+      for j = i - 96, i do assert(t[j] == "rs" .. j) end
+    end
+  end
+  for i = 1, N do assert(t[i] == "rs" .. i) end
+  local size = T and T.querystr()
+  t = nil
+  collectgarbage(); collectgarbage()   -- table shrinks
+  local u = {}
+  for i = 1, N, 3 do u[i] = "rs" .. i end
+  for i = 1, N, 3 do assert(u[i] == "rs" .. i) end
+  if T then assert(T.querystr() < size) end
+  for _, mode in ipairs{"generational", "incremental"} do
+    collectgarbage(mode)
+    u = nil
+    collectgarbage()
+    u = {}
+    for i = 1, N do u[i] = "rs" .. i end
+    for i = 1, N do assert(u[i] == "rs" .. i) end
+  end
+end
+
 print('OK')
 
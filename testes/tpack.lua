@@ -319,5 +319,85 @@ do    -- testing initial position
  
 end
 
+
+print("testing packmany/unpackmany")
+do
+  local packmany, unpackmany = string.packmany, string.unpackmany
+  local fmt = "<!4 i2 d c5 B Xi4"    -- records are aligned
+  local t = {}
+  local s = ""
+  for i = 1, 20 do
+    local r = {-i, i / 3, string.format("%5d", i), i % 256}
+    table.move(r, 1, 4, #t + 1, t)
+    s = s .. pack(fmt, table.unpack(r))
+  end
+  assert(packmany(fmt, t) == s)
+  local t1, p = unpackmany(fmt, s)
+  assert(#t1 == #t and p == #s + 1)
+  for i = 1, #t do assert(t1[i] == t[i]) end
+
+  -- same as repeated calls to 'unpack'
+  local pos = 1
+  local t2 = {}
+  for i = 1, 5 do
+    local a, b, c, d
+    a, b, c, d, pos = unpack(fmt, s, pos)
+    table.move({a, b, c, d}, 1, 4, #t2 + 1, t2)
+  end
+  local t3, p3 = unpackmany(fmt, s, 1, 5)
+  assert(#t3 == 20 and p3 == pos)
+  for i = 1, #t2 do assert(t3[i] == t2[i]) end
+  local t4, p4 = unpackmany(fmt, s, p3, 0)
+  assert(next(t4) == nil and p4 == p3)
+
+  -- ranges
+  assert(packmany(fmt, t, 5, 12) == pack(fmt, table.unpack(t, 5, 8)) ..
+                                    pack(fmt, table.unpack(t, 9, 12)))
+  assert(packmany(fmt, t, 10, 9) == "")
+  assert(packmany("i4", {}) == "")
+  assert(next((unpackmany("i4", ""))) == nil)
+  assert(#unpackmany("c0", "", 1, 3) == 3)
+  local t5, p5 = unpackmany("z", "ab\0\0c\0")
+  assert(#t5 == 3 and t5[1] == "ab" and t5[2] == "" and t5[3] == "c" and
+         p5 == 7)
+  do   -- variable-length records do not preallocate one slot per byte
+    local s = string.rep("a", 1000000) .. "\0"
+    local t, p = unpackmany("z", s)
+    assert(#t == 1 and #t[1] == 1000000 and p == #s + 1)
+    t, p = unpackmany("s1", "\3abc\0\1x", 1, 3)
+    assert(#t == 3 and t[1] == "abc" and t[2] == "" and t[3] == "x")
+    t = unpackmany("i4", string.rep("\0", 4 * 10000))
+    assert(#t == 10000 and t[10000] == 0)
+  end
+
+  -- formats are cached; check that they are not mixed up
+  for i = 1, 100 do
+    local f = "<i" .. (i % 8 + 1)
+    assert(packsize(f) == i % 8 + 1)
+    assert(unpack(f, pack(f, 7)) == 7)
+  end
+  collectgarbage()
+  assert(unpack("<i2", pack("<i2", -3)) == -3)
+
+  -- errors
+  checkerror("multiple of record size", packmany, "i4d", {1, 2, 3})
+  checkerror("missing value at index 2", packmany, "i4", {1, nil, 3}, 1, 3)
+  checkerror("#2 .*integer expected at index 2, got string",
+             packmany, "i4", {1, "x"})
+  checkerror("#2 .*no integer representation at index 3",
+             packmany, "i4", {1, 2, 1.5})
+  checkerror("#2 .*number expected at index 1, got table",
+             packmany, "d", {{}})
+  checkerror("#2 .*string expected at index 4, got boolean",
+             packmany, "i4z", {1, "a", 2, true}, 1, 4)
+  checkerror("overflow", packmany, "i1", {1, 1000})
+  checkerror("no values", packmany, "xx", {})
+  checkerror("no values", unpackmany, "!4", "abc")
+  checkerror("reads no data", unpackmany, "c0", "abc")
+  checkerror("too short", unpackmany, "i4", "abcdef")
+  checkerror("out of string", unpackmany, "i4", "abcd", 6)
+  checkerror("negative", unpackmany, "i4", "abcd", 1, -1)
+end
+
 print "OK"
 